@@ -26,6 +26,16 @@ class aabb {
         z = interval(fmin(a[2],b[2]), fmax(a[2],b[2]));
     }
 
+    aabb pad() const {
+        // Return an AABB that has no side narrower than some delta, padding if necessary.
+        double delta = 0.0001;
+        interval new_x = (x.size() >= delta) ? x : x.expand(delta);
+        interval new_y = (y.size() >= delta) ? y : y.expand(delta);
+        interval new_z = (z.size() >= delta) ? z : z.expand(delta);
+
+        return aabb(new_x, new_y, new_z);
+    }
+
     const interval& axis(int n) const {
         if (n == 1) return y;
         if (n == 2) return z;
@@ -51,4 +61,12 @@ class aabb {
         }
         return true;
     }
-};
\ No newline at end of file
+};
+
+inline aabb operator+(const aabb& bbox, const vec3& offset) {
+    return aabb(bbox.x + offset.x(), bbox.y + offset.y(), bbox.z + offset.z());
+}
+
+inline aabb operator+(const vec3& offset, const aabb& bbox) {
+    return bbox + offset;
+}
\ No newline at end of file
@@ -0,0 +1,87 @@
+#pragma once
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "bvh_cache.h"
+#include "grid.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+enum class accelerator_type {
+    automatic,
+    bvh,
+    grid
+};
+
+struct accelerator_policy {
+    accelerator_type type = accelerator_type::automatic;
+    bvh_options bvh;
+    grid_options grid;
+    std::string bvh_cache_dir;  // When set, BVHs are loaded from and saved to this directory
+
+    // Thresholds of the automatic choice. The grid wins for many primitives of similar size
+    // spread evenly over the grid bounds; anything else goes to the BVH.
+    size_t min_grid_primitives = 64;
+    double max_size_ratio = 4.0;       // 90th over 10th percentile of primitive sizes
+    double min_cell_occupancy = 0.3;   // Cells holding a centroid, at one cell per primitive
+};
+
+inline accelerator_type choose_accelerator(const std::vector<shared_ptr<hittable>>& objects,
+                                           const accelerator_policy& policy = {}) {
+    if (policy.type != accelerator_type::automatic)
+        return policy.type;
+
+    std::vector<shared_ptr<hittable>> inliers, outliers;
+    split_grid_outliers(objects, policy.grid.outlier_scale, inliers, outliers);
+    if (inliers.size() < policy.min_grid_primitives)
+        return accelerator_type::bvh;
+
+    std::vector<double> sizes;
+    sizes.reserve(inliers.size());
+    aabb bounds;
+    for (const auto& object : inliers) {
+        auto box = object->bounding_box();
+        sizes.push_back(largest_extent(box));
+        bounds = aabb(bounds, box);
+    }
+    std::sort(sizes.begin(), sizes.end());
+    auto p10 = sizes[sizes.size() / 10];
+    auto p90 = sizes[sizes.size() * 9 / 10];
+    if (p10 <= 0 || p90 / p10 > policy.max_size_ratio)
+        return accelerator_type::bvh;
+
+    auto resolution = grid_resolution_for(bounds, inliers.size(), 1.0, policy.grid.max_resolution);
+    std::vector<bool> occupied(static_cast<size_t>(resolution[0]) * resolution[1] * resolution[2], false);
+    size_t occupied_count = 0;
+    for (const auto& object : inliers) {
+        auto box = object->bounding_box();
+        size_t cell = 0;
+        for (int a = 2; a >= 0; a--) {
+            auto extent = bounds.axis(a).size();
+            auto t = extent > 0 ? (0.5 * (box.axis(a).min + box.axis(a).max) - bounds.axis(a).min) / extent : 0.0;
+            auto c = std::clamp(static_cast<int>(t * resolution[a]), 0, resolution[a] - 1);
+            cell = cell * resolution[a] + c;
+        }
+        if (!occupied[cell]) {
+            occupied[cell] = true;
+            ++occupied_count;
+        }
+    }
+
+    auto reachable = std::min(occupied.size(), inliers.size());
+    auto occupancy = static_cast<double>(occupied_count) / reachable;
+    return occupancy >= policy.min_cell_occupancy ? accelerator_type::grid : accelerator_type::bvh;
+}
+
+// Builds the acceleration structure for one group of primitives: a whole scene or a single
+// instanced object, so different parts of a scene can use different accelerators.
+inline shared_ptr<hittable> make_accelerator(const hittable_list& list, const accelerator_policy& policy = {}) {
+    if (choose_accelerator(list.objects, policy) == accelerator_type::grid)
+        return make_shared<uniform_grid>(list, policy.grid);
+    if (!policy.bvh_cache_dir.empty())
+        return make_cached_bvh(list, policy.bvh_cache_dir, policy.bvh);
+    return make_shared<bvh_node>(list, policy.bvh);
+}
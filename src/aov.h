@@ -0,0 +1,134 @@
+#pragma once
+
+#include "image_io.h"
+#include "vec3.h"
+
+#include <cstdint>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Arbitrary output variables: features of the first surface each camera ray hits, written next
+// to the color from the same primary hits. Channels are bits of a mask; disabled channels
+// aren't allocated and cost nothing per sample.
+enum aov_channel : unsigned {
+    aov_albedo = 1u << 0,     // Material color at the first hit
+    aov_normal = 1u << 1,     // World-space shading normal, facing the camera
+    aov_depth = 1u << 2,      // Distance from the camera
+    aov_object_id = 1u << 3,  // Id of the object hit, 0 for the background
+    aov_all = aov_albedo | aov_normal | aov_depth | aov_object_id
+};
+
+// Filled in by the camera at the primary hit of a sample.
+struct aov_hit {
+    bool hit = false;
+    color albedo;
+    vec3 normal;
+    double depth = 0;
+    uint32_t object_id = 0;
+};
+
+// Parses a comma separated list of channel names, e.g. "albedo,normal", or "all". Throws
+// std::invalid_argument naming the first unknown channel.
+inline unsigned parse_aov_channels(const std::string& list) {
+    unsigned mask = 0;
+    std::istringstream in(list);
+    std::string name;
+    while (std::getline(in, name, ',')) {
+        if (name == "albedo") mask |= aov_albedo;
+        else if (name == "normal") mask |= aov_normal;
+        else if (name == "depth") mask |= aov_depth;
+        else if (name == "object_id") mask |= aov_object_id;
+        else if (name == "all") mask |= aov_all;
+        else throw std::invalid_argument("unknown AOV channel '" + name + "'");
+    }
+    return mask;
+}
+
+class aov_buffers {
+  public:
+    aov_buffers() = default;
+
+    aov_buffers(int _width, int _height, unsigned _channels = aov_all)
+      : width(_width), height(_height), channels(_channels) {
+        auto pixels = size_t(_width) * _height;
+        if (enabled(aov_albedo)) albedo.assign(pixels * 3, 0);
+        if (enabled(aov_normal)) normal.assign(pixels * 3, 0);
+        if (enabled(aov_depth)) depth.assign(pixels, 0);
+        if (enabled(aov_object_id)) object_id.assign(pixels, 0);
+        if (channels) samples_taken.assign(pixels, 0);
+    }
+
+    int image_width() const { return width; }
+    int image_height() const { return height; }
+    unsigned enabled_channels() const { return channels; }
+    bool enabled(aov_channel c) const { return (channels & c) != 0; }
+
+    // Averages the sample into pixel (x, y); misses count as zero. The object id is the one of
+    // the pixel's first sample, ids can't be averaged.
+    void add_sample(int x, int y, const aov_hit& h) {
+        auto i = size_t(y) * width + x;
+        auto previous = static_cast<float>(samples_taken[i]);
+        auto total = previous + 1;
+        auto update_average = [&](std::vector<float>& values, size_t at, double value) {
+            values[at] = (values[at] * previous + static_cast<float>(value)) / total;
+        };
+        if (enabled(aov_albedo)) {
+            for (int c = 0; c < 3; ++c)
+                update_average(albedo, i * 3 + c, h.hit ? h.albedo[c] : 0);
+        }
+        if (enabled(aov_normal)) {
+            for (int c = 0; c < 3; ++c)
+                update_average(normal, i * 3 + c, h.hit ? h.normal[c] : 0);
+        }
+        if (enabled(aov_depth))
+            update_average(depth, i, h.hit ? h.depth : 0);
+        if (enabled(aov_object_id) && samples_taken[i] == 0)
+            object_id[i] = h.hit ? h.object_id : 0;
+        samples_taken[i]++;
+    }
+
+    color albedo_at(int x, int y) const { return read3(albedo, x, y); }
+    vec3 normal_at(int x, int y) const { return read3(normal, x, y); }
+    float depth_at(int x, int y) const { return depth[size_t(y) * width + x]; }
+    uint32_t object_id_at(int x, int y) const { return object_id[size_t(y) * width + x]; }
+
+    // Interleaved RGB / XYZ and single-channel planes; empty when the channel is disabled.
+    const std::vector<float>& albedo_channel() const { return albedo; }
+    const std::vector<float>& normal_channel() const { return normal; }
+    const std::vector<float>& depth_channel() const { return depth; }
+    const std::vector<uint32_t>& object_id_channel() const { return object_id; }
+
+    // Writes <prefix>_albedo.pfm, <prefix>_normal.pfm, <prefix>_depth.pfm and
+    // <prefix>_object_id.pfm for the enabled channels.
+    bool write(const std::string& prefix) const {
+        bool ok = true;
+        if (enabled(aov_albedo))
+            ok = write_pfm(prefix + "_albedo.pfm", width, height, 3, albedo.data()) && ok;
+        if (enabled(aov_normal))
+            ok = write_pfm(prefix + "_normal.pfm", width, height, 3, normal.data()) && ok;
+        if (enabled(aov_depth))
+            ok = write_pfm(prefix + "_depth.pfm", width, height, 1, depth.data()) && ok;
+        if (enabled(aov_object_id)) {
+            std::vector<float> ids(object_id.begin(), object_id.end());
+            ok = write_pfm(prefix + "_object_id.pfm", width, height, 1, ids.data()) && ok;
+        }
+        return ok;
+    }
+
+  private:
+    vec3 read3(const std::vector<float>& values, int x, int y) const {
+        auto i = (size_t(y) * width + x) * 3;
+        return vec3(values[i], values[i + 1], values[i + 2]);
+    }
+
+    int width = 0;
+    int height = 0;
+    unsigned channels = 0;
+    std::vector<float> albedo;
+    std::vector<float> normal;
+    std::vector<float> depth;
+    std::vector<uint32_t> object_id;
+    std::vector<uint32_t> samples_taken;
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+inline size_t next_arena_type_id() {
+    static std::atomic<size_t> next{0};
+    return next++;
+}
+
+// Small dense id per type, cheaper to look up than a type_index.
+template <typename T>
+size_t arena_type_id() {
+    static const size_t id = next_arena_type_id();
+    return id;
+}
+
+struct arena_stats {
+    size_t objects = 0;         // Objects constructed in the arena
+    size_t blocks = 0;          // Heap allocations made for them
+    size_t bytes_reserved = 0;  // Total size of those allocations
+    size_t bytes_used = 0;      // Bytes taken by the objects
+};
+
+// Monotonic allocator for scene objects. Objects of each type are packed into their own blocks,
+// so e.g. all spheres lie next to each other in memory. Nothing is freed individually: all
+// objects are destroyed and all blocks released together with the arena.
+//
+// make() returns shared_ptrs that share ownership of the arena's storage rather than of the
+// object alone, so all objects of an arena use one control block and none is destroyed before
+// the arena and the last pointer into it are gone. Pointers into the same arena that are passed
+// to make() reach the constructor without ownership, as an object owning its own arena would
+// never be released. An arena is not thread-safe; use one per thread.
+class scene_arena {
+  public:
+    explicit scene_arena(size_t block_bytes = 64 * 1024)
+      : storage(std::make_shared<arena_storage>(block_bytes)) {}
+
+    template <typename T, typename... Args>
+    std::shared_ptr<T> make(Args&&... args) {
+        void* memory = storage->pool_for<T>().allocate(storage->stats);
+        T* object = new (memory) T(argument(std::forward<Args>(args))...);
+        if constexpr (!std::is_trivially_destructible_v<T>)
+            storage->destructors.emplace_back(object, [](void* p) { static_cast<T*>(p)->~T(); });
+        storage->stats.objects++;
+        return std::shared_ptr<T>(storage, object);
+    }
+
+    arena_stats stats() const { return storage->stats; }
+
+  private:
+    template <typename T>
+    struct is_shared_ptr : std::false_type {};
+    template <typename T>
+    struct is_shared_ptr<std::shared_ptr<T>> : std::true_type {};
+
+    template <typename A>
+    decltype(auto) argument(A&& arg) const {
+        using type = std::decay_t<A>;
+        if constexpr (is_shared_ptr<type>::value) {
+            if (!arg.owner_before(storage) && !storage.owner_before(arg))
+                return type(type(), arg.get());
+            return type(std::forward<A>(arg));
+        } else {
+            return std::forward<A>(arg);
+        }
+    }
+
+    struct arena_pool {
+        size_t object_size = 0;
+        size_t alignment = 0;
+        size_t objects_per_block = 0;
+        size_t allocated = 0;
+        std::vector<unsigned char*> blocks;
+
+        void* allocate(arena_stats& stats) {
+            if (allocated == blocks.size() * objects_per_block) {
+                auto bytes = objects_per_block * object_size;
+                blocks.push_back(static_cast<unsigned char*>(::operator new(bytes, std::align_val_t(alignment))));
+                stats.blocks++;
+                stats.bytes_reserved += bytes;
+            }
+            stats.bytes_used += object_size;
+            auto slot = allocated++;
+            return blocks[slot / objects_per_block] + (slot % objects_per_block) * object_size;
+        }
+    };
+
+    struct arena_storage {
+        size_t block_bytes;
+        arena_stats stats;
+        std::deque<arena_pool> pools;  // Deque keeps pools in place while constructors add more
+        std::vector<arena_pool*> pool_by_type;  // Indexed by arena_type_id<T>()
+        std::vector<std::pair<void*, void (*)(void*)>> destructors;
+
+        explicit arena_storage(size_t _block_bytes) : block_bytes(_block_bytes) {}
+
+        ~arena_storage() {
+            // Destroy in reverse order of construction, like automatic objects.
+            for (auto d = destructors.rbegin(); d != destructors.rend(); ++d)
+                d->second(d->first);
+            for (auto& pool : pools) {
+                for (auto block : pool.blocks)
+                    ::operator delete(block, std::align_val_t(pool.alignment));
+            }
+        }
+
+        template <typename T>
+        arena_pool& pool_for() {
+            auto id = arena_type_id<T>();
+            if (id < pool_by_type.size() && pool_by_type[id])
+                return *pool_by_type[id];
+
+            auto& pool = pools.emplace_back();
+            pool.object_size = sizeof(T);
+            pool.alignment = std::max(alignof(T), alignof(std::max_align_t));
+            pool.objects_per_block = std::max<size_t>(1, block_bytes / sizeof(T));
+            if (id >= pool_by_type.size())
+                pool_by_type.resize(id + 1, nullptr);
+            pool_by_type[id] = &pool;
+            return pool;
+        }
+    };
+
+    std::shared_ptr<arena_storage> storage;
+};
@@ -3,30 +3,775 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "parallel.h"
+#include "stats.h"
+#include "trace.h"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+enum class bvh_builder {
+    sah,   // Binned surface area heuristic: slower build, best trace performance
+    lbvh   // Linear BVH over sorted Morton codes: near linear build for per-frame rebuilds
+};
+
+struct bvh_options {
+    bvh_builder builder = bvh_builder::sah;
+    int max_leaf_size = 4;
+    int morton_bits = 30;              // LBVH only: 30 or 63 bit Morton codes
+    bool treelet_restructure = false;  // LBVH only: optimize 7-leaf treelets for SAH after the build
+};
+
+// Node of the flattened BVH. Nodes are stored depth-first, so the first child of an interior
+// node directly follows it and only the second child needs an index. The layout holds no
+// pointers, which lets the node array be written to disk or uploaded to the GPU as is.
+struct bvh_linear_node {
+    double bounds_min[3];
+    double bounds_max[3];
+    uint32_t offset;  // Leaf: first primitive, interior node: second child
+    uint32_t count;   // Primitive count, 0 for interior nodes. Leaves at the depth cap can be big
+    uint32_t axis;    // Axis along which the first child lies before the second
+    uint32_t unused;  // Spells out the tail padding, so cache files hold no indeterminate bytes
+};
+
+static_assert(sizeof(bvh_linear_node) == 64, "bvh_linear_node must have no implicit padding");
+
+// Read-only view of an array owned by the BVH or by the memory it was loaded from.
+template <typename T>
+struct bvh_span {
+    const T* data = nullptr;
+    size_t count = 0;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T& operator[](size_t i) const { return data[i]; }
+    const T* begin() const { return data; }
+    const T* end() const { return data + count; }
+};
+
+// A flattened BVH built earlier, e.g. read from a memory-mapped cache file. `storage` keeps
+// the memory behind `nodes` and `order` alive for as long as the BVH uses it.
+struct bvh_prebuilt {
+    bvh_span<bvh_linear_node> nodes;
+    bvh_span<uint32_t> order;
+    shared_ptr<const void> storage;
+};
+
+static constexpr int bvh_max_depth = 128;
+static constexpr double bvh_traversal_cost = 0.125;  // Relative to one primitive test
+
+// Checks that a flattened BVH over `primitive_count` primitives can be traversed safely: every
+// child and leaf range is in bounds, each node is reached exactly once, no path is deeper than
+// the traversal stack, and the primitive order is a permutation.
+inline bool bvh_is_well_formed(bvh_span<bvh_linear_node> nodes, bvh_span<uint32_t> order, size_t primitive_count) {
+    if (order.size() != primitive_count || nodes.empty() != (primitive_count == 0))
+        return false;
+
+    std::vector<bool> seen(primitive_count, false);
+    for (auto index : order) {
+        if (index >= primitive_count || seen[index])
+            return false;
+        seen[index] = true;
+    }
+
+    std::vector<bool> reached(nodes.size(), false);
+    std::vector<std::pair<size_t, int>> pending;
+    if (!nodes.empty())
+        pending.push_back({0, 0});
+    while (!pending.empty()) {
+        auto [index, depth] = pending.back();
+        pending.pop_back();
+        if (index >= nodes.size() || reached[index] || depth >= bvh_max_depth)
+            return false;
+        reached[index] = true;
+
+        const auto& node = nodes[index];
+        if (node.count > 0) {
+            if (node.offset > primitive_count || node.count > primitive_count - node.offset)
+                return false;
+        } else {
+            if (node.axis > 2)
+                return false;
+            pending.push_back({index + 1, depth + 1});
+            pending.push_back({node.offset, depth + 1});
+        }
+    }
+    return std::find(reached.begin(), reached.end(), false) == reached.end();
+}
+
+inline int leading_zeros64(uint64_t x) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    return _BitScanReverse64(&index, x) ? 63 - static_cast<int>(index) : 64;
+#else
+    return x == 0 ? 64 : __builtin_clzll(x);
+#endif
+}
+
+inline int leading_zeros32(uint32_t x) {
+    return leading_zeros64(x) - 32;
+}
+
+struct bvh_bounds {
+    double min[3] = {+infinity, +infinity, +infinity};
+    double max[3] = {-infinity, -infinity, -infinity};
+
+    bvh_bounds() {}
+
+    explicit bvh_bounds(const aabb& box) {
+        for (int a = 0; a < 3; a++) {
+            min[a] = box.axis(a).min;
+            max[a] = box.axis(a).max;
+        }
+    }
+
+    void expand(const bvh_bounds& b) {
+        for (int a = 0; a < 3; a++) {
+            min[a] = fmin(min[a], b.min[a]);
+            max[a] = fmax(max[a], b.max[a]);
+        }
+    }
+
+    void expand(const double p[3]) {
+        for (int a = 0; a < 3; a++) {
+            min[a] = fmin(min[a], p[a]);
+            max[a] = fmax(max[a], p[a]);
+        }
+    }
+
+    double centroid(int a) const { return 0.5 * (min[a] + max[a]); }
+
+    double extent(int a) const { return max[a] > min[a] ? max[a] - min[a] : 0; }
+
+    double surface_area() const {
+        if (max[0] < min[0])
+            return 0;
+        auto dx = extent(0), dy = extent(1), dz = extent(2);
+        return 2 * (dx*dy + dy*dz + dz*dx);
+    }
+
+    int longest_axis() const {
+        if (extent(0) > extent(1))
+            return extent(0) > extent(2) ? 0 : 2;
+        return extent(1) > extent(2) ? 1 : 2;
+    }
+
+    aabb to_aabb() const {
+        return aabb(interval(min[0], max[0]), interval(min[1], max[1]), interval(min[2], max[2]));
+    }
+};
+
+struct bvh_primitive {
+    bvh_bounds bounds;
+    double centroid[3];
+    uint32_t index;
+};
+
+// Interleaves the low 21 bits of v so that bit i moves to bit 3*i.
+inline uint64_t morton_spread_bits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+    v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2)  & 0x1249249249249249ULL;
+    return v;
+}
+
+inline uint64_t morton_code(const double p[3], const bvh_bounds& centroid_bounds, int bits_per_axis) {
+    uint64_t code = 0;
+    double scale = static_cast<double>(uint64_t(1) << bits_per_axis);
+    uint64_t max_cell = (uint64_t(1) << bits_per_axis) - 1;
+    for (int a = 0; a < 3; a++) {
+        auto extent = centroid_bounds.extent(a);
+        auto normalized = extent > 0 ? (p[a] - centroid_bounds.min[a]) / extent : 0.0;
+        auto cell = std::min(max_cell, static_cast<uint64_t>(fmax(0.0, normalized * scale)));
+        code |= morton_spread_bits(cell) << (2 - a);
+    }
+    return code;
+}
+
+// Stable LSD radix sort of `values` by `keys`, 8 bits per pass. Every pass builds per-thread
+// digit histograms, turns them into per-thread scatter offsets and scatters in parallel.
+inline void radix_sort(std::vector<uint64_t>& keys, std::vector<uint32_t>& values, int key_bits) {
+    constexpr size_t grain = size_t(1) << 16;
+    size_t n = keys.size();
+    size_t chunks = parallel_chunk_count(n, grain);
+    std::vector<uint64_t> keys_tmp(n);
+    std::vector<uint32_t> values_tmp(n);
+    std::vector<std::array<size_t, 256>> histograms(chunks);
+
+    for (int shift = 0; shift < key_bits; shift += 8) {
+        parallel_chunks(n, grain, [&](size_t begin, size_t end, size_t chunk) {
+            auto& histogram = histograms[chunk];
+            histogram.fill(0);
+            for (size_t i = begin; i < end; ++i)
+                ++histogram[(keys[i] >> shift) & 0xff];
+        });
+
+        // Digit-major, chunk-minor prefix sum keeps equal digits in input order.
+        size_t sum = 0;
+        for (int digit = 0; digit < 256; ++digit) {
+            for (auto& histogram : histograms) {
+                auto count = histogram[digit];
+                histogram[digit] = sum;
+                sum += count;
+            }
+        }
+
+        parallel_chunks(n, grain, [&](size_t begin, size_t end, size_t chunk) {
+            auto& offsets = histograms[chunk];
+            for (size_t i = begin; i < end; ++i) {
+                auto dst = offsets[(keys[i] >> shift) & 0xff]++;
+                keys_tmp[dst] = keys[i];
+                values_tmp[dst] = values[i];
+            }
+        });
+
+        keys.swap(keys_tmp);
+        values.swap(values_tmp);
+    }
+}
 
 class bvh_node : public hittable {
   public:
-    bvh_node(const hittable_list& list) : bvh_node(list.objects, 0, list.objects.size()) {}
+    bvh_node(const hittable_list& list, bvh_options options = {})
+      : bvh_node(list.objects, 0, list.objects.size(), options) {}
 
-    bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end) {
-        // To be implemented later.
+    bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end,
+             bvh_options options = {}) {
+        trace_scope trace("bvh_build", "bvh", static_cast<int64_t>(end - start));
+        auto build_start = std::chrono::steady_clock::now();
+        options.max_leaf_size = std::clamp(options.max_leaf_size, 1, 255);
+
+        std::vector<bvh_primitive> prims(end - start);
+        for (size_t i = 0; i < prims.size(); ++i) {
+            auto& p = prims[i];
+            p.bounds = bvh_bounds(src_objects[start + i]->bounding_box());
+            for (int a = 0; a < 3; a++)
+                p.centroid[a] = p.bounds.centroid(a);
+            p.index = static_cast<uint32_t>(i);
+        }
+
+        order.reserve(prims.size());
+        if (!prims.empty()) {
+            if (options.builder == bvh_builder::lbvh)
+                build_lbvh(prims, options);
+            else
+                build_sah(prims, 0, prims.size(), options.max_leaf_size);
+        }
+
+        node_view = {linear_nodes.data(), linear_nodes.size()};
+        order_view = {order.data(), order.size()};
+        attach_objects(src_objects, start);
+
+        build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - build_start).count();
     }
 
+    // Uses an already built BVH over the same primitives instead of building one.
+    bvh_node(const hittable_list& list, bvh_prebuilt prebuilt)
+      : node_view(prebuilt.nodes), order_view(prebuilt.order), storage(std::move(prebuilt.storage)) {
+        attach_objects(list.objects, 0);
+    }
+
+    // The node and order views may point into this object's own arrays.
+    bvh_node(const bvh_node&) = delete;
+    bvh_node& operator=(const bvh_node&) = delete;
+
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        if (!box.hit(r, ray_t))
+        if (node_view.empty())
             return false;
 
-        bool hit_left = left->hit(r, ray_t, rec);
-        bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+        const point3 origin = r.origin();
+        const vec3 direction = r.direction();
+        const double orig[3] = {origin[0], origin[1], origin[2]};
+        const double inv_dir[3] = {1 / direction[0], 1 / direction[1], 1 / direction[2]};
+        const bool dir_is_neg[3] = {inv_dir[0] < 0, inv_dir[1] < 0, inv_dir[2] < 0};
+
+        uint32_t stack[bvh_max_depth];
+        int stack_size = 0;
+        uint32_t current = 0;
+        bool hit_anything = false;
 
-        return hit_left || hit_right;
+        while (true) {
+            const auto& node = node_view[current];
+            RT_STAT_INC(bvh_node_visits);
+            if (node_hit(node, orig, inv_dir, ray_t)) {
+                if (node.count > 0) {
+                    for (uint32_t i = 0; i < node.count; ++i) {
+                        if (objects[node.offset + i]->hit(r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                    if (stack_size == 0)
+                        break;
+                    current = stack[--stack_size];
+                } else if (dir_is_neg[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            } else {
+                if (stack_size == 0)
+                    break;
+                current = stack[--stack_size];
+            }
+        }
+
+        return hit_anything;
     }
 
     aabb bounding_box() const override { return bbox; }
 
+    bvh_span<bvh_linear_node> nodes() const { return node_view; }
+
+    // Index into the source range of the primitive stored in each BVH primitive slot.
+    bvh_span<uint32_t> primitive_order() const { return order_view; }
+
+    double build_milliseconds() const { return build_ms; }
+
   private:
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
+    // Binary tree produced by the LBVH builder before flattening. Leaves occupy
+    // [0, n), internal nodes [n, 2n - 1).
+    struct lbvh_node {
+        bvh_bounds bounds;
+        uint32_t left = 0;
+        uint32_t right = 0;
+        uint32_t parent = UINT32_MAX;
+        uint32_t leaf_count = 1;
+        double cost = 0;
+    };
+
+    std::vector<shared_ptr<hittable>> objects;
+    std::vector<bvh_linear_node> linear_nodes;
+    std::vector<uint32_t> order;
+    bvh_span<bvh_linear_node> node_view;
+    bvh_span<uint32_t> order_view;
+    shared_ptr<const void> storage;
     aabb bbox;
-};
\ No newline at end of file
+    double build_ms = 0;
+
+    void attach_objects(const std::vector<shared_ptr<hittable>>& src_objects, size_t start) {
+        objects.reserve(order_view.size());
+        for (auto index : order_view) {
+            if (start + index >= src_objects.size())
+                throw std::out_of_range("BVH primitive index out of range");
+            objects.push_back(src_objects[start + index]);
+        }
+
+        if (!node_view.empty()) {
+            const auto& root = node_view[0];
+            bbox = aabb(interval(root.bounds_min[0], root.bounds_max[0]),
+                        interval(root.bounds_min[1], root.bounds_max[1]),
+                        interval(root.bounds_min[2], root.bounds_max[2]));
+        }
+    }
+
+    static bool node_hit(const bvh_linear_node& node, const double orig[3], const double inv_dir[3],
+                         interval ray_t) {
+        for (int a = 0; a < 3; a++) {
+            auto t0 = (node.bounds_min[a] - orig[a]) * inv_dir[a];
+            auto t1 = (node.bounds_max[a] - orig[a]) * inv_dir[a];
+
+            if (inv_dir[a] < 0)
+                std::swap(t0, t1);
+
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+    uint32_t push_node(const bvh_bounds& bounds) {
+        auto index = static_cast<uint32_t>(linear_nodes.size());
+        bvh_linear_node node{};
+        for (int a = 0; a < 3; a++) {
+            node.bounds_min[a] = bounds.min[a];
+            node.bounds_max[a] = bounds.max[a];
+        }
+        linear_nodes.push_back(node);
+        return index;
+    }
+
+    void make_leaf(uint32_t node_index, const std::vector<bvh_primitive>& prims, size_t start, size_t end) {
+        auto& node = linear_nodes[node_index];
+        node.offset = static_cast<uint32_t>(order.size());
+        node.count = static_cast<uint32_t>(end - start);
+        for (size_t i = start; i < end; ++i)
+            order.push_back(prims[i].index);
+    }
+
+    uint32_t build_sah(std::vector<bvh_primitive>& prims, size_t start, size_t end, int max_leaf_size,
+                       int depth = 0) {
+        bvh_bounds bounds, centroid_bounds;
+        for (size_t i = start; i < end; ++i) {
+            bounds.expand(prims[i].bounds);
+            centroid_bounds.expand(prims[i].centroid);
+        }
+
+        auto node_index = push_node(bounds);
+        auto count = end - start;
+        if (count == 1 || depth + 1 >= bvh_max_depth) {
+            make_leaf(node_index, prims, start, end);
+            return node_index;
+        }
+
+        int axis = centroid_bounds.longest_axis();
+        size_t mid = start + count / 2;
+
+        if (centroid_bounds.extent(axis) <= 0) {
+            // All centroids coincide, no split can separate them.
+            if (count <= static_cast<size_t>(max_leaf_size)) {
+                make_leaf(node_index, prims, start, end);
+                return node_index;
+            }
+        } else {
+            constexpr int bucket_count = 12;
+            struct bucket {
+                size_t count = 0;
+                bvh_bounds bounds;
+            } buckets[bucket_count];
+
+            auto axis_min = centroid_bounds.min[axis];
+            auto axis_extent = centroid_bounds.extent(axis);
+            auto bucket_of = [&](const bvh_primitive& p) {
+                int b = static_cast<int>(bucket_count * ((p.centroid[axis] - axis_min) / axis_extent));
+                return std::clamp(b, 0, bucket_count - 1);
+            };
+
+            for (size_t i = start; i < end; ++i) {
+                auto& b = buckets[bucket_of(prims[i])];
+                b.count++;
+                b.bounds.expand(prims[i].bounds);
+            }
+
+            // Sweep from both sides to get the cost of splitting after each bucket.
+            double costs[bucket_count - 1] = {};
+            size_t count_below = 0;
+            bvh_bounds bounds_below;
+            for (int i = 0; i < bucket_count - 1; ++i) {
+                bounds_below.expand(buckets[i].bounds);
+                count_below += buckets[i].count;
+                costs[i] += count_below * bounds_below.surface_area();
+            }
+            size_t count_above = 0;
+            bvh_bounds bounds_above;
+            for (int i = bucket_count - 1; i >= 1; --i) {
+                bounds_above.expand(buckets[i].bounds);
+                count_above += buckets[i].count;
+                costs[i - 1] += count_above * bounds_above.surface_area();
+            }
+
+            int min_bucket = 0;
+            for (int i = 1; i < bucket_count - 1; ++i) {
+                if (costs[i] < costs[min_bucket])
+                    min_bucket = i;
+            }
+
+            auto area = bounds.surface_area();
+            auto leaf_cost = static_cast<double>(count);
+            auto split_cost = bvh_traversal_cost + (area > 0 ? costs[min_bucket] / area : leaf_cost);
+
+            if (count <= static_cast<size_t>(max_leaf_size) && leaf_cost <= split_cost) {
+                make_leaf(node_index, prims, start, end);
+                return node_index;
+            }
+
+            auto it = std::partition(prims.begin() + start, prims.begin() + end,
+                                     [&](const bvh_primitive& p) { return bucket_of(p) <= min_bucket; });
+            mid = static_cast<size_t>(it - prims.begin());
+        }
+
+        if (mid == start || mid == end) {
+            mid = start + count / 2;
+            std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+                             [axis](const bvh_primitive& a, const bvh_primitive& b) {
+                                 return a.centroid[axis] < b.centroid[axis];
+                             });
+        }
+
+        linear_nodes[node_index].axis = static_cast<uint32_t>(axis);
+        build_sah(prims, start, mid, max_leaf_size, depth + 1);
+        auto second = build_sah(prims, mid, end, max_leaf_size, depth + 1);
+        linear_nodes[node_index].offset = second;
+        return node_index;
+    }
+
+    void build_lbvh(const std::vector<bvh_primitive>& prims, const bvh_options& options) {
+        const size_t n = prims.size();
+        const int bits_per_axis = options.morton_bits > 30 ? 21 : 10;
+
+        bvh_bounds centroid_bounds;
+        for (const auto& p : prims)
+            centroid_bounds.expand(p.centroid);
+
+        std::vector<uint64_t> codes(n);
+        std::vector<uint32_t> sorted(n);
+        std::iota(sorted.begin(), sorted.end(), 0);
+        parallel_for(n, 4096, [&](size_t i) {
+            codes[i] = morton_code(prims[i].centroid, centroid_bounds, bits_per_axis);
+        });
+        radix_sort(codes, sorted, 3 * bits_per_axis);
+
+        std::vector<lbvh_node> tree(2 * n - 1);
+        for (size_t i = 0; i < n; ++i) {
+            tree[i].bounds = prims[sorted[i]].bounds;
+            tree[i].cost = tree[i].bounds.surface_area();
+        }
+
+        // Karras 2012: every internal node finds its key range and split independently.
+        auto delta = [&](int64_t i, int64_t j) -> int {
+            if (j < 0 || j >= static_cast<int64_t>(n))
+                return -1;
+            if (codes[i] == codes[j])
+                return 64 + leading_zeros32(static_cast<uint32_t>(i ^ j));
+            return leading_zeros64(codes[i] ^ codes[j]);
+        };
+
+        parallel_for(n - 1, 4096, [&](size_t node) {
+            auto i = static_cast<int64_t>(node);
+            int64_t d = delta(i, i + 1) - delta(i, i - 1) >= 0 ? 1 : -1;
+
+            int delta_min = delta(i, i - d);
+            int64_t l_max = 2;
+            while (delta(i, i + l_max * d) > delta_min)
+                l_max *= 2;
+
+            int64_t l = 0;
+            for (int64_t t = l_max / 2; t >= 1; t /= 2) {
+                if (delta(i, i + (l + t) * d) > delta_min)
+                    l += t;
+            }
+            int64_t j = i + l * d;
+
+            int delta_node = delta(i, j);
+            int64_t s = 0;
+            for (int64_t div = 2; ; div *= 2) {
+                int64_t t = (l + div - 1) / div;
+                if (delta(i, i + (s + t) * d) > delta_node)
+                    s += t;
+                if (t <= 1)
+                    break;
+            }
+            int64_t gamma = i + s * d + std::min<int64_t>(d, 0);
+
+            auto self = static_cast<uint32_t>(n + node);
+            auto& internal = tree[self];
+            internal.left = static_cast<uint32_t>(std::min(i, j) == gamma ? gamma : n + gamma);
+            internal.right = static_cast<uint32_t>(std::max(i, j) == gamma + 1 ? gamma + 1 : n + gamma + 1);
+            tree[internal.left].parent = self;
+            tree[internal.right].parent = self;
+        });
+
+        // Bounds, leaf counts and SAH costs bottom-up; the second child to arrive completes a node.
+        std::vector<uint32_t> completed;
+        completed.reserve(n - 1);
+        std::vector<uint8_t> arrivals(n, 0);
+        for (size_t leaf = 0; leaf < n; ++leaf) {
+            auto node = tree[leaf].parent;
+            while (node != UINT32_MAX && ++arrivals[node - n] == 2) {
+                update_lbvh_node(tree, node);
+                completed.push_back(node);
+                node = tree[node].parent;
+            }
+        }
+
+        if (options.treelet_restructure) {
+            for (auto node : completed)
+                restructure_treelet(tree, node, n);
+        }
+
+        auto root = n > 1 ? static_cast<uint32_t>(n) : 0u;
+        flatten_lbvh(tree, root, n, sorted, options.max_leaf_size, 0);
+    }
+
+    static void update_lbvh_node(std::vector<lbvh_node>& tree, uint32_t index) {
+        auto& node = tree[index];
+        const auto& left = tree[node.left];
+        const auto& right = tree[node.right];
+        node.bounds = left.bounds;
+        node.bounds.expand(right.bounds);
+        node.leaf_count = left.leaf_count + right.leaf_count;
+        node.cost = bvh_traversal_cost * node.bounds.surface_area() + left.cost + right.cost;
+    }
+
+    // Karras & Aila 2013: grow a treelet of up to 7 leaves below `root` by repeatedly expanding
+    // the largest leaf, then rebuild it with the topology that minimizes the SAH cost.
+    static void restructure_treelet(std::vector<lbvh_node>& tree, uint32_t root, size_t n) {
+        constexpr int max_leaves = 7;
+        std::array<uint32_t, max_leaves> leaves;
+        std::array<uint32_t, max_leaves - 1> internals;
+        int leaf_count = 2;
+        int internal_count = 1;
+        leaves[0] = tree[root].left;
+        leaves[1] = tree[root].right;
+        internals[0] = root;
+
+        while (leaf_count < max_leaves) {
+            int largest = -1;
+            double largest_area = -1;
+            for (int i = 0; i < leaf_count; ++i) {
+                if (leaves[i] < n)
+                    continue;
+                auto area = tree[leaves[i]].bounds.surface_area();
+                if (area > largest_area) {
+                    largest_area = area;
+                    largest = i;
+                }
+            }
+            if (largest < 0)
+                break;
+
+            auto expanded = leaves[largest];
+            internals[internal_count++] = expanded;
+            leaves[largest] = tree[expanded].left;
+            leaves[leaf_count++] = tree[expanded].right;
+        }
+
+        if (leaf_count < 3)
+            return;
+
+        const int subsets = 1 << leaf_count;
+        std::array<double, 1 << max_leaves> area{};
+        std::array<double, 1 << max_leaves> best_cost{};
+        std::array<int, 1 << max_leaves> best_split{};
+
+        for (int s = 1; s < subsets; ++s) {
+            bvh_bounds bounds;
+            for (int i = 0; i < leaf_count; ++i) {
+                if (s & (1 << i))
+                    bounds.expand(tree[leaves[i]].bounds);
+            }
+            area[s] = bounds.surface_area();
+        }
+
+        for (int s = 1; s < subsets; ++s) {
+            if ((s & (s - 1)) == 0) {
+                int i = 0;
+                while (!(s & (1 << i)))
+                    ++i;
+                best_cost[s] = tree[leaves[i]].cost;
+                continue;
+            }
+
+            // Fixing the lowest leaf on the left side visits every partition once.
+            int lowest = s & -s;
+            int rest = s ^ lowest;
+            double best = infinity;
+            for (int sub = rest; ; sub = (sub - 1) & rest) {
+                int p = sub | lowest;
+                if (p != s) {
+                    double cost = best_cost[p] + best_cost[s ^ p];
+                    if (cost < best) {
+                        best = cost;
+                        best_split[s] = p;
+                    }
+                }
+                if (sub == 0)
+                    break;
+            }
+            best_cost[s] = bvh_traversal_cost * area[s] + best;
+        }
+
+        if (best_cost[subsets - 1] >= tree[root].cost * (1 - 1e-9))
+            return;
+
+        int next_internal = 1;
+        auto rebuild = [&](auto&& self, int s, uint32_t node) -> void {
+            auto child = [&](int subset) -> uint32_t {
+                if ((subset & (subset - 1)) == 0) {
+                    int i = 0;
+                    while (!(subset & (1 << i)))
+                        ++i;
+                    return leaves[i];
+                }
+                auto internal = internals[next_internal++];
+                self(self, subset, internal);
+                return internal;
+            };
+            int p = best_split[s];
+            tree[node].left = child(p);
+            tree[node].right = child(s ^ p);
+            tree[tree[node].left].parent = node;
+            tree[tree[node].right].parent = node;
+            update_lbvh_node(tree, node);
+        };
+        rebuild(rebuild, subsets - 1, root);
+    }
+
+    uint32_t flatten_lbvh(const std::vector<lbvh_node>& tree, uint32_t index, size_t n,
+                          const std::vector<uint32_t>& sorted, int max_leaf_size, int depth) {
+        const auto& node = tree[index];
+        auto node_index = push_node(node.bounds);
+
+        if (index < n) {
+            linear_nodes[node_index].offset = static_cast<uint32_t>(order.size());
+            linear_nodes[node_index].count = 1;
+            order.push_back(sorted[index]);
+            return node_index;
+        }
+
+        auto leaf_cost = node.bounds.surface_area() * node.leaf_count;
+        bool small_enough = node.leaf_count <= static_cast<uint32_t>(max_leaf_size) && leaf_cost <= node.cost;
+        if (small_enough || depth + 1 >= bvh_max_depth) {
+            linear_nodes[node_index].offset = static_cast<uint32_t>(order.size());
+            linear_nodes[node_index].count = node.leaf_count;
+            collect_lbvh_leaves(tree, index, n, sorted);
+            return node_index;
+        }
+
+        // Pick the axis that best separates the children and emit the lower child first, so
+        // traversal can order the children by ray direction like the SAH layout.
+        const auto& left = tree[node.left];
+        const auto& right = tree[node.right];
+        int axis = 0;
+        double separation = -1;
+        for (int a = 0; a < 3; a++) {
+            auto diff = fabs(right.bounds.centroid(a) - left.bounds.centroid(a));
+            if (diff > separation) {
+                separation = diff;
+                axis = a;
+            }
+        }
+        bool swap_children = right.bounds.centroid(axis) < left.bounds.centroid(axis);
+        auto first = swap_children ? node.right : node.left;
+        auto second = swap_children ? node.left : node.right;
+
+        linear_nodes[node_index].axis = static_cast<uint32_t>(axis);
+        flatten_lbvh(tree, first, n, sorted, max_leaf_size, depth + 1);
+        auto second_index = flatten_lbvh(tree, second, n, sorted, max_leaf_size, depth + 1);
+        linear_nodes[node_index].offset = second_index;
+        return node_index;
+    }
+
+    void collect_lbvh_leaves(const std::vector<lbvh_node>& tree, uint32_t index, size_t n,
+                             const std::vector<uint32_t>& sorted) {
+        std::vector<uint32_t> stack{index};
+        while (!stack.empty()) {
+            auto current = stack.back();
+            stack.pop_back();
+            if (current < n) {
+                order.push_back(sorted[current]);
+            } else {
+                stack.push_back(tree[current].right);
+                stack.push_back(tree[current].left);
+            }
+        }
+    }
+};
@@ -0,0 +1,164 @@
+#pragma once
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "hittable_list.h"
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+
+static constexpr char bvh_cache_magic[8] = {'R', 'T', 'B', 'V', 'H', 'C', 0, 0};
+static constexpr uint32_t bvh_cache_version = 2;
+static constexpr uint16_t bvh_cache_byte_order = 0x0102;
+static constexpr uint64_t bvh_cache_alignment = 64;
+
+// The header is followed by the node array and the primitive order at the recorded offsets.
+// Offsets are relative to the start of the file, so the file can be mapped at any address and
+// the arrays used in place.
+struct bvh_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint16_t node_size;
+    uint16_t byte_order;
+    uint64_t content_hash;
+    uint64_t node_count;
+    uint64_t primitive_count;
+    uint64_t nodes_offset;
+    uint64_t order_offset;
+};
+
+inline uint64_t bvh_hash_mix(uint64_t h, uint64_t v) {
+    v *= 0xff51afd7ed558ccdull;
+    v ^= v >> 33;
+    h = (h ^ v) * 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 29);
+}
+
+// Hash of everything the BVH depends on: the primitive bounds, in order, and the build options.
+inline uint64_t bvh_content_hash(const hittable_list& list, const bvh_options& options) {
+    uint64_t h = bvh_hash_mix(bvh_cache_version, list.objects.size());
+    h = bvh_hash_mix(h, static_cast<uint64_t>(options.builder));
+    h = bvh_hash_mix(h, static_cast<uint64_t>(options.max_leaf_size));
+    h = bvh_hash_mix(h, static_cast<uint64_t>(options.morton_bits));
+    h = bvh_hash_mix(h, options.treelet_restructure ? 1 : 0);
+
+    for (const auto& object : list.objects) {
+        auto box = object->bounding_box();
+        for (int a = 0; a < 3; a++) {
+            double bounds[2] = {box.axis(a).min, box.axis(a).max};
+            uint64_t bits[2];
+            std::memcpy(bits, bounds, sizeof(bits));
+            h = bvh_hash_mix(bvh_hash_mix(h, bits[0]), bits[1]);
+        }
+    }
+    return h;
+}
+
+inline uint64_t bvh_cache_align(uint64_t offset) {
+    return (offset + bvh_cache_alignment - 1) / bvh_cache_alignment * bvh_cache_alignment;
+}
+
+// Writes to a temporary file first, so a concurrent reader never maps a partial cache.
+inline bool save_bvh_cache(const std::string& path, const bvh_node& bvh, uint64_t content_hash) {
+    auto nodes = bvh.nodes();
+    auto order = bvh.primitive_order();
+
+    bvh_cache_header header{};
+    std::memcpy(header.magic, bvh_cache_magic, sizeof(header.magic));
+    header.version = bvh_cache_version;
+    header.node_size = sizeof(bvh_linear_node);
+    header.byte_order = bvh_cache_byte_order;
+    header.content_hash = content_hash;
+    header.node_count = nodes.size();
+    header.primitive_count = order.size();
+    header.nodes_offset = bvh_cache_align(sizeof(header));
+    header.order_offset = bvh_cache_align(header.nodes_offset + nodes.size() * sizeof(bvh_linear_node));
+
+    auto temp_path = path + ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+        if (!file)
+            return false;
+
+        const char padding[bvh_cache_alignment] = {};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(padding, header.nodes_offset - sizeof(header));
+        file.write(reinterpret_cast<const char*>(nodes.data), nodes.size() * sizeof(bvh_linear_node));
+        file.write(padding, header.order_offset - header.nodes_offset - nodes.size() * sizeof(bvh_linear_node));
+        file.write(reinterpret_cast<const char*>(order.data), order.size() * sizeof(uint32_t));
+        if (!file)
+            return false;
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temp_path, path, error);
+    return !error;
+}
+
+// Maps a cache file and checks it was written for this content hash and holds a well formed
+// tree. Nothing is parsed: the returned views point straight into the mapping.
+inline std::optional<bvh_prebuilt> load_bvh_cache(const std::string& path, uint64_t content_hash,
+                                                  size_t primitive_count) {
+    auto file = mapped_file::open(path);
+    if (!file || file->size() < sizeof(bvh_cache_header))
+        return std::nullopt;
+
+    bvh_cache_header header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, bvh_cache_magic, sizeof(header.magic)) != 0 ||
+        header.version != bvh_cache_version ||
+        header.node_size != sizeof(bvh_linear_node) ||
+        header.byte_order != bvh_cache_byte_order ||
+        header.content_hash != content_hash ||
+        header.primitive_count != primitive_count)
+        return std::nullopt;
+
+    // Each count is bounded by the file size first, so the end offsets can't overflow.
+    if (header.nodes_offset % alignof(bvh_linear_node) != 0 || header.order_offset % alignof(uint32_t) != 0 ||
+        header.nodes_offset > file->size() || header.order_offset > file->size() ||
+        header.node_count > (file->size() - header.nodes_offset) / sizeof(bvh_linear_node) ||
+        header.primitive_count > (file->size() - header.order_offset) / sizeof(uint32_t))
+        return std::nullopt;
+
+    bvh_prebuilt prebuilt;
+    prebuilt.nodes = {reinterpret_cast<const bvh_linear_node*>(file->data() + header.nodes_offset),
+                      static_cast<size_t>(header.node_count)};
+    prebuilt.order = {reinterpret_cast<const uint32_t*>(file->data() + header.order_offset),
+                      static_cast<size_t>(header.primitive_count)};
+    prebuilt.storage = file;
+    if (!bvh_is_well_formed(prebuilt.nodes, prebuilt.order, primitive_count))
+        return std::nullopt;
+    return prebuilt;
+}
+
+inline std::string bvh_cache_path(const std::string& cache_dir, uint64_t content_hash) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.bvh", static_cast<unsigned long long>(content_hash));
+    return (std::filesystem::path(cache_dir) / name).string();
+}
+
+// Loads the BVH for `list` from `cache_dir` when an up to date one is there, otherwise builds
+// it and stores it for the next run.
+inline shared_ptr<bvh_node> make_cached_bvh(const hittable_list& list, const std::string& cache_dir,
+                                            bvh_options options = {}) {
+    auto content_hash = bvh_content_hash(list, options);
+    auto path = bvh_cache_path(cache_dir, content_hash);
+
+    if (auto prebuilt = load_bvh_cache(path, content_hash, list.objects.size()))
+        return make_shared<bvh_node>(list, std::move(*prebuilt));
+    if (std::filesystem::exists(path))
+        std::clog << "Rebuilding BVH, cache " << path << " is unusable" << std::endl;
+
+    auto bvh = make_shared<bvh_node>(list, options);
+    std::error_code error;
+    std::filesystem::create_directories(cache_dir, error);
+    if (error || !save_bvh_cache(path, *bvh, content_hash))
+        std::clog << "Failed to write BVH cache " << path << std::endl;
+    return bvh;
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include "rtweekend.h"
+
+#include "bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Node of a BVH laid out for the GPU, 32 bytes and std430 compatible: float bounds, and instead
+// of the second child a skip pointer to the node that follows the subtree in depth-first order.
+// A ray enters the next node when it hits an interior node and follows the skip pointer when it
+// misses a node or is done with a leaf, so traversal needs no stack.
+struct bvh_gpu_node {
+    float bounds_min[3];
+    uint32_t skip;        // Node count when the subtree is the last one
+    float bounds_max[3];
+    uint32_t primitives;  // First primitive slot << 8 | primitive count, 0 for interior nodes
+};
+
+static_assert(sizeof(bvh_gpu_node) == 32, "bvh_gpu_node must match the GLSL BvhNode");
+
+static constexpr uint32_t bvh_gpu_max_primitives = 1u << 24;  // Slots fit the 24 bit offset
+static constexpr uint32_t bvh_gpu_max_leaf_size = 255;        // Fits the 8 bit count
+
+// Float bounds that still contain the double ones, so rounding never loses a hit.
+inline float bvh_gpu_round_down(double v) {
+    auto f = static_cast<float>(v);
+    return static_cast<double>(f) > v ? std::nextafter(f, -INFINITY) : f;
+}
+
+inline float bvh_gpu_round_up(double v) {
+    auto f = static_cast<float>(v);
+    return static_cast<double>(f) < v ? std::nextafter(f, INFINITY) : f;
+}
+
+// Converts the flattened CPU BVH. Leaves keep their primitive slots, so primitive i of the GPU
+// scene must be the object bvh.primitive_order()[i] of the list the BVH was built over. A leaf
+// over more primitives than the count holds, which the depth cap of the builders allows, becomes
+// a run of leaves with the same bounds, each skipping to the next.
+inline std::vector<bvh_gpu_node> flatten_bvh_for_gpu(const bvh_node& bvh) {
+    auto nodes = bvh.nodes();
+    if (bvh.primitive_order().size() > bvh_gpu_max_primitives)
+        throw std::length_error("too many primitives for the GPU BVH");
+
+    // The CPU nodes are in depth-first order too, so GPU node indices only shift by the extra
+    // leaves of the runs before them. The last entry is the end of the array.
+    std::vector<uint32_t> first_gpu_node(nodes.size() + 1);
+    uint32_t gpu_nodes = 0;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        first_gpu_node[i] = gpu_nodes;
+        gpu_nodes += nodes[i].count > 0 ? (nodes[i].count + bvh_gpu_max_leaf_size - 1) / bvh_gpu_max_leaf_size : 1;
+    }
+    first_gpu_node[nodes.size()] = gpu_nodes;
+
+    std::vector<bvh_gpu_node> result(gpu_nodes);
+    // Pairs of CPU node and the CPU node that follows its subtree.
+    std::vector<std::pair<uint32_t, uint32_t>> stack;
+    if (!nodes.empty())
+        stack.emplace_back(0, static_cast<uint32_t>(nodes.size()));
+    while (!stack.empty()) {
+        auto [index, skip] = stack.back();
+        stack.pop_back();
+
+        const auto& node = nodes[index];
+        bvh_gpu_node out{};
+        for (int a = 0; a < 3; a++) {
+            out.bounds_min[a] = bvh_gpu_round_down(node.bounds_min[a]);
+            out.bounds_max[a] = bvh_gpu_round_up(node.bounds_max[a]);
+        }
+
+        auto first = first_gpu_node[index];
+        if (node.count == 0) {
+            out.skip = first_gpu_node[skip];
+            result[first] = out;
+            // The first child directly follows its parent and is skipped to the second one.
+            stack.emplace_back(node.offset, skip);
+            stack.emplace_back(index + 1, node.offset);
+            continue;
+        }
+
+        auto last = first_gpu_node[index + 1] - 1;
+        for (auto i = first; i <= last; ++i) {
+            uint32_t offset = node.offset + (i - first) * bvh_gpu_max_leaf_size;
+            uint32_t count = std::min(bvh_gpu_max_leaf_size, node.offset + node.count - offset);
+            out.skip = i < last ? i + 1 : first_gpu_node[skip];
+            out.primitives = offset << 8 | count;
+            result[i] = out;
+        }
+    }
+    return result;
+}
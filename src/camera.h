@@ -1,12 +1,48 @@
 #pragma once
 #include "rtweekend.h"
 
+#include "aov.h"
 #include "color.h"
+#include "framebuffer.h"
+#include "heatmap.h"
 #include "hittable.h"
 #include "material.h"
+#include "parallel.h"
+#include "sampler.h"
+#include "stats.h"
+#include "trace.h"
+#include "warps.h"
 
+#include <chrono>
+#include <functional>
 #include <iostream>
 
+struct progressive_settings {
+    int pass_samples = 4;           // Samples added to every pixel per pass
+    int target_samples = 0;         // Stop at this many samples per pixel, 0 for samples_per_pixel
+    double time_budget = 0;         // Wall-clock seconds, 0 for no limit
+    double noise_threshold = 0;     // Stop once every pixel's relative error is below, 0 to disable
+    int tile_size = 16;             // Tiles are the unit of work handed to the threads
+    cost_heatmaps* heatmaps = nullptr;  // Per-pixel render cost is measured when set
+    aov_buffers* aovs = nullptr;        // First-hit features are written when set
+
+    // Called after every pass, e.g. to flush a preview image.
+    std::function<void(const framebuffer&, int samples_per_pixel)> on_pass;
+};
+
+enum class progressive_stop {
+    target_samples,
+    time_budget,
+    noise_threshold
+};
+
+struct progressive_result {
+    progressive_stop reason = progressive_stop::target_samples;
+    int samples_per_pixel = 0;
+    int passes = 0;
+    double seconds = 0;
+};
+
 class camera {
   protected:
     virtual ~camera() = default;
@@ -25,28 +61,144 @@ class camera {
     double defocus_angle = 0;  // Variation angle of rays through each pixel
     double focus_dist = 10;    // Distance from camera lookfrom point to plane of perfect focus
 
+    sampler_type sampling = sampler_type::sobol;  // Source of the sample values of every path
+
     auto image_size() const {
         return std::make_pair(image_width, image_height);
     }
 
     void render(const hittable& world) {
+        trace_scope trace("render");
+        reset_render_stats();  // The counters dumped below cover this render only
         initialize();
 
         std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
 
+        auto s = make_sampler(sampling, samples_per_pixel);
         for (int j = 0; j < image_height; ++j) {
+            trace_scope trace_row("scanline", "render", j);
             std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
             for (int i = 0; i < image_width; ++i) {
                 color pixel_color(0,0,0);
                 for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                    ray r = get_ray(i, j);
-                    pixel_color += ray_color(r, max_depth, world);
+                    s->start_pixel_sample(i, j, sample);
+                    pixel_color += ray_color(generate_ray(i, j, *s), max_depth, world, *s);
                 }
+                RT_STAT_TIMER(output);
                 write_color(std::cout, pixel_color, samples_per_pixel);
             }
         }
 
         std::clog << "\rDone.                 \n";
+        dump_render_stats(std::clog);
+    }
+
+    // Renders in passes of settings.pass_samples into the accumulation buffer until the target
+    // sample count, the time budget or the noise threshold is reached. The buffer may already
+    // hold samples of an earlier render of the same image; sample indices continue from its
+    // counts. Sample values depend only on pixel and sample index, so the result doesn't depend
+    // on the thread count or on how the samples were split into passes.
+    progressive_result render_progressive(const hittable& world, framebuffer& image, const progressive_settings& settings) {
+        trace_scope trace("progressive_render");
+        reset_render_stats();
+        initialize();
+        if (image.image_width() != image_width || image.image_height() != image_height)
+            image = framebuffer(image_width, image_height);
+        auto heatmaps = settings.heatmaps;
+        if (heatmaps && (heatmaps->image_width() != image_width || heatmaps->image_height() != image_height))
+            *heatmaps = cost_heatmaps(image_width, image_height);
+        auto aovs = settings.aovs;
+        if (aovs && (aovs->image_width() != image_width || aovs->image_height() != image_height))
+            *aovs = aov_buffers(image_width, image_height, aovs->enabled_channels());
+        if (aovs && !aovs->enabled_channels())
+            aovs = nullptr;
+
+        using clock = std::chrono::steady_clock;
+        auto start = clock::now();
+        auto elapsed = [&start]() { return std::chrono::duration<double>(clock::now() - start).count(); };
+
+        progressive_result result;
+        auto target = settings.target_samples > 0 ? settings.target_samples : samples_per_pixel;
+        auto pass_samples = std::max(1, settings.pass_samples);
+        auto tile = std::max(1, settings.tile_size);
+        int tiles_x = (image_width + tile - 1) / tile;
+        int tiles_y = (image_height + tile - 1) / tile;
+        size_t tiles = size_t(tiles_x) * tiles_y;
+        // The random sampler shares one generator, so it can't be used from several threads.
+        size_t grain = sampling == sampler_type::random ? tiles : 1;
+
+        int done = static_cast<int>(image.samples(0, 0));
+        double last_pass = 0;
+        while (true) {
+            if (done >= target) {
+                result.reason = progressive_stop::target_samples;
+                break;
+            }
+            // Don't start a pass that is expected to overrun the budget.
+            if (settings.time_budget > 0 && result.passes > 0 && elapsed() + last_pass > settings.time_budget) {
+                result.reason = progressive_stop::time_budget;
+                break;
+            }
+
+            trace_scope trace_pass("pass", "render", result.passes);
+            auto pass_start = elapsed();
+            auto count = std::min(pass_samples, target - done);
+            parallel_chunks(tiles, grain, [&](size_t begin, size_t end, size_t) {
+                auto s = make_sampler(sampling, target);
+                for (size_t t = begin; t < end; ++t) {
+                    trace_scope trace_tile("tile", "render", static_cast<int64_t>(t));
+                    int x0 = static_cast<int>(t % tiles_x) * tile;
+                    int y0 = static_cast<int>(t / tiles_x) * tile;
+                    render_tile(world, image, x0, y0, std::min(x0 + tile, image_width),
+                                std::min(y0 + tile, image_height), done, done + count, *s, heatmaps, aovs);
+                }
+            });
+            done += count;
+            result.passes++;
+            last_pass = elapsed() - pass_start;
+
+            std::clog << "\rSamples per pixel: " << done << '/' << target << ' ' << std::flush;
+            if (settings.on_pass)
+                settings.on_pass(image, done);
+
+            if (settings.noise_threshold > 0 && image.max_relative_error() < settings.noise_threshold) {
+                result.reason = progressive_stop::noise_threshold;
+                break;
+            }
+        }
+
+        result.samples_per_pixel = done;
+        result.seconds = elapsed();
+        std::clog << "\rDone.                 \n";
+        dump_render_stats(std::clog);
+        return result;
+    }
+
+    // Adds samples [sample_begin, sample_end) of the pixels in [x0, x1) x [y0, y1) to `image`,
+    // which may be the whole image or a buffer for just this tile, their cost to `heatmaps` and
+    // their first-hit features to `aovs` if given.
+    void render_tile(const hittable& world, framebuffer& image, int x0, int y0, int x1, int y1,
+                     int sample_begin, int sample_end, sampler& s, cost_heatmaps* heatmaps = nullptr,
+                     aov_buffers* aovs = nullptr) const {
+        for (int j = y0; j < y1; ++j) {
+            for (int i = x0; i < x1; ++i) {
+                cost_heatmaps::pixel_probe probe;
+                if (heatmaps)
+                    probe = cost_heatmaps::pixel_probe::now();
+                for (int sample = sample_begin; sample < sample_end; ++sample) {
+                    s.start_pixel_sample(i, j, sample);
+                    if (!aovs) {
+                        image.add_sample(i, j, ray_color(generate_ray(i, j, s), max_depth, world, s));
+                        continue;
+                    }
+                    aov_hit primary;
+                    image.add_sample(i, j, ray_color(generate_ray(i, j, s), max_depth, world, s, &primary));
+                    aovs->add_sample(i, j, primary);
+                }
+                if (heatmaps)
+                    heatmaps->add_pixel(i, j, probe, sample_end - sample_begin);
+            }
+        }
     }
 
     void initialize() {
@@ -99,6 +251,23 @@ class camera {
         return ray(ray_origin, ray_direction, ray_time);
     }
 
+    ray get_ray(int i, int j, sampler& s) const {
+        // Same as above, with the pixel position, lens position and time taken from the first
+        // sample dimensions of the current pixel sample.
+        s.set_dimension(0);
+        auto pixel_u = s.get_2d();
+        auto lens_u = s.get_2d();
+        auto ray_time = s.get_1d();
+
+        auto pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
+        auto pixel_sample = pixel_center + ((pixel_u.x - 0.5) * pixel_delta_u) + ((pixel_u.y - 0.5) * pixel_delta_v);
+
+        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample(lens_u);
+        auto ray_direction = pixel_sample - ray_origin;
+
+        return ray(ray_origin, ray_direction, ray_time);
+    }
+
     vec3 pixel_sample_square() const {
         // Returns a random point in the square surrounding a pixel at the origin.
         auto px = -0.5 + random_double();
@@ -112,9 +281,25 @@ class camera {
         return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 
+    point3 defocus_disk_sample(sample_2d u) const {
+        auto p = warp_concentric_disk(u);
+        return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
+    }
+
     virtual color ray_color(const ray& r, int depth, const hittable& world) const = 0;
 
+    // Takes the scattering decisions at path vertex (max_depth - depth) from the sampler, and
+    // describes the first surface hit in `primary` if given.
+    virtual color ray_color(const ray& r, int depth, const hittable& world, sampler& s,
+                            aov_hit* primary = nullptr) const = 0;
+
   private:
+    ray generate_ray(int i, int j, sampler& s) const {
+        RT_STAT_INC(primary_rays);
+        RT_STAT_TIMER(ray_generation);
+        return get_ray(i, j, s);
+    }
+
     int    image_height;   // Rendered image height
     point3 center;         // Camera center
     point3 pixel00_loc;    // Location of pixel 0, 0
@@ -20,6 +20,55 @@ namespace CPUImpl {
                 return color(0,0,0);
             }
 
+            return background(r);
+        }
+
+        color ray_color(const ray& r, int depth, const hittable& world, sampler& s,
+                        aov_hit* primary = nullptr) const override {
+            hit_record rec;
+            auto bounces = max_depth - depth;
+
+            if (depth <= 0) {
+                RT_STAT_PATH_LENGTH(bounces);
+                return color(0,0,0);
+            }
+            if (bounces > 0)
+                RT_STAT_INC(secondary_rays);
+
+            if (trace(r, world, rec)) {
+                if (primary) {
+                    primary->hit = true;
+                    primary->albedo = rec.mat->surface_albedo(rec);
+                    primary->normal = rec.normal;
+                    primary->depth = rec.t * r.direction().length();
+                    primary->object_id = rec.object_id;
+                }
+                ray scattered;
+                color attenuation;
+                s.set_dimension(sampler_vertex_dimension(bounces));
+                if (shade(r, rec, attenuation, scattered, s))
+                    return attenuation * ray_color(scattered, depth-1, world, s);
+                RT_STAT_PATH_LENGTH(bounces);
+                return color(0,0,0);
+            }
+
+            RT_STAT_PATH_LENGTH(bounces);
+            return background(r);
+        }
+
+    private:
+        // Traversal and shading, split out to time them separately.
+        static bool trace(const ray& r, const hittable& world, hit_record& rec) {
+            RT_STAT_TIMER(traversal);
+            return world.hit(r, interval(0.001, infinity), rec);
+        }
+
+        static bool shade(const ray& r, const hit_record& rec, color& attenuation, ray& scattered, sampler& s) {
+            RT_STAT_TIMER(shading);
+            return rec.mat->scatter(r, rec, attenuation, scattered, s);
+        }
+
+        static color background(const ray& r) {
             vec3 unit_direction = unit_vector(r.direction());
             auto a = 0.5*(unit_direction.y() + 1.0);
             return (1.0-a)*color(1.0, 1.0, 1.0) + a*color(0.5, 0.7, 1.0);
@@ -0,0 +1,185 @@
+#pragma once
+#include "rtweekend.h"
+
+#include "framebuffer.h"
+#include "sampler.h"
+#include "trace.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+
+static constexpr char checkpoint_magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', 0, 0};
+static constexpr uint32_t checkpoint_version = 1;
+
+// Header of a checkpoint file. It is followed by the framebuffer's per-pixel sums (3 doubles),
+// squared luminance sums (doubles) and sample counts (uint32), then the random_double()
+// generator state as text.
+struct checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t sampling;
+    uint32_t target_samples;
+    uint32_t samples_per_pixel;
+    uint64_t random_state_bytes;
+};
+
+// What besides the framebuffer a render needs to continue. Samplers other than the random one
+// derive their values from pixel and sample index alone, so the sampler type and the sample
+// count they were created for are their whole state.
+struct checkpoint_state {
+    sampler_type sampling = sampler_type::sobol;
+    int target_samples = 0;
+    std::string random_state;
+};
+
+inline std::string save_random_state() {
+    std::ostringstream out;
+    out << random_generator();
+    return out.str();
+}
+
+inline void restore_random_state(const std::string& state) {
+    std::istringstream in(state);
+    in >> random_generator();
+}
+
+// Writes to a temporary file first, so a crash mid-write leaves the previous checkpoint intact.
+inline bool save_checkpoint(const std::string& path, const framebuffer& image, const checkpoint_state& state) {
+    trace_scope trace("checkpoint_write", "output");
+    checkpoint_header header{};
+    std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.version = checkpoint_version;
+    header.width = static_cast<uint32_t>(image.image_width());
+    header.height = static_cast<uint32_t>(image.image_height());
+    header.sampling = static_cast<uint32_t>(state.sampling);
+    header.target_samples = static_cast<uint32_t>(state.target_samples);
+    header.samples_per_pixel = image.sample_counts().empty() ? 0 : image.sample_counts()[0];
+    header.random_state_bytes = state.random_state.size();
+
+    auto temp_path = path + ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+        if (!file)
+            return false;
+
+        const auto& sums = image.sums();
+        const auto& luminance_sq = image.luminance_squares();
+        const auto& counts = image.sample_counts();
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (const auto& sum : sums) {
+            double values[3] = {sum.x(), sum.y(), sum.z()};
+            file.write(reinterpret_cast<const char*>(values), sizeof(values));
+        }
+        file.write(reinterpret_cast<const char*>(luminance_sq.data()), luminance_sq.size() * sizeof(double));
+        file.write(reinterpret_cast<const char*>(counts.data()), counts.size() * sizeof(uint32_t));
+        file.write(state.random_state.data(), state.random_state.size());
+        if (!file)
+            return false;
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temp_path, path, error);
+    return !error;
+}
+
+// Reads a checkpoint of a width x height image. A checkpoint of another size, or whose file
+// size doesn't match what its header describes, is rejected before anything is allocated; one
+// whose sample counts disagree with the header's, after reading.
+inline std::optional<checkpoint_state> load_checkpoint(const std::string& path, framebuffer& image, int width,
+                                                       int height) {
+    std::error_code error;
+    auto file_size = std::filesystem::file_size(path, error);
+    std::ifstream file(path, std::ios::binary);
+    checkpoint_header header{};
+    if (error || !file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        return std::nullopt;
+    if (std::memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0 || header.version != checkpoint_version)
+        return std::nullopt;
+    if (width < 0 || height < 0 || header.width != static_cast<uint32_t>(width) ||
+        header.height != static_cast<uint32_t>(height))
+        return std::nullopt;
+
+    constexpr uint64_t pixel_bytes = 3 * sizeof(double) + sizeof(double) + sizeof(uint32_t);
+    uint64_t pixels = uint64_t(header.width) * header.height;
+    uint64_t body_bytes = file_size - sizeof(header);
+    if (pixels > body_bytes / pixel_bytes || header.random_state_bytes != body_bytes - pixels * pixel_bytes)
+        return std::nullopt;
+
+    framebuffer loaded(static_cast<int>(header.width), static_cast<int>(header.height));
+    for (auto& sum : loaded.sums()) {
+        double values[3];
+        file.read(reinterpret_cast<char*>(values), sizeof(values));
+        sum = color(values[0], values[1], values[2]);
+    }
+    auto& luminance_sq = loaded.luminance_squares();
+    auto& counts = loaded.sample_counts();
+    file.read(reinterpret_cast<char*>(luminance_sq.data()), luminance_sq.size() * sizeof(double));
+    file.read(reinterpret_cast<char*>(counts.data()), counts.size() * sizeof(uint32_t));
+    // Progressive passes sample every pixel equally, so all counts are the header's.
+    for (auto count : counts) {
+        if (count != header.samples_per_pixel)
+            return std::nullopt;
+    }
+    if (header.samples_per_pixel > header.target_samples)
+        return std::nullopt;
+
+    checkpoint_state state;
+    state.sampling = static_cast<sampler_type>(header.sampling);
+    state.target_samples = static_cast<int>(header.target_samples);
+    state.random_state.resize(header.random_state_bytes);
+    file.read(state.random_state.data(), state.random_state.size());
+    if (!file)
+        return std::nullopt;
+
+    image = std::move(loaded);
+    return state;
+}
+
+// Saves checkpoints on a background thread. write() snapshots the framebuffer, which is a plain
+// copy, and returns while the file is written; if the previous checkpoint is still being
+// written the new one is skipped rather than stalling the render.
+class checkpoint_writer {
+  public:
+    explicit checkpoint_writer(std::string _path) : path(std::move(_path)) {}
+
+    ~checkpoint_writer() { wait(); }
+
+    checkpoint_writer(const checkpoint_writer&) = delete;
+    checkpoint_writer& operator=(const checkpoint_writer&) = delete;
+
+    bool write(const framebuffer& image, checkpoint_state state) {
+        if (pending.valid() && pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return false;
+        finish();
+
+        pending = std::async(std::launch::async, [this, snapshot = image, state = std::move(state)]() {
+            return save_checkpoint(path, snapshot, state);
+        });
+        return true;
+    }
+
+    // Blocks until the last checkpoint is on disk.
+    void wait() {
+        if (pending.valid())
+            finish();
+    }
+
+  private:
+    std::string path;
+    std::future<bool> pending;
+
+    void finish() {
+        if (pending.valid() && !pending.get())
+            std::clog << "Failed to write checkpoint " << path << std::endl;
+    }
+};
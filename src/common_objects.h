@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstdint>
+#include <string>
+
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 
@@ -11,14 +14,40 @@ struct GraphicalEnvironmentSettings {
     int max_images = 2;
     int width = 1024;
     int height = 768;
-    int sphere_count = 20;
+    int sphere_count = 200;  // Spheres the GPU buffers hold, at least those added before init
+    bool headless = false;  // Render offscreen at width x height, without a window or swap chain
+    bool gpu_bvh = true;    // Traverse a BVH over the spheres instead of testing each of them
+    std::string pipeline_cache_path = "pipeline_cache.bin";  // Empty to compile the pipelines every run
+};
+
+enum class SphereMaterial : uint32_t {
+    Lambertian,
+    Metal,
+    Dielectric
 };
 
+// Laid out like the std430 Sphere array of ray_tracing.comp.
 struct Sphere
 {
     glm::vec3 center;
     float radius;
-    glm::vec4 color;
+    glm::vec4 color;  // Albedo of lambertian and metal spheres
+    SphereMaterial material = SphereMaterial::Lambertian;
+    float parameter = 0;  // Fuzz of metal, index of refraction of dielectric spheres
+    float padding[2] = {};
+};
+
+// View of the GPU path tracer, with the same meaning as the CPU camera's parameters.
+struct CameraSettings
+{
+    glm::vec3 lookfrom = {13.0f, 2.0f, 3.0f};
+    glm::vec3 lookat = {0.0f, 0.0f, 0.0f};
+    glm::vec3 vup = {0.0f, 1.0f, 0.0f};
+    float vfov = 20;
+    float defocus_angle = 0;
+    float focus_dist = 10;
+    int samples_per_pixel = 4;  // Per frame
+    int max_depth = 10;
 };
 
 } // namespace
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "aov.h"
+#include "framebuffer.h"
+#include "parallel.h"
+#include "trace.h"
+
+#include <array>
+#include <cmath>
+#include <vector>
+
+struct denoise_settings {
+    int iterations = 4;         // Filter passes; the taps spread twice as far every pass
+    float color_sigma = 1.0f;   // Tolerated color difference, halved every pass
+    float normal_sigma = 0.5f;  // Tolerated normal difference
+    float albedo_sigma = 0.3f;  // Tolerated albedo difference
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) for low sample count renders,
+// guided by the albedo and normal buffers rendered with the image. The color is divided by the
+// albedo, so surface detail isn't blurred away, filtered in passes of a 5x5 B3-spline kernel
+// whose taps are 2^pass pixels apart, and multiplied by the albedo again. Taps across normal
+// or albedo edges, or of very different color, get little weight. Channels missing from
+// `features` are left out of the weights. Returns a buffer with one sample per pixel.
+inline framebuffer denoise(const framebuffer& image, const aov_buffers& features, const denoise_settings& settings = {}) {
+    trace_scope trace("denoise");
+    int width = image.image_width();
+    int height = image.image_height();
+    auto pixels = size_t(width) * height;
+    bool same_size = features.image_width() == width && features.image_height() == height;
+    bool use_albedo = same_size && features.enabled(aov_albedo);
+    bool use_normal = same_size && features.enabled(aov_normal);
+
+    // Planar float channels: the inner loops run over contiguous rows without branches, which
+    // the compiler can vectorize.
+    std::array<std::vector<float>, 3> current, next, albedo, normal;
+    for (int c = 0; c < 3; ++c) {
+        current[c].resize(pixels);
+        next[c].resize(pixels);
+        albedo[c].assign(pixels, 1.0f);
+        normal[c].assign(pixels, 0.0f);
+    }
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            auto i = size_t(y) * width + x;
+            auto a = use_albedo ? features.albedo_at(x, y) : color(1, 1, 1);
+            auto n = use_normal ? features.normal_at(x, y) : vec3(0, 0, 0);
+            auto c = image.average(image.origin_x() + x, image.origin_y() + y);
+            for (int k = 0; k < 3; ++k) {
+                // Black albedo, e.g. the background, can't be divided out.
+                albedo[k][i] = a[k] > 0.01 ? static_cast<float>(a[k]) : 1.0f;
+                normal[k][i] = static_cast<float>(n[k]);
+                current[k][i] = static_cast<float>(c[k]) / albedo[k][i];
+            }
+        }
+    }
+
+    static constexpr float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+    auto normal_scale = use_normal ? 1.0f / (settings.normal_sigma * settings.normal_sigma) : 0.0f;
+    auto albedo_scale = use_albedo ? 1.0f / (settings.albedo_sigma * settings.albedo_sigma) : 0.0f;
+
+    for (int pass = 0; pass < settings.iterations; ++pass) {
+        trace_scope trace_pass("denoise_pass", "render", pass);
+        int step = 1 << pass;
+        auto color_sigma = settings.color_sigma / static_cast<float>(step);
+        auto color_scale = 1.0f / (color_sigma * color_sigma);
+
+        parallel_chunks(size_t(height), 8, [&](size_t row_begin, size_t row_end, size_t) {
+            std::array<std::vector<float>, 3> sum;
+            std::vector<float> weights;
+            for (int y = static_cast<int>(row_begin); y < static_cast<int>(row_end); ++y) {
+                auto at = size_t(y) * width;
+                for (auto& s : sum)
+                    s.assign(width, 0.0f);
+                weights.assign(width, 0.0f);
+
+                for (int ky = 0; ky < 5; ++ky) {
+                    int yy = y + (ky - 2) * step;
+                    if (yy < 0 || yy >= height)
+                        continue;
+                    auto from = size_t(yy) * width;
+                    for (int kx = 0; kx < 5; ++kx) {
+                        int dx = (kx - 2) * step;
+                        int x_begin = std::max(0, -dx);
+                        int x_end = std::min(width, width - dx);
+                        auto h = kernel[ky] * kernel[kx];
+                        for (int x = x_begin; x < x_end; ++x) {
+                            auto p = at + x;
+                            auto q = from + x + dx;
+                            float color_d = 0, normal_d = 0, albedo_d = 0;
+                            for (int k = 0; k < 3; ++k) {
+                                auto dc = current[k][p] - current[k][q];
+                                auto dn = normal[k][p] - normal[k][q];
+                                auto da = albedo[k][p] - albedo[k][q];
+                                color_d += dc * dc;
+                                normal_d += dn * dn;
+                                albedo_d += da * da;
+                            }
+                            auto w = h * std::exp(-color_d * color_scale - normal_d * normal_scale - albedo_d * albedo_scale);
+                            for (int k = 0; k < 3; ++k)
+                                sum[k][x] += w * current[k][q];
+                            weights[x] += w;
+                        }
+                    }
+                }
+
+                // The center tap always has weight, so the sum is never zero.
+                for (int k = 0; k < 3; ++k)
+                    for (int x = 0; x < width; ++x)
+                        next[k][at + x] = sum[k][x] / weights[x];
+            }
+        });
+        std::swap(current, next);
+    }
+
+    framebuffer result(width, height, image.origin_x(), image.origin_y());
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            auto i = size_t(y) * width + x;
+            result.add_sample(image.origin_x() + x, image.origin_y() + y,
+                              color(current[0][i] * albedo[0][i], current[1][i] * albedo[1][i], current[2][i] * albedo[2][i]));
+        }
+    }
+    return result;
+}
@@ -0,0 +1,449 @@
+#pragma once
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "sampler.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Splits a frame across worker processes that talk to a coordinator over stream sockets, Unix
+// domain socket pairs for local workers or TCP for remote ones. There is no shared memory: the
+// coordinator sends tile requests and the workers send back the tile's accumulation buffer,
+// which the coordinator merges into the image. Workers have to render the same scene with the
+// same camera, either as forked copies of the coordinator or by loading the same scene file.
+// Messages use the host byte order, so all machines must agree on it. POSIX only.
+
+enum class tile_message : uint32_t {
+    render = 1,    // tile_request
+    result = 2,    // tile_result, then per pixel 3 sum doubles, a luminance square double, a count
+    shutdown = 3   // No payload
+};
+
+struct tile_message_header {
+    uint32_t type;
+    uint32_t bytes;
+};
+
+struct tile_request {
+    uint32_t tile;
+    int32_t x0, y0, x1, y1;
+    uint32_t sample_begin, sample_end;
+    uint32_t samples_per_pixel;  // What the sampler is created for, see make_sampler
+};
+
+struct tile_result {
+    uint32_t tile;
+    int32_t x0, y0, x1, y1;
+};
+
+inline bool socket_write_all(int fd, const void* data, size_t bytes) {
+    auto p = static_cast<const char*>(data);
+    while (bytes > 0) {
+#ifdef MSG_NOSIGNAL
+        auto n = ::send(fd, p, bytes, MSG_NOSIGNAL);
+#else
+        auto n = ::send(fd, p, bytes, 0);
+#endif
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+inline bool socket_read_all(int fd, void* data, size_t bytes) {
+    auto p = static_cast<char*>(data);
+    while (bytes > 0) {
+        auto n = ::recv(fd, p, bytes, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+inline bool send_tile_message(int fd, tile_message type, const void* payload, size_t bytes) {
+    tile_message_header header{static_cast<uint32_t>(type), static_cast<uint32_t>(bytes)};
+    return socket_write_all(fd, &header, sizeof(header)) && (bytes == 0 || socket_write_all(fd, payload, bytes));
+}
+
+// Fails on payloads larger than `max_bytes`, before allocating for them.
+inline bool receive_tile_message(int fd, tile_message& type, std::vector<char>& payload, size_t max_bytes) {
+    tile_message_header header;
+    if (!socket_read_all(fd, &header, sizeof(header)) || header.bytes > max_bytes)
+        return false;
+    type = static_cast<tile_message>(header.type);
+    payload.resize(header.bytes);
+    return header.bytes == 0 || socket_read_all(fd, payload.data(), payload.size());
+}
+
+inline size_t tile_result_bytes(size_t pixels) {
+    return sizeof(tile_result) + pixels * (4 * sizeof(double) + sizeof(uint32_t));
+}
+
+inline std::vector<char> pack_tile_result(uint32_t tile, const framebuffer& image) {
+    tile_result header{tile, image.origin_x(), image.origin_y(), image.origin_x() + image.image_width(),
+                       image.origin_y() + image.image_height()};
+    auto pixels = image.sums().size();
+    std::vector<char> payload(tile_result_bytes(pixels));
+    auto p = payload.data();
+    std::memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    for (size_t k = 0; k < pixels; ++k) {
+        double values[4] = {image.sums()[k].x(), image.sums()[k].y(), image.sums()[k].z(), image.luminance_squares()[k]};
+        std::memcpy(p, values, sizeof(values));
+        std::memcpy(p + sizeof(values), &image.sample_counts()[k], sizeof(uint32_t));
+        p += sizeof(values) + sizeof(uint32_t);
+    }
+    return payload;
+}
+
+inline bool unpack_tile_result(const std::vector<char>& payload, uint32_t& tile, framebuffer& image) {
+    tile_result header;
+    if (payload.size() < sizeof(header))
+        return false;
+    std::memcpy(&header, payload.data(), sizeof(header));
+    if (header.x1 < header.x0 || header.y1 < header.y0)
+        return false;
+    size_t pixels = size_t(header.x1 - header.x0) * (header.y1 - header.y0);
+    if (payload.size() != tile_result_bytes(pixels))
+        return false;
+
+    tile = header.tile;
+    image = framebuffer(header.x1 - header.x0, header.y1 - header.y0, header.x0, header.y0);
+    auto p = payload.data() + sizeof(header);
+    for (size_t k = 0; k < pixels; ++k) {
+        double values[4];
+        std::memcpy(values, p, sizeof(values));
+        std::memcpy(&image.sample_counts()[k], p + sizeof(values), sizeof(uint32_t));
+        image.sums()[k] = color(values[0], values[1], values[2]);
+        image.luminance_squares()[k] = values[3];
+        p += sizeof(values) + sizeof(uint32_t);
+    }
+    return true;
+}
+
+inline bool tile_matches_request(const framebuffer& tile, const tile_request& request) {
+    return tile.origin_x() == request.x0 && tile.origin_y() == request.y0 &&
+           tile.image_width() == request.x1 - request.x0 && tile.image_height() == request.y1 - request.y0;
+}
+
+// Serves tile requests on `fd` until the coordinator sends shutdown or disconnects.
+inline void run_tile_worker(int fd, camera& cam, const hittable& world) {
+    cam.initialize();
+    tile_message type;
+    std::vector<char> payload;
+    while (receive_tile_message(fd, type, payload, sizeof(tile_request))) {
+        if (type != tile_message::render || payload.size() != sizeof(tile_request))
+            break;
+        tile_request request;
+        std::memcpy(&request, payload.data(), sizeof(request));
+
+        trace_scope trace("tile", "render", request.tile);
+        auto s = make_sampler(cam.sampling, static_cast<int>(request.samples_per_pixel));
+        framebuffer tile(request.x1 - request.x0, request.y1 - request.y0, request.x0, request.y0);
+        cam.render_tile(world, tile, request.x0, request.y0, request.x1, request.y1,
+                        static_cast<int>(request.sample_begin), static_cast<int>(request.sample_end), *s);
+
+        auto result = pack_tile_result(request.tile, tile);
+        if (!send_tile_message(fd, tile_message::result, result.data(), result.size()))
+            break;
+    }
+}
+
+struct distributed_settings {
+    int tile_size = 32;
+    int sample_begin = 0;
+    int sample_end = 0;  // 0 for samples_per_pixel
+    int tile_timeout_ms = 60000;  // A worker that holds a tile longer is dropped, the tile redispatched
+};
+
+struct distributed_result {
+    size_t tiles = 0;
+    size_t redispatched = 0;      // Tiles handed out again after their worker failed
+    size_t rendered_locally = 0;  // Tiles the coordinator rendered itself after losing all workers
+    size_t workers_lost = 0;
+};
+
+// Renders samples [sample_begin, sample_end) of every pixel on the workers connected through
+// `workers` and adds them to `image`. Each worker has one tile in flight at a time, so faster
+// workers take more tiles. A worker that disconnects or sends garbage is dropped and its tile
+// goes back into the queue, as does one that answers with another tile's rectangle or does
+// not answer within the tile timeout; if no worker is left, the coordinator renders the rest
+// itself.
+// Takes ownership of the sockets: they are closed on return, after a shutdown message.
+inline distributed_result render_distributed(camera& cam, const hittable& world, framebuffer& image,
+                                             std::vector<int> workers, const distributed_settings& settings = {}) {
+    cam.initialize();
+    auto image_size = cam.image_size();
+    if (image.image_width() != image_size.first || image.image_height() != image_size.second)
+        image = framebuffer(image_size.first, image_size.second);
+
+    auto sample_end = settings.sample_end > 0 ? settings.sample_end : cam.samples_per_pixel;
+    auto tile = std::max(1, settings.tile_size);
+    std::vector<tile_request> requests;
+    for (int y0 = 0; y0 < image_size.second; y0 += tile) {
+        for (int x0 = 0; x0 < image_size.first; x0 += tile) {
+            tile_request request;
+            request.tile = static_cast<uint32_t>(requests.size());
+            request.x0 = x0;
+            request.y0 = y0;
+            request.x1 = std::min(x0 + tile, image_size.first);
+            request.y1 = std::min(y0 + tile, image_size.second);
+            request.sample_begin = static_cast<uint32_t>(settings.sample_begin);
+            request.sample_end = static_cast<uint32_t>(sample_end);
+            request.samples_per_pixel = static_cast<uint32_t>(sample_end);
+            requests.push_back(request);
+        }
+    }
+    size_t max_result_bytes = tile_result_bytes(size_t(tile) * tile);
+
+    distributed_result result;
+    result.tiles = requests.size();
+    std::deque<uint32_t> pending;
+    for (auto& request : requests)
+        pending.push_back(request.tile);
+    std::vector<bool> done(requests.size(), false);
+    size_t completed = 0;
+
+    const long idle = -1;
+    std::vector<long> in_flight(workers.size(), idle);
+    auto timeout = std::chrono::milliseconds(std::max(1, settings.tile_timeout_ms));
+    std::vector<std::chrono::steady_clock::time_point> deadlines(workers.size());
+    auto drop_worker = [&](size_t w) {
+        ::close(workers[w]);
+        workers[w] = -1;
+        result.workers_lost++;
+        if (in_flight[w] != idle) {
+            pending.push_front(static_cast<uint32_t>(in_flight[w]));
+            result.redispatched++;
+            in_flight[w] = idle;
+        }
+    };
+
+    std::vector<char> payload;
+    while (completed < requests.size()) {
+        for (size_t w = 0; w < workers.size() && !pending.empty(); ++w) {
+            if (workers[w] < 0 || in_flight[w] != idle)
+                continue;
+            auto t = pending.front();
+            pending.pop_front();
+            in_flight[w] = t;
+            deadlines[w] = std::chrono::steady_clock::now() + timeout;
+            if (!send_tile_message(workers[w], tile_message::render, &requests[t], sizeof(tile_request)))
+                drop_worker(w);
+        }
+
+        std::vector<pollfd> polled;
+        std::vector<size_t> polled_worker;
+        auto next_deadline = std::chrono::steady_clock::time_point::max();
+        for (size_t w = 0; w < workers.size(); ++w) {
+            if (workers[w] >= 0 && in_flight[w] != idle) {
+                polled.push_back({workers[w], POLLIN, 0});
+                polled_worker.push_back(w);
+                next_deadline = std::min(next_deadline, deadlines[w]);
+            }
+        }
+
+        if (polled.empty()) {
+            // Every worker is gone: finish the frame here.
+            auto s = make_sampler(cam.sampling, sample_end);
+            while (!pending.empty()) {
+                auto& request = requests[pending.front()];
+                pending.pop_front();
+                if (done[request.tile])
+                    continue;
+                cam.render_tile(world, image, request.x0, request.y0, request.x1, request.y1,
+                                settings.sample_begin, sample_end, *s);
+                done[request.tile] = true;
+                completed++;
+                result.rendered_locally++;
+            }
+            break;
+        }
+
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next_deadline - std::chrono::steady_clock::now());
+        if (::poll(polled.data(), polled.size(), static_cast<int>(std::max<int64_t>(wait.count(), 0) + 1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            for (auto w : polled_worker)
+                drop_worker(w);
+            continue;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        for (size_t k = 0; k < polled.size(); ++k) {
+            auto w = polled_worker[k];
+            if (polled[k].revents == 0) {
+                if (now >= deadlines[w]) {
+                    std::clog << "Render worker " << w << " timed out, handing its tile to another one\n";
+                    drop_worker(w);
+                }
+                continue;
+            }
+            tile_message type;
+            uint32_t t;
+            framebuffer tile_image;
+            // The result has to cover exactly the requested rectangle, nothing outside the image.
+            if (!receive_tile_message(workers[w], type, payload, max_result_bytes) || type != tile_message::result ||
+                !unpack_tile_result(payload, t, tile_image) || static_cast<long>(t) != in_flight[w] ||
+                !tile_matches_request(tile_image, requests[t])) {
+                std::clog << "Lost render worker " << w << ", handing its tile to another one\n";
+                drop_worker(w);
+                continue;
+            }
+            in_flight[w] = idle;
+            if (!done[t]) {
+                trace_scope trace("merge_tile", "render", t);
+                image.merge(tile_image);
+                done[t] = true;
+                completed++;
+            }
+        }
+    }
+
+    for (auto fd : workers) {
+        if (fd < 0)
+            continue;
+        send_tile_message(fd, tile_message::shutdown, nullptr, 0);
+        ::close(fd);
+    }
+    return result;
+}
+
+// Forks `count` worker processes that inherit the camera and scene, each connected through a
+// Unix domain socket pair. The scene is loaded once, in the coordinator, and shared with the
+// workers copy-on-write.
+class local_worker_pool {
+  public:
+    local_worker_pool(int count, camera& cam, const hittable& world) {
+        for (int k = 0; k < count; ++k) {
+            int fds[2];
+            if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+                break;
+            auto pid = ::fork();
+            if (pid == 0) {
+                ::close(fds[0]);
+                for (auto fd : sockets)
+                    ::close(fd);
+                run_tile_worker(fds[1], cam, world);
+                ::close(fds[1]);
+                std::_Exit(0);
+            }
+            ::close(fds[1]);
+            if (pid < 0) {
+                ::close(fds[0]);
+                break;
+            }
+            sockets.push_back(fds[0]);
+            pids.push_back(pid);
+        }
+    }
+
+    ~local_worker_pool() {
+        for (auto fd : sockets)
+            ::close(fd);
+        for (auto pid : pids)
+            ::waitpid(pid, nullptr, 0);
+    }
+
+    local_worker_pool(const local_worker_pool&) = delete;
+    local_worker_pool& operator=(const local_worker_pool&) = delete;
+
+    // Hands the coordinator ends of the sockets to render_distributed.
+    std::vector<int> take_sockets() { return std::move(sockets); }
+
+    const std::vector<pid_t>& processes() const { return pids; }
+
+  private:
+    std::vector<int> sockets;
+    std::vector<pid_t> pids;
+};
+
+// TCP transport for workers on other machines.
+
+inline int listen_tcp(uint16_t port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    int yes = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(fd, 64) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline std::vector<int> accept_workers(int listen_fd, int count) {
+    std::vector<int> workers;
+    while (static_cast<int>(workers.size()) < count) {
+        int fd = ::accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        int yes = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        workers.push_back(fd);
+    }
+    return workers;
+}
+
+inline int connect_tcp(const std::string& host, uint16_t port) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0)
+        return -1;
+
+    int fd = -1;
+    for (auto a = addresses; a; a = a->ai_next) {
+        fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (::connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+            break;
+        ::close(fd);
+        fd = -1;
+    }
+    ::freeaddrinfo(addresses);
+    if (fd >= 0) {
+        int yes = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+    return fd;
+}
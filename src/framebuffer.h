@@ -0,0 +1,110 @@
+#pragma once
+#include "rtweekend.h"
+
+#include "color.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+// Floating point accumulation buffer. Keeps the running sum of samples per pixel, their count
+// and the sum of squared luminance, so the image can be resolved and its noise estimated at any
+// point of a progressive render. A buffer can also cover just a tile of the image, starting at
+// pixel (x0, y0); pixels are always addressed in image coordinates.
+class framebuffer {
+  public:
+    framebuffer() = default;
+
+    framebuffer(int _width, int _height, int _x0 = 0, int _y0 = 0)
+      : width(_width), height(_height), x0(_x0), y0(_y0), sum(size_t(_width) * _height, color(0, 0, 0)),
+        luminance_sq(size_t(_width) * _height, 0), counts(size_t(_width) * _height, 0) {}
+
+    int image_width() const { return width; }
+    int image_height() const { return height; }
+    int origin_x() const { return x0; }
+    int origin_y() const { return y0; }
+
+    void add_sample(int x, int y, const color& c) {
+        auto i = index(x, y);
+        sum[i] += c;
+        auto l = luminance(c);
+        luminance_sq[i] += l * l;
+        counts[i]++;
+    }
+
+    // Adds the samples another buffer accumulated for the same image, or for a tile of it.
+    void merge(const framebuffer& other) {
+        for (int y = 0; y < other.height; ++y) {
+            for (int x = 0; x < other.width; ++x) {
+                auto from = size_t(y) * other.width + x;
+                auto to = index(other.x0 + x, other.y0 + y);
+                sum[to] += other.sum[from];
+                luminance_sq[to] += other.luminance_sq[from];
+                counts[to] += other.counts[from];
+            }
+        }
+    }
+
+    uint32_t samples(int x, int y) const { return counts[index(x, y)]; }
+
+    color average(int x, int y) const {
+        auto i = index(x, y);
+        return counts[i] == 0 ? color(0, 0, 0) : sum[i] / counts[i];
+    }
+
+    // Standard error of the pixel's mean luminance relative to the mean itself.
+    double relative_error(int x, int y) const {
+        auto i = index(x, y);
+        if (counts[i] < 2)
+            return infinity;
+        auto n = static_cast<double>(counts[i]);
+        auto mean = luminance(sum[i]) / n;
+        auto variance = fmax(0.0, (luminance_sq[i] - n * mean * mean) / (n - 1));
+        return std::sqrt(variance / n) / fmax(mean, 1e-3);
+    }
+
+    double max_relative_error() const {
+        double worst = 0;
+        for (int y = y0; y < y0 + height; ++y)
+            for (int x = x0; x < x0 + width; ++x)
+                worst = fmax(worst, relative_error(x, y));
+        return worst;
+    }
+
+    void write_ppm(std::ostream& out) const {
+        RT_STAT_TIMER(output);
+        trace_scope trace("write_image", "output");
+        out << "P3\n" << width << ' ' << height << "\n255\n";
+        for (int y = y0; y < y0 + height; ++y) {
+            for (int x = x0; x < x0 + width; ++x) {
+                auto i = index(x, y);
+                write_color(out, sum[i], counts[i] == 0 ? 1 : static_cast<int>(counts[i]));
+            }
+        }
+    }
+
+    // Raw access for serialization.
+    std::vector<color>& sums() { return sum; }
+    std::vector<double>& luminance_squares() { return luminance_sq; }
+    std::vector<uint32_t>& sample_counts() { return counts; }
+    const std::vector<color>& sums() const { return sum; }
+    const std::vector<double>& luminance_squares() const { return luminance_sq; }
+    const std::vector<uint32_t>& sample_counts() const { return counts; }
+
+  private:
+    int width = 0;
+    int height = 0;
+    int x0 = 0;
+    int y0 = 0;
+    std::vector<color> sum;
+    std::vector<double> luminance_sq;
+    std::vector<uint32_t> counts;
+
+    size_t index(int x, int y) const { return size_t(y - y0) * width + (x - x0); }
+};
@@ -25,6 +25,7 @@ protected:
     virtual void init() = 0;
     virtual void load_preconfigured_shapes() = 0;
     virtual void add_spheres(const std::vector<Sphere>& spheres) = 0;
+    virtual void set_camera(const CameraSettings& camera) = 0;
 
     virtual void add_texture(const std::string &file) = 0;
 
@@ -0,0 +1,234 @@
+#pragma once
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+struct grid_options {
+    double density = 3.0;        // Target number of cells per primitive
+    double outlier_scale = 8.0;  // Primitives this many times larger than the median stay out of the grid
+    int max_resolution = 256;    // Cells per axis
+};
+
+inline double largest_extent(const aabb& box) {
+    return fmax(box.x.size(), fmax(box.y.size(), box.z.size()));
+}
+
+// Separates primitives much larger than the typical one, like the huge ground sphere, which
+// would otherwise be referenced from most cells of a grid.
+inline void split_grid_outliers(const std::vector<shared_ptr<hittable>>& objects, double outlier_scale,
+                                std::vector<shared_ptr<hittable>>& inliers,
+                                std::vector<shared_ptr<hittable>>& outliers) {
+    if (objects.empty())
+        return;
+
+    std::vector<double> extents;
+    extents.reserve(objects.size());
+    for (const auto& object : objects)
+        extents.push_back(largest_extent(object->bounding_box()));
+
+    auto sorted = extents;
+    auto median = sorted.begin() + sorted.size() / 2;
+    std::nth_element(sorted.begin(), median, sorted.end());
+    auto limit = outlier_scale * *median;
+
+    for (size_t i = 0; i < objects.size(); ++i) {
+        if (extents[i] > limit)
+            outliers.push_back(objects[i]);
+        else
+            inliers.push_back(objects[i]);
+    }
+}
+
+// Picks cells per axis so that the grid holds about `density` cells per primitive and the
+// cells are roughly cubical.
+inline std::array<int, 3> grid_resolution_for(const aabb& bounds, size_t count, double density, int max_resolution) {
+    double extent[3];
+    double max_extent = 0;
+    for (int a = 0; a < 3; a++) {
+        extent[a] = bounds.axis(a).size();
+        max_extent = fmax(max_extent, extent[a]);
+    }
+
+    std::array<int, 3> resolution = {1, 1, 1};
+    if (max_extent <= 0 || count == 0)
+        return resolution;
+
+    // Flat axes get a token thickness so the volume stays meaningful.
+    double volume = 1;
+    for (int a = 0; a < 3; a++)
+        volume *= fmax(extent[a], max_extent * 1e-3);
+
+    auto cells_per_unit = std::cbrt(density * static_cast<double>(count) / volume);
+    for (int a = 0; a < 3; a++) {
+        auto cells = static_cast<int>(std::round(extent[a] * cells_per_unit));
+        resolution[a] = std::clamp(cells, 1, max_resolution);
+    }
+    return resolution;
+}
+
+class uniform_grid : public hittable {
+  public:
+    uniform_grid(const hittable_list& list, grid_options options = {}) {
+        trace_scope trace("grid_build", "grid", static_cast<int64_t>(list.objects.size()));
+        for (const auto& object : list.objects)
+            bbox = aabb(bbox, object->bounding_box());
+
+        split_grid_outliers(list.objects, options.outlier_scale, objects, outliers);
+        if (objects.empty())
+            return;
+
+        for (const auto& object : objects)
+            bounds = aabb(bounds, object->bounding_box());
+
+        resolution = grid_resolution_for(bounds, objects.size(), options.density, options.max_resolution);
+        for (int a = 0; a < 3; a++) {
+            cell_size[a] = bounds.axis(a).size() / resolution[a];
+            inv_cell_size[a] = cell_size[a] > 0 ? 1 / cell_size[a] : 0;
+        }
+
+        // Two passes build a compact cell -> primitive index table.
+        size_t cell_count = static_cast<size_t>(resolution[0]) * resolution[1] * resolution[2];
+        cell_start.assign(cell_count + 1, 0);
+        for_each_overlapped_cell([this](size_t cell, uint32_t) { ++cell_start[cell + 1]; });
+        for (size_t c = 0; c < cell_count; ++c)
+            cell_start[c + 1] += cell_start[c];
+
+        cell_items.resize(cell_start.back());
+        std::vector<uint32_t> cursor(cell_start.begin(), cell_start.end() - 1);
+        for_each_overlapped_cell([&](size_t cell, uint32_t object) { cell_items[cursor[cell]++] = object; });
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        bool hit_anything = false;
+
+        // Large primitives first, their hits bound how far the grid has to be walked.
+        for (const auto& object : outliers) {
+            if (object->hit(r, ray_t, rec)) {
+                hit_anything = true;
+                ray_t.max = rec.t;
+            }
+        }
+
+        if (objects.empty())
+            return hit_anything;
+
+        const point3 origin = r.origin();
+        const vec3 direction = r.direction();
+
+        auto t_enter = ray_t.min;
+        auto t_exit = ray_t.max;
+        for (int a = 0; a < 3; a++) {
+            const auto& slab = bounds.axis(a);
+            if (direction[a] == 0) {
+                if (origin[a] < slab.min || origin[a] > slab.max)
+                    return hit_anything;
+                continue;
+            }
+            auto inv_d = 1 / direction[a];
+            auto t0 = (slab.min - origin[a]) * inv_d;
+            auto t1 = (slab.max - origin[a]) * inv_d;
+            if (inv_d < 0)
+                std::swap(t0, t1);
+            t_enter = fmax(t_enter, t0);
+            t_exit = fmin(t_exit, t1);
+            if (t_exit < t_enter)
+                return hit_anything;
+        }
+
+        // Amanatides & Woo 3D-DDA from the cell containing the entry point.
+        auto entry = origin + t_enter * direction;
+        int cell[3], step[3];
+        double t_next[3], t_delta[3];
+        for (int a = 0; a < 3; a++) {
+            cell[a] = cell_of(entry[a], a);
+            if (direction[a] > 0) {
+                step[a] = 1;
+                auto boundary = bounds.axis(a).min + (cell[a] + 1) * cell_size[a];
+                t_next[a] = t_enter + (boundary - entry[a]) / direction[a];
+                t_delta[a] = cell_size[a] / direction[a];
+            } else if (direction[a] < 0) {
+                step[a] = -1;
+                auto boundary = bounds.axis(a).min + cell[a] * cell_size[a];
+                t_next[a] = t_enter + (boundary - entry[a]) / direction[a];
+                t_delta[a] = -cell_size[a] / direction[a];
+            } else {
+                step[a] = 0;
+                t_next[a] = infinity;
+                t_delta[a] = infinity;
+            }
+        }
+
+        while (true) {
+            auto index = (static_cast<size_t>(cell[2]) * resolution[1] + cell[1]) * resolution[0] + cell[0];
+            RT_STAT_INC(grid_cell_visits);
+            for (auto k = cell_start[index]; k < cell_start[index + 1]; ++k) {
+                if (objects[cell_items[k]]->hit(r, ray_t, rec)) {
+                    hit_anything = true;
+                    ray_t.max = rec.t;
+                }
+            }
+
+            int axis = 0;
+            if (t_next[1] < t_next[axis]) axis = 1;
+            if (t_next[2] < t_next[axis]) axis = 2;
+
+            // A hit inside the visited cells can't be beaten by primitives further along.
+            auto t_cell_exit = t_next[axis];
+            if (ray_t.max <= t_cell_exit || t_cell_exit > t_exit)
+                break;
+
+            cell[axis] += step[axis];
+            if (cell[axis] < 0 || cell[axis] >= resolution[axis])
+                break;
+            t_next[axis] += t_delta[axis];
+        }
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    std::array<int, 3> grid_resolution() const { return resolution; }
+
+    size_t outlier_count() const { return outliers.size(); }
+
+  private:
+    std::vector<shared_ptr<hittable>> objects;
+    std::vector<shared_ptr<hittable>> outliers;
+    std::vector<uint32_t> cell_start;
+    std::vector<uint32_t> cell_items;
+    std::array<int, 3> resolution = {1, 1, 1};
+    double cell_size[3] = {};
+    double inv_cell_size[3] = {};
+    aabb bounds;
+    aabb bbox;
+
+    int cell_of(double p, int a) const {
+        auto c = static_cast<int>((p - bounds.axis(a).min) * inv_cell_size[a]);
+        return std::clamp(c, 0, resolution[a] - 1);
+    }
+
+    template <typename F>
+    void for_each_overlapped_cell(F&& fn) const {
+        for (uint32_t i = 0; i < objects.size(); ++i) {
+            auto box = objects[i]->bounding_box();
+            int lo[3], hi[3];
+            for (int a = 0; a < 3; a++) {
+                lo[a] = cell_of(box.axis(a).min, a);
+                hi[a] = cell_of(box.axis(a).max, a);
+            }
+            for (int z = lo[2]; z <= hi[2]; ++z)
+                for (int y = lo[1]; y <= hi[1]; ++y)
+                    for (int x = lo[0]; x <= hi[0]; ++x)
+                        fn((static_cast<size_t>(z) * resolution[1] + y) * resolution[0] + x, i);
+        }
+    }
+};
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "image_io.h"
+#include "stats.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class heatmap_channel {
+    traversal_steps,  // BVH nodes and grid cells visited per sample
+    primitive_tests,  // Ray-primitive intersection tests per sample
+    path_length,      // Rays traced per sample
+    nanoseconds,      // Wall-clock time spent on the pixel, all samples
+    count
+};
+
+inline const char* heatmap_channel_name(heatmap_channel c) {
+    static const char* names[] = {"traversal_steps", "primitive_tests", "path_length", "nanoseconds"};
+    return names[static_cast<size_t>(c)];
+}
+
+// Per-pixel render cost, written as one single-channel float image per measure. The traversal,
+// intersection and path counts come from the render counters, so they stay zero unless the
+// renderer is built with RT_ENABLE_STATS; main refuses --heatmaps without it.
+class cost_heatmaps {
+  public:
+    cost_heatmaps() = default;
+
+    cost_heatmaps(int _width, int _height)
+      : width(_width), height(_height),
+        values(static_cast<size_t>(heatmap_channel::count), std::vector<float>(size_t(_width) * _height, 0)),
+        samples_taken(size_t(_width) * _height, 0) {}
+
+    int image_width() const { return width; }
+    int image_height() const { return height; }
+
+    // Takes a snapshot of the calling thread's counters at the start of a pixel.
+    struct pixel_probe {
+        uint64_t traversal_steps;
+        uint64_t primitive_tests;
+        uint64_t rays;
+        std::chrono::steady_clock::time_point start;
+
+        static pixel_probe now() {
+            const auto& stats = current_thread_stats();
+            return {stats[stat_counter::bvh_node_visits] + stats[stat_counter::grid_cell_visits],
+                    stats[stat_counter::primitive_tests],
+                    stats[stat_counter::primary_rays] + stats[stat_counter::secondary_rays],
+                    std::chrono::steady_clock::now()};
+        }
+    };
+
+    // Adds the cost since `before` to pixel (x, y), which took `samples` more samples. Pixels
+    // of a tile are written by one thread at a time.
+    void add_pixel(int x, int y, const pixel_probe& before, int samples) {
+        auto after = pixel_probe::now();
+        auto i = size_t(y) * width + x;
+        auto previous = static_cast<float>(samples_taken[i]);
+        auto total = previous + samples;
+        auto update_average = [&](heatmap_channel c, uint64_t amount) {
+            auto& v = values[static_cast<size_t>(c)][i];
+            v = (v * previous + static_cast<float>(amount)) / total;
+        };
+        update_average(heatmap_channel::traversal_steps, after.traversal_steps - before.traversal_steps);
+        update_average(heatmap_channel::primitive_tests, after.primitive_tests - before.primitive_tests);
+        update_average(heatmap_channel::path_length, after.rays - before.rays);
+        values[static_cast<size_t>(heatmap_channel::nanoseconds)][i] += static_cast<float>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(after.start - before.start).count());
+        samples_taken[i] += samples;
+    }
+
+    float value(heatmap_channel c, int x, int y) const {
+        return values[static_cast<size_t>(c)][size_t(y) * width + x];
+    }
+
+    const std::vector<float>& channel(heatmap_channel c) const { return values[static_cast<size_t>(c)]; }
+
+    // Writes <prefix>_<channel>.pfm for every channel.
+    bool write(const std::string& prefix) const {
+        bool ok = true;
+        for (size_t c = 0; c < values.size(); ++c) {
+            auto path = prefix + "_" + heatmap_channel_name(static_cast<heatmap_channel>(c)) + ".pfm";
+            ok = write_pfm(path, width, height, 1, values[c].data()) && ok;
+        }
+        return ok;
+    }
+
+  private:
+    int width = 0;
+    int height = 0;
+    std::vector<std::vector<float>> values;
+    std::vector<uint32_t> samples_taken;
+};
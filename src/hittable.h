@@ -2,6 +2,8 @@
 #include "rtweekend.h"
 #include "aabb.h"
 
+#include <cstdint>
+
 class material;
 
 class hit_record {
@@ -11,6 +13,7 @@ class hit_record {
     shared_ptr<material> mat;
     double t;
     bool front_face;
+    uint32_t object_id = 0;
 
     void set_face_normal(const ray& r, const vec3& outward_normal) {
         // Sets the hit record normal vector.
@@ -27,4 +30,38 @@ class hittable {
 
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
     virtual aabb bounding_box() const = 0;
+
+    uint32_t object_id = 0;  // Reported in hit records; 0 when not assigned
+};
+
+class translate : public hittable {
+  public:
+    translate(shared_ptr<hittable> p, const vec3& displacement)
+      : object(p), offset(displacement)
+    {
+        bbox = object->bounding_box() + offset;
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        // Move the ray backwards by the offset
+        ray offset_r(r.origin() - offset, r.direction(), r.time());
+
+        // Determine where (if any) an intersection occurs along the offset ray
+        if (!object->hit(offset_r, ray_t, rec))
+            return false;
+
+        // Move the intersection point forwards by the offset
+        rec.p += offset;
+        if (object_id != 0)
+            rec.object_id = object_id;
+
+        return true;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+  private:
+    shared_ptr<hittable> object;
+    vec3 offset;
+    aabb bbox;
 };
\ No newline at end of file
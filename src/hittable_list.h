@@ -22,6 +22,12 @@ class hittable_list : public hittable {
         bbox = aabb(bbox, object->bounding_box());
     }
 
+    // Numbers the objects consecutively from `first`, for the object id output.
+    void assign_object_ids(uint32_t first = 1) {
+        for (auto& object : objects)
+            object->object_id = first++;
+    }
+
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         hit_record temp_rec;
         bool hit_anything = false;
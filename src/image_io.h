@@ -0,0 +1,50 @@
+#pragma once
+
+#include "framebuffer.h"
+#include "trace.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Floating point images in the Portable Float Map format: "PF" for three channels, "Pf" for one.
+// Rows go bottom to top; the negative scale marks little-endian data.
+inline bool write_pfm(std::ostream& out, int width, int height, int channels, const float* data) {
+    if (channels != 1 && channels != 3)
+        return false;
+
+    out << (channels == 3 ? "PF" : "Pf") << '\n' << width << ' ' << height << '\n';
+    const uint16_t probe = 1;
+    unsigned char first_byte;
+    std::memcpy(&first_byte, &probe, 1);
+    out << (first_byte == 1 ? "-1.0" : "1.0") << '\n';
+
+    auto row = size_t(width) * channels;
+    for (int y = height - 1; y >= 0; --y)
+        out.write(reinterpret_cast<const char*>(data + y * row), row * sizeof(float));
+    return static_cast<bool>(out);
+}
+
+inline bool write_pfm(const std::string& path, int width, int height, int channels, const float* data) {
+    trace_scope trace("write_image", "output");
+    std::ofstream out(path, std::ios::binary);
+    return out && write_pfm(out, width, height, channels, data);
+}
+
+// The framebuffer's averaged, linear colors.
+inline bool write_pfm(const std::string& path, const framebuffer& image) {
+    std::vector<float> pixels;
+    pixels.reserve(image.sums().size() * 3);
+    for (int y = image.origin_y(); y < image.origin_y() + image.image_height(); ++y) {
+        for (int x = image.origin_x(); x < image.origin_x() + image.image_width(); ++x) {
+            auto c = image.average(x, y);
+            pixels.push_back(static_cast<float>(c.x()));
+            pixels.push_back(static_cast<float>(c.y()));
+            pixels.push_back(static_cast<float>(c.z()));
+        }
+    }
+    return write_pfm(path, image.image_width(), image.image_height(), 3, pixels.data());
+}
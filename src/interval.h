@@ -37,5 +37,13 @@ class interval {
     static const interval empty, universe;
 };
 
+inline interval operator+(const interval& ival, double displacement) {
+    return interval(ival.min + displacement, ival.max + displacement);
+}
+
+inline interval operator+(double displacement, const interval& ival) {
+    return ival + displacement;
+}
+
 const static interval empty(+infinity, -infinity);
 const static interval universe(-infinity, +infinity);
\ No newline at end of file
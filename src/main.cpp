@@ -1,18 +1,268 @@
 #include "rtweekend.h"
 
+#include "accelerator.h"
+#include "arena.h"
 #include "camera.h"
 #include "camera_cpu.h"
+#include "checkpoint.h"
 #include "color.h"
+#include "denoise.h"
+#ifndef _WIN32
+#include "distributed.h"
+#endif
 #include "hittable_list.h"
 #include "material.h"
+#include "scene_file.h"
 #include "sphere.h"
+#include "trace.h"
 
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
 
-int main() {
+struct render_options {
+    std::string scene_path;
+    bool progressive = false;
+    progressive_settings settings;
+    std::string preview_path;
+    std::string checkpoint_path;
+    double checkpoint_interval = 60;
+    bool resume = false;
+    int local_workers = 0;
+    int listen_port = 0;
+    int remote_workers = 0;
+    std::string coordinator;  // host:port of the coordinator when running as a worker
+    std::string trace_path;
+    accelerator_policy accelerators;  // --bvh-cache sets the BVH cache directory
+    std::string heatmap_prefix;  // Cost heatmaps are written to <prefix>_<measure>.pfm
+    std::string aov_prefix;      // Feature buffers are written to <prefix>_<channel>.pfm
+    unsigned aov_channels = aov_all;
+    bool denoise = false;  // Filter the image guided by the albedo and normal buffers
+};
+
+// Usage: main [scene file] [--time-budget seconds] [--spp samples] [--pass-spp samples]
+//             [--noise relative error] [--preview image.ppm]
+//             [--checkpoint file] [--checkpoint-interval seconds] [--resume]
+//             [--workers count] [--listen port --remote-workers count] [--connect host:port]
+//             [--trace trace.json] [--heatmaps prefix] [--aovs prefix [--aov-channels list]]
+//             [--denoise] [--bvh-cache directory]
+// The first options switch to progressive rendering. --workers forks local worker processes,
+// --listen waits for remote workers started with --connect and the same scene arguments.
+render_options parse_options(int argc, char* argv[]) {
+    render_options options;
+    for (int i = 1; i < argc; ++i) {
+        auto value = [&]() { return i + 1 < argc ? argv[++i] : "0"; };
+        if (std::strcmp(argv[i], "--time-budget") == 0)
+            options.settings.time_budget = std::atof(value());
+        else if (std::strcmp(argv[i], "--spp") == 0)
+            options.settings.target_samples = std::atoi(value());
+        else if (std::strcmp(argv[i], "--pass-spp") == 0)
+            options.settings.pass_samples = std::atoi(value());
+        else if (std::strcmp(argv[i], "--noise") == 0)
+            options.settings.noise_threshold = std::atof(value());
+        else if (std::strcmp(argv[i], "--preview") == 0)
+            options.preview_path = value();
+        else if (std::strcmp(argv[i], "--heatmaps") == 0)
+            options.heatmap_prefix = value();
+        else if (std::strcmp(argv[i], "--aovs") == 0)
+            options.aov_prefix = value();
+        else if (std::strcmp(argv[i], "--aov-channels") == 0)
+            options.aov_channels = parse_aov_channels(value());
+        else if (std::strcmp(argv[i], "--denoise") == 0)
+            options.denoise = true;
+        else if (std::strcmp(argv[i], "--checkpoint") == 0)
+            options.checkpoint_path = value();
+        else if (std::strcmp(argv[i], "--checkpoint-interval") == 0)
+            options.checkpoint_interval = std::atof(value());
+        else if (std::strcmp(argv[i], "--resume") == 0)
+            options.resume = true;
+        else if (std::strcmp(argv[i], "--workers") == 0) {
+            options.local_workers = std::atoi(value());
+            continue;
+        } else if (std::strcmp(argv[i], "--listen") == 0) {
+            options.listen_port = std::atoi(value());
+            continue;
+        } else if (std::strcmp(argv[i], "--remote-workers") == 0) {
+            options.remote_workers = std::atoi(value());
+            continue;
+        } else if (std::strcmp(argv[i], "--connect") == 0) {
+            options.coordinator = value();
+            continue;
+        } else if (std::strcmp(argv[i], "--trace") == 0) {
+            options.trace_path = value();
+            continue;
+        } else if (std::strcmp(argv[i], "--bvh-cache") == 0) {
+            options.accelerators.bvh_cache_dir = value();
+            continue;
+        } else {
+            options.scene_path = argv[i];
+            continue;
+        }
+        options.progressive = true;
+    }
+    return options;
+}
+
+#ifndef _WIN32
+// Returns false when no distributed mode was requested.
+bool render_with_workers(camera& cam, const hittable& world, const render_options& options) {
+    if (!options.coordinator.empty()) {
+        auto colon = options.coordinator.rfind(':');
+        auto host = options.coordinator.substr(0, colon);
+        auto port = colon == std::string::npos ? 0 : std::atoi(options.coordinator.c_str() + colon + 1);
+        int fd = connect_tcp(host, static_cast<uint16_t>(port));
+        if (fd < 0) {
+            std::cerr << "Can't connect to " << options.coordinator << '\n';
+            return true;
+        }
+        run_tile_worker(fd, cam, world);
+        ::close(fd);
+        return true;
+    }
+
+    std::vector<int> workers;
+    std::unique_ptr<local_worker_pool> pool;
+    if (options.local_workers > 0) {
+        pool = std::make_unique<local_worker_pool>(options.local_workers, cam, world);
+        workers = pool->take_sockets();
+    } else if (options.listen_port > 0) {
+        int listen_fd = listen_tcp(static_cast<uint16_t>(options.listen_port));
+        if (listen_fd < 0) {
+            std::cerr << "Can't listen on port " << options.listen_port << '\n';
+            return true;
+        }
+        std::clog << "Waiting for " << options.remote_workers << " workers on port " << options.listen_port << '\n';
+        workers = accept_workers(listen_fd, options.remote_workers);
+        ::close(listen_fd);
+    } else {
+        return false;
+    }
+
+    framebuffer image;
+    distributed_settings settings;
+    if (options.settings.target_samples > 0)
+        settings.sample_end = options.settings.target_samples;
+    auto result = render_distributed(cam, world, image, std::move(workers), settings);
+    std::clog << "Distributed render: " << result.tiles << " tiles, " << result.redispatched << " redispatched, "
+              << result.rendered_locally << " rendered locally\n";
+    image.write_ppm(std::cout);
+    return true;
+}
+#endif
+
+void render(camera& cam, const hittable& world, const render_options& options) {
+#ifndef _WIN32
+    if (render_with_workers(cam, world, options))
+        return;
+#endif
+    if (!options.progressive) {
+        cam.render(world);
+        return;
+    }
+
+    auto settings = options.settings;
+    if (settings.target_samples <= 0)
+        settings.target_samples = cam.samples_per_pixel;
+
+    framebuffer image;
+    if (options.resume && !options.checkpoint_path.empty()) {
+        cam.initialize();
+        auto [width, height] = cam.image_size();
+        if (auto state = load_checkpoint(options.checkpoint_path, image, width, height)) {
+            cam.sampling = state->sampling;
+            settings.target_samples = state->target_samples;
+            restore_random_state(state->random_state);
+            std::clog << "Resuming from " << options.checkpoint_path << " at " << image.samples(0, 0) << " spp\n";
+        } else {
+            std::clog << "No usable checkpoint in " << options.checkpoint_path << ", starting over\n";
+        }
+    }
+
+    std::unique_ptr<checkpoint_writer> checkpoints;
+    if (!options.checkpoint_path.empty())
+        checkpoints = std::make_unique<checkpoint_writer>(options.checkpoint_path);
+
+    auto preview_path = options.preview_path;
+    auto last_checkpoint = std::chrono::steady_clock::now();
+    settings.on_pass = [&](const framebuffer& current, int) {
+        if (!preview_path.empty()) {
+            std::ofstream out(preview_path);
+            current.write_ppm(out);
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (checkpoints && std::chrono::duration<double>(now - last_checkpoint).count() >= options.checkpoint_interval) {
+            // The generator state has to be taken here, between passes.
+            if (checkpoints->write(current, {cam.sampling, settings.target_samples, save_random_state()}))
+                last_checkpoint = now;
+        }
+    };
+
+    cost_heatmaps heatmaps;
+    if (!options.heatmap_prefix.empty())
+        settings.heatmaps = &heatmaps;
+    aov_buffers aovs(0, 0, options.aov_channels);
+    if (!options.aov_prefix.empty() || options.denoise)
+        settings.aovs = &aovs;
+
+    auto result = cam.render_progressive(world, image, settings);
+    std::clog << "Progressive render: " << result.samples_per_pixel << " spp in " << result.passes
+              << " passes, " << result.seconds << " s\n";
+    if (options.denoise)
+        denoise(image, aovs).write_ppm(std::cout);
+    else
+        image.write_ppm(std::cout);
+    if (settings.heatmaps && !heatmaps.write(options.heatmap_prefix))
+        std::cerr << "Failed to write heatmaps " << options.heatmap_prefix << "_*.pfm\n";
+    if (!options.aov_prefix.empty() && !aovs.write(options.aov_prefix))
+        std::cerr << "Failed to write AOVs " << options.aov_prefix << "_*.pfm\n";
+}
+
+int main(int argc, char* argv[]) {
+    render_options options;
+    try {
+        options = parse_options(argc, argv);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+#ifndef RT_ENABLE_STATS
+    if (!options.heatmap_prefix.empty()) {
+        // The traversal, intersection and path heatmaps would all be zero.
+        std::cerr << "--heatmaps needs the render counters, rebuild with -DRT_ENABLE_STATS=ON\n";
+        return 1;
+    }
+#endif
+    if (options.resume && (!options.heatmap_prefix.empty() || !options.aov_prefix.empty() || options.denoise)) {
+        // Checkpoints hold the framebuffer only; the buffers filled alongside it would restart empty.
+        std::cerr << "--resume can't be combined with --heatmaps, --aovs or --denoise\n";
+        return 1;
+    }
+    trace_session trace(options.trace_path);
+    if (!options.scene_path.empty()) {
+        // Render a text or binary scene file instead of the built-in scene.
+        loaded_scene scene;
+        try {
+            scene = load_scene(options.scene_path, options.accelerators);
+        } catch (const std::exception& e) {
+            // Text scene errors name the line they were found on.
+            std::cerr << options.scene_path << ": " << e.what() << '\n';
+            return 1;
+        }
+        CPUImpl::Camera cam;
+        scene.camera.apply(cam);
+        render(cam, scene.world, options);
+        return 0;
+    }
+
+    // Scene objects are packed into the arena, which frees them all at once at exit.
+    scene_arena arena;
     hittable_list world;
 
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground_material));
+    auto ground_material = arena.make<lambertian>(color(0.5, 0.5, 0.5));
+    world.add(arena.make<sphere>(point3(0,-1000,0), 1000, ground_material));
 
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
@@ -25,32 +275,39 @@ int main() {
                 if (choose_mat < 0.8) {
                     // diffuse
                     auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
+                    sphere_material = arena.make<lambertian>(albedo);
                     auto center2 = center + vec3(0, random_double(0,.5), 0);
-                    world.add(make_shared<sphere>(center, center2, 0.2, sphere_material));
+                    world.add(arena.make<sphere>(center, center2, 0.2, sphere_material));
                 } else if (choose_mat < 0.95) {
                     // metal
                     auto albedo = color::random(0.5, 1);
                     auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    sphere_material = arena.make<metal>(albedo, fuzz);
+                    world.add(arena.make<sphere>(center, 0.2, sphere_material));
                 } else {
                     // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    sphere_material = arena.make<dielectric>(1.5);
+                    world.add(arena.make<sphere>(center, 0.2, sphere_material));
                 }
             }
         }
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+    auto material1 = arena.make<dielectric>(1.5);
+    world.add(arena.make<sphere>(point3(0, 1, 0), 1.0, material1));
+
+    auto material2 = arena.make<lambertian>(color(0.4, 0.2, 0.1));
+    world.add(arena.make<sphere>(point3(-4, 1, 0), 1.0, material2));
+
+    auto material3 = arena.make<metal>(color(0.7, 0.6, 0.5), 0.0);
+    world.add(arena.make<sphere>(point3(4, 1, 0), 1.0, material3));
 
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+    auto stats = arena.stats();
+    std::clog << "Scene arena: " << stats.objects << " objects in " << stats.blocks << " blocks, "
+              << stats.bytes_used << " of " << stats.bytes_reserved << " bytes used\n";
 
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    world.assign_object_ids();
+    world = hittable_list(make_accelerator(world, options.accelerators));
 
     CPUImpl::Camera cam;
 
@@ -67,5 +324,5 @@ int main() {
     cam.defocus_angle = 0.6;
     cam.focus_dist    = 10.0;
 
-    cam.render(world);
+    render(cam, world, options);
 }
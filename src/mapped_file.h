@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file. The pages are loaded lazily by the OS, so opening
+// even a large file costs next to nothing.
+class mapped_file {
+  public:
+    // Returns nullptr when the file doesn't exist or can't be mapped.
+    static std::shared_ptr<const mapped_file> open(const std::string& path) {
+        std::shared_ptr<mapped_file> file(new mapped_file());
+        if (!file->map(path))
+            return nullptr;
+        return file;
+    }
+
+    ~mapped_file() {
+#if defined(_WIN32)
+        if (view) UnmapViewOfFile(view);
+        if (mapping) CloseHandle(mapping);
+#else
+        if (view) munmap(view, length);
+#endif
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const unsigned char* data() const { return static_cast<const unsigned char*>(view); }
+    size_t size() const { return length; }
+
+  private:
+    void* view = nullptr;
+    size_t length = 0;
+#if defined(_WIN32)
+    HANDLE mapping = nullptr;
+#endif
+
+    mapped_file() = default;
+
+    bool map(const std::string& path) {
+#if defined(_WIN32)
+        HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                    FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (handle == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(handle, &file_size) || file_size.QuadPart == 0) {
+            CloseHandle(handle);
+            return false;
+        }
+        mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(handle);
+        if (!mapping)
+            return false;
+        view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        length = static_cast<size_t>(file_size.QuadPart);
+        return view != nullptr;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        length = static_cast<size_t>(st.st_size);
+        void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        view = p;
+        return true;
+#endif
+    }
+};
@@ -2,6 +2,9 @@
 #include "rtweekend.h"
 #include "color.h"
 #include "hittable.h"
+#include "sampler.h"
+#include "stats.h"
+#include "warps.h"
 
 
 class material {
@@ -10,6 +13,16 @@ class material {
 
     virtual bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const = 0;
+
+    // Same as above, but takes its random decisions from the sample dimensions of the current
+    // path vertex. Materials that don't override it ignore the sampler.
+    virtual bool scatter(
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler&) const {
+        return scatter(r_in, rec, attenuation, scattered);
+    }
+
+    // Surface color for the albedo output; white for materials without one.
+    virtual color surface_albedo(const hit_record&) const { return color(1,1,1); }
 };
 
 class lambertian : public material {
@@ -18,12 +31,21 @@ class lambertian : public material {
 
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
     const override {
-        auto scatter_direction = rec.normal + random_unit_vector();
+        random_sampler s;
+        return scatter(r_in, rec, attenuation, scattered, s);
+    }
+
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s)
+    const override {
+        RT_STAT_INC(lambertian_hits);
+        auto scatter_direction = onb(rec.normal).local(warp_cosine_hemisphere(s.get_2d()));
         scattered = ray(rec.p, scatter_direction, r_in.time());
         attenuation = albedo;
         return true;
     }
 
+    color surface_albedo(const hit_record&) const override { return albedo; }
+
   private:
     color albedo;
 };
@@ -34,12 +56,22 @@ class metal : public material {
 
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
     const override {
+        random_sampler s;
+        return scatter(r_in, rec, attenuation, scattered, s);
+    }
+
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s)
+    const override {
+        RT_STAT_INC(metal_hits);
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere(), r_in.time());
+        auto direction_u = s.get_2d();
+        scattered = ray(rec.p, reflected + fuzz*warp_uniform_ball(direction_u, s.get_1d()), r_in.time());
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);
     }
 
+    color surface_albedo(const hit_record&) const override { return albedo; }
+
   private:
     color albedo;
     double fuzz;
@@ -51,6 +83,20 @@ class dielectric : public material {
 
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
     const override {
+        return refract_or_reflect(r_in, rec, attenuation, scattered, random_double());
+    }
+
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s)
+    const override {
+        return refract_or_reflect(r_in, rec, attenuation, scattered, s.get_1d());
+    }
+
+  private:
+    double ir; // Index of Refraction
+
+    bool refract_or_reflect(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered,
+                            double lobe_u) const {
+        RT_STAT_INC(dielectric_hits);
         attenuation = color(1.0, 1.0, 1.0);
         double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
 
@@ -61,7 +107,7 @@ class dielectric : public material {
         bool cannot_refract = refraction_ratio * sin_theta > 1.0;
         vec3 direction;
 
-        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > lobe_u)
             direction = reflect(unit_direction, rec.normal);
         else
             direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -70,9 +116,6 @@ class dielectric : public material {
         return true;
     }
 
-  private:
-    double ir; // Index of Refraction
-
     static double reflectance(double cosine, double ref_idx) {
         // Use Schlick's approximation for reflectance.
         auto r0 = (1-ref_idx) / (1+ref_idx);
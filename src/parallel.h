@@ -0,0 +1,47 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+inline unsigned worker_count() {
+    auto n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : n;
+}
+
+// Splits [0, count) into contiguous chunks of at least `grain` items and runs
+// fn(begin, end, chunk_index) for each chunk on its own thread. Small ranges run inline.
+template <typename F>
+void parallel_chunks(size_t count, size_t grain, F&& fn) {
+    size_t chunks = std::min<size_t>(worker_count(), (count + grain - 1) / std::max<size_t>(grain, 1));
+    if (chunks <= 1) {
+        fn(size_t(0), count, size_t(0));
+        return;
+    }
+
+    size_t chunk_size = (count + chunks - 1) / chunks;
+    std::vector<std::thread> threads;
+    threads.reserve(chunks - 1);
+    for (size_t c = 1; c < chunks; ++c) {
+        size_t begin = std::min(count, c * chunk_size);
+        size_t end = std::min(count, begin + chunk_size);
+        threads.emplace_back([&fn, begin, end, c]() { fn(begin, end, c); });
+    }
+    fn(size_t(0), std::min(count, chunk_size), size_t(0));
+
+    for (auto& t : threads)
+        t.join();
+}
+
+inline size_t parallel_chunk_count(size_t count, size_t grain) {
+    return std::max<size_t>(1, std::min<size_t>(worker_count(), (count + grain - 1) / std::max<size_t>(grain, 1)));
+}
+
+template <typename F>
+void parallel_for(size_t count, size_t grain, F&& fn) {
+    parallel_chunks(count, grain, [&fn](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i)
+            fn(i);
+    });
+}
@@ -22,10 +22,15 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+// The generator behind random_double(), exposed so that checkpoints can save and restore it.
+inline std::mt19937& random_generator() {
+    static std::mt19937 generator;
+    return generator;
+}
+
 inline double random_double() {
     static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    return distribution(random_generator());
 }
 
 inline double random_double(double min, double max) {
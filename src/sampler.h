@@ -0,0 +1,253 @@
+#pragma once
+#include "rtweekend.h"
+
+#include "warps.h"
+
+#include <cstdint>
+#include <memory>
+
+// Every path consumes sample dimensions in the same fixed order, so that a given dimension
+// always drives the same decision: the camera takes the first two blocks of four (pixel 2D,
+// lens 2D, time 1D) and the material at every path vertex one more block.
+static constexpr int sampler_camera_dimensions = 8;
+static constexpr int sampler_vertex_dimensions = 4;
+
+inline int sampler_vertex_dimension(int vertex) {
+    return sampler_camera_dimensions + vertex * sampler_vertex_dimensions;
+}
+
+inline uint32_t sampler_hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t sampler_hash(uint32_t a, uint32_t b) {
+    return sampler_hash(a ^ sampler_hash(b + 0x9e3779b9u));
+}
+
+inline double sampler_to_unit(uint32_t bits) {
+    return bits * 0x1p-32;  // Always below 1
+}
+
+// Produces the sample values of one pixel sample at a time. Values depend only on the pixel,
+// the sample index, the dimension and the seed, never on what other threads do, so renders are
+// reproducible.
+class sampler {
+  public:
+    virtual ~sampler() = default;
+
+    void start_pixel_sample(int x, int y, int sample_index) {
+        pixel_seed = sampler_hash(sampler_hash(static_cast<uint32_t>(x), static_cast<uint32_t>(y)), seed);
+        index = static_cast<uint32_t>(sample_index);
+        dimension = 0;
+    }
+
+    void set_dimension(int d) { dimension = d; }
+
+    double get_1d() { return sample(dimension++); }
+
+    sample_2d get_2d() {
+        // Keep both values of a pair inside the same block of four dimensions.
+        if (dimension % 4 == 3)
+            ++dimension;
+        auto s = sample_pair(dimension);
+        dimension += 2;
+        return s;
+    }
+
+  protected:
+    explicit sampler(uint32_t _seed) : seed(_seed) {}
+
+    virtual double sample(int dim) const = 0;
+
+    virtual sample_2d sample_pair(int dim) const { return {sample(dim), sample(dim + 1)}; }
+
+    uint32_t seed;
+    uint32_t pixel_seed = 0;
+    uint32_t index = 0;
+    int dimension = 0;
+};
+
+// Draws from the shared random_double() stream in call order, like the original renderer.
+class random_sampler : public sampler {
+  public:
+    random_sampler() : sampler(0) {}
+
+  protected:
+    double sample(int) const override { return random_double(); }
+};
+
+// Uncorrelated uniform values, hashed from the sample coordinates.
+class independent_sampler : public sampler {
+  public:
+    explicit independent_sampler(uint32_t seed = 0) : sampler(seed) {}
+
+  protected:
+    double sample(int dim) const override {
+        return sampler_to_unit(sampler_hash(sampler_hash(pixel_seed, index), static_cast<uint32_t>(dim)));
+    }
+};
+
+// Kensler's hashed permutation of [0, length), "Correlated Multi-Jittered Sampling" (2013).
+inline uint32_t permute_index(uint32_t i, uint32_t length, uint32_t p) {
+    uint32_t w = length - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p;
+        i *= 0xe170893du;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3fu;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= length);
+    return (i + p) % length;
+}
+
+// Jittered samples: each of the samples_per_pixel samples falls in its own stratum, 1D strata
+// for single values and an n x n grid for pairs. Strata are shuffled per pixel and dimension so
+// that dimensions don't correlate.
+class stratified_sampler : public sampler {
+  public:
+    explicit stratified_sampler(int samples_per_pixel, uint32_t seed = 0)
+      : sampler(seed),
+        strata(static_cast<uint32_t>(samples_per_pixel < 1 ? 1 : samples_per_pixel)),
+        strata_per_axis(static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(strata))))) {}
+
+  protected:
+    double sample(int dim) const override {
+        auto h = sampler_hash(pixel_seed, static_cast<uint32_t>(dim));
+        auto stratum = permute_index(index % strata, strata, h);
+        auto jitter = sampler_to_unit(sampler_hash(h, index));
+        return (stratum + jitter) / strata;
+    }
+
+    sample_2d sample_pair(int dim) const override {
+        auto cells = strata_per_axis * strata_per_axis;
+        auto h = sampler_hash(pixel_seed, static_cast<uint32_t>(dim));
+        auto stratum = permute_index(index % cells, cells, h);
+        auto jx = sampler_to_unit(sampler_hash(h, 2 * index));
+        auto jy = sampler_to_unit(sampler_hash(h, 2 * index + 1));
+        return {(stratum % strata_per_axis + jx) / strata_per_axis,
+                (stratum / strata_per_axis + jy) / strata_per_axis};
+    }
+
+  private:
+    uint32_t strata;
+    uint32_t strata_per_axis;
+};
+
+// Sobol direction numbers for the first four dimensions: van der Corput and the Joe & Kuo
+// (new-joe-kuo-6.21201) polynomials of degree 1, 2 and 3.
+struct sobol_directions {
+    uint32_t v[4][32];
+
+    sobol_directions() {
+        for (int bit = 0; bit < 32; bit++)
+            v[0][bit] = 1u << (31 - bit);
+
+        const uint32_t degree[3] = {1, 2, 3};
+        const uint32_t coefficients[3] = {0, 1, 1};
+        const uint32_t initial[3][3] = {{1, 0, 0}, {1, 3, 0}, {1, 3, 1}};
+        for (int d = 1; d < 4; d++) {
+            auto s = degree[d - 1];
+            auto a = coefficients[d - 1];
+            for (uint32_t k = 0; k < 32; k++) {
+                if (k < s) {
+                    v[d][k] = initial[d - 1][k] << (31 - k);
+                    continue;
+                }
+                v[d][k] = v[d][k - s] ^ (v[d][k - s] >> s);
+                for (uint32_t l = 1; l < s; l++) {
+                    if ((a >> (s - 1 - l)) & 1)
+                        v[d][k] ^= v[d][k - l];
+                }
+            }
+        }
+    }
+};
+
+inline uint32_t sobol_sample(uint32_t index, int dim) {
+    static const sobol_directions directions;
+    uint32_t x = 0;
+    for (int bit = 0; index != 0; index >>= 1, ++bit) {
+        if (index & 1)
+            x ^= directions.v[dim][bit];
+    }
+    return x;
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Hash-based Owen scrambling (Burley, "Practical Hash-based Owen Scrambling", 2020).
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+// Owen-scrambled Sobol points. Dimensions come in independently scrambled blocks of four
+// ("padding"), and each pixel shuffles the sample order, so neighbouring pixels decorrelate
+// while every pixel keeps the stratification of the sequence.
+class sobol_sampler : public sampler {
+  public:
+    explicit sobol_sampler(uint32_t seed = 0) : sampler(seed) {}
+
+  protected:
+    double sample(int dim) const override {
+        auto block_seed = sampler_hash(pixel_seed, static_cast<uint32_t>(dim / 4));
+        auto shuffled = nested_uniform_scramble(index, block_seed);
+        auto value = sobol_sample(shuffled, dim % 4);
+        return sampler_to_unit(nested_uniform_scramble(value, sampler_hash(block_seed, static_cast<uint32_t>(dim % 4))));
+    }
+};
+
+enum class sampler_type {
+    random,
+    independent,
+    stratified,
+    sobol
+};
+
+inline std::unique_ptr<sampler> make_sampler(sampler_type type, int samples_per_pixel, uint32_t seed = 0) {
+    switch (type) {
+        case sampler_type::random:
+            return std::make_unique<random_sampler>();
+        case sampler_type::independent:
+            return std::make_unique<independent_sampler>(seed);
+        case sampler_type::stratified:
+            return std::make_unique<stratified_sampler>(samples_per_pixel, seed);
+        case sampler_type::sobol:
+        default:
+            return std::make_unique<sobol_sampler>(seed);
+    }
+}
@@ -0,0 +1,669 @@
+#pragma once
+#include "rtweekend.h"
+
+#include "accelerator.h"
+#include "arena.h"
+#include "camera.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "parallel.h"
+#include "sphere.h"
+#include "trace.h"
+#include "triangle.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Scene description stored as structure-of-arrays, in the same layout as the binary file, so
+// each section is read with a few large reads straight into its arrays.
+
+enum class scene_material_type : uint32_t {
+    lambertian = 0,
+    metal = 1,
+    dielectric = 2
+};
+
+struct scene_materials {
+    std::vector<uint32_t> type;
+    std::vector<double> params;  // r, g, b and fuzz or index of refraction, per material
+
+    size_t size() const { return type.size(); }
+};
+
+struct scene_spheres {
+    std::vector<double> center0;  // x, y, z per sphere
+    std::vector<double> center1;  // Equal to center0 for stationary spheres
+    std::vector<double> radius;
+    std::vector<uint32_t> material;
+
+    size_t size() const { return radius.size(); }
+};
+
+struct scene_mesh {
+    std::vector<float> vertices;    // x, y, z per vertex
+    std::vector<uint32_t> indices;  // Three vertex indices per triangle
+    uint32_t material = 0;
+};
+
+struct scene_instances {
+    std::vector<uint32_t> mesh;
+    std::vector<double> offset;  // x, y, z per instance
+
+    size_t size() const { return mesh.size(); }
+};
+
+struct scene_camera {
+    double aspect_ratio = 1.0;
+    int image_width = 100;
+    int samples_per_pixel = 10;
+    int max_depth = 10;
+    double vfov = 90;
+    point3 lookfrom = point3(0,0,-1);
+    point3 lookat = point3(0,0,0);
+    vec3 vup = vec3(0,1,0);
+    double defocus_angle = 0;
+    double focus_dist = 10;
+
+    void apply(camera& cam) const {
+        cam.aspect_ratio = aspect_ratio;
+        cam.image_width = image_width;
+        cam.samples_per_pixel = samples_per_pixel;
+        cam.max_depth = max_depth;
+        cam.vfov = vfov;
+        cam.lookfrom = lookfrom;
+        cam.lookat = lookat;
+        cam.vup = vup;
+        cam.defocus_angle = defocus_angle;
+        cam.focus_dist = focus_dist;
+    }
+};
+
+struct scene_description {
+    scene_materials materials;
+    scene_spheres spheres;
+    std::vector<scene_mesh> meshes;
+    scene_instances instances;
+    scene_camera camera;
+};
+
+struct loaded_scene {
+    std::vector<scene_arena> arenas;  // Hold the scene objects; the pointers in world share them
+    hittable_list world;
+    scene_camera camera;
+};
+
+// Turns scene sections into hittables as they arrive. Each mesh gets its own acceleration
+// structure built in the background, so later sections can be read in the meantime.
+class scene_builder {
+  public:
+    explicit scene_builder(accelerator_policy _policy = {}) : policy(_policy) {}
+
+    void add_materials(const scene_materials& materials) {
+        for (size_t i = 0; i < materials.size(); ++i) {
+            const double* p = &materials.params[4 * i];
+            switch (static_cast<scene_material_type>(materials.type[i])) {
+                case scene_material_type::lambertian:
+                    this->materials.push_back(material_arena.make<lambertian>(color(p[0], p[1], p[2])));
+                    break;
+                case scene_material_type::metal:
+                    this->materials.push_back(material_arena.make<metal>(color(p[0], p[1], p[2]), p[3]));
+                    break;
+                case scene_material_type::dielectric:
+                    this->materials.push_back(material_arena.make<dielectric>(p[3]));
+                    break;
+                default:
+                    throw std::runtime_error("Unknown material type " + std::to_string(materials.type[i]));
+            }
+        }
+    }
+
+    void add_spheres(const scene_spheres& spheres) {
+        for (size_t i = 0; i < spheres.size(); ++i) {
+            point3 c0(spheres.center0[3 * i], spheres.center0[3 * i + 1], spheres.center0[3 * i + 2]);
+            point3 c1(spheres.center1[3 * i], spheres.center1[3 * i + 1], spheres.center1[3 * i + 2]);
+            auto mat = material_at(spheres.material[i]);
+            if (c0[0] == c1[0] && c0[1] == c1[1] && c0[2] == c1[2])
+                objects.add(arena.make<sphere>(c0, spheres.radius[i], mat));
+            else
+                objects.add(arena.make<sphere>(c0, c1, spheres.radius[i], mat));
+        }
+    }
+
+    void add_mesh(scene_mesh mesh) {
+        auto vertex_count = mesh.vertices.size() / 3;
+        for (auto index : mesh.indices) {
+            if (index >= vertex_count)
+                throw std::runtime_error("Mesh vertex index out of range");
+        }
+        auto mat = material_at(mesh.material);
+
+        // Bound the number of meshes building at the same time.
+        if (pending_builds.size() >= worker_count()) {
+            meshes[pending_builds.front()].wait();
+            pending_builds.pop_front();
+        }
+
+        auto build = std::async(std::launch::async, [mesh = std::move(mesh), mat, policy = policy]() {
+            mesh_build result;
+            auto& mesh_arena = result.arena;
+            hittable_list triangles;
+            triangles.objects.reserve(mesh.indices.size() / 3);
+            auto vertex = [&mesh](uint32_t index) {
+                const float* v = &mesh.vertices[3 * index];
+                return point3(v[0], v[1], v[2]);
+            };
+            for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+                triangles.add(mesh_arena.make<triangle>(vertex(mesh.indices[i]), vertex(mesh.indices[i + 1]),
+                                                        vertex(mesh.indices[i + 2]), mat));
+            }
+            result.accelerator = make_accelerator(triangles, policy);
+            return result;
+        });
+        meshes.push_back(std::move(build));
+        pending_builds.push_back(meshes.size() - 1);
+    }
+
+    void add_instances(const scene_instances& instances) {
+        for (size_t i = 0; i < instances.size(); ++i) {
+            if (instances.mesh[i] >= meshes.size())
+                throw std::runtime_error("Instance of unknown mesh " + std::to_string(instances.mesh[i]));
+            vec3 offset(instances.offset[3 * i], instances.offset[3 * i + 1], instances.offset[3 * i + 2]);
+            placements.emplace_back(instances.mesh[i], offset);
+        }
+    }
+
+    // Waits for the mesh builds and puts everything under one top-level accelerator. The
+    // returned scene takes over the arenas holding its objects.
+    loaded_scene finish() {
+        loaded_scene scene;
+        std::vector<shared_ptr<hittable>> mesh_accelerators;
+        for (auto& build : meshes) {
+            auto mesh = build.get();
+            mesh_accelerators.push_back(mesh.accelerator);
+            scene.arenas.push_back(std::move(mesh.arena));
+        }
+
+        for (const auto& [mesh, offset] : placements)
+            objects.add(arena.make<translate>(mesh_accelerators[mesh], offset));
+        objects.assign_object_ids();
+
+        scene.world = objects.objects.empty() ? objects : hittable_list(make_accelerator(objects, policy));
+        objects.clear();
+        scene.arenas.push_back(std::move(arena));
+        scene.arenas.push_back(std::move(material_arena));
+        return scene;
+    }
+
+  private:
+    struct mesh_build {
+        shared_ptr<hittable> accelerator;
+        scene_arena arena;  // Each mesh has its own, as meshes are built on other threads
+    };
+
+    accelerator_policy policy;
+    scene_arena arena;
+    // Materials reference nothing, so objects of every other arena can own them without a cycle.
+    scene_arena material_arena;
+    std::vector<shared_ptr<material>> materials;
+    std::vector<std::future<mesh_build>> meshes;
+    std::deque<size_t> pending_builds;
+    std::vector<std::pair<uint32_t, vec3>> placements;
+    hittable_list objects;
+
+    shared_ptr<material> material_at(uint32_t index) const {
+        if (index >= materials.size())
+            throw std::runtime_error("Unknown material " + std::to_string(index));
+        return materials[index];
+    }
+};
+
+inline loaded_scene build_scene(scene_description scene, accelerator_policy policy = {}) {
+    scene_builder builder(policy);
+    builder.add_materials(scene.materials);
+    builder.add_spheres(scene.spheres);
+    for (auto& mesh : scene.meshes)
+        builder.add_mesh(std::move(mesh));
+    builder.add_instances(scene.instances);
+    auto loaded = builder.finish();
+    loaded.camera = scene.camera;
+    return loaded;
+}
+
+// Text front-end. One statement per line, '#' starts a comment:
+//
+//   material <name> lambertian <r> <g> <b>
+//   material <name> metal <r> <g> <b> <fuzz>
+//   material <name> dielectric <index of refraction>
+//   sphere <material> <x> <y> <z> <radius>
+//   moving_sphere <material> <x0> <y0> <z0> <x1> <y1> <z1> <radius>
+//   mesh <name> <material>
+//   v <x> <y> <z>            vertices and faces belong to the last mesh,
+//   f <i> <j> <k>            indices count from 0
+//   instance <mesh> <x> <y> <z>
+//   camera <setting> <values>  where setting is any scene_camera field
+inline scene_description parse_scene_text(std::istream& in) {
+    scene_description scene;
+    std::map<std::string, uint32_t> material_names;
+    std::map<std::string, uint32_t> mesh_names;
+    std::string line;
+    int line_number = 0;
+
+    while (std::getline(in, line)) {
+        ++line_number;
+        auto comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+
+        std::istringstream words(line);
+        std::string keyword;
+        if (!(words >> keyword))
+            continue;
+
+        auto fail = [line_number](const std::string& message) {
+            return std::runtime_error("Scene line " + std::to_string(line_number) + ": " + message);
+        };
+        auto read = [&](auto& value) {
+            if (!(words >> value))
+                throw fail("missing or invalid value for '" + keyword + "'");
+        };
+        auto read_vec = [&](vec3& v) {
+            double x, y, z;
+            read(x); read(y); read(z);
+            v = vec3(x, y, z);
+        };
+        auto lookup = [&](const std::map<std::string, uint32_t>& names, const std::string& kind) {
+            std::string name;
+            read(name);
+            auto found = names.find(name);
+            if (found == names.end())
+                throw fail("unknown " + kind + " '" + name + "'");
+            return found->second;
+        };
+        auto current_mesh = [&]() -> scene_mesh& {
+            if (scene.meshes.empty())
+                throw fail("'" + keyword + "' outside of a mesh");
+            return scene.meshes.back();
+        };
+
+        if (keyword == "material") {
+            std::string name, type;
+            read(name);
+            read(type);
+            double params[4] = {0, 0, 0, 0};
+            if (type == "lambertian") {
+                read(params[0]); read(params[1]); read(params[2]);
+                scene.materials.type.push_back(static_cast<uint32_t>(scene_material_type::lambertian));
+            } else if (type == "metal") {
+                read(params[0]); read(params[1]); read(params[2]); read(params[3]);
+                scene.materials.type.push_back(static_cast<uint32_t>(scene_material_type::metal));
+            } else if (type == "dielectric") {
+                read(params[3]);
+                scene.materials.type.push_back(static_cast<uint32_t>(scene_material_type::dielectric));
+            } else {
+                throw fail("unknown material type '" + type + "'");
+            }
+            scene.materials.params.insert(scene.materials.params.end(), params, params + 4);
+            material_names[name] = static_cast<uint32_t>(scene.materials.size() - 1);
+        } else if (keyword == "sphere" || keyword == "moving_sphere") {
+            auto mat = lookup(material_names, "material");
+            vec3 c0, c1;
+            read_vec(c0);
+            c1 = c0;
+            if (keyword == "moving_sphere")
+                read_vec(c1);
+            double radius;
+            read(radius);
+            for (int a = 0; a < 3; a++) {
+                scene.spheres.center0.push_back(c0[a]);
+                scene.spheres.center1.push_back(c1[a]);
+            }
+            scene.spheres.radius.push_back(radius);
+            scene.spheres.material.push_back(mat);
+        } else if (keyword == "mesh") {
+            std::string name;
+            read(name);
+            scene_mesh mesh;
+            mesh.material = lookup(material_names, "material");
+            scene.meshes.push_back(std::move(mesh));
+            mesh_names[name] = static_cast<uint32_t>(scene.meshes.size() - 1);
+        } else if (keyword == "v") {
+            auto& mesh = current_mesh();
+            vec3 v;
+            read_vec(v);
+            for (int a = 0; a < 3; a++)
+                mesh.vertices.push_back(static_cast<float>(v[a]));
+        } else if (keyword == "f") {
+            auto& mesh = current_mesh();
+            for (int k = 0; k < 3; k++) {
+                uint32_t index;
+                read(index);
+                if (index >= mesh.vertices.size() / 3)
+                    throw fail("vertex index " + std::to_string(index) + " out of range");
+                mesh.indices.push_back(index);
+            }
+        } else if (keyword == "instance") {
+            auto mesh = lookup(mesh_names, "mesh");
+            vec3 offset;
+            read_vec(offset);
+            scene.instances.mesh.push_back(mesh);
+            for (int a = 0; a < 3; a++)
+                scene.instances.offset.push_back(offset[a]);
+        } else if (keyword == "camera") {
+            std::string setting;
+            read(setting);
+            auto& cam = scene.camera;
+            if (setting == "aspect_ratio") read(cam.aspect_ratio);
+            else if (setting == "image_width") read(cam.image_width);
+            else if (setting == "samples_per_pixel") read(cam.samples_per_pixel);
+            else if (setting == "max_depth") read(cam.max_depth);
+            else if (setting == "vfov") read(cam.vfov);
+            else if (setting == "lookfrom") read_vec(cam.lookfrom);
+            else if (setting == "lookat") read_vec(cam.lookat);
+            else if (setting == "vup") read_vec(cam.vup);
+            else if (setting == "defocus_angle") read(cam.defocus_angle);
+            else if (setting == "focus_dist") read(cam.focus_dist);
+            else throw fail("unknown camera setting '" + setting + "'");
+        } else {
+            throw fail("unknown statement '" + keyword + "'");
+        }
+    }
+
+    return scene;
+}
+
+// Binary format: a file header followed by sections. Every section starts with a header giving
+// its type, element count and payload size, so readers can skip sections they don't know.
+// Materials must come before anything that uses them and meshes before their instances.
+
+static constexpr char scene_file_magic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', 0};
+static constexpr uint32_t scene_file_version = 1;
+
+enum class scene_section_type : uint32_t {
+    materials = 1,  // type[count], params[4 * count]
+    spheres = 2,    // center0[3 * count], center1[3 * count], radius[count], material[count]
+    mesh = 3,       // vertex count, material, vertices[3 * vertex count], indices[3 * count]
+    instances = 4,  // mesh[count], offset[3 * count]
+    camera = 5      // scene_camera_record
+};
+
+struct scene_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct scene_section_header {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t bytes;  // Payload size, not counting this header
+};
+
+struct scene_mesh_header {
+    uint64_t vertex_count;
+    uint32_t material;
+    uint32_t reserved;
+};
+
+struct scene_camera_record {
+    double aspect_ratio, vfov, defocus_angle, focus_dist;
+    double lookfrom[3], lookat[3], vup[3];
+    int32_t image_width, samples_per_pixel, max_depth, reserved;
+};
+
+class scene_file_writer {
+  public:
+    explicit scene_file_writer(const std::string& path) : file(path, std::ios::binary | std::ios::trunc) {
+        if (!file)
+            throw std::runtime_error("Failed to create scene file " + path);
+        scene_file_header header{};
+        std::memcpy(header.magic, scene_file_magic, sizeof(header.magic));
+        header.version = scene_file_version;
+        write(&header, sizeof(header));
+    }
+
+    void write_section(scene_section_type type, uint64_t count, uint64_t bytes) {
+        scene_section_header header{};
+        header.type = static_cast<uint32_t>(type);
+        header.count = count;
+        header.bytes = bytes;
+        write(&header, sizeof(header));
+    }
+
+    template <typename T>
+    void write_array(const std::vector<T>& values) {
+        write(values.data(), values.size() * sizeof(T));
+    }
+
+    void write(const void* data, size_t bytes) {
+        file.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+        if (!file)
+            throw std::runtime_error("Failed to write scene file");
+    }
+
+  private:
+    std::ofstream file;
+};
+
+template <typename T>
+uint64_t scene_array_bytes(const std::vector<T>& values) {
+    return values.size() * sizeof(T);
+}
+
+inline void write_scene_binary(const std::string& path, const scene_description& scene) {
+    scene_file_writer out(path);
+
+    const auto& m = scene.materials;
+    out.write_section(scene_section_type::materials, m.size(), scene_array_bytes(m.type) + scene_array_bytes(m.params));
+    out.write_array(m.type);
+    out.write_array(m.params);
+
+    const auto& s = scene.spheres;
+    out.write_section(scene_section_type::spheres, s.size(),
+                      scene_array_bytes(s.center0) + scene_array_bytes(s.center1) +
+                      scene_array_bytes(s.radius) + scene_array_bytes(s.material));
+    out.write_array(s.center0);
+    out.write_array(s.center1);
+    out.write_array(s.radius);
+    out.write_array(s.material);
+
+    for (const auto& mesh : scene.meshes) {
+        scene_mesh_header header{};
+        header.vertex_count = mesh.vertices.size() / 3;
+        header.material = mesh.material;
+        out.write_section(scene_section_type::mesh, mesh.indices.size() / 3,
+                          sizeof(header) + scene_array_bytes(mesh.vertices) + scene_array_bytes(mesh.indices));
+        out.write(&header, sizeof(header));
+        out.write_array(mesh.vertices);
+        out.write_array(mesh.indices);
+    }
+
+    const auto& inst = scene.instances;
+    out.write_section(scene_section_type::instances, inst.size(),
+                      scene_array_bytes(inst.mesh) + scene_array_bytes(inst.offset));
+    out.write_array(inst.mesh);
+    out.write_array(inst.offset);
+
+    const auto& c = scene.camera;
+    scene_camera_record record{};
+    record.aspect_ratio = c.aspect_ratio;
+    record.vfov = c.vfov;
+    record.defocus_angle = c.defocus_angle;
+    record.focus_dist = c.focus_dist;
+    for (int a = 0; a < 3; a++) {
+        record.lookfrom[a] = c.lookfrom[a];
+        record.lookat[a] = c.lookat[a];
+        record.vup[a] = c.vup[a];
+    }
+    record.image_width = c.image_width;
+    record.samples_per_pixel = c.samples_per_pixel;
+    record.max_depth = c.max_depth;
+    out.write_section(scene_section_type::camera, 1, sizeof(record));
+    out.write(&record, sizeof(record));
+}
+
+// Streaming reader: section payloads go straight from the file into preallocated arrays, and
+// each mesh starts building its acceleration structure while the following sections are read.
+class scene_file_reader {
+  public:
+    explicit scene_file_reader(const std::string& path) : file(std::fopen(path.c_str(), "rb")) {
+        std::error_code error;
+        file_left = std::filesystem::file_size(path, error);
+        if (!file || error)
+            throw std::runtime_error("Failed to open scene file " + path);
+        scene_file_header header;
+        read(&header, sizeof(header));
+        if (std::memcmp(header.magic, scene_file_magic, sizeof(header.magic)) != 0)
+            throw std::runtime_error("Not a binary scene file: " + path);
+        if (header.version != scene_file_version)
+            throw std::runtime_error("Unsupported scene file version " + std::to_string(header.version));
+    }
+
+    ~scene_file_reader() { std::fclose(file); }
+
+    scene_file_reader(const scene_file_reader&) = delete;
+    scene_file_reader& operator=(const scene_file_reader&) = delete;
+
+    loaded_scene load(accelerator_policy policy = {}) {
+        scene_builder builder(policy);
+        scene_camera camera;
+        scene_section_header section;
+
+        // A file may only end between sections; sizes are checked against what is left of it
+        // before anything is read or skipped.
+        while (file_left > 0) {
+            read(&section, sizeof(section));
+            if (section.bytes > file_left)
+                throw std::runtime_error("Scene section runs past the end of the file");
+            section_left = section.bytes;
+            auto n = static_cast<size_t>(section.count);
+
+            switch (static_cast<scene_section_type>(section.type)) {
+                case scene_section_type::materials: {
+                    scene_materials materials;
+                    read_array(materials.type, n);
+                    read_array(materials.params, 4 * n);
+                    builder.add_materials(materials);
+                    break;
+                }
+                case scene_section_type::spheres: {
+                    scene_spheres spheres;
+                    read_array(spheres.center0, 3 * n);
+                    read_array(spheres.center1, 3 * n);
+                    read_array(spheres.radius, n);
+                    read_array(spheres.material, n);
+                    builder.add_spheres(spheres);
+                    break;
+                }
+                case scene_section_type::mesh: {
+                    scene_mesh_header header;
+                    read_section(&header, sizeof(header));
+                    scene_mesh mesh;
+                    mesh.material = header.material;
+                    read_array(mesh.vertices, 3 * static_cast<size_t>(header.vertex_count));
+                    read_array(mesh.indices, 3 * n);
+                    builder.add_mesh(std::move(mesh));
+                    break;
+                }
+                case scene_section_type::instances: {
+                    scene_instances instances;
+                    read_array(instances.mesh, n);
+                    read_array(instances.offset, 3 * n);
+                    builder.add_instances(instances);
+                    break;
+                }
+                case scene_section_type::camera: {
+                    scene_camera_record record;
+                    read_section(&record, sizeof(record));
+                    auto& c = camera;
+                    c.aspect_ratio = record.aspect_ratio;
+                    c.vfov = record.vfov;
+                    c.defocus_angle = record.defocus_angle;
+                    c.focus_dist = record.focus_dist;
+                    c.lookfrom = point3(record.lookfrom[0], record.lookfrom[1], record.lookfrom[2]);
+                    c.lookat = point3(record.lookat[0], record.lookat[1], record.lookat[2]);
+                    c.vup = vec3(record.vup[0], record.vup[1], record.vup[2]);
+                    c.image_width = record.image_width;
+                    c.samples_per_pixel = record.samples_per_pixel;
+                    c.max_depth = record.max_depth;
+                    break;
+                }
+                default:
+                    break;
+            }
+            skip(section_left);
+        }
+
+        auto scene = builder.finish();
+        scene.camera = camera;
+        return scene;
+    }
+
+  private:
+    std::FILE* file;
+    uint64_t file_left = 0;
+    uint64_t section_left = 0;
+
+    void read(void* data, size_t bytes) {
+        if (bytes > file_left || (bytes > 0 && std::fread(data, 1, bytes, file) != bytes))
+            throw std::runtime_error("Unexpected end of scene file");
+        file_left -= bytes;
+    }
+
+    void read_section(void* data, size_t bytes) {
+        if (bytes > section_left)
+            throw std::runtime_error("Scene section is shorter than its contents");
+        read(data, bytes);
+        section_left -= bytes;
+    }
+
+    template <typename T>
+    void read_array(std::vector<T>& values, size_t count) {
+        if (count > section_left / sizeof(T))
+            throw std::runtime_error("Scene section is shorter than its contents");
+        values.resize(count);
+        read_section(values.data(), count * sizeof(T));
+    }
+
+    void skip(uint64_t bytes) {
+        if (bytes > file_left)
+            throw std::runtime_error("Unexpected end of scene file");
+        file_left -= bytes;
+        while (bytes > 0) {
+            auto step = static_cast<long>(std::min<uint64_t>(bytes, 1u << 30));
+            if (std::fseek(file, step, SEEK_CUR) != 0)
+                throw std::runtime_error("Failed to skip scene section");
+            bytes -= step;
+        }
+    }
+};
+
+inline bool is_binary_scene_file(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[sizeof(scene_file_magic)] = {};
+    file.read(magic, sizeof(magic));
+    return file && std::memcmp(magic, scene_file_magic, sizeof(magic)) == 0;
+}
+
+// Loads a binary or text scene file.
+inline loaded_scene load_scene(const std::string& path, accelerator_policy policy = {}) {
+    trace_scope trace("load_scene", "scene");
+    if (is_binary_scene_file(path))
+        return scene_file_reader(path).load(policy);
+
+    std::ifstream file(path);
+    if (!file)
+        throw std::runtime_error("Failed to open scene file " + path);
+    return build_scene(parse_scene_text(file), policy);
+}
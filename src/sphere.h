@@ -1,6 +1,7 @@
 #pragma once
 
 #include "hittable.h"
+#include "stats.h"
 #include "vec3.h"
 
 class sphere : public hittable {
@@ -28,6 +29,7 @@ class sphere : public hittable {
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        RT_STAT_INC(primitive_tests);
         point3 center = is_moving ? sphere_center(r.time()) : center1;
         vec3 oc = r.origin() - center;
         auto a = r.direction().length_squared();
@@ -52,6 +54,7 @@ class sphere : public hittable {
         vec3 outward_normal = (rec.p - center) / radius;
         rec.set_face_normal(r, outward_normal);
         rec.mat = mat;
+        rec.object_id = object_id;
 
         return true;
     }
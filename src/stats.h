@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Render counters and per-stage timers. They are only collected when RT_ENABLE_STATS is
+// defined; otherwise the RT_STAT_* macros expand to nothing and cost nothing. Every thread
+// counts into its own thread_local record, merged when the thread exits or when
+// collect_render_stats() is called after a render.
+
+enum class stat_counter {
+    primary_rays,
+    secondary_rays,
+    bvh_node_visits,
+    grid_cell_visits,
+    primitive_tests,
+    lambertian_hits,
+    metal_hits,
+    dielectric_hits,
+    count
+};
+
+enum class stat_stage {
+    ray_generation,
+    traversal,
+    shading,
+    output,
+    count
+};
+
+static constexpr size_t stat_path_length_bins = 64;  // The last bin holds longer paths too
+
+inline const char* stat_counter_name(stat_counter c) {
+    static const char* names[] = {"primary_rays", "secondary_rays", "bvh_node_visits", "grid_cell_visits",
+                                  "primitive_tests", "lambertian_hits", "metal_hits", "dielectric_hits"};
+    return names[static_cast<size_t>(c)];
+}
+
+inline const char* stat_stage_name(stat_stage s) {
+    static const char* names[] = {"ray_generation", "traversal", "shading", "output"};
+    return names[static_cast<size_t>(s)];
+}
+
+struct render_stats {
+    std::array<uint64_t, static_cast<size_t>(stat_counter::count)> counters{};
+    std::array<uint64_t, static_cast<size_t>(stat_stage::count)> stage_nanoseconds{};
+    std::array<uint64_t, stat_path_length_bins> path_lengths{};  // Paths by number of bounces
+
+    uint64_t operator[](stat_counter c) const { return counters[static_cast<size_t>(c)]; }
+
+    void add(const render_stats& other) {
+        for (size_t i = 0; i < counters.size(); ++i)
+            counters[i] += other.counters[i];
+        for (size_t i = 0; i < stage_nanoseconds.size(); ++i)
+            stage_nanoseconds[i] += other.stage_nanoseconds[i];
+        for (size_t i = 0; i < path_lengths.size(); ++i)
+            path_lengths[i] += other.path_lengths[i];
+    }
+};
+
+inline void write_render_stats_json(std::ostream& out, const render_stats& stats) {
+    out << "{\n  \"counters\": {";
+    for (size_t i = 0; i < stats.counters.size(); ++i) {
+        out << (i ? ", " : "") << "\"" << stat_counter_name(static_cast<stat_counter>(i)) << "\": "
+            << stats.counters[i];
+    }
+    out << "},\n  \"stage_seconds\": {";
+    for (size_t i = 0; i < stats.stage_nanoseconds.size(); ++i) {
+        out << (i ? ", " : "") << "\"" << stat_stage_name(static_cast<stat_stage>(i)) << "\": "
+            << stats.stage_nanoseconds[i] * 1e-9;
+    }
+    out << "},\n  \"path_lengths\": [";
+    for (size_t i = 0; i < stats.path_lengths.size(); ++i)
+        out << (i ? ", " : "") << stats.path_lengths[i];
+    out << "]\n}\n";
+}
+
+#ifdef RT_ENABLE_STATS
+
+class render_stats_registry {
+  public:
+    static render_stats_registry& instance() {
+        static render_stats_registry registry;
+        return registry;
+    }
+
+    void attach(render_stats* stats) {
+        std::lock_guard<std::mutex> lock(mutex);
+        live.push_back(stats);
+    }
+
+    void detach(render_stats* stats) {
+        std::lock_guard<std::mutex> lock(mutex);
+        retired.add(*stats);
+        for (auto& s : live) {
+            if (s == stats) {
+                s = live.back();
+                live.pop_back();
+                break;
+            }
+        }
+    }
+
+    // Counts of exited threads plus those of live ones, which must not be rendering.
+    render_stats collect() {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto total = retired;
+        for (auto s : live)
+            total.add(*s);
+        return total;
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        retired = render_stats();
+        for (auto s : live)
+            *s = render_stats();
+    }
+
+  private:
+    std::mutex mutex;
+    std::vector<render_stats*> live;
+    render_stats retired;
+};
+
+struct thread_render_stats {
+    render_stats stats;
+    thread_render_stats() { render_stats_registry::instance().attach(&stats); }
+    ~thread_render_stats() { render_stats_registry::instance().detach(&stats); }
+};
+
+inline render_stats& local_render_stats() {
+    thread_local thread_render_stats local;
+    return local.stats;
+}
+
+class stat_stage_timer {
+  public:
+    explicit stat_stage_timer(stat_stage _stage) : stage(_stage), start(std::chrono::steady_clock::now()) {}
+
+    ~stat_stage_timer() {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        local_render_stats().stage_nanoseconds[static_cast<size_t>(stage)] += static_cast<uint64_t>(ns.count());
+    }
+
+  private:
+    stat_stage stage;
+    std::chrono::steady_clock::time_point start;
+};
+
+inline const render_stats& current_thread_stats() { return local_render_stats(); }
+
+inline render_stats collect_render_stats() { return render_stats_registry::instance().collect(); }
+inline void reset_render_stats() { render_stats_registry::instance().reset(); }
+
+#define RT_STAT_CONCAT_(a, b) a##b
+#define RT_STAT_CONCAT(a, b) RT_STAT_CONCAT_(a, b)
+#define RT_STAT_ADD(counter, n) (local_render_stats().counters[static_cast<size_t>(stat_counter::counter)] += (n))
+#define RT_STAT_PATH_LENGTH(bounces) \
+    (local_render_stats().path_lengths[std::min<size_t>(static_cast<size_t>(bounces), stat_path_length_bins - 1)]++)
+#define RT_STAT_TIMER(stage) stat_stage_timer RT_STAT_CONCAT(rt_stat_timer_, __LINE__)(stat_stage::stage)
+
+#else
+
+inline const render_stats& current_thread_stats() {
+    static const render_stats none;
+    return none;
+}
+
+inline render_stats collect_render_stats() { return render_stats(); }
+inline void reset_render_stats() {}
+
+#define RT_STAT_ADD(counter, n) ((void)0)
+#define RT_STAT_PATH_LENGTH(bounces) ((void)0)
+#define RT_STAT_TIMER(stage) ((void)0)
+
+#endif
+
+#define RT_STAT_INC(counter) RT_STAT_ADD(counter, 1)
+
+// Writes the merged counters as JSON, when they are collected at all.
+inline void dump_render_stats(std::ostream& out) {
+#ifdef RT_ENABLE_STATS
+    write_render_stats_json(out, collect_render_stats());
+#else
+    (void)out;
+#endif
+}
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Timeline of scoped events in the Chrome Trace Event format, to be opened in chrome://tracing
+// or Perfetto. Recording is off until trace_start(); a disabled trace_scope costs one relaxed
+// atomic load. Every thread appends to its own buffer without locks. Buffers are chains of
+// fixed-size blocks: only the owning thread writes, and it publishes each event by bumping the
+// block's count. Event names and categories must be string literals, only their pointers are
+// stored. Events timed elsewhere, like GPU passes, go to a track of their own with record_gpu().
+
+struct trace_event {
+    const char* name;
+    const char* category;
+    int64_t begin_ns;
+    int64_t end_ns;
+    int64_t arg;  // Written as args.id unless negative
+};
+
+class trace_buffer {
+  public:
+    static constexpr size_t block_events = 4096;
+
+    explicit trace_buffer(uint32_t _thread_id) : thread_id(_thread_id), head(new block), tail(head) {}
+
+    ~trace_buffer() {
+        for (auto b = head; b;) {
+            auto next = b->next.load(std::memory_order_relaxed);
+            delete b;
+            b = next;
+        }
+    }
+
+    trace_buffer(const trace_buffer&) = delete;
+    trace_buffer& operator=(const trace_buffer&) = delete;
+
+    // Owning thread only.
+    void append(const trace_event& event) {
+        auto count = tail->count.load(std::memory_order_relaxed);
+        if (count == block_events) {
+            auto b = new block;
+            tail->next.store(b, std::memory_order_release);
+            tail = b;
+            count = 0;
+        }
+        tail->events[count] = event;
+        tail->count.store(count + 1, std::memory_order_release);
+    }
+
+    // Any thread; sees every event published before the call.
+    template <typename F>
+    void for_each(F&& fn) const {
+        for (auto b = head; b; b = b->next.load(std::memory_order_acquire)) {
+            auto count = b->count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < count; ++i)
+                fn(b->events[i]);
+        }
+    }
+
+    const uint32_t thread_id;
+
+  private:
+    struct block {
+        trace_event events[block_events];
+        std::atomic<size_t> count{0};
+        std::atomic<block*> next{nullptr};
+    };
+
+    block* head;
+    block* tail;
+};
+
+class trace_recorder {
+  public:
+    static trace_recorder& instance() {
+        static trace_recorder recorder;
+        return recorder;
+    }
+
+    bool enabled() const { return recording.load(std::memory_order_relaxed); }
+
+    // Drops events of an earlier session and starts recording.
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex);
+        generation++;
+        buffers.clear();
+        gpu_buffer = std::make_shared<trace_buffer>(gpu_thread_id);
+        origin_ns.store(clock_ns(), std::memory_order_relaxed);
+        recording.store(true, std::memory_order_release);
+    }
+
+    void stop() { recording.store(false, std::memory_order_release); }
+
+    int64_t now_ns() const { return clock_ns() - origin_ns.load(std::memory_order_relaxed); }
+
+    void record(const trace_event& event) { local_buffer().append(event); }
+
+    // An event of the GPU timeline, already converted to now_ns() time. Any thread. Dropped,
+    // without taking the lock, while recording is off.
+    void record_gpu(const trace_event& event) {
+        if (!enabled())
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (gpu_buffer)
+            gpu_buffer->append(event);
+    }
+
+    void write_json(std::ostream& out) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        bool first = true;
+        auto write_buffer = [&](const trace_buffer& buffer) {
+            buffer.for_each([&](const trace_event& e) {
+                out << (first ? "" : ",\n") << "{\"name\": \"" << e.name << "\", \"cat\": \"" << e.category
+                    << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer.thread_id
+                    << ", \"ts\": " << e.begin_ns / 1000.0 << ", \"dur\": " << (e.end_ns - e.begin_ns) / 1000.0;
+                if (e.arg >= 0)
+                    out << ", \"args\": {\"id\": " << e.arg << "}";
+                out << "}";
+                first = false;
+            });
+        };
+        for (const auto& buffer : buffers)
+            write_buffer(*buffer);
+        if (gpu_buffer) {
+            bool any = false;
+            gpu_buffer->for_each([&any](const trace_event&) { any = true; });
+            if (any) {
+                out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+                    << gpu_thread_id << ", \"args\": {\"name\": \"GPU\"}}";
+                first = false;
+                write_buffer(*gpu_buffer);
+            }
+        }
+        out << "\n]}\n";
+    }
+
+    size_t event_count() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t count = 0;
+        for (const auto& buffer : buffers)
+            buffer->for_each([&count](const trace_event&) { count++; });
+        if (gpu_buffer)
+            gpu_buffer->for_each([&count](const trace_event&) { count++; });
+        return count;
+    }
+
+  private:
+    static int64_t clock_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Buffers outlive their threads, so tile workers' events survive until the trace is written.
+    trace_buffer& local_buffer() {
+        thread_local std::shared_ptr<trace_buffer> buffer;
+        thread_local uint64_t buffer_generation = 0;
+        if (!buffer || buffer_generation != generation.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            buffer = std::make_shared<trace_buffer>(static_cast<uint32_t>(buffers.size()));
+            buffer_generation = generation.load(std::memory_order_relaxed);
+            buffers.push_back(buffer);
+        }
+        return *buffer;
+    }
+
+    mutable std::mutex mutex;
+    std::atomic<bool> recording{false};
+    std::atomic<uint64_t> generation{0};
+    std::atomic<int64_t> origin_ns{clock_ns()};
+    std::vector<std::shared_ptr<trace_buffer>> buffers;
+    std::shared_ptr<trace_buffer> gpu_buffer;
+
+    static constexpr uint32_t gpu_thread_id = 1u << 16;  // Clear of the CPU threads
+};
+
+inline void trace_start() { trace_recorder::instance().start(); }
+
+inline void trace_stop() { trace_recorder::instance().stop(); }
+
+inline bool write_trace(const std::string& path) {
+    std::ofstream out(path);
+    trace_recorder::instance().write_json(out);
+    return static_cast<bool>(out);
+}
+
+// Records the lifetime of the scope as one event.
+class trace_scope {
+  public:
+    explicit trace_scope(const char* _name, const char* _category = "render", int64_t _arg = -1) {
+        auto& recorder = trace_recorder::instance();
+        if (!recorder.enabled())
+            return;
+        event = {_name, _category, recorder.now_ns(), 0, _arg};
+        active = true;
+    }
+
+    ~trace_scope() {
+        if (!active)
+            return;
+        auto& recorder = trace_recorder::instance();
+        event.end_ns = recorder.now_ns();
+        recorder.record(event);
+    }
+
+    trace_scope(const trace_scope&) = delete;
+    trace_scope& operator=(const trace_scope&) = delete;
+
+  private:
+    trace_event event{};
+    bool active = false;
+};
+
+// Records from construction to destruction and writes the trace to `path`; does nothing for an
+// empty path.
+class trace_session {
+  public:
+    explicit trace_session(std::string _path) : path(std::move(_path)) {
+        if (!path.empty())
+            trace_start();
+    }
+
+    ~trace_session() {
+        if (path.empty())
+            return;
+        trace_stop();
+        if (!write_trace(path))
+            std::clog << "Failed to write trace " << path << std::endl;
+    }
+
+    trace_session(const trace_session&) = delete;
+    trace_session& operator=(const trace_session&) = delete;
+
+  private:
+    std::string path;
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "hittable.h"
+#include "stats.h"
+#include "vec3.h"
+
+class triangle : public hittable {
+  public:
+    triangle(const point3& _v0, const point3& _v1, const point3& _v2, shared_ptr<material> _material)
+      : v0(_v0), e1(_v1 - _v0), e2(_v2 - _v0), mat(_material)
+    {
+        normal = unit_vector(cross(e1, e2));
+        bbox = aabb(aabb(_v0, _v1), aabb(_v2, _v2)).pad();
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        RT_STAT_INC(primitive_tests);
+        // Moller-Trumbore: solve for the barycentric coordinates and t at once.
+        vec3 pvec = cross(r.direction(), e2);
+        auto det = dot(e1, pvec);
+        if (fabs(det) < 1e-12)
+            return false;
+
+        auto inv_det = 1 / det;
+        vec3 tvec = r.origin() - v0;
+        auto u = dot(tvec, pvec) * inv_det;
+        if (u < 0 || u > 1)
+            return false;
+
+        vec3 qvec = cross(tvec, e1);
+        auto v = dot(r.direction(), qvec) * inv_det;
+        if (v < 0 || u + v > 1)
+            return false;
+
+        auto t = dot(e2, qvec) * inv_det;
+        if (!ray_t.surrounds(t))
+            return false;
+
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.set_face_normal(r, normal);
+        rec.mat = mat;
+        rec.object_id = object_id;
+
+        return true;
+    }
+
+  private:
+    point3 v0;
+    vec3 e1, e2;
+    vec3 normal;
+    shared_ptr<material> mat;
+    aabb bbox;
+};
@@ -0,0 +1,388 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "buffer_base.h"
+#include "texture.h"
+#include "upload_batch.h"
+
+namespace VulkanImpl
+{
+
+// Streams textures in behind the running frames. Worker threads read and decode the files; poll(),
+// called once a frame, records the uploads of what was decoded on the transfer queue and swaps
+// in the textures whose uploads completed. With a dedicated transfer family the images are
+// released by it and acquired by the graphics family, and a timeline semaphore orders the two
+// submits and tells when a batch is done, so the frame loop never waits for an upload. Without
+// timeline semaphores decoded textures are uploaded through an UploadBatch inside poll().
+// Frames in flight may still sample the images a swap replaced, so the caller releases them
+// once the descriptor sets of all swap chain images point at the new ones.
+class AssetStreamer : public BufferBase {
+public:
+    AssetStreamer(Device &device, unsigned threads) : BufferBase(device) {
+        _transfer_pool = create_command_pool(_device.transfer_family());
+        _graphics_pool = create_command_pool(_device.graphics_family());
+
+        if (_device.timeline_semaphores()) {
+            VkSemaphoreTypeCreateInfo typeInfo{};
+            typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+            typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+            typeInfo.initialValue = 0;
+            VkSemaphoreCreateInfo semaphoreInfo{};
+            semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+            semaphoreInfo.pNext = &typeInfo;
+            if (vkCreateSemaphore(_device.device(), &semaphoreInfo, nullptr, &_timeline) != VK_SUCCESS)
+            {
+                LOG_AND_THROW(std::runtime_error("failed to create timeline semaphore!"));
+            }
+        }
+
+        for (unsigned i = 0; i < std::max(threads, 1u); ++i) {
+            _workers.emplace_back([this] { decode_loop(); });
+        }
+    }
+
+    ~AssetStreamer() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _jobs_ready.notify_all();
+        for (auto &worker : _workers) {
+            worker.join();
+        }
+
+        if (!_batches.empty()) {
+            vkDeviceWaitIdle(_device.device());
+        }
+        for (auto &batch : _batches) {
+            release(batch);
+        }
+        _uploads.reset();
+        if (_timeline != VK_NULL_HANDLE) {
+            vkDestroySemaphore(_device.device(), _timeline, nullptr);
+        }
+        vkDestroyCommandPool(_device.device(), _graphics_pool, nullptr);
+        vkDestroyCommandPool(_device.device(), _transfer_pool, nullptr);
+    }
+
+    // Queues the file of the texture for decoding. The texture must outlive the streamer.
+    void request(Texture &texture) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _jobs.push_back(&texture);
+        }
+        ++_pending;
+        _jobs_ready.notify_one();
+    }
+
+    // Uploads what the workers decoded and swaps in the textures whose uploads completed. Returns
+    // whether any texture got a new image; the descriptors pointing at it need an update then.
+    // The replaced images are kept until release_replaced_images(), nothing is waited for here.
+    bool poll() {
+        std::vector<Decoded> decoded;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            decoded.swap(_decoded);
+        }
+        std::vector<Texture *> uploaded;
+        if (!decoded.empty()) {
+            if (_timeline != VK_NULL_HANDLE) {
+                submit(decoded);
+            } else {
+                uploaded = upload(decoded);
+            }
+        }
+
+        std::vector<Batch> completed;
+        if (!_batches.empty()) {
+            uint64_t value = 0;
+            vkGetSemaphoreCounterValue(_device.device(), _timeline, &value);
+            while (!_batches.empty() && _batches.front().ready_value <= value) {
+                completed.push_back(std::move(_batches.front()));
+                _batches.pop_front();
+            }
+        }
+        for (auto &batch : completed) {
+            uploaded.insert(uploaded.end(), batch.textures.begin(), batch.textures.end());
+        }
+        if (uploaded.empty()) {
+            return false;
+        }
+
+        for (auto texture : uploaded) {
+            texture->swap_staged_image();
+        }
+        _replaced.insert(_replaced.end(), uploaded.begin(), uploaded.end());
+        for (auto &batch : completed) {
+            release(batch);
+        }
+        _pending -= uploaded.size();
+        _streamed += uploaded.size();
+        if (idle()) {
+            _uploads.reset();  // Its staging ring isn't needed until more textures are requested
+        }
+        return true;
+    }
+
+    // Frees the images the swapped in textures replaced. Call it once every descriptor set was
+    // pointed at the new images and the frames that used the old sets have completed.
+    void release_replaced_images() {
+        for (auto texture : _replaced) {
+            texture->release_replaced_image();
+        }
+        _replaced.clear();
+    }
+
+    // Whether every requested texture was streamed in or failed to decode.
+    bool idle() const {
+        return _pending == 0;
+    }
+
+    size_t streamed_count() const {
+        return _streamed;
+    }
+
+private:
+    AssetStreamer(const AssetStreamer &) = delete;
+    AssetStreamer &operator=(const AssetStreamer &) = delete;
+
+    struct Decoded {
+        Texture *texture;
+        TexturePixels pixels;
+    };
+
+    struct Batch {
+        uint64_t ready_value = 0;
+        VkCommandBuffer transfer_commands = VK_NULL_HANDLE;
+        VkCommandBuffer acquire_commands = VK_NULL_HANDLE;
+        std::vector<std::pair<VkBuffer, Allocation>> staging;
+        std::vector<Texture *> textures;
+    };
+
+    VkCommandPool create_command_pool(uint32_t family) {
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        poolInfo.queueFamilyIndex = family;
+        VkCommandPool pool;
+        if (vkCreateCommandPool(_device.device(), &poolInfo, nullptr, &pool) != VK_SUCCESS)
+        {
+            LOG_AND_THROW(std::runtime_error("failed to create streaming command pool!"));
+        }
+        return pool;
+    }
+
+    // A command buffer of the pool, recording for one submit. release() frees it.
+    VkCommandBuffer begin_commands(VkCommandPool pool) {
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandPool = pool;
+        allocInfo.commandBufferCount = 1;
+        VkCommandBuffer commands;
+        if (vkAllocateCommandBuffers(_device.device(), &allocInfo, &commands) != VK_SUCCESS)
+        {
+            LOG_AND_THROW(std::runtime_error("failed to allocate streaming command buffer!"));
+        }
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (vkBeginCommandBuffer(commands, &beginInfo) != VK_SUCCESS)
+        {
+            LOG_AND_THROW(std::runtime_error("vkBeginCommandBuffer failed"));
+        }
+        return commands;
+    }
+
+    void decode_loop() {
+        for (;;) {
+            Texture *texture;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _jobs_ready.wait(lock, [this] { return _stop || !_jobs.empty(); });
+                if (_stop) {
+                    return;
+                }
+                texture = _jobs.front();
+                _jobs.pop_front();
+            }
+
+            Decoded result{texture, {}};
+            try {
+                result.pixels = Texture::decode(texture->file());
+            } catch (const std::exception &e) {
+                std::cerr << e.what() << ", keeping the placeholder" << std::endl;
+                --_pending;
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(_mutex);
+            _decoded.push_back(std::move(result));
+        }
+    }
+
+    static VkImageMemoryBarrier image_barrier(VkImage image, VkImageLayout old_layout, VkImageLayout new_layout,
+                                              VkAccessFlags src_access, VkAccessFlags dst_access,
+                                              uint32_t src_family = VK_QUEUE_FAMILY_IGNORED, uint32_t dst_family = VK_QUEUE_FAMILY_IGNORED) {
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.oldLayout = old_layout;
+        barrier.newLayout = new_layout;
+        barrier.srcAccessMask = src_access;
+        barrier.dstAccessMask = dst_access;
+        barrier.srcQueueFamilyIndex = src_family;
+        barrier.dstQueueFamilyIndex = dst_family;
+        barrier.image = image;
+        barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+        return barrier;
+    }
+
+    // Records the uploads on the transfer queue, and the acquire on the graphics queue when the
+    // images change queue family. Nothing is waited for.
+    void submit(std::vector<Decoded> &decoded) {
+        const bool transfer_ownership = _device.transfer_family() != _device.graphics_family();
+        Batch batch;
+        batch.transfer_commands = begin_commands(_transfer_pool);
+        if (transfer_ownership) {
+            batch.acquire_commands = begin_commands(_graphics_pool);
+        }
+
+        for (auto &[texture, pixels] : decoded) {
+            VkImage image = texture->stage_image(pixels.width, pixels.height);
+            batch.textures.push_back(texture);
+
+            batch.staging.emplace_back();
+            auto &[staging_buffer, staging_memory] = batch.staging.back();
+            createBuffer(pixels.pixels.size(), VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, staging_buffer, staging_memory);
+            memcpy(staging_memory.mapped, pixels.pixels.data(), pixels.pixels.size());
+
+            auto to_transfer = image_barrier(image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0, VK_ACCESS_TRANSFER_WRITE_BIT);
+            vkCmdPipelineBarrier(batch.transfer_commands, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                                 0, nullptr, 0, nullptr, 1, &to_transfer);
+
+            VkBufferImageCopy region{};
+            region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+            region.imageExtent = {pixels.width, pixels.height, 1};
+            vkCmdCopyBufferToImage(batch.transfer_commands, staging_buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+            if (transfer_ownership) {
+                // The release and the acquire must match: same layouts, same families.
+                auto release = image_barrier(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                             VK_ACCESS_TRANSFER_WRITE_BIT, 0, _device.transfer_family(), _device.graphics_family());
+                vkCmdPipelineBarrier(batch.transfer_commands, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+                                     0, nullptr, 0, nullptr, 1, &release);
+                auto acquire = image_barrier(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                             0, VK_ACCESS_SHADER_READ_BIT, _device.transfer_family(), _device.graphics_family());
+                vkCmdPipelineBarrier(batch.acquire_commands, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+                                     0, nullptr, 0, nullptr, 1, &acquire);
+            } else {
+                auto to_shader = image_barrier(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                               VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT);
+                vkCmdPipelineBarrier(batch.transfer_commands, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+                                     0, nullptr, 0, nullptr, 1, &to_shader);
+            }
+        }
+
+        uint64_t released = ++_timeline_value;
+        submit_commands(_device.transfer_queue(), batch.transfer_commands, 0, released);
+        batch.ready_value = released;
+        if (transfer_ownership) {
+            batch.ready_value = ++_timeline_value;
+            submit_commands(_device.graphics_queue(), batch.acquire_commands, released, batch.ready_value);
+        }
+        _batches.push_back(std::move(batch));
+    }
+
+    // Submits the commands, waiting for `wait_value` of the timeline first unless it is 0, and
+    // signals `signal_value`.
+    void submit_commands(VkQueue queue, VkCommandBuffer commands, uint64_t wait_value, uint64_t signal_value) {
+        if (vkEndCommandBuffer(commands) != VK_SUCCESS)
+        {
+            LOG_AND_THROW(std::runtime_error("vkEndCommandBuffer failed"));
+        }
+
+        VkTimelineSemaphoreSubmitInfo timelineInfo{};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.waitSemaphoreValueCount = wait_value != 0 ? 1 : 0;
+        timelineInfo.pWaitSemaphoreValues = &wait_value;
+        timelineInfo.signalSemaphoreValueCount = 1;
+        timelineInfo.pSignalSemaphoreValues = &signal_value;
+
+        VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.pNext = &timelineInfo;
+        submitInfo.waitSemaphoreCount = wait_value != 0 ? 1 : 0;
+        submitInfo.pWaitSemaphores = &_timeline;
+        submitInfo.pWaitDstStageMask = &wait_stage;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &commands;
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &_timeline;
+        if (vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+        {
+            LOG_AND_THROW(std::runtime_error("failed to submit streaming upload!"));
+        }
+    }
+
+    // Fallback without timeline semaphores: one batch on the graphics queue, waited for here. The
+    // batch and its staging ring are kept for the following polls while textures are streaming.
+    std::vector<Texture *> upload(std::vector<Decoded> &decoded) {
+        std::vector<Texture *> uploaded;
+        if (!_uploads) {
+            _uploads = std::make_unique<UploadBatch>(_device, _graphics_pool, _device.graphics_queue());
+        }
+        auto &uploads = *_uploads;
+        for (auto &[texture, pixels] : decoded) {
+            VkImage image = texture->stage_image(pixels.width, pixels.height);
+            uploads.copy_to_image(pixels.pixels.data(), pixels.pixels.size(), image, pixels.width, pixels.height,
+                                  VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+            uploaded.push_back(texture);
+        }
+        uploads.submit();
+        return uploaded;
+    }
+
+    void release(Batch &batch) {
+        for (auto &[buffer, memory] : batch.staging) {
+            destroyBuffer(buffer, memory);
+        }
+        vkFreeCommandBuffers(_device.device(), _transfer_pool, 1, &batch.transfer_commands);
+        if (batch.acquire_commands != VK_NULL_HANDLE) {
+            vkFreeCommandBuffers(_device.device(), _graphics_pool, 1, &batch.acquire_commands);
+        }
+    }
+
+    VkCommandPool _transfer_pool = VK_NULL_HANDLE;
+    VkCommandPool _graphics_pool = VK_NULL_HANDLE;
+    VkSemaphore _timeline = VK_NULL_HANDLE;
+    uint64_t _timeline_value = 0;
+    std::deque<Batch> _batches;  // Submitted, in timeline order
+    std::unique_ptr<UploadBatch> _uploads;  // Without timeline semaphores, while streaming
+    std::vector<Texture *> _replaced;  // Swapped, the replaced image not released yet
+    std::atomic<size_t> _pending{0};
+    size_t _streamed = 0;
+
+    std::mutex _mutex;
+    std::condition_variable _jobs_ready;
+    std::deque<Texture *> _jobs;
+    std::vector<Decoded> _decoded;
+    bool _stop = false;
+    std::vector<std::thread> _workers;
+};
+
+}  // namespace
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <vector>
+
+namespace VulkanImpl
+{
+
+// Buddy allocator over the offsets of one memory block. Allocations are rounded up to a power
+// of two, at least `min_size`, and start at a multiple of their rounded size, which covers any
+// power of two alignment not larger than the size. Freed blocks merge with their free buddy,
+// so the block doesn't fragment over time. Only offsets are managed, no memory is touched.
+class BuddyAllocator {
+public:
+    static constexpr uint64_t npos = UINT64_MAX;
+
+    // `size` and `min_size` are powers of two, min_size <= size.
+    BuddyAllocator(uint64_t size, uint64_t min_size) : _size(size), _min_size(min_size) {
+        assert(size > 0 && (size & (size - 1)) == 0);
+        assert(min_size > 0 && (min_size & (min_size - 1)) == 0 && min_size <= size);
+        int levels = 1;
+        while ((size >> (levels - 1)) > min_size) {
+            ++levels;
+        }
+        _free.resize(levels);
+        _free[0].insert(0);
+    }
+
+    // Offset of `size` bytes aligned to `alignment`, a power of two, or npos when no free block
+    // is large enough.
+    uint64_t allocate(uint64_t size, uint64_t alignment = 1) {
+        auto needed = round_up_pow2(std::max({size, alignment, _min_size}));
+        if (size == 0 || needed > _size) {
+            return npos;
+        }
+        int level = level_of(needed);
+        int from = level;
+        while (from >= 0 && _free[from].empty()) {
+            --from;
+        }
+        if (from < 0) {
+            return npos;
+        }
+
+        uint64_t offset = *_free[from].begin();
+        _free[from].erase(_free[from].begin());
+        // Split down to the requested size, keeping the lower halves.
+        while (from < level) {
+            ++from;
+            _free[from].insert(offset + level_size(from));
+        }
+
+        _allocated[offset] = {level, size};
+        _used_bytes += needed;
+        _requested_bytes += size;
+        return offset;
+    }
+
+    void free(uint64_t offset) {
+        auto it = _allocated.find(offset);
+        assert(it != _allocated.end());
+        int level = it->second.level;
+        _used_bytes -= level_size(level);
+        _requested_bytes -= it->second.requested;
+        _allocated.erase(it);
+
+        while (level > 0) {
+            auto buddy = offset ^ level_size(level);
+            auto free_buddy = _free[level].find(buddy);
+            if (free_buddy == _free[level].end()) {
+                break;
+            }
+            _free[level].erase(free_buddy);
+            offset = std::min(offset, buddy);
+            --level;
+        }
+        _free[level].insert(offset);
+    }
+
+    uint64_t size() const {
+        return _size;
+    }
+
+    bool empty() const {
+        return _allocated.empty();
+    }
+
+    size_t allocation_count() const {
+        return _allocated.size();
+    }
+
+    // Bytes of the blocks handed out, with the rounding up to powers of two.
+    uint64_t used_bytes() const {
+        return _used_bytes;
+    }
+
+    // Bytes asked for; used_bytes() - requested_bytes() is lost to internal fragmentation.
+    uint64_t requested_bytes() const {
+        return _requested_bytes;
+    }
+
+    uint64_t largest_free_block() const {
+        for (int level = 0; level < static_cast<int>(_free.size()); ++level) {
+            if (!_free[level].empty()) {
+                return level_size(level);
+            }
+        }
+        return 0;
+    }
+
+private:
+    struct Allocated {
+        int level;
+        uint64_t requested;
+    };
+
+    static uint64_t round_up_pow2(uint64_t v) {
+        uint64_t p = 1;
+        while (p < v) {
+            p <<= 1;
+        }
+        return p;
+    }
+
+    uint64_t level_size(int level) const {
+        return _size >> level;
+    }
+
+    int level_of(uint64_t block_size) const {
+        int level = 0;
+        while (level_size(level) > block_size) {
+            ++level;
+        }
+        return level;
+    }
+
+    const uint64_t _size;
+    const uint64_t _min_size;
+    std::vector<std::set<uint64_t>> _free;  // Free block offsets per level, level 0 is everything
+    std::map<uint64_t, Allocated> _allocated;
+    uint64_t _used_bytes = 0;
+    uint64_t _requested_bytes = 0;
+};
+
+}  // namespace
@@ -3,15 +3,17 @@
 namespace VulkanImpl
 {
 
-VkCommandBuffer CommandBuffers::reset_record_graphics_command_buffer(
+VkCommandBuffer CommandBuffers::record_graphics_command_buffer(
     VkFramebuffer frame_buffer,
     VkExtent2D swap_chain_extent,
     std::map<PipelineType, std::unique_ptr<Pipeline>>& pipelines,
     const VertexBuffer &vertex_buffer,
     DescriptorsManager &descriptors,
+    uint32_t uniforms_offset,
     ImageIndex image_index,
     VkClearValue background,
-    const RenderPass &render_pass)
+    const RenderPass &render_pass,
+    GpuProfiler &profiler)
 {
     assert(swap_chain_extent.height > 10);
     assert(swap_chain_extent.width > 10);
@@ -40,6 +42,7 @@ VkCommandBuffer CommandBuffers::reset_record_graphics_command_buffer(
     renderPassInfo.clearValueCount = 1;
     renderPassInfo.pClearValues = &background;
 
+    profiler.begin_pass(command_buffer, image_index, GpuPass::Graphics);
     vkCmdBeginRenderPass(command_buffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 
     vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines[PipelineType::Graphics]->pipeline());
@@ -65,11 +68,12 @@ VkCommandBuffer CommandBuffers::reset_record_graphics_command_buffer(
     vkCmdBindIndexBuffer(command_buffer, vertex_buffer.index_buffer(), 0, VK_INDEX_TYPE_UINT16);
 
     vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                            pipelines[PipelineType::Graphics]->pipeline_layout(), 0, 1, &descriptors.descriptor(image_index), 0, nullptr);
+                            pipelines[PipelineType::Graphics]->pipeline_layout(), 0, 1, &descriptors.descriptor(image_index), 1, &uniforms_offset);
 
     vkCmdDrawIndexed(command_buffer, static_cast<uint32_t>(vertex_buffer.indices_size()), 1, 0, 0, 0);
 
     vkCmdEndRenderPass(command_buffer);
+    profiler.end_pass(command_buffer, image_index, GpuPass::Graphics);
 
     if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS)
     {
@@ -143,7 +147,9 @@ void CommandBuffers::prepare_to_trace_barrier(ImageIndex current_image, VkImage
 void CommandBuffers::dispatch_raytrace(
     std::map<PipelineType, std::unique_ptr<Pipeline>> &pipelines,
     DescriptorsManager &descriptors,
-    ImageIndex image_index)
+    uint32_t uniforms_offset,
+    ImageIndex image_index,
+    VkExtent2D image_extent)
 {
     VkCommandBuffer &command_buffer = _command_buffers[static_cast<uint32_t>(image_index)];
 
@@ -151,10 +157,10 @@ void CommandBuffers::dispatch_raytrace(
     vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->pipeline());
 
     vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->pipeline_layout(), 0, 1,
-                            &descriptors.descriptor(image_index), 0, nullptr);
+                            &descriptors.descriptor(image_index), 1, &uniforms_offset);
 
-    vkCmdDispatch(command_buffer, 1, 1, 1);
-    // commandBuffer.dispatch(static_cast<uint32_t>(swapchainExtent.width / 8), static_cast<uint32_t>(swapchainExtent.height / 8), 1);
+    // One invocation per pixel, in the 8x8 work groups of ray_tracing.comp.
+    vkCmdDispatch(command_buffer, (image_extent.width + 7) / 8, (image_extent.height + 7) / 8, 1);
 }
 
 void CommandBuffers::prepare_to_present_barrier(ImageIndex image_index, VkImage image)
@@ -6,6 +6,7 @@
 #include "device.h"
 #include "descriptors_manager.h"
 #include "frame_buffers.h"
+#include "gpu_profiler.h"
 #include "ray_tracing_pipeline.h"
 #include "vertex_buffer.h"
 
@@ -56,19 +57,19 @@ namespace VulkanImpl
                 }
             }
 
-            _command_buffers.resize(static_cast<size_t>(_images_count), VK_NULL_HANDLE);
-
-            VkCommandBufferAllocateInfo allocInfo{};
-            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-            allocInfo.commandPool = _command_pool;
-            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-            allocInfo.commandBufferCount = (uint32_t)_command_buffers.size();
+            allocate_command_buffers();
+            std::clog << "Command buffers created" << std::endl;
+        }
 
-            if (vkAllocateCommandBuffers(_device.device(), &allocInfo, _command_buffers.data()) != VK_SUCCESS)
-            {
-                LOG_AND_THROW(std::runtime_error("failed to allocate command buffers!"));
+        // One command buffer per image of the new swap chain; the old ones are freed, they must
+        // not be in use.
+        void resize(ImagesCount images_count) {
+            if (!_command_buffers.empty()) {
+                vkFreeCommandBuffers(_device.device(), _command_pool, static_cast<uint32_t>(_command_buffers.size()),
+                                     _command_buffers.data());
             }
-            std::clog << "Command buffers created" << std::endl;
+            _images_count = images_count;
+            allocate_command_buffers();
         }
 
         PipelineType type() const {
@@ -98,14 +99,18 @@ namespace VulkanImpl
             return _command_pool;
         }
 
-        VkCommandBuffer reset_record_graphics_command_buffer(VkFramebuffer frame_buffer,
-                                                             VkExtent2D swap_chain_extent,
-                                                             std::map<PipelineType, std::unique_ptr<Pipeline>> &pipelines,
-                                                             const VertexBuffer &vertex_buffer,
-                                                             DescriptorsManager &descriptors,
-                                                             ImageIndex image_index,
-                                                             VkClearValue background,
-                                                             const RenderPass &render_pass);
+        // Records the render pass of the image once; the command buffer is then submitted every
+        // frame the image is presented, until the swap chain or the descriptors change.
+        VkCommandBuffer record_graphics_command_buffer(VkFramebuffer frame_buffer,
+                                                       VkExtent2D swap_chain_extent,
+                                                       std::map<PipelineType, std::unique_ptr<Pipeline>> &pipelines,
+                                                       const VertexBuffer &vertex_buffer,
+                                                       DescriptorsManager &descriptors,
+                                                       uint32_t uniforms_offset,
+                                                       ImageIndex image_index,
+                                                       VkClearValue background,
+                                                       const RenderPass &render_pass,
+                                                       GpuProfiler &profiler);
 
         VkCommandBuffer reset_record_compute_command_buffer(std::map<PipelineType, std::unique_ptr<Pipeline>> &pipelines,
                                                  DescriptorsManager &descriptors,
@@ -114,7 +119,9 @@ namespace VulkanImpl
         void prepare_to_trace_barrier(ImageIndex current_image, VkImage image);
         void dispatch_raytrace(std::map<PipelineType, std::unique_ptr<Pipeline>> &pipelines,
                                DescriptorsManager &descriptors,
-                               ImageIndex image_index);
+                               uint32_t uniforms_offset,
+                               ImageIndex image_index,
+                               VkExtent2D image_extent);
         void prepare_to_present_barrier(ImageIndex image_index, VkImage image);
         void end_command_buffer(ImageIndex image_index);
 
@@ -122,8 +129,23 @@ namespace VulkanImpl
         CommandBuffers(const CommandBuffers &) = delete;
         CommandBuffers &operator=(const CommandBuffers &) = delete;
 
+        void allocate_command_buffers() {
+            _command_buffers.assign(static_cast<size_t>(_images_count), VK_NULL_HANDLE);
+
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = _command_pool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandBufferCount = (uint32_t)_command_buffers.size();
+
+            if (vkAllocateCommandBuffers(_device.device(), &allocInfo, _command_buffers.data()) != VK_SUCCESS)
+            {
+                LOG_AND_THROW(std::runtime_error("failed to allocate command buffers!"));
+            }
+        }
+
         const Device &_device;
-        const ImagesCount _images_count;
+        ImagesCount _images_count;
         const PipelineType _type;
 
         VkCommandPool _command_pool = VK_NULL_HANDLE;
@@ -1,19 +1,29 @@
 #pragma once
 
-#include "buffer_base.h"
+#include <initializer_list>
+#include <cstring>
+#include <vector>
 
-#include "command_buffers.h"
+#include "buffer_base.h"
+#include "upload_batch.h"
 
 namespace VulkanImpl
 {
 
 class ComputeImage : public BufferBase {
 public:
-    ComputeImage(Device &device, CommandBuffers &cmd_buffers, BindingKey key)
-        : BufferBase(device), _cmd_buffers(cmd_buffers), _key(key) {}
+    ComputeImage(Device &device, BindingKey key)
+        : BufferBase(device), _key(key) {}
 
     ~ComputeImage() {
+        destroy();
+    }
 
+    // Creates the images, and later the readback buffer, anew at the current render extent. The
+    // old ones must not be in use; descriptors pointing at them have to be written again.
+    void resize(UploadBatch &uploads) {
+        destroy();
+        init(uploads);
     }
 
     VkImageView texture_image_view() const {
@@ -24,73 +34,31 @@ public:
         return _texture_image;
     }
 
-    void init() {
-        auto width = _device.swap_chain_extent().width;
-        auto height = _device.swap_chain_extent().height;
-        auto format = VK_FORMAT_R8G8B8A8_UNORM;
+    // The HDR running mean of the frames rendered since the last reset, resolved into the image
+    // above by the same dispatch.
+    VkImageView accumulation_image_view() const {
+        return _accumulation_image_view;
+    }
 
-        VkImageCreateInfo imageCreateInfo{};
-        imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-        imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
-        imageCreateInfo.format = format;
-        imageCreateInfo.extent = {width, height, 1};
-        imageCreateInfo.mipLevels = 1;
-        imageCreateInfo.arrayLayers = 1;
-        imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-        imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-        imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    // The layout transitions are recorded into `uploads`, a batch of the compute queue; the images
+    // can be used once it was submitted.
+    void init(UploadBatch &uploads) {
+        auto format = VK_FORMAT_R8G8B8A8_UNORM;
         // Image will be sampled in the fragment shader and used as storage target in the compute shader
-        imageCreateInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
-        imageCreateInfo.flags = 0;
-
-        if (vkCreateImage(_device.device(), &imageCreateInfo, nullptr, &_texture_image) != VK_SUCCESS)
-        {
-            throw std::runtime_error("failed to create compute image!");
-        }
-
-        VkMemoryAllocateInfo memAllocInfo{};
-        VkMemoryRequirements memReqs{};
-        vkGetImageMemoryRequirements(_device.device(), _texture_image, &memReqs);
-
-        memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        memAllocInfo.allocationSize = memReqs.size;
-        memAllocInfo.memoryTypeIndex = findMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-        if (vkAllocateMemory(_device.device(), &memAllocInfo, nullptr, &_texture_image_memory) != VK_SUCCESS ||
-            vkBindImageMemory(_device.device(), _texture_image, _texture_image_memory, 0) != VK_SUCCESS)
-        {
-            LOG_AND_THROW(std::runtime_error("failed to allocate vertex buffer memory!"));
+        create_storage_image(format, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                             _texture_image, _texture_image_memory, _texture_image_view);
+        // Only read and written by the compute shader, at full float precision so thousands of
+        // frames average without banding.
+        create_storage_image(VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_USAGE_STORAGE_BIT,
+                             _accumulation_image, _accumulation_image_memory, _accumulation_image_view);
+
+        // Only the compute shader writes the images, in the general layout they stay in.
+        for (auto image : {_texture_image, _accumulation_image}) {
+            uploads.transition_image(image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+                                     VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0,
+                                     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
         }
 
-        auto command_buffer = beginSingleTimeCommands(_cmd_buffers.compute_command_pool());
-
-        VkImageSubresourceRange subresourceRange = {};
-        subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        subresourceRange.baseMipLevel = 0;
-        subresourceRange.levelCount = 1;
-        subresourceRange.layerCount = 1;
-
-        // Create an image barrier object
-        VkImageMemoryBarrier imageMemoryBarrier = {};
-        imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-        imageMemoryBarrier.image = _texture_image;
-        imageMemoryBarrier.subresourceRange = subresourceRange;
-        imageMemoryBarrier.srcAccessMask = 0;
-        imageMemoryBarrier.dstAccessMask = 0;
-
-        // Put barrier inside setup command buffer
-        vkCmdPipelineBarrier(
-            command_buffer,
-            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-            0,
-            0, nullptr,
-            0, nullptr,
-            1, &imageMemoryBarrier);
-
-        endSingleTimeCommands(command_buffer, _cmd_buffers.compute_command_pool(), _device.compute_queue());
-
         // Create sampler
         VkSamplerCreateInfo sampler{};
         sampler.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
@@ -110,27 +78,136 @@ public:
         {
             LOG_AND_THROW(std::runtime_error("failed to create texture sampler!"));
         }
+    }
+
+    // Records, before the dispatch, that it waits for the previous dispatch: each frame reads the
+    // accumulation the previous one wrote, also when they come from different command buffers.
+    void record_accumulation_barrier(VkCommandBuffer command_buffer) {
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                             1, &barrier, 0, nullptr, 0, nullptr);
+    }
+
+    // Records, after the dispatch that writes the image, its copy into a host visible buffer.
+    // The image stays in the general layout.
+    void record_readback(VkCommandBuffer command_buffer) {
+        auto extent = _device.swap_chain_extent();
+        if (_readback_buffer == VK_NULL_HANDLE) {
+            createBuffer(VkDeviceSize(extent.width) * extent.height * 4, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                         _readback_buffer, _readback_buffer_memory);
+        }
+
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = _texture_image;
+        barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                             0, nullptr, 0, nullptr, 1, &barrier);
+
+        VkBufferImageCopy region{};
+        region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+        region.imageExtent = {extent.width, extent.height, 1};
+        vkCmdCopyImageToBuffer(command_buffer, _texture_image, VK_IMAGE_LAYOUT_GENERAL, _readback_buffer, 1, &region);
+
+        VkBufferMemoryBarrier host_barrier{};
+        host_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        host_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        host_barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        host_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        host_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        host_barrier.buffer = _readback_buffer;
+        host_barrier.size = VK_WHOLE_SIZE;
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+                             0, nullptr, 1, &host_barrier, 0, nullptr);
+    }
+
+    // RGBA8 rows of the image, top to bottom, as of the last completed readback.
+    std::vector<uint8_t> read_pixels() {
+        assert(_readback_buffer != VK_NULL_HANDLE);
+        auto extent = _device.swap_chain_extent();
+        std::vector<uint8_t> pixels(size_t(extent.width) * extent.height * 4);
+        memcpy(pixels.data(), _readback_buffer_memory.mapped, pixels.size());
+        return pixels;
+    }
+
+private:
+    void destroy() {
+        if (_readback_buffer != VK_NULL_HANDLE) {
+            destroyBuffer(_readback_buffer, _readback_buffer_memory);
+        }
+        if (_texture_image != VK_NULL_HANDLE) {
+            vkDestroySampler(_device.device(), _texture_sampler, nullptr);
+            vkDestroyImageView(_device.device(), _texture_image_view, nullptr);
+            vkDestroyImage(_device.device(), _texture_image, nullptr);
+            _device.allocator().free(_texture_image_memory);
+            _texture_image = VK_NULL_HANDLE;
+        }
+        if (_accumulation_image != VK_NULL_HANDLE) {
+            vkDestroyImageView(_device.device(), _accumulation_image_view, nullptr);
+            vkDestroyImage(_device.device(), _accumulation_image, nullptr);
+            _device.allocator().free(_accumulation_image_memory);
+            _accumulation_image = VK_NULL_HANDLE;
+        }
+    }
+
+    // An image of the render extent, with its memory and view, not yet in the general layout.
+    void create_storage_image(VkFormat format, VkImageUsageFlags usage, VkImage &image, Allocation &memory, VkImageView &view) {
+        auto width = _device.swap_chain_extent().width;
+        auto height = _device.swap_chain_extent().height;
+
+        VkImageCreateInfo imageCreateInfo{};
+        imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+        imageCreateInfo.format = format;
+        imageCreateInfo.extent = {width, height, 1};
+        imageCreateInfo.mipLevels = 1;
+        imageCreateInfo.arrayLayers = 1;
+        imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+        imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        imageCreateInfo.usage = usage;
+        imageCreateInfo.flags = 0;
+
+        if (vkCreateImage(_device.device(), &imageCreateInfo, nullptr, &image) != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to create compute image!");
+        }
+
+        memory = _device.allocator().allocate_image_memory(image, VK_IMAGE_TILING_OPTIMAL, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
         // Create image view
-        VkImageViewCreateInfo view{};
-        view.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-        view.viewType = VK_IMAGE_VIEW_TYPE_2D;
-        view.format = format;
-        view.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
-        view.image = _texture_image;
-        if (vkCreateImageView(_device.device(), &view, nullptr, &_texture_image_view) != VK_SUCCESS)
+        VkImageViewCreateInfo viewInfo{};
+        viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        viewInfo.format = format;
+        viewInfo.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+        viewInfo.image = image;
+        if (vkCreateImageView(_device.device(), &viewInfo, nullptr, &view) != VK_SUCCESS)
         {
             LOG_AND_THROW(std::runtime_error("failed to create image view!"));
         }
     }
 
-private:
     const BindingKey _key;
-    const CommandBuffers& _cmd_buffers;
-    VkImage _texture_image;
-    VkDeviceMemory _texture_image_memory;
-    VkImageView _texture_image_view;
-    VkSampler _texture_sampler;
+    VkImage _texture_image = VK_NULL_HANDLE;
+    Allocation _texture_image_memory;
+    VkImageView _texture_image_view = VK_NULL_HANDLE;
+    VkSampler _texture_sampler = VK_NULL_HANDLE;
+    VkImage _accumulation_image = VK_NULL_HANDLE;
+    Allocation _accumulation_image_memory;
+    VkImageView _accumulation_image_view = VK_NULL_HANDLE;
+    VkBuffer _readback_buffer = VK_NULL_HANDLE;
+    Allocation _readback_buffer_memory;
 };
 
 }  // namespace
@@ -2,68 +2,88 @@
 
 #include <vulkan/vulkan.h>
 
+#include <algorithm>
+#include <cstring>
+#include <iostream>
 #include <vector>
 
 #include "buffer_base.h"
+#include "upload_batch.h"
 #include "vertex.h"
 
 namespace VulkanImpl
 {
 
-template<typename T, size_t MAX>
+// Array of up to `capacity` objects in a device local storage buffer, laid out as
+// `buffer { int count; T objects[]; }` in std430, with the objects 16 byte aligned.
+template<typename T>
 class DataBuffer : public BufferBase {
 public:
-    DataBuffer(Device &device) : BufferBase(device) {
-        _data.count = 0;
+    DataBuffer(Device &device, size_t capacity) : BufferBase(device), _capacity(capacity) {
+        _objects.reserve(capacity);
     }
 
     ~DataBuffer() {
-        vkDestroyBuffer(_device.device(), _data_buffer, nullptr);
-        vkFreeMemory(_device.device(), _data_buffer_memory, nullptr);
+        destroyBuffer(_data_buffer, _data_buffer_memory);
     }
 
-    void init(VkCommandPool command_pool)
+    void init(UploadBatch &uploads)
     {
-        VkDeviceSize bufferSize = sizeof(Data);
+        createBuffer(buffer_size(), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            _data_buffer, _data_buffer_memory);
+        upload(uploads);
+    }
 
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+    // Records the copy of the count and the objects to the device. The buffer must not be in use
+    // by the GPU until the batch is submitted.
+    void upload(UploadBatch &uploads)
+    {
+        int32_t count = static_cast<int32_t>(_objects.size());
+        uploads.copy_to_buffer(&count, sizeof(count), _data_buffer);
+        uploads.copy_to_buffer(_objects.data(), _objects.size() * sizeof(T), _data_buffer, s_objects_offset);
+    }
 
-        void *data;
-        vkMapMemory(_device.device(), stagingBufferMemory, 0, bufferSize, 0, &data);
-        memcpy(data, static_cast<void*>(&_data), (size_t)bufferSize);
-        vkUnmapMemory(_device.device(), stagingBufferMemory);
+    void append(const T &obj) {
+        if (_objects.size() < _capacity) {
+            _objects.push_back(obj);
+        } else {
+            std::cerr << "DataBuffer is full, object dropped" << std::endl;
+        }
+    }
 
-        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-            _data_buffer, _data_buffer_memory);
+    void clear() {
+        _objects.clear();
+    }
 
-        copyBuffer(stagingBuffer, _data_buffer, bufferSize, command_pool);
+    size_t size() const {
+        return _objects.size();
+    }
 
-        vkDestroyBuffer(_device.device(), stagingBuffer, nullptr);
-        vkFreeMemory(_device.device(), stagingBufferMemory, nullptr);
+    size_t capacity() const {
+        return _capacity;
     }
 
-    void append(T obj) {
-        if (_data.count < MAX) {
-            _data.objects[_data.count] = obj;
-            ++_data.count;
-        }
+    VkDescriptorBufferInfo descriptor_info() const {
+        return VkDescriptorBufferInfo{_data_buffer, 0, buffer_size()};
     }
 
 private:
-    struct Data {
-        alignas(4)  int count;
-        alignas(16) T objects[MAX];
-    };
+    static constexpr VkDeviceSize s_objects_offset = 16;
+    static_assert(alignof(T) <= s_objects_offset, "objects must fit the 16 byte alignment");
 
     DataBuffer(const DataBuffer &) = delete;
     DataBuffer &operator=(const DataBuffer &) = delete;
 
-    VkBuffer _data_buffer;
-    VkDeviceMemory _data_buffer_memory;
+    VkDeviceSize buffer_size() const {
+        // Never empty, a zero sized buffer can't be created.
+        return s_objects_offset + std::max<size_t>(_capacity, 1) * sizeof(T);
+    }
+
+    VkBuffer _data_buffer = VK_NULL_HANDLE;
+    Allocation _data_buffer_memory;
 
-    Data _data;
+    const size_t _capacity;
+    std::vector<T> _objects;
 };
 
 } // namespace
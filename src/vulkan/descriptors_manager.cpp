@@ -19,11 +19,23 @@ DescriptorsManager::~DescriptorsManager() {
 }
 
 void DescriptorsManager::init(
-    const std::vector<std::unique_ptr<Texture>> &textures, const ComputeImage& computeImg, const UniformBuffers &uniformBuffers)
+    const std::vector<std::unique_ptr<Texture>> &textures, const ComputeImage& computeImg, const UniformBuffers &uniformBuffers,
+    const std::map<BindingKey, VkDescriptorBufferInfo> &storage_buffers)
 {
     init_pool();
     init_layout();
-    init_descriptors(textures, computeImg, uniformBuffers);
+    init_descriptors(textures, computeImg, uniformBuffers, storage_buffers);
+}
+
+void DescriptorsManager::rebuild_descriptors(
+    const std::vector<std::unique_ptr<Texture>> &textures, const ComputeImage& computeImg, const UniformBuffers &uniformBuffers,
+    const std::map<BindingKey, VkDescriptorBufferInfo> &storage_buffers)
+{
+    vkDestroyDescriptorPool(_device.device(), _descriptor_pool, nullptr);
+    _descriptor_pool = VK_NULL_HANDLE;
+    _descriptor_sets.clear();
+    init_pool();
+    init_descriptors(textures, computeImg, uniformBuffers, storage_buffers);
 }
 
 void DescriptorsManager::init_pool()
@@ -74,7 +86,8 @@ void DescriptorsManager::init_layout() {
 }
 
 void DescriptorsManager::init_descriptors(
-    const std::vector<std::unique_ptr<Texture>> &textures, const ComputeImage& computeImg,  const UniformBuffers &uniform_buffers)
+    const std::vector<std::unique_ptr<Texture>> &textures, const ComputeImage& computeImg,  const UniformBuffers &uniform_buffers,
+    const std::map<BindingKey, VkDescriptorBufferInfo> &storage_buffers)
 {
     uint32_t images_count = static_cast<uint32_t>(_device.swap_chain_image_count());
     std::vector<VkDescriptorSetLayout> layouts(static_cast<uint32_t>(images_count), _descriptor_set_layout);
@@ -141,12 +154,43 @@ void DescriptorsManager::init_descriptors(
                 }
                 break;
 
+                case BindingType::AccumulationImage:
+                {
+                    image_infos.push_back(VkDescriptorImageInfo{});
+                    VkDescriptorImageInfo& imageInfo = image_infos.back();
+                    imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+                    imageInfo.imageView = computeImg.accumulation_image_view();
+                    imageInfo.sampler = nullptr;
+
+                    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                    write.dstSet = _descriptor_sets[i];
+                    write.dstBinding = static_cast<uint32_t>(binding.binding);
+                    write.dstArrayElement = 0;
+                    write.descriptorType = binding.descriptor_type;
+                    write.descriptorCount = 1;
+                    write.pImageInfo = &image_infos.back();
+                }
+                break;
+
                 case BindingType::Buffer: {
-                    VkDescriptorBufferInfo bufferInfo{};
-                    bufferInfo.buffer = uniform_buffers.uniform_buffer(FrameIndex(i), binding.key);
-                    bufferInfo.offset = 0;
-                    bufferInfo.range = uniform_buffers.uniform_buffer_size(FrameIndex(i), binding.key);
-                    buffer_infos.push_back(bufferInfo);
+                    // The slot of the frame is picked by the dynamic offset at bind time.
+                    assert(binding.key == BindingKey::CommonUBO);
+                    buffer_infos.push_back(uniform_buffers.descriptor_info());
+
+                    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                    write.dstSet = _descriptor_sets[i];
+                    write.dstBinding = static_cast<uint32_t>(binding.binding);
+                    write.dstArrayElement = 0;
+                    write.descriptorType = binding.descriptor_type;
+                    write.descriptorCount = 1;
+                    write.pBufferInfo = &buffer_infos.back();
+                }
+                break;
+
+                case BindingType::StorageBuffer: {
+                    auto it = storage_buffers.find(binding.key);
+                    assert(it != storage_buffers.end());
+                    buffer_infos.push_back(it->second);
 
                     write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
                     write.dstSet = _descriptor_sets[i];
@@ -168,4 +212,33 @@ void DescriptorsManager::init_descriptors(
     std::clog << "Descriptors initialized" << std::endl;
 }
 
+void DescriptorsManager::update_textures(const std::vector<std::unique_ptr<Texture>> &textures, ImageIndex image_index)
+{
+    std::vector<VkDescriptorImageInfo> image_infos;
+    std::vector<VkWriteDescriptorSet> writes;
+    image_infos.reserve(std::size(s_bindings));  // No reallocation, writes point into it
+    int tex = 0;
+    for (const Binding &binding : s_bindings) {
+        if (binding.binding_type != BindingType::Image) {
+            continue;
+        }
+        image_infos.push_back(VkDescriptorImageInfo{});
+        VkDescriptorImageInfo &imageInfo = image_infos.back();
+        imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        imageInfo.imageView = textures[tex]->texture_image_view();
+        imageInfo.sampler = textures[tex++]->texture_sampler();
+
+        VkWriteDescriptorSet write{};
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.dstSet = descriptor(image_index);
+        write.dstBinding = static_cast<uint32_t>(binding.binding);
+        write.dstArrayElement = 0;
+        write.descriptorType = binding.descriptor_type;
+        write.descriptorCount = 1;
+        write.pImageInfo = &imageInfo;
+        writes.push_back(write);
+    }
+    vkUpdateDescriptorSets(_device.device(), static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+}
+
 } // namespace
@@ -3,6 +3,7 @@
 #include <vulkan/vulkan.h>
 
 #include <array>
+#include <map>
 
 #include "vulkan_common_objects.h"
 #include "device.h"
@@ -25,13 +26,22 @@ struct Binding {
 
 inline constexpr Binding s_bindings[] =
 {
-    { BindingSequence::COMMON_UBO, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, BindingType::Buffer, BindingKey::CommonUBO,
+    { BindingSequence::COMMON_UBO, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, BindingType::Buffer, BindingKey::CommonUBO,
         VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT, BindingsMaxCount{1} },
 
     { BindingSequence::TEXTURE_IMAGE_SAMPLER, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, BindingType::Image, BindingKey::PrimaryTexture,
         VK_SHADER_STAGE_FRAGMENT_BIT, BindingsMaxCount{1} },
 
     { BindingSequence::FRAME_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, BindingType::SwapChainImage, BindingKey::FrameImage,
+        VK_SHADER_STAGE_COMPUTE_BIT, BindingsMaxCount{1} },
+
+    { BindingSequence::SPHERES, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BindingType::StorageBuffer, BindingKey::Spheres,
+        VK_SHADER_STAGE_COMPUTE_BIT, BindingsMaxCount{1} },
+
+    { BindingSequence::BVH_NODES, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BindingType::StorageBuffer, BindingKey::BvhNodes,
+        VK_SHADER_STAGE_COMPUTE_BIT, BindingsMaxCount{1} },
+
+    { BindingSequence::ACCUMULATION_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, BindingType::AccumulationImage, BindingKey::AccumulationImage,
         VK_SHADER_STAGE_COMPUTE_BIT, BindingsMaxCount{1} }
 };
 
@@ -44,7 +54,18 @@ public:
     ~DescriptorsManager();
 
     void init(const std::vector<std::unique_ptr<Texture>> &textures,
-        const ComputeImage& computeImg, const UniformBuffers &uniformBuffers);
+        const ComputeImage& computeImg, const UniformBuffers &uniformBuffers,
+        const std::map<BindingKey, VkDescriptorBufferInfo> &storage_buffers);
+
+    // Allocates the sets anew, one per image of the current swap chain, keeping the layout the
+    // pipelines were created with. The old sets must not be in use.
+    void rebuild_descriptors(const std::vector<std::unique_ptr<Texture>> &textures,
+        const ComputeImage& computeImg, const UniformBuffers &uniformBuffers,
+        const std::map<BindingKey, VkDescriptorBufferInfo> &storage_buffers);
+
+    // Points the texture bindings of the set of the image at the current images of the
+    // textures. The set must not be in use by the GPU.
+    void update_textures(const std::vector<std::unique_ptr<Texture>> &textures, ImageIndex image_index);
 
     VkDescriptorSet descriptor(ImageIndex image_index) const
     {
@@ -64,7 +85,8 @@ private:
     void init_pool();
     void init_layout();
     void init_descriptors(const std::vector<std::unique_ptr<Texture>> &textures,
-                          const ComputeImage &computeImg, const UniformBuffers &uniformBuffers);
+                          const ComputeImage &computeImg, const UniformBuffers &uniformBuffers,
+                          const std::map<BindingKey, VkDescriptorBufferInfo> &storage_buffers);
 
     const Device &_device;
 
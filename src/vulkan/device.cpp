@@ -19,19 +19,32 @@ const std::vector<const char *> deviceExtensions = {
     VK_KHR_SWAPCHAIN_EXTENSION_NAME
 };
 
+static std::vector<const char *> requiredExtensions(VkSurfaceKHR surface)
+{
+    return surface == VK_NULL_HANDLE ? std::vector<const char *>{} : deviceExtensions;
+}
+
 std::vector<const char *> validationLayers = {
     "VK_LAYER_KHRONOS_validation"
 };
 
 void Device::init(const GraphicalEnvironmentSettings &settings, VkInstance instance, VkSurfaceKHR surface, GLFWwindow *const window) {
+    _headless = surface == VK_NULL_HANDLE;
     init_physical_device(instance, surface);
     init_logical_device(surface);
+    _allocator = std::make_unique<MemoryAllocator>(_device, _physical_device);
+    if (_headless) {
+        _swap_chain_extent = {static_cast<uint32_t>(settings.width), static_cast<uint32_t>(settings.height)};
+        _swap_chain_image_format = VK_FORMAT_R8G8B8A8_UNORM;  // Of the compute image
+        std::clog << "Headless device initialized" << std::endl;
+        return;
+    }
     init_swap_chain(settings, surface, window);
     init_image_views();
     std::clog << "Device initialized" << std::endl;
 }
 
-static bool checkDeviceExtensionSupport(VkPhysicalDevice device)
+static bool checkDeviceExtensionSupport(VkPhysicalDevice device, const std::vector<const char *> &extensions)
 {
     uint32_t extensionCount;
     vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
@@ -39,24 +52,24 @@ static bool checkDeviceExtensionSupport(VkPhysicalDevice device)
     std::vector<VkExtensionProperties> availableExtensions(extensionCount);
     vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
 
-    std::set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+    std::set<std::string> required(extensions.begin(), extensions.end());
 
     for (const auto &extension : availableExtensions)
     {
-        requiredExtensions.erase(extension.extensionName);
+        required.erase(extension.extensionName);
     }
 
-    return requiredExtensions.empty();
+    return required.empty();
 }
 
 static bool isDeviceSuitable(VkPhysicalDevice device, VkSurfaceKHR surface)
 {
     QueueFamilyIndices indices = Device::findQueueFamilies(device, surface);
 
-    bool extensionsSupported = checkDeviceExtensionSupport(device);
+    bool extensionsSupported = checkDeviceExtensionSupport(device, requiredExtensions(surface));
 
-    bool swapChainAdequate = false;
-    if (extensionsSupported)
+    bool swapChainAdequate = surface == VK_NULL_HANDLE;
+    if (extensionsSupported && !swapChainAdequate)
     {
         SwapChainSupportDetails swapChainSupport = Device::querySwapChainSupport(device, surface);
         swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
@@ -104,6 +117,9 @@ void Device::init_logical_device(VkSurfaceKHR surface) {
 
     std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
     std::set<uint32_t> uniqueQueueFamilies = {indices.graphicsFamily.value(), indices.computeFamily.value(), indices.presentFamily.value()};
+    if (indices.transferFamily) {
+        uniqueQueueFamilies.insert(*indices.transferFamily);
+    }
 
     float queuePriority = 1.0f;
     for (uint32_t queueFamily : uniqueQueueFamilies)
@@ -127,8 +143,28 @@ void Device::init_logical_device(VkSurfaceKHR surface) {
 
     createInfo.pEnabledFeatures = &deviceFeatures;
 
-    createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-    createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+    // Timeline semaphores track asset uploads; they need a Vulkan 1.2 device.
+    VkPhysicalDeviceProperties properties{};
+    vkGetPhysicalDeviceProperties(_physical_device, &properties);
+    VkPhysicalDeviceVulkan12Features features12{};
+    features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    if (properties.apiVersion >= VK_API_VERSION_1_2) {
+        VkPhysicalDeviceFeatures2 features2{};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = &features12;
+        vkGetPhysicalDeviceFeatures2(_physical_device, &features2);
+        _timeline_semaphores = features12.timelineSemaphore == VK_TRUE;
+    }
+    VkPhysicalDeviceVulkan12Features enabled12{};
+    enabled12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    enabled12.timelineSemaphore = VK_TRUE;
+    if (_timeline_semaphores) {
+        createInfo.pNext = &enabled12;
+    }
+
+    auto extensions = requiredExtensions(surface);
+    createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+    createInfo.ppEnabledExtensionNames = extensions.data();
 
     createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
     createInfo.ppEnabledLayerNames = validationLayers.data();
@@ -141,10 +177,15 @@ void Device::init_logical_device(VkSurfaceKHR surface) {
     vkGetDeviceQueue(_device, indices.graphicsFamily.value(), 0, &_graphics_queue);
     vkGetDeviceQueue(_device, indices.computeFamily.value(), 0, &_compute_queue);
     vkGetDeviceQueue(_device, indices.presentFamily.value(), 0, &_present_queue);
-    if (_graphics_queue == VK_NULL_HANDLE || _present_queue == VK_NULL_HANDLE)
+    _graphics_family = indices.graphicsFamily.value();
+    _transfer_family = indices.transferFamily.value_or(_graphics_family);
+    vkGetDeviceQueue(_device, _transfer_family, 0, &_transfer_queue);
+    if (_graphics_queue == VK_NULL_HANDLE || _present_queue == VK_NULL_HANDLE || _transfer_queue == VK_NULL_HANDLE)
     {
         LOG_AND_THROW(std::runtime_error("failed to create queue!"));
     }
+    indices.describe();
+    std::clog << "Timeline semaphores " << (_timeline_semaphores ? "enabled" : "not supported") << std::endl;
 }
 
 // static
@@ -241,6 +282,17 @@ QueueFamilyIndices Device::findQueueFamilies(VkPhysicalDevice device, VkSurfaceK
         }
     }
 
+    // Dedicated queue for uploads, usually backed by a DMA engine
+    for (uint32_t i = 0; i < static_cast<uint32_t>(queueFamilies.size()); i++)
+    {
+        if ((queueFamilies[i].queueFlags & VK_QUEUE_TRANSFER_BIT) &&
+            (queueFamilies[i].queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) == 0)
+        {
+            indices.transferFamily = i;
+            break;
+        }
+    }
+
     int i = 0;
     for (const auto &queueFamily : queueFamilies)
     {
@@ -253,7 +305,11 @@ QueueFamilyIndices Device::findQueueFamilies(VkPhysicalDevice device, VkSurfaceK
         }
 
         VkBool32 presentSupport = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+        if (surface != VK_NULL_HANDLE) {
+            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+        } else {
+            presentSupport = indices.graphicsFamily.has_value();
+        }
 
         if (presentSupport)
         {
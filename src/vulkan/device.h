@@ -1,6 +1,7 @@
 #pragma once
 
 #include <assert.h>
+#include <memory>
 #include <optional>
 #include <set>
 #include <vector>
@@ -9,6 +10,7 @@
 #include <GLFW/glfw3.h>
 
 #include "graphical_environment.h"
+#include "memory_allocator.h"
 #include "vulkan_common_objects.h"
 
 namespace VulkanImpl {
@@ -18,6 +20,11 @@ struct QueueFamilyIndices
     std::optional<uint32_t> computeFamily;
     std::optional<uint32_t> graphicsFamily;
     std::optional<uint32_t> presentFamily;
+    std::optional<uint32_t> transferFamily;  // Only of a family without graphics and compute
+
+    bool separate_transfer_family() const {
+        return transferFamily.has_value();
+    }
 
     bool separate_compute_family() const {
         return computeFamily != graphicsFamily;
@@ -36,7 +43,11 @@ struct QueueFamilyIndices
     }
 
     void describe() const {
-        std::clog << "Compute: " << *computeFamily << ", graphics: " << *graphicsFamily << std::endl;
+        std::clog << "Compute: " << *computeFamily << ", graphics: " << *graphicsFamily;
+        if (transferFamily) {
+            std::clog << ", transfer: " << *transferFamily;
+        }
+        std::clog << std::endl;
     }
 };
 
@@ -61,13 +72,26 @@ public:
     ~Device() {
         vkDeviceWaitIdle(_device);
         cleanup_swap_chain();
+        _allocator.reset();
         vkDestroyDevice(_device, 0);
         std::clog << "Device destroyed" << std::endl;
     }
 
+    // Without a surface the device is headless: no swap chain, and the render extent comes from
+    // the settings.
     void init(const RayTracingProject::GraphicalEnvironmentSettings &settings, VkInstance instance,
               VkSurfaceKHR surface, GLFWwindow *const window);
 
+    // Device memory of all buffers and images.
+    MemoryAllocator &allocator() const {
+        assert(_allocator);
+        return *_allocator;
+    }
+
+    bool headless() const {
+        return _headless;
+    }
+
     void init_swap_chain(const RayTracingProject::GraphicalEnvironmentSettings &settings,
                          VkSurfaceKHR surface, GLFWwindow *window);
 
@@ -107,7 +131,11 @@ public:
         return _swap_chain_extent;
     }
 
+    // A headless device renders into a single offscreen image.
     ImagesCount swap_chain_image_count() const {
+        if (_headless) {
+            return ImagesCount(1);
+        }
         assert(!_swap_chain_images.empty());
         return ImagesCount(_swap_chain_images.size());
     }
@@ -137,12 +165,31 @@ public:
         return _present_queue;
     }
 
+    // Queue of the dedicated transfer family, or the graphics queue when there is none.
+    VkQueue transfer_queue() const {
+        return _transfer_queue;
+    }
+
+    uint32_t graphics_family() const {
+        return _graphics_family;
+    }
+
+    uint32_t transfer_family() const {
+        return _transfer_family;
+    }
+
+    // Whether timeline semaphores (Vulkan 1.2) are enabled.
+    bool timeline_semaphores() const {
+        return _timeline_semaphores;
+    }
+
     static SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice device, VkSurfaceKHR surface);
 
     QueueFamilyIndices findQueueFamilies(VkSurfaceKHR surface) const {
         return Device::findQueueFamilies(_physical_device, surface);
     }
 
+    // Without a surface the graphics family stands in for the present family.
     static QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device, VkSurfaceKHR surface);
 
     VkImageView createImageView(VkImage image, VkFormat format);
@@ -155,11 +202,17 @@ private:
 
     void init_logical_device(VkSurfaceKHR surface);
 
+    bool _headless = false;
+    std::unique_ptr<MemoryAllocator> _allocator;
     VkDevice _device = VK_NULL_HANDLE;
     VkPhysicalDevice _physical_device = VK_NULL_HANDLE;
     VkQueue _graphics_queue = VK_NULL_HANDLE;
     VkQueue _compute_queue = VK_NULL_HANDLE;
     VkQueue _present_queue = VK_NULL_HANDLE;
+    VkQueue _transfer_queue = VK_NULL_HANDLE;
+    uint32_t _graphics_family = 0;
+    uint32_t _transfer_family = 0;
+    bool _timeline_semaphores = false;
     VkSwapchainKHR _swap_chain = VK_NULL_HANDLE;
     std::vector<VkImage> _swap_chain_images;
     VkFormat _swap_chain_image_format = VK_FORMAT_UNDEFINED;
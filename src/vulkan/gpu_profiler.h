@@ -0,0 +1,216 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "device.h"
+#include "trace.h"
+
+namespace VulkanImpl
+{
+
+enum class GpuPass : uint32_t {
+    RayTrace,
+    Graphics,
+    Count
+};
+
+// GPU time of the passes, from timestamp queries written at their start and end. The queries
+// are recorded once into the prerecorded command buffer of each swapchain image, in a query pool
+// of that image; the results of an image are read when it is submitted again, after its previous
+// use was waited for, and only if available, so reading never stalls.
+// Durations are kept as rolling averages and, while a trace is recorded, exported as events of
+// the GPU track. GPU ticks are mapped to trace time with the smallest offset that puts no pass
+// before its command buffer was submitted, which converges to within the submit latency.
+class GpuProfiler {
+public:
+    static constexpr size_t s_window = 64;  // Frames in the rolling averages
+
+    GpuProfiler(const Device &device, ImagesCount images_count, uint32_t compute_family)
+        : _device(device), _images(static_cast<uint32_t>(images_count)) {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(_device.physical_device(), &properties);
+        _tick_ns = properties.limits.timestampPeriod;
+
+        uint32_t count = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(_device.physical_device(), &count, nullptr);
+        std::vector<VkQueueFamilyProperties> families(count);
+        vkGetPhysicalDeviceQueueFamilyProperties(_device.physical_device(), &count, families.data());
+        _valid_bits[pass_index(GpuPass::RayTrace)] = families[compute_family].timestampValidBits;
+        _valid_bits[pass_index(GpuPass::Graphics)] = families[_device.graphics_family()].timestampValidBits;
+
+        create_query_pools();
+    }
+
+    ~GpuProfiler() {
+        destroy_query_pools();
+    }
+
+    // Query pools for the images of a new swap chain. The averages are kept, the timestamps of
+    // the last submits are dropped; the GPU must be idle.
+    void resize(ImagesCount images_count) {
+        destroy_query_pools();
+        _images.assign(static_cast<uint32_t>(images_count), ImageQueries{});
+        create_query_pools();
+    }
+
+    // Records the start timestamp of the pass into the command buffer of the image. The queries
+    // are reset by the command buffer itself, so it can be submitted again and again.
+    void begin_pass(VkCommandBuffer command_buffer, ImageIndex image_index, GpuPass pass) {
+        auto p = pass_index(pass);
+        if (_valid_bits[p] == 0) {
+            return;
+        }
+        auto &image = _images[static_cast<uint32_t>(image_index)];
+        vkCmdResetQueryPool(command_buffer, image.pool, 2 * p, 2);
+        vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, image.pool, 2 * p);
+    }
+
+    // Records the end timestamp, outside of a render pass like begin_pass().
+    void end_pass(VkCommandBuffer command_buffer, ImageIndex image_index, GpuPass pass) {
+        auto p = pass_index(pass);
+        if (_valid_bits[p] == 0) {
+            return;
+        }
+        auto &image = _images[static_cast<uint32_t>(image_index)];
+        vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, image.pool, 2 * p + 1);
+    }
+
+    // Called right before the command buffer of the image is submitted: takes the timestamps of
+    // its previous submit, which must be complete.
+    void submit_pass(ImageIndex image_index, GpuPass pass) {
+        auto p = pass_index(pass);
+        if (_valid_bits[p] == 0) {
+            return;
+        }
+        auto &image = _images[static_cast<uint32_t>(image_index)];
+        collect(image, pass);
+        image.submitted[p] = true;
+        image.submitted_ns[p] = trace_recorder::instance().now_ns();
+    }
+
+    // Average of the last s_window measured frames, 0 before the first one.
+    double average_milliseconds(GpuPass pass) const {
+        const auto &history = _history[pass_index(pass)];
+        if (history.count == 0) {
+            return 0;
+        }
+        double sum = 0;
+        for (size_t i = 0; i < history.count; ++i) {
+            sum += history.ns[i];
+        }
+        return sum / history.count / 1e6;
+    }
+
+    size_t samples(GpuPass pass) const {
+        return _history[pass_index(pass)].samples;
+    }
+
+    void dump(std::ostream &out) const {
+        out << "GPU time: ray trace " << average_milliseconds(GpuPass::RayTrace) << " ms, graphics "
+            << average_milliseconds(GpuPass::Graphics) << " ms (average of the last " << s_window << " frames)" << std::endl;
+    }
+
+private:
+    GpuProfiler(const GpuProfiler &) = delete;
+    GpuProfiler &operator=(const GpuProfiler &) = delete;
+
+    static constexpr uint32_t s_pass_count = static_cast<uint32_t>(GpuPass::Count);
+
+    struct ImageQueries {
+        VkQueryPool pool = VK_NULL_HANDLE;
+        std::array<bool, s_pass_count> submitted{};
+        std::array<int64_t, s_pass_count> submitted_ns{};
+    };
+
+    struct History {
+        std::array<double, s_window> ns{};
+        size_t next = 0;
+        size_t count = 0;
+        size_t samples = 0;
+    };
+
+    void create_query_pools() {
+        VkQueryPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        poolInfo.queryCount = 2 * s_pass_count;
+        for (auto &image : _images) {
+            if (vkCreateQueryPool(_device.device(), &poolInfo, nullptr, &image.pool) != VK_SUCCESS)
+            {
+                LOG_AND_THROW(std::runtime_error("failed to create timestamp query pool!"));
+            }
+        }
+    }
+
+    void destroy_query_pools() {
+        for (auto &image : _images) {
+            vkDestroyQueryPool(_device.device(), image.pool, nullptr);
+            image.pool = VK_NULL_HANDLE;
+        }
+    }
+
+    static uint32_t pass_index(GpuPass pass) {
+        return static_cast<uint32_t>(pass);
+    }
+
+    static const char *trace_name(GpuPass pass) {
+        switch (pass) {
+            case GpuPass::RayTrace: return "gpu_ray_trace";
+            case GpuPass::Graphics: return "gpu_graphics";
+            default: return "gpu_pass";
+        }
+    }
+
+    // Takes the timestamps of the previous submit of the image, if the GPU wrote them.
+    void collect(ImageQueries &image, GpuPass pass) {
+        auto p = pass_index(pass);
+        if (!image.submitted[p]) {
+            return;
+        }
+        image.submitted[p] = false;
+
+        // Begin, availability, end, availability.
+        uint64_t results[4] = {};
+        auto result = vkGetQueryPoolResults(_device.device(), image.pool, 2 * p, 2, sizeof(results), results, 2 * sizeof(uint64_t),
+                                            VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+        if ((result != VK_SUCCESS && result != VK_NOT_READY) || results[1] == 0 || results[3] == 0) {
+            return;
+        }
+
+        uint64_t mask = _valid_bits[p] >= 64 ? ~uint64_t(0) : (uint64_t(1) << _valid_bits[p]) - 1;
+        uint64_t begin = results[0] & mask;
+        uint64_t end = results[2] & mask;
+        double duration_ns = double((end - begin) & mask) * _tick_ns;
+
+        auto &history = _history[p];
+        history.ns[history.next] = duration_ns;
+        history.next = (history.next + 1) % s_window;
+        history.count = std::min(history.count + 1, s_window);
+        ++history.samples;
+
+        auto &recorder = trace_recorder::instance();
+        if (recorder.enabled()) {
+            auto begin_ns = static_cast<int64_t>(double(begin) * _tick_ns);
+            _offset_ns = _calibrated ? std::max(_offset_ns, image.submitted_ns[p] - begin_ns) : image.submitted_ns[p] - begin_ns;
+            _calibrated = true;
+            recorder.record_gpu({trace_name(pass), "gpu", begin_ns + _offset_ns,
+                                 begin_ns + _offset_ns + static_cast<int64_t>(duration_ns), -1});
+        }
+    }
+
+    const Device &_device;
+    double _tick_ns = 1;
+    std::array<uint32_t, s_pass_count> _valid_bits{};
+    std::vector<ImageQueries> _images;
+    std::array<History, s_pass_count> _history;
+    int64_t _offset_ns = 0;
+    bool _calibrated = false;
+};
+
+}  // namespace
@@ -1,13 +1,20 @@
 #include <vulkan/vulkan_core.h>
+#ifdef _WIN32
 #include <Windows.h>
+#endif
 
 #include "graphical_environment_vulkan.h"
 
+#include <algorithm>
 #include <bitset>
 #include <chrono>
+#include <cmath>
 #include <thread>
 
+#include "hittable_list.h"
 #include "shader_loader.h"
+#include "sphere.h"
+#include "trace.h"
 
 
 namespace VulkanImpl
@@ -20,40 +27,47 @@ namespace VulkanImpl
 
     void GraphicalEnvironment::init()
     {
+        trace_scope trace("init", "vulkan");
         std::clog << "Init Vulkan" << std::endl;
 #   ifdef _WIN32
         char buffer[MAX_PATH] = { 0 };
         GetModuleFileName( NULL, buffer, MAX_PATH );
         std::clog << "CWD " << buffer << std::endl;
 #   endif
-        if (!glfwInit())
-        {
-            LOG_AND_THROW(std::runtime_error("glfwInit() failed"));
-        }
-
-        if (!glfwVulkanSupported())
-        {
-            LOG_AND_THROW(std::runtime_error("glfwVulkanSupported() failed"));
+        if (!_settings.headless) {
+            trace_scope trace_glfw("glfw_init", "vulkan");
+            if (!glfwInit())
+            {
+                LOG_AND_THROW(std::runtime_error("glfwInit() failed"));
+            }
+
+            if (!glfwVulkanSupported())
+            {
+                LOG_AND_THROW(std::runtime_error("glfwVulkanSupported() failed"));
+            }
+
+            window_init();
+            std::clog << "Window initialized" << std::endl;
         }
 
-        window_init();
-        std::clog << "Window initialized" << std::endl;
-
         VkApplicationInfo appInfo{};
         appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
         appInfo.pApplicationName = "Vulkan Project";
         appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
         appInfo.pEngineName = "No Engine";
         appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-        appInfo.apiVersion = VK_API_VERSION_1_0;
+        appInfo.apiVersion = VK_API_VERSION_1_2;
 
-        uint32_t glfwExtensionCount = 0;
-        auto glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-        if (glfwExtensionCount <= 0) {
-            LOG_AND_THROW(std::runtime_error("No instance extensions found"));
-        }
+        // A headless instance needs no surface extensions.
         std::vector<const char*> extensions;
-        std::copy(&glfwExtensions[0], &glfwExtensions[glfwExtensionCount], back_inserter(extensions));
+        if (!_settings.headless) {
+            uint32_t glfwExtensionCount = 0;
+            auto glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+            if (glfwExtensionCount <= 0) {
+                LOG_AND_THROW(std::runtime_error("No instance extensions found"));
+            }
+            std::copy(&glfwExtensions[0], &glfwExtensions[glfwExtensionCount], back_inserter(extensions));
+        }
 
         if (_validation != nullptr) {
             _validation->append_extensions(&extensions);
@@ -65,9 +79,12 @@ namespace VulkanImpl
         createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
         createInfo.pApplicationInfo = &appInfo;
         createInfo.enabledExtensionCount = extensions.size();
-        createInfo.ppEnabledExtensionNames = &extensions[0];
+        createInfo.ppEnabledExtensionNames = extensions.data();
 
-        auto layers = _validation->supported_layers();
+        std::vector<const char*> layers;
+        if (_validation != nullptr) {
+            layers = _validation->supported_layers();
+        }
         createInfo.enabledLayerCount	= layers.size();
         createInfo.ppEnabledLayerNames	= layers.data();
 
@@ -79,30 +96,45 @@ namespace VulkanImpl
 
         createInfo.pNext = (VkDebugUtilsMessengerCreateInfoEXT *)&debugCreateInfo;
 
-        if (VK_SUCCESS != vkCreateInstance(&createInfo, nullptr, &_instance)) {
-            LOG_AND_THROW(std::runtime_error("create instance"));
+        {
+            trace_scope trace_instance("create_instance", "vulkan");
+            if (VK_SUCCESS != vkCreateInstance(&createInfo, nullptr, &_instance)) {
+                LOG_AND_THROW(std::runtime_error("create instance"));
+            }
         }
         std::clog << "Instance created" << std::endl;
         if (_validation != nullptr) {
             _validation->init(_instance);
         }
 
-        surface_init();
-        std::clog << "Surface initialized" << std::endl;
-        _device = std::make_unique<Device>();
-        _device->init(_settings, _instance, _surface, _window);
-
-        _render_pass = std::make_unique<RenderPass>(*_device);
-        _render_pass->init();
-
-        for (const auto& f : _texture_files) {
-            _textures.emplace_back(std::make_unique<Texture>(*_device, f, BindingKey::PrimaryTexture));
+        if (!_settings.headless) {
+            surface_init();
+            std::clog << "Surface initialized" << std::endl;
+        }
+        {
+            trace_scope trace_device("device_init", "vulkan");
+            _device = std::make_unique<Device>();
+            _device->init(_settings, _instance, _surface, _window);
+        }
+        {
+            trace_scope trace_render_pass("render_pass_init", "vulkan");
+            _render_pass = std::make_unique<RenderPass>(*_device);
+            _render_pass->init();
+        }
+        {
+            trace_scope trace_textures("textures_create", "vulkan");
+            for (const auto& f : _texture_files) {
+                _textures.emplace_back(std::make_unique<Texture>(*_device, f, BindingKey::PrimaryTexture));
+            }
+        }
+        {
+            trace_scope trace_uniforms("uniform_buffers_init", "vulkan");
+            _uniform_buffers = std::make_unique<UniformBuffers>(*_device.get(), _device->swap_chain_image_count(),
+                                                                sizeof(UniformBufferObject));
         }
-
-        _uniform_buffers = std::make_unique<UniformBuffers>(*_device.get(), _settings.max_frames_in_flight);
-        _uniform_buffers->add<UniformBufferObject>(BindingKey::CommonUBO);
 
         init_pipeline();
+        _device->allocator().dump_stats(std::clog);
     }
 
     static void framebufferResizeCallback(GLFWwindow *window, int width, int height)
@@ -112,6 +144,7 @@ namespace VulkanImpl
     }
 
     void GraphicalEnvironment::window_init() {
+        trace_scope trace("window_init", "vulkan");
         glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
         glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
 
@@ -130,6 +163,7 @@ namespace VulkanImpl
     }
 
     void GraphicalEnvironment::surface_init() {
+        trace_scope trace("surface_init", "vulkan");
         if (VK_SUCCESS != glfwCreateWindowSurface(_instance, _window, nullptr, &_surface)) {
             LOG_AND_THROW(std::runtime_error("create window surface"));
         }
@@ -140,41 +174,94 @@ namespace VulkanImpl
     }
 
     void GraphicalEnvironment::init_pipeline() {
-        _command_buffers[PipelineType::Graphics] = std::make_unique<CommandBuffers>(*_device.get(), PipelineType::Graphics);
-        _command_buffers[PipelineType::Graphics]->init(_surface);
-        _command_buffers[PipelineType::Compute] = std::make_unique<CommandBuffers>(*_device.get(), PipelineType::Compute);
-        _command_buffers[PipelineType::Compute]->init(_surface);
-
-        for (auto &texture : _textures)
+        trace_scope trace("init_pipeline", "vulkan");
         {
-            texture->load(_command_buffers[PipelineType::Graphics]->graphics_command_pool());
+            trace_scope trace_commands("command_buffers_init", "vulkan");
+            _command_buffers[PipelineType::Graphics] = std::make_unique<CommandBuffers>(*_device.get(), PipelineType::Graphics);
+            _command_buffers[PipelineType::Graphics]->init(_surface);
+            _command_buffers[PipelineType::Compute] = std::make_unique<CommandBuffers>(*_device.get(), PipelineType::Compute);
+            _command_buffers[PipelineType::Compute]->init(_surface);
+        }
+        // Textures and buffers are recorded into one batch and uploaded together below.
+        UploadBatch uploads(*_device, _command_buffers[PipelineType::Graphics]->graphics_command_pool(), _device->graphics_queue());
+        {
+            trace_scope trace_textures("textures_load", "vulkan");
+            for (auto &texture : _textures)
+            {
+                texture->init_placeholder(uploads);
+            }
+        }
+        {
+            trace_scope trace_image("compute_image_init", "vulkan");
+            // The compute queue is the one using the images, so it takes their layout transitions.
+            UploadBatch transitions(*_device, _command_buffers[PipelineType::Compute]->compute_command_pool(), _device->compute_queue());
+            _compute_image = std::make_unique<ComputeImage>(*_device, BindingKey::FrameImage);
+            _compute_image->init(transitions);
+            transitions.submit();
         }
 
-        _compute_image = std::make_unique<ComputeImage>(*_device, *_command_buffers[PipelineType::Compute], BindingKey::FrameImage);
-        _compute_image->init();
-
-        frame_buffers_init();
-
-        _descriptors_manager = std::make_unique<DescriptorsManager>(*_device);
-        _descriptors_manager->init(_textures, *_compute_image, * _uniform_buffers);
-
-        _pipelines[PipelineType::Graphics] = std::make_unique<GraphicsPipeline>(*_device.get());
-        _pipelines[PipelineType::Graphics]->init(*_shader_modules, _descriptors_manager->descriptor_set_layout(), *_render_pass);
-        _pipelines[PipelineType::Compute] = std::make_unique<ComputePipeline>(*_device.get());
-        _pipelines[PipelineType::Compute]->init(*_shader_modules, _descriptors_manager->descriptor_set_layout(), *_render_pass);
-        _shader_modules.reset();
-        std::clog << "Pipeline initialized" << std::endl;
+        if (!_settings.headless) {
+            frame_buffers_init();
+        }
 
-        _vertex_buffer = std::make_unique<VertexBuffer>(*_device.get());
-        _vertex_buffer->init(_command_buffers[PipelineType::Graphics]->graphics_command_pool());
+        {
+            trace_scope trace_buffers("buffers_init", "vulkan");
+            _vertex_buffer = std::make_unique<VertexBuffer>(*_device.get());
+            _vertex_buffer->init(uploads);
+
+            // Spheres added before init.
+            auto capacity = std::max(static_cast<size_t>(std::max(_settings.sphere_count, 0)), _spheres.size());
+            _spheres_buffer = std::make_unique<DataBuffer<Sphere>>(*_device, capacity);
+            _bvh_buffer = std::make_unique<DataBuffer<bvh_gpu_node>>(*_device, 2 * capacity);
+            fill_scene_buffers();
+            _spheres_buffer->init(uploads);
+            _bvh_buffer->init(uploads);
+        }
+        {
+            trace_scope trace_uploads("uploads_submit", "vulkan", static_cast<int64_t>(uploads.staged_bytes()));
+            uploads.submit();
+            _startup_upload_submits = uploads.submit_count();
+        }
+        std::clog << "Uploaded " << uploads.staged_bytes() << " bytes in " << _startup_upload_submits << " submits" << std::endl;
 
-        _spheres_buffer = std::make_unique<DataBuffer<Sphere, 200>>(*_device);
-        _spheres_buffer->init(_command_buffers[PipelineType::Compute]->compute_command_pool());
+        {
+            trace_scope trace_descriptors("descriptor_sets_init", "vulkan");
+            _descriptors_manager = std::make_unique<DescriptorsManager>(*_device);
+            _descriptors_manager->init(_textures, *_compute_image, * _uniform_buffers, storage_buffers());
+        }
+        {
+            // Decoding starts now and overlaps with the pipeline creation below.
+            trace_scope trace_streamer("texture_streaming_start", "vulkan", static_cast<int64_t>(_textures.size()));
+            unsigned threads = std::clamp(std::thread::hardware_concurrency() / 2, 1u, 4u);
+            _asset_streamer = std::make_unique<AssetStreamer>(*_device, threads);
+            for (auto &texture : _textures) {
+                _asset_streamer->request(*texture);
+            }
+        }
+        {
+            trace_scope trace_cache("pipeline_cache_load", "vulkan");
+            _pipeline_cache = std::make_unique<PipelineCache>(*_device, _settings.pipeline_cache_path);
+            _pipeline_cache->init();
+        }
+        {
+            trace_scope trace_pipelines("pipelines_init", "vulkan");
+            auto start = std::chrono::steady_clock::now();
+            _pipelines[PipelineType::Graphics] = std::make_unique<GraphicsPipeline>(*_device.get(), _pipeline_cache->cache());
+            _pipelines[PipelineType::Graphics]->init(*_shader_modules, _descriptors_manager->descriptor_set_layout(), *_render_pass);
+            _pipelines[PipelineType::Compute] = std::make_unique<ComputePipeline>(*_device.get(), _pipeline_cache->cache());
+            _pipelines[PipelineType::Compute]->init(*_shader_modules, _descriptors_manager->descriptor_set_layout(), *_render_pass);
+            _shader_modules.reset();
+            _pipeline_creation_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+        std::clog << "Pipeline initialized in " << _pipeline_creation_ms << " ms, "
+                  << (_pipeline_cache->loaded() ? "warm" : "cold") << " pipeline cache" << std::endl;
 
         frames_init();
+        record_command_buffers();
     }
 
     void GraphicalEnvironment::frame_buffers_init() {
+        trace_scope trace("frame_buffers_init", "vulkan");
         _frame_buffers.reset();
         _frame_buffers = std::make_unique<FrameBuffers>(*_device.get(), _device->swap_chain_image_count());
         _frame_buffers->init(*_render_pass);
@@ -182,11 +269,70 @@ namespace VulkanImpl
     }
 
     void GraphicalEnvironment::frames_init() {
+        trace_scope trace("frames_init", "vulkan");
+        auto compute_family = _device->findQueueFamilies(_surface).computeFamily.value();
+        _gpu_profiler = std::make_unique<GpuProfiler>(*_device, _device->swap_chain_image_count(), compute_family);
         for (size_t i = 0; i < _settings.max_frames_in_flight; i++)
         {
             _frames.push_back(std::make_unique<Frame>(*_device));
             _frames.back()->init();
         }
+        _images_in_flight.assign(static_cast<size_t>(_device->swap_chain_image_count()), nullptr);
+    }
+
+    void GraphicalEnvironment::record_command_buffers() {
+        trace_scope trace("record_command_buffers", "vulkan");
+        auto images_count = static_cast<uint32_t>(_device->swap_chain_image_count());
+        for (uint32_t i = 0; i < images_count; ++i) {
+            record_command_buffer(ImageIndex(i));
+        }
+        ++_command_buffer_recordings;
+    }
+
+    void GraphicalEnvironment::record_command_buffer(ImageIndex image_index) {
+        auto &compute = *_command_buffers[PipelineType::Compute];
+        auto uniforms_offset = _uniform_buffers->dynamic_offset(image_index);
+
+        auto command_buffer = compute.reset_record_compute_command_buffer(_pipelines, *_descriptors_manager, image_index);
+        _compute_image->record_accumulation_barrier(command_buffer);
+        _gpu_profiler->begin_pass(command_buffer, image_index, GpuPass::RayTrace);
+        compute.dispatch_raytrace(_pipelines, *_descriptors_manager, uniforms_offset, image_index, _device->swap_chain_extent());
+        _gpu_profiler->end_pass(command_buffer, image_index, GpuPass::RayTrace);
+        if (_settings.headless) {
+            _compute_image->record_readback(command_buffer);
+        }
+        compute.end_command_buffer(image_index);
+
+        if (!_settings.headless) {
+            _command_buffers[PipelineType::Graphics]->record_graphics_command_buffer(
+                _frame_buffers->frame_buffers()[static_cast<uint32_t>(image_index)],
+                _device->swap_chain_extent(),
+                _pipelines,
+                *_vertex_buffer,
+                *_descriptors_manager,
+                uniforms_offset,
+                image_index,
+                _background,
+                *_render_pass,
+                *_gpu_profiler);
+        }
+    }
+
+    void GraphicalEnvironment::wait_for_image(ImageIndex image_index) {
+        auto &previous = _images_in_flight[static_cast<size_t>(image_index)];
+        if (previous != nullptr) {
+            trace_scope trace("wait_image", "vulkan");
+            VkFence fences[] = {previous->in_flight_fence(PipelineType::Compute), previous->in_flight_fence(PipelineType::Graphics)};
+            vkWaitForFences(_device->device(), 2, fences, VK_TRUE, UINT64_MAX);
+        }
+        previous = _frames[_current_frame].get();
+    }
+
+    bool GraphicalEnvironment::image_idle(ImageIndex image_index) const {
+        auto previous = _images_in_flight[static_cast<size_t>(image_index)];
+        return previous == nullptr ||
+               (vkGetFenceStatus(_device->device(), previous->in_flight_fence(PipelineType::Compute)) == VK_SUCCESS &&
+                vkGetFenceStatus(_device->device(), previous->in_flight_fence(PipelineType::Graphics)) == VK_SUCCESS);
     }
 
     void GraphicalEnvironment::dump_device_info() const {
@@ -203,12 +349,21 @@ namespace VulkanImpl
             std::clog << std::bitset<8>(properties.memoryHeaps[i].flags) << " : " << properties.memoryHeaps[i].size << " ";
         }
         std::clog << std::endl;
+        _device->allocator().dump_stats(std::clog);
     }
 
     void GraphicalEnvironment::start_interactive_loop(std::chrono::milliseconds duration)
     {
         auto startTime = std::chrono::high_resolution_clock::now();
 
+        if (_settings.headless) {
+            while ((std::chrono::high_resolution_clock::now() - startTime) < duration) {
+                render_offscreen();
+            }
+            _gpu_profiler->dump(std::clog);
+            return;
+        }
+
         while (!glfwWindowShouldClose(_window) &&
                (std::chrono::high_resolution_clock::now() - startTime) < duration)
         {
@@ -217,48 +372,133 @@ namespace VulkanImpl
         }
 
         vkDeviceWaitIdle(_device->device());
+        _gpu_profiler->dump(std::clog);
+    }
+
+    bool GraphicalEnvironment::wait_for_textures(std::chrono::milliseconds timeout)
+    {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (!_asset_streamer->idle() && std::chrono::steady_clock::now() < deadline) {
+            poll_textures();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        poll_textures();
+        return _asset_streamer->idle();
+    }
+
+    void GraphicalEnvironment::poll_textures()
+    {
+        if (_asset_streamer && _asset_streamer->poll()) {
+            _stale_texture_sets.assign(static_cast<size_t>(_device->swap_chain_image_count()), true);
+        }
+        // Images still in flight are refreshed once drawn to again, after wait_for_image().
+        for (uint32_t i = 0; i < _stale_texture_sets.size(); ++i) {
+            if (_stale_texture_sets[i] && image_idle(ImageIndex(i))) {
+                refresh_textures(ImageIndex(i));
+            }
+        }
+    }
+
+    void GraphicalEnvironment::refresh_textures(ImageIndex image_index)
+    {
+        auto i = static_cast<size_t>(image_index);
+        if (i >= _stale_texture_sets.size() || !_stale_texture_sets[i]) {
+            return;
+        }
+        trace_scope trace("textures_swap", "vulkan");
+        // A rewritten set invalidates the command buffers it is bound in.
+        _descriptors_manager->update_textures(_textures, image_index);
+        record_command_buffer(image_index);
+        _stale_texture_sets[i] = false;
+
+        // Each set was rewritten while its image was idle, so the frames that sampled the
+        // replaced images have all completed.
+        if (std::find(_stale_texture_sets.begin(), _stale_texture_sets.end(), true) == _stale_texture_sets.end()) {
+            _asset_streamer->release_replaced_images();
+            _stale_texture_sets.clear();
+            ++_command_buffer_recordings;
+        }
     }
 
     void GraphicalEnvironment::draw_frame() {
-        ImageIndex imageIndex = draw_frame_computational();
-        draw_frame_graphical(imageIndex);
+        trace_scope trace("frame", "vulkan");
+        poll_textures();
+        auto imageIndex = draw_frame_computational();
+        if (imageIndex) {
+            draw_frame_graphical(*imageIndex);
+        }
     }
 
-    ImageIndex GraphicalEnvironment::draw_frame_computational() {
+    std::vector<uint8_t> GraphicalEnvironment::render_offscreen() {
+        trace_scope trace("offscreen_frame", "vulkan");
+        assert(_settings.headless);
+        poll_textures();
+        PipelineType current_pipeline_type = PipelineType::Compute;
+        auto &commands = *_command_buffers[current_pipeline_type];
+        auto &current_frame = *_frames[0];
+
+        // One image and one frame: wait for the previous one, there is nothing to overlap with.
+        vkWaitForFences(_device->device(), 1, &current_frame.in_flight_fence(current_pipeline_type), VK_TRUE, UINT64_MAX);
+        vkResetFences(_device->device(), 1, &current_frame.in_flight_fence(current_pipeline_type));
+
+        update_uniform_buffer(ImageIndex(0));
+        _gpu_profiler->submit_pass(ImageIndex(0), GpuPass::RayTrace);
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &commands.command_buffer(ImageIndex(0));
+
+        if (vkQueueSubmit(_device->compute_queue(), 1, &submitInfo, current_frame.in_flight_fence(current_pipeline_type)) != VK_SUCCESS)
+        {
+            LOG_AND_THROW(std::runtime_error("failed to submit offscreen command buffer!"));
+        }
+        {
+            trace_scope trace_wait("wait_readback", "vulkan");
+            vkWaitForFences(_device->device(), 1, &current_frame.in_flight_fence(current_pipeline_type), VK_TRUE, UINT64_MAX);
+        }
+        return _compute_image->read_pixels();
+    }
+
+    std::optional<ImageIndex> GraphicalEnvironment::draw_frame_computational() {
+        trace_scope trace("compute_pass", "vulkan");
         PipelineType current_pipeline_type = PipelineType::Compute;
 
         assert(_current_frame < _frames.size());
         auto &current_frame = *_frames[_current_frame];
-        vkWaitForFences(_device->device(), 1, &current_frame.in_flight_fence(current_pipeline_type), VK_TRUE, UINT64_MAX);
+        {
+            trace_scope trace_wait("wait_compute_fence", "vulkan");
+            vkWaitForFences(_device->device(), 1, &current_frame.in_flight_fence(current_pipeline_type), VK_TRUE, UINT64_MAX);
+        }
 
         uint32_t imageIndex;
-        VkResult result = vkAcquireNextImageKHR(_device->device(), _device->swap_chain(), UINT64_MAX,
-                                                current_frame.image_available_semaphore(), VK_NULL_HANDLE, &imageIndex);
+        VkResult result;
+        {
+            trace_scope trace_acquire("acquire_image", "vulkan");
+            result = vkAcquireNextImageKHR(_device->device(), _device->swap_chain(), UINT64_MAX,
+                                           current_frame.image_available_semaphore(), VK_NULL_HANDLE, &imageIndex);
+        }
 
         if (result == VK_ERROR_OUT_OF_DATE_KHR)
         {
             recreate_swap_chain();
 
-            return ImageIndex(imageIndex);
+            // Nothing was acquired or submitted, the graphics pass has nothing to wait for.
+            return std::nullopt;
         }
         else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR)
         {
             LOG_AND_THROW(std::runtime_error("failed to acquire swap chain image! Err: " + std::to_string(result)));
         }
 
-        update_uniform_buffer(FrameIndex(_current_frame));
+        // The command buffers and the uniforms slot of the image are reused, the frame that
+        // used them last must be done.
+        wait_for_image(ImageIndex(imageIndex));
+        refresh_textures(ImageIndex(imageIndex));
+        update_uniform_buffer(ImageIndex(imageIndex));
 
         vkResetFences(_device->device(), 1, &current_frame.in_flight_fence(current_pipeline_type));
-
-        auto command_buffer = _command_buffers[current_pipeline_type]->reset_record_compute_command_buffer(
-            _pipelines,
-            *_descriptors_manager,
-            ImageIndex(imageIndex));
-
-        _command_buffers[current_pipeline_type]->dispatch_raytrace(
-            _pipelines, *_descriptors_manager,
-            ImageIndex(imageIndex));
-        _command_buffers[current_pipeline_type]->end_command_buffer(ImageIndex(imageIndex));
+        _gpu_profiler->submit_pass(ImageIndex(imageIndex), GpuPass::RayTrace);
 
         VkSubmitInfo submitInfo{};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
@@ -302,32 +542,29 @@ namespace VulkanImpl
 
     void GraphicalEnvironment::draw_frame_graphical(ImageIndex imageIndex)
     {
+        trace_scope trace("graphics_pass", "vulkan");
         PipelineType current_pipeline_type = PipelineType::Graphics;
         assert(_current_frame < _frames.size());
         auto& current_frame = *_frames[_current_frame];
-        vkWaitForFences(_device->device(), 1, &current_frame.in_flight_fence(current_pipeline_type), VK_TRUE, UINT64_MAX);
+        {
+            trace_scope trace_wait("wait_graphics_fence", "vulkan");
+            vkWaitForFences(_device->device(), 1, &current_frame.in_flight_fence(current_pipeline_type), VK_TRUE, UINT64_MAX);
+        }
 
         // update_backgroung_color();
 
         vkResetFences(_device->device(), 1, &current_frame.in_flight_fence(current_pipeline_type));
 
-        assert(_current_frame < static_cast<size_t>(_frame_buffers->size()));
-        _command_buffers[current_pipeline_type]->reset_record_graphics_command_buffer(
-            _frame_buffers->frame_buffers()[static_cast<size_t>(imageIndex)],
-            _device->swap_chain_extent(),
-            _pipelines,
-            *_vertex_buffer,
-            *_descriptors_manager,
-            ImageIndex(imageIndex),
-            _background,
-            *_render_pass);
+        _gpu_profiler->submit_pass(imageIndex, GpuPass::Graphics);
 
         VkSubmitInfo submitInfo{};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-        VkSemaphore waitSemaphores[] = {current_frame.image_available_semaphore()};
-        VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-        submitInfo.waitSemaphoreCount = 1;
+        // The fragment shader samples what the compute pass of this frame rendered.
+        VkSemaphore waitSemaphores[] = {current_frame.image_available_semaphore(),
+                                        current_frame.render_finished_semaphore(PipelineType::Compute)};
+        VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT};
+        submitInfo.waitSemaphoreCount = 2;
         submitInfo.pWaitSemaphores = waitSemaphores;
         submitInfo.pWaitDstStageMask = waitStages;
 
@@ -356,7 +593,11 @@ namespace VulkanImpl
         uint32_t intImageIndex = static_cast<uint32_t>(imageIndex);
         presentInfo.pImageIndices = &intImageIndex;
 
-        VkResult result = vkQueuePresentKHR(_device->present_queue(), &presentInfo);
+        VkResult result;
+        {
+            trace_scope trace_present("present", "vulkan");
+            result = vkQueuePresentKHR(_device->present_queue(), &presentInfo);
+        }
 
         if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || _framebuffer_resized)
         {
@@ -371,23 +612,60 @@ namespace VulkanImpl
         _current_frame = (_current_frame + 1) % _settings.max_frames_in_flight;
     }
 
-    void GraphicalEnvironment::update_uniform_buffer(FrameIndex current_frame)
+    void GraphicalEnvironment::update_uniform_buffer(ImageIndex image_index)
     {
         static auto startTime = std::chrono::high_resolution_clock::now();
 
         auto currentTime = std::chrono::high_resolution_clock::now();
         float time = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - startTime).count();
 
-        UniformBufferObject ubo{};
+        // Only the model rotation and the frame counters change every frame.
+        auto &ubo = _frame_uniforms;
+        if (_frame_uniforms_dirty) {
+            ubo.view = glm::lookAt(glm::vec3(2.0f, 2.0f, -2.0f) /*eye*/, glm::vec3(0.0f, 0.0f, 0.0f) /*center*/,
+                glm::vec3(0.0f, 1.0f, 0.0f) /*up*/);
+            ubo.proj = glm::perspective(
+                glm::radians(45.0f),
+                (float)_device->swap_chain_extent().width / (float)_device->swap_chain_extent().height, 0.1f, 10.0f);
+            ubo.proj[1][1] *= -1;
+
+            update_camera_uniforms(ubo, _device->swap_chain_extent());
+            ubo.use_bvh = _settings.gpu_bvh ? 1 : 0;
+            _frame_uniforms_dirty = false;
+        }
         ubo.model = glm::rotate(glm::mat4(1.0f), time * glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-        ubo.view = glm::lookAt(glm::vec3(2.0f, 2.0f, -2.0f) /*eye*/, glm::vec3(0.0f, 0.0f, 0.0f) /*center*/,
-            glm::vec3(0.0f, 1.0f, 0.0f) /*up*/);
-        ubo.proj = glm::perspective(
-            glm::radians(45.0f),
-            (float)_device->swap_chain_extent().width / (float)_device->swap_chain_extent().height, 0.1f, 10.0f);
-        ubo.proj[1][1] *= -1;
-
-        _uniform_buffers->copy_to_uniform_buffers_for_frame(current_frame, BindingKey::CommonUBO, ubo);
+        ubo.frame_index = _frame_index++;
+        ubo.accumulated_frames = _accumulated_frames++;
+
+        _uniform_buffers->write(image_index, ubo);
+    }
+
+    void GraphicalEnvironment::update_camera_uniforms(UniformBufferObject &ubo, VkExtent2D extent) const
+    {
+        auto theta = glm::radians(_camera.vfov);
+        auto viewport_height = 2.0f * std::tan(theta / 2) * _camera.focus_dist;
+        auto viewport_width = viewport_height * static_cast<float>(extent.width) / static_cast<float>(extent.height);
+
+        auto w = glm::normalize(_camera.lookfrom - _camera.lookat);
+        auto u = glm::normalize(glm::cross(_camera.vup, w));
+        auto v = glm::cross(w, u);
+
+        auto viewport_u = viewport_width * u;
+        auto viewport_v = -viewport_height * v;
+        auto pixel_delta_u = viewport_u / static_cast<float>(extent.width);
+        auto pixel_delta_v = viewport_v / static_cast<float>(extent.height);
+        auto viewport_upper_left = _camera.lookfrom - _camera.focus_dist * w - viewport_u / 2.0f - viewport_v / 2.0f;
+        auto defocus_radius = _camera.focus_dist * std::tan(glm::radians(_camera.defocus_angle / 2));
+        auto depth_of_field = _camera.defocus_angle > 0 ? 1.0f : 0.0f;
+
+        ubo.camera_center = glm::vec4(_camera.lookfrom, 1.0f);
+        ubo.pixel00 = glm::vec4(viewport_upper_left + 0.5f * (pixel_delta_u + pixel_delta_v), 1.0f);
+        ubo.pixel_delta_u = glm::vec4(pixel_delta_u, 0.0f);
+        ubo.pixel_delta_v = glm::vec4(pixel_delta_v, 0.0f);
+        ubo.defocus_disk_u = glm::vec4(u * defocus_radius, depth_of_field);
+        ubo.defocus_disk_v = glm::vec4(v * defocus_radius, depth_of_field);
+        ubo.samples_per_pixel = static_cast<uint32_t>(std::max(_camera.samples_per_pixel, 1));
+        ubo.max_depth = static_cast<uint32_t>(std::max(_camera.max_depth, 1));
     }
 
     void GraphicalEnvironment::update_backgroung_color() {
@@ -402,6 +680,7 @@ namespace VulkanImpl
     }
 
     void GraphicalEnvironment::recreate_swap_chain() {
+        trace_scope trace("recreate_swap_chain", "vulkan");
         std::clog << "Recreate swap chain" << std::endl;
         vkDeviceWaitIdle(_device->device());
 
@@ -411,13 +690,84 @@ namespace VulkanImpl
         _device->init_swap_chain(_settings, _surface, _window);
         _device->init_image_views();
         frame_buffers_init();
+
+        // Everything is idle: no image is in use. The new swap chain may have another number of
+        // images, so all per-image state is built anew before the command buffers are recorded,
+        // and another extent, so are the images the compute pass renders and accumulates into;
+        // the descriptor sets rebuilt below bind the new ones.
+        UploadBatch transitions(*_device, _command_buffers[PipelineType::Compute]->compute_command_pool(), _device->compute_queue());
+        _compute_image->resize(transitions);
+        transitions.submit();
+        auto images_count = _device->swap_chain_image_count();
+        for (auto &[type, commands] : _command_buffers) {
+            commands->resize(images_count);
+        }
+        _uniform_buffers = std::make_unique<UniformBuffers>(*_device.get(), images_count, sizeof(UniformBufferObject));
+        _descriptors_manager->rebuild_descriptors(_textures, *_compute_image, *_uniform_buffers, storage_buffers());
+        _stale_texture_sets.clear();
+        if (_asset_streamer) {
+            _asset_streamer->release_replaced_images();
+        }
+        _gpu_profiler->resize(images_count);
+        _images_in_flight.assign(static_cast<size_t>(images_count), nullptr);
+        _frame_uniforms_dirty = true;
+        _accumulated_frames = 0;
+        record_command_buffers();
     }
 
     void GraphicalEnvironment::add_spheres(const std::vector<RayTracingProject::Sphere> &spheres)
     {
-        for (const auto& s : spheres) {
-            _spheres_buffer->append(s);
+        _spheres.insert(_spheres.end(), spheres.begin(), spheres.end());
+        _accumulated_frames = 0;
+        if (!_spheres_buffer) {
+            return;  // Uploaded by init()
+        }
+        vkDeviceWaitIdle(_device->device());
+        fill_scene_buffers();
+        UploadBatch uploads(*_device, _command_buffers[PipelineType::Graphics]->graphics_command_pool(), _device->graphics_queue());
+        _spheres_buffer->upload(uploads);
+        _bvh_buffer->upload(uploads);
+        uploads.submit();
+    }
+
+    std::map<BindingKey, VkDescriptorBufferInfo> GraphicalEnvironment::storage_buffers() const
+    {
+        return {{BindingKey::Spheres, _spheres_buffer->descriptor_info()},
+                {BindingKey::BvhNodes, _bvh_buffer->descriptor_info()}};
+    }
+
+    void GraphicalEnvironment::fill_scene_buffers()
+    {
+        trace_scope trace("fill_scene_buffers", "vulkan", static_cast<int64_t>(_spheres.size()));
+        _spheres_buffer->clear();
+        _bvh_buffer->clear();
+        auto count = std::min(_spheres.size(), _spheres_buffer->capacity());
+        if (count < _spheres.size()) {
+            std::cerr << "Sphere buffer is full, " << _spheres.size() - count << " spheres dropped" << std::endl;
+        }
+        if (!_settings.gpu_bvh || count == 0) {
+            for (size_t i = 0; i < count; ++i) {
+                _spheres_buffer->append(_spheres[i]);
+            }
+            return;
+        }
+
+        // The BVH is built by the CPU renderer's builder, over proxies with the spheres' bounds,
+        // and the spheres are stored in its primitive order, so leaves address them directly.
+        hittable_list proxies;
+        for (size_t i = 0; i < count; ++i) {
+            const auto &s = _spheres[i];
+            proxies.add(make_shared<sphere>(point3(s.center.x, s.center.y, s.center.z), s.radius, nullptr));
+        }
+        bvh_node bvh(proxies);
+        for (auto index : bvh.primitive_order()) {
+            _spheres_buffer->append(_spheres[index]);
+        }
+        for (const auto &node : flatten_bvh_for_gpu(bvh)) {
+            _bvh_buffer->append(node);
         }
+        std::clog << "GPU BVH: " << _bvh_buffer->size() << " nodes over " << count << " spheres, built in "
+                  << bvh.build_milliseconds() << " ms" << std::endl;
     }
 
 } // namespace
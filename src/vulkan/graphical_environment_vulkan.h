@@ -1,6 +1,8 @@
 #pragma once
 
+#include <algorithm>
 #include <map>
+#include <optional>
 #include <vulkan/vulkan.h>
 #include <GLFW/glfw3.h>
 
@@ -8,6 +10,9 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include "asset_streamer.h"
+#include "bvh_gpu.h"
+
 #include "command_buffers.h"
 #include "common_objects.h"
 #include "compute_image.h"
@@ -16,11 +21,14 @@
 #include "descriptors_manager.h"
 #include "frame.h"
 #include "frame_buffers.h"
+#include "gpu_profiler.h"
 #include "graphical_environment.h"
+#include "pipeline_cache.h"
 #include "ray_tracing_pipeline.h"
 #include "render_pass.h"
 #include "shader_modules.h"
 #include "texture.h"
+#include "upload_batch.h"
 #include "user_control.h"
 #include "validation.h"
 #include "vertex_buffer.h"
@@ -34,17 +42,25 @@ class GraphicalEnvironment : public ::RayTracingProject::GraphicalEnvironment
 {
 public:
     GraphicalEnvironment(RayTracingProject::GraphicalEnvironmentSettings settings = {})
+        : _settings(settings)
     {
         _shader_modules = std::make_unique<ShaderModules>();
     }
 
     ~GraphicalEnvironment() override {
         std::clog << "Tearing down" << std::endl;
+        _asset_streamer.reset();
         _frames.clear();
+        _gpu_profiler.reset();
         _frame_buffers.reset();
         _spheres_buffer.reset();
+        _bvh_buffer.reset();
         _device->cleanup_swap_chain();
         _pipelines.clear();
+        if (_pipeline_cache) {
+            _pipeline_cache->save();
+            _pipeline_cache.reset();
+        }
         _render_pass.reset();
         _shader_modules.reset();
         _descriptors_manager.reset();
@@ -53,14 +69,20 @@ public:
         _command_buffers.clear();
         _textures.clear();
 
+        _compute_image.reset();
+
         _device.reset();
-        vkDestroySurfaceKHR(_instance, _surface, nullptr);
+        if (_surface != VK_NULL_HANDLE) {
+            vkDestroySurfaceKHR(_instance, _surface, nullptr);
+        }
         _validation.reset();
         vkDestroyInstance(_instance, 0);
         std::clog << "Instance deleted" << std::endl;
-        glfwDestroyWindow(_window);
-        std::clog << "Window deleted" << std::endl;
-        glfwTerminate();
+        if (_window != nullptr) {
+            glfwDestroyWindow(_window);
+            std::clog << "Window deleted" << std::endl;
+            glfwTerminate();
+        }
         std::clog << "Environment termninated" << std::endl;
     }
 
@@ -85,12 +107,61 @@ public:
 
     void add_spheres(const std::vector<RayTracingProject::Sphere> &spheres) override;
 
+    void set_camera(const RayTracingProject::CameraSettings &camera) override {
+        _camera = camera;
+        _frame_uniforms_dirty = true;
+        _accumulated_frames = 0;
+    }
+
     void dump_device_info() const;
 
+    // Time init took to create the pipelines, shorter when the pipeline cache was loaded.
+    double pipeline_creation_milliseconds() const {
+        return _pipeline_creation_ms;
+    }
+
+    bool pipeline_cache_loaded() const {
+        return _pipeline_cache && _pipeline_cache->loaded();
+    }
+
+    // Queue submits init needed to upload the textures and buffers, 1 unless the staging ring filled up.
+    uint32_t startup_upload_submits() const {
+        return _startup_upload_submits;
+    }
+
+    // Textures are streamed in after init; until then they show a white placeholder. Waits, up
+    // to the timeout, for all of them; returns whether they all arrived or failed to load.
+    bool wait_for_textures(std::chrono::milliseconds timeout);
+
+    // Rolling average of the GPU time of a pass, 0 until its first timestamps were read back.
+    double gpu_milliseconds(GpuPass pass) const {
+        return _gpu_profiler ? _gpu_profiler->average_milliseconds(pass) : 0;
+    }
+
+    // Times the command buffers of all images were recorded: once at init, then again only when
+    // the swap chain or the descriptors change, not per frame.
+    uint32_t command_buffer_recordings() const {
+        return _command_buffer_recordings;
+    }
+
+    // Samples per pixel averaged into the current image. Frames accumulate until the camera,
+    // the scene or the extent changes, so a still view keeps converging.
+    uint64_t accumulated_samples() const {
+        return uint64_t(_accumulated_frames) * static_cast<uint64_t>(std::max(_camera.samples_per_pixel, 1));
+    }
+
+    size_t streamed_textures() const {
+        return _asset_streamer ? _asset_streamer->streamed_count() : 0;
+    }
+
     void start_interactive_loop(std::chrono::milliseconds duration = std::chrono::seconds(3)) override;
 
     void draw_frame();
 
+    // Renders one frame into the compute image and reads it back: RGBA8 rows, top to bottom,
+    // of width x height of the settings. Only in headless mode.
+    std::vector<uint8_t> render_offscreen();
+
     void recreate_swap_chain();
 
     void framebuffer_resized() {
@@ -109,11 +180,38 @@ private:
     void frame_buffers_init();
     void frames_init();
 
-    ImageIndex draw_frame_computational();
+    // The image the compute pass rendered for, none when the swap chain had to be recreated.
+    std::optional<ImageIndex> draw_frame_computational();
 
     void draw_frame_graphical(ImageIndex imageIndex);
 
-    void update_uniform_buffer(FrameIndex current_frame);
+    void fill_scene_buffers();
+
+    // Bindings of the scene storage buffers in the descriptor sets.
+    std::map<BindingKey, VkDescriptorBufferInfo> storage_buffers() const;
+
+    // Records the compute and graphics command buffers of every image. The GPU must be idle.
+    void record_command_buffers();
+
+    // Records the command buffers of one image, which must not be in use by the GPU.
+    void record_command_buffer(ImageIndex image_index);
+
+    // Waits until the image is no longer used by the frame that last rendered to it.
+    void wait_for_image(ImageIndex image_index);
+
+    // Whether the frame that last rendered to the image has completed, without waiting.
+    bool image_idle(ImageIndex image_index) const;
+
+    // Swaps in streamed textures and points the descriptors at them. Never waits for I/O or
+    // the GPU: the sets of images still in flight are updated when they are free.
+    void poll_textures();
+
+    // Points the set of the image at the streamed textures if it still shows the replaced
+    // ones, and frees those once no set does. The image must not be in use by the GPU.
+    void refresh_textures(ImageIndex image_index);
+
+    void update_uniform_buffer(ImageIndex image_index);
+    void update_camera_uniforms(UniformBufferObject &ubo, VkExtent2D extent) const;
     void update_backgroung_color();
 
     void image_memory_barrier(
@@ -127,28 +225,43 @@ private:
 
     const RayTracingProject::GraphicalEnvironmentSettings _settings;
     uint32_t _current_frame = 0;
+    uint32_t _frame_index = 0;  // Frames rendered so far
     bool _framebuffer_resized = false;
 
     VkInstance _instance = VK_NULL_HANDLE;
     GLFWwindow* _window = nullptr;
-    VkSurfaceKHR _surface;
+    VkSurfaceKHR _surface = VK_NULL_HANDLE;
     std::map<PipelineType, std::unique_ptr<Pipeline>> _pipelines;
+    std::unique_ptr<PipelineCache> _pipeline_cache;
+    double _pipeline_creation_ms = 0;
+    uint32_t _startup_upload_submits = 0;
     std::unique_ptr<Device> _device;
     std::unique_ptr<RenderPass> _render_pass;
     std::unique_ptr<ShaderModules> _shader_modules;
     std::unique_ptr<FrameBuffers> _frame_buffers;
     std::unique_ptr<VertexBuffer> _vertex_buffer;
-    std::unique_ptr<DataBuffer<RayTracingProject::Sphere, 200>> _spheres_buffer;
+    std::vector<RayTracingProject::Sphere> _spheres;
+    std::unique_ptr<DataBuffer<RayTracingProject::Sphere>> _spheres_buffer;
+    std::unique_ptr<DataBuffer<bvh_gpu_node>> _bvh_buffer;
+    RayTracingProject::CameraSettings _camera;
     std::map<PipelineType, std::unique_ptr<CommandBuffers>> _command_buffers;
     std::unique_ptr<UniformBuffers> _uniform_buffers;
+    UniformBufferObject _frame_uniforms{};  // Rebuilt when the camera or the extent changes
+    bool _frame_uniforms_dirty = true;
+    uint32_t _accumulated_frames = 0;  // Frames in the accumulation image
+    uint32_t _command_buffer_recordings = 0;
     std::unique_ptr<Validation> _validation;
     std::unique_ptr<DescriptorsManager> _descriptors_manager;
 
     std::vector<std::string> _texture_files;
     std::vector<std::unique_ptr<Texture>> _textures;
+    std::unique_ptr<AssetStreamer> _asset_streamer;
+    std::vector<bool> _stale_texture_sets;  // Per image, set still points at replaced textures
     std::unique_ptr<ComputeImage> _compute_image;
 
     std::vector<std::unique_ptr<Frame>> _frames;
+    std::vector<Frame *> _images_in_flight;  // Frame that last rendered to each image
+    std::unique_ptr<GpuProfiler> _gpu_profiler;
 
     UserControl _user_control;
     VkClearValue _background = {{{0.0f, 0.0f, 0.0f, 0.5f}}};
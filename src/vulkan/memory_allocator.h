@@ -0,0 +1,276 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "buddy_allocator.h"
+#include "graphical_environment.h"
+
+namespace VulkanImpl
+{
+
+// Memory of one buffer or image: a range of a shared block, or a dedicated VkDeviceMemory.
+struct Allocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    void *mapped = nullptr;  // Start of the range when the memory is host visible
+    uint32_t memory_type = 0;
+    bool linear = true;      // Buffers and linear images, kept apart from optimal tiling images
+    int block = -1;          // Index of the block in its pool, -1 for dedicated memory
+};
+
+struct MemoryStats {
+    uint32_t device_allocations = 0;      // Live vkAllocateMemory allocations
+    uint32_t max_device_allocations = 0;  // maxMemoryAllocationCount of the device
+    uint32_t blocks = 0;
+    uint32_t dedicated = 0;
+    uint32_t allocations = 0;             // Live buffers and images
+    VkDeviceSize reserved_bytes = 0;      // Device memory held, blocks and dedicated
+    VkDeviceSize used_bytes = 0;          // Of it handed out, with the buddy rounding
+    VkDeviceSize requested_bytes = 0;     // Of it asked for
+};
+
+// Device memory for all buffers and images. Small resources are sub-allocated by a buddy
+// allocator from large blocks, one set of blocks per memory type and tiling, so the device
+// sees few vkAllocateMemory calls; resources larger than half a block get memory of their own.
+// Host visible blocks stay mapped for their lifetime, since a VkDeviceMemory can't be mapped
+// by several users at once.
+class MemoryAllocator {
+public:
+    static constexpr VkDeviceSize s_default_block_size = VkDeviceSize(64) << 20;
+    static constexpr VkDeviceSize s_min_allocation = 256;
+
+    MemoryAllocator(VkDevice device, VkPhysicalDevice physical_device, VkDeviceSize block_size = s_default_block_size)
+        : _device(device), _block_size(block_size) {
+        vkGetPhysicalDeviceMemoryProperties(physical_device, &_memory_properties);
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physical_device, &properties);
+        _max_device_allocations = properties.limits.maxMemoryAllocationCount;
+    }
+
+    ~MemoryAllocator() {
+        for (auto &[key, pool] : _pools) {
+            for (auto &block : pool) {
+                if (block) {
+                    if (!block->buddy.empty()) {
+                        std::cerr << "Memory block freed with " << block->buddy.allocation_count() << " live allocations" << std::endl;
+                    }
+                    vkFreeMemory(_device, block->memory, nullptr);
+                }
+            }
+        }
+        if (_dedicated != 0) {
+            std::cerr << _dedicated << " dedicated allocations leaked" << std::endl;
+        }
+    }
+
+    uint32_t find_memory_type(uint32_t type_bits, VkMemoryPropertyFlags properties) const {
+        for (uint32_t i = 0; i < _memory_properties.memoryTypeCount; i++)
+        {
+            if ((type_bits & (1 << i)) && (_memory_properties.memoryTypes[i].propertyFlags & properties) == properties)
+            {
+                return i;
+            }
+        }
+        LOG_AND_THROW(std::runtime_error("failed to find suitable memory type!"));
+    }
+
+    Allocation allocate(const VkMemoryRequirements &requirements, VkMemoryPropertyFlags properties, bool linear) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        Allocation allocation;
+        allocation.memory_type = find_memory_type(requirements.memoryTypeBits, properties);
+        allocation.size = requirements.size;
+        allocation.linear = linear;
+
+        auto block_size = pool_block_size(allocation.memory_type);
+        if (requirements.size > block_size / 2) {
+            allocation.memory = allocate_device_memory(requirements.size, allocation.memory_type, &allocation.mapped);
+            ++_dedicated;
+            _dedicated_bytes += requirements.size;
+            return allocation;
+        }
+
+        auto &pool = _pools[{allocation.memory_type, linear}];
+        auto place = [&](size_t b) {
+            auto offset = pool[b]->buddy.allocate(requirements.size, requirements.alignment);
+            if (offset == BuddyAllocator::npos) {
+                return false;
+            }
+            allocation.memory = pool[b]->memory;
+            allocation.offset = offset;
+            allocation.block = static_cast<int>(b);
+            if (pool[b]->mapped != nullptr) {
+                allocation.mapped = static_cast<char *>(pool[b]->mapped) + offset;
+            }
+            return true;
+        };
+        for (size_t b = 0; b < pool.size(); ++b) {
+            if (pool[b] && place(b)) {
+                return allocation;
+            }
+        }
+
+        // No room in the blocks there are: a new one, in the slot of a released block if any.
+        auto slot = std::find(pool.begin(), pool.end(), nullptr) - pool.begin();
+        if (slot == static_cast<ptrdiff_t>(pool.size())) {
+            pool.emplace_back();
+        }
+        pool[slot] = std::make_unique<Block>(block_size);
+        pool[slot]->memory = allocate_device_memory(block_size, allocation.memory_type, &pool[slot]->mapped);
+        if (place(slot)) {
+            return allocation;
+        }
+        LOG_AND_THROW(std::runtime_error("failed to sub-allocate memory!"));
+    }
+
+    Allocation allocate_buffer_memory(VkBuffer buffer, VkMemoryPropertyFlags properties) {
+        VkMemoryRequirements requirements;
+        vkGetBufferMemoryRequirements(_device, buffer, &requirements);
+        auto allocation = allocate(requirements, properties, true);
+        if (vkBindBufferMemory(_device, buffer, allocation.memory, allocation.offset) != VK_SUCCESS)
+        {
+            free(allocation);
+            LOG_AND_THROW(std::runtime_error("failed to bind buffer memory!"));
+        }
+        return allocation;
+    }
+
+    Allocation allocate_image_memory(VkImage image, VkImageTiling tiling, VkMemoryPropertyFlags properties) {
+        VkMemoryRequirements requirements;
+        vkGetImageMemoryRequirements(_device, image, &requirements);
+        auto allocation = allocate(requirements, properties, tiling == VK_IMAGE_TILING_LINEAR);
+        if (vkBindImageMemory(_device, image, allocation.memory, allocation.offset) != VK_SUCCESS)
+        {
+            free(allocation);
+            LOG_AND_THROW(std::runtime_error("failed to bind image memory!"));
+        }
+        return allocation;
+    }
+
+    // Returns the memory; the allocation is reset. Freeing an empty allocation does nothing.
+    void free(Allocation &allocation) {
+        if (allocation.memory == VK_NULL_HANDLE) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (allocation.block < 0) {
+            if (allocation.mapped != nullptr) {
+                vkUnmapMemory(_device, allocation.memory);
+            }
+            vkFreeMemory(_device, allocation.memory, nullptr);
+            --_dedicated;
+            _dedicated_bytes -= allocation.size;
+        } else {
+            auto &pool = _pools[{allocation.memory_type, allocation.linear}];
+            auto &block = pool[static_cast<size_t>(allocation.block)];
+            assert(block && block->memory == allocation.memory);
+            block->buddy.free(allocation.offset);
+            // Empty blocks go back to the device, except the first one of the pool.
+            if (block->buddy.empty() && allocation.block > 0) {
+                vkFreeMemory(_device, block->memory, nullptr);
+                block.reset();
+            }
+        }
+        allocation = Allocation{};
+    }
+
+    MemoryStats stats() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        MemoryStats stats;
+        stats.max_device_allocations = _max_device_allocations;
+        stats.dedicated = _dedicated;
+        stats.allocations = _dedicated;
+        stats.reserved_bytes = _dedicated_bytes;
+        stats.used_bytes = _dedicated_bytes;
+        stats.requested_bytes = _dedicated_bytes;
+        for (const auto &[key, pool] : _pools) {
+            for (const auto &block : pool) {
+                if (block) {
+                    ++stats.blocks;
+                    stats.allocations += static_cast<uint32_t>(block->buddy.allocation_count());
+                    stats.reserved_bytes += block->buddy.size();
+                    stats.used_bytes += block->buddy.used_bytes();
+                    stats.requested_bytes += block->buddy.requested_bytes();
+                }
+            }
+        }
+        stats.device_allocations = stats.blocks + stats.dedicated;
+        return stats;
+    }
+
+    void dump_stats(std::ostream &out) const {
+        auto s = stats();
+        constexpr double mib = 1024.0 * 1024.0;
+        out << "Device memory: " << s.allocations << " resources in " << s.blocks << " blocks + "
+            << s.dedicated << " dedicated, " << s.device_allocations << " of " << s.max_device_allocations
+            << " device allocations; " << s.requested_bytes / mib << " MiB requested, "
+            << s.used_bytes / mib << " MiB used, " << s.reserved_bytes / mib << " MiB reserved" << std::endl;
+    }
+
+private:
+    MemoryAllocator(const MemoryAllocator &) = delete;
+    MemoryAllocator &operator=(const MemoryAllocator &) = delete;
+
+    struct Block {
+        explicit Block(VkDeviceSize size) : buddy(size, s_min_allocation) {}
+
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        void *mapped = nullptr;
+        BuddyAllocator buddy;
+    };
+
+    // The default block size, or the largest power of two up to an eighth of a small heap.
+    VkDeviceSize pool_block_size(uint32_t memory_type) const {
+        auto heap = _memory_properties.memoryHeaps[_memory_properties.memoryTypes[memory_type].heapIndex].size;
+        auto size = _block_size;
+        while (size > s_min_allocation && size > heap / 8) {
+            size >>= 1;
+        }
+        return size;
+    }
+
+    VkDeviceMemory allocate_device_memory(VkDeviceSize size, uint32_t memory_type, void **mapped) {
+        VkMemoryAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = size;
+        allocInfo.memoryTypeIndex = memory_type;
+
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        if (vkAllocateMemory(_device, &allocInfo, nullptr, &memory) != VK_SUCCESS)
+        {
+            LOG_AND_THROW(std::runtime_error("failed to allocate device memory!"));
+        }
+
+        *mapped = nullptr;
+        if (_memory_properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+            if (vkMapMemory(_device, memory, 0, VK_WHOLE_SIZE, 0, mapped) != VK_SUCCESS)
+            {
+                vkFreeMemory(_device, memory, nullptr);
+                LOG_AND_THROW(std::runtime_error("failed to map device memory!"));
+            }
+        }
+        return memory;
+    }
+
+    const VkDevice _device;
+    const VkDeviceSize _block_size;
+    VkPhysicalDeviceMemoryProperties _memory_properties;
+    uint32_t _max_device_allocations = 0;
+
+    mutable std::mutex _mutex;
+    std::map<std::pair<uint32_t, bool>, std::vector<std::unique_ptr<Block>>> _pools;
+    uint32_t _dedicated = 0;
+    VkDeviceSize _dedicated_bytes = 0;
+};
+
+}  // namespace
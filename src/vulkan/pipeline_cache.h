@@ -0,0 +1,169 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "device.h"
+#include "graphical_environment.h"
+
+namespace VulkanImpl
+{
+
+// VkPipelineCache kept on disk between runs, so the driver doesn't compile the shaders again on
+// every launch. The file starts with the identity of the device and driver it was written by;
+// data of another device or driver version is dropped and the cache starts out empty.
+class PipelineCache {
+public:
+    PipelineCache(const Device &device, std::string path) : _device(device), _path(std::move(path)) {}
+
+    ~PipelineCache() {
+        vkDestroyPipelineCache(_device.device(), _cache, nullptr);
+    }
+
+    void init() {
+        std::vector<char> data = load();
+        _loaded = !data.empty();
+
+        VkPipelineCacheCreateInfo createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+        createInfo.initialDataSize = data.size();
+        createInfo.pInitialData = data.empty() ? nullptr : data.data();
+        if (vkCreatePipelineCache(_device.device(), &createInfo, nullptr, &_cache) != VK_SUCCESS)
+        {
+            LOG_AND_THROW(std::runtime_error("failed to create pipeline cache!"));
+        }
+        std::clog << "Pipeline cache " << (_loaded ? "loaded from " : "created, nothing usable in ") << _path << std::endl;
+    }
+
+    // Writes a temporary file and renames it, so a crash never leaves a torn cache behind.
+    void save() const {
+        if (_cache == VK_NULL_HANDLE || _path.empty()) {
+            return;
+        }
+        size_t size = 0;
+        if (vkGetPipelineCacheData(_device.device(), _cache, &size, nullptr) != VK_SUCCESS) {
+            std::cerr << "Pipeline cache size query failed" << std::endl;
+            return;
+        }
+        std::vector<char> data(size);
+        if (vkGetPipelineCacheData(_device.device(), _cache, &size, data.data()) != VK_SUCCESS) {
+            std::cerr << "Pipeline cache data query failed" << std::endl;
+            return;
+        }
+
+        Header header = device_header();
+        header.data_size = size;
+        auto temp_path = _path + ".tmp";
+        {
+            std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            out.write(data.data(), static_cast<std::streamsize>(size));
+            if (!out) {
+                std::cerr << "Failed to write pipeline cache " << temp_path << std::endl;
+                return;
+            }
+        }
+        std::remove(_path.c_str());
+        if (std::rename(temp_path.c_str(), _path.c_str()) != 0) {
+            std::cerr << "Failed to replace pipeline cache " << _path << std::endl;
+            return;
+        }
+        std::clog << "Pipeline cache saved, " << size << " bytes" << std::endl;
+    }
+
+    VkPipelineCache cache() const {
+        return _cache;
+    }
+
+    // Whether the cache was seeded from a file of this device and driver.
+    bool loaded() const {
+        return _loaded;
+    }
+
+private:
+    PipelineCache(const PipelineCache &) = delete;
+    PipelineCache &operator=(const PipelineCache &) = delete;
+
+    static constexpr char s_magic[8] = {'R', 'T', 'P', 'C', 'A', 'C', 'H', 'E'};
+    static constexpr uint32_t s_version = 1;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t vendor_id;
+        uint32_t device_id;
+        uint32_t driver_version;
+        uint8_t pipeline_cache_uuid[VK_UUID_SIZE];
+        uint64_t data_size;
+    };
+
+    Header device_header() const {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(_device.physical_device(), &properties);
+
+        Header header{};
+        memcpy(header.magic, s_magic, sizeof(s_magic));
+        header.version = s_version;
+        header.vendor_id = properties.vendorID;
+        header.device_id = properties.deviceID;
+        header.driver_version = properties.driverVersion;
+        memcpy(header.pipeline_cache_uuid, properties.pipelineCacheUUID, VK_UUID_SIZE);
+        return header;
+    }
+
+    // The cache data of the file, empty when there is none for this device and driver.
+    std::vector<char> load() const {
+        if (_path.empty()) {
+            return {};
+        }
+        std::ifstream in(_path, std::ios::binary);
+        if (!in) {
+            return {};
+        }
+
+        Header header{};
+        in.read(reinterpret_cast<char *>(&header), sizeof(header));
+        Header expected = device_header();
+        if (!in || memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version) {
+            std::clog << "Pipeline cache " << _path << " is not a cache file, ignored" << std::endl;
+            return {};
+        }
+        if (header.vendor_id != expected.vendor_id || header.device_id != expected.device_id ||
+            header.driver_version != expected.driver_version ||
+            memcmp(header.pipeline_cache_uuid, expected.pipeline_cache_uuid, VK_UUID_SIZE) != 0) {
+            std::clog << "Pipeline cache " << _path << " is of another device or driver, ignored" << std::endl;
+            return {};
+        }
+
+        auto data_start = in.tellg();
+        in.seekg(0, std::ios::end);
+        if (static_cast<uint64_t>(in.tellg() - data_start) != header.data_size) {
+            std::clog << "Pipeline cache " << _path << " is truncated, ignored" << std::endl;
+            return {};
+        }
+        in.seekg(data_start);
+
+        std::vector<char> data(header.data_size);
+        in.read(data.data(), static_cast<std::streamsize>(data.size()));
+        if (!in) {
+            std::clog << "Pipeline cache " << _path << " is truncated, ignored" << std::endl;
+            return {};
+        }
+        return data;
+    }
+
+    const Device &_device;
+    const std::string _path;
+    VkPipelineCache _cache = VK_NULL_HANDLE;
+    bool _loaded = false;
+};
+
+}  // namespace
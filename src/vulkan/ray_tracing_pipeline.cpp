@@ -119,7 +119,7 @@ void GraphicsPipeline::init_graphics_pipeline(ShaderModules &shader_modules, VkD
     pipelineInfo.renderPass = render_pass.render_pass();
     pipelineInfo.subpass = 0;
 
-    if (auto err = vkCreateGraphicsPipelines(_device.device(), VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &_pipeline);
+    if (auto err = vkCreateGraphicsPipelines(_device.device(), _cache, 1, &pipelineInfo, nullptr, &_pipeline);
         err != VK_SUCCESS) {
         auto msg = std::string("failed to create graphics pipeline! err=") + std::to_string(err);
         LOG_AND_THROW(std::runtime_error(msg));
@@ -146,7 +146,7 @@ void ComputePipeline::init(ShaderModules &shader_modules, VkDescriptorSetLayout
     pipelineInfo.layout = _pipeline_layout;
     pipelineInfo.stage = loaded_shaders[0];
 
-    if (vkCreateComputePipelines(_device.device(), VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &_pipeline) != VK_SUCCESS)
+    if (vkCreateComputePipelines(_device.device(), _cache, 1, &pipelineInfo, nullptr, &_pipeline) != VK_SUCCESS)
     {
         LOG_AND_THROW(std::runtime_error("failed to create compute pipeline!"));
     }
@@ -31,9 +31,10 @@ public:
     }
 
 protected:
-    Pipeline(const Device& device) : _device(device) {}
+    Pipeline(const Device& device, VkPipelineCache cache) : _device(device), _cache(cache) {}
 
     const Device &_device;
+    const VkPipelineCache _cache;  // May be VK_NULL_HANDLE
     VkPipelineLayout _pipeline_layout = VK_NULL_HANDLE;
     VkPipeline _pipeline = VK_NULL_HANDLE;
 };
@@ -41,7 +42,7 @@ protected:
 class GraphicsPipeline : public Pipeline
 {
 public:
-    GraphicsPipeline(const Device &device) : Pipeline(device) {}
+    GraphicsPipeline(const Device &device, VkPipelineCache cache = VK_NULL_HANDLE) : Pipeline(device, cache) {}
     ~GraphicsPipeline() override
     {
     }
@@ -59,7 +60,7 @@ private:
 class ComputePipeline : public Pipeline
 {
 public:
-    ComputePipeline(const Device &device) : Pipeline(device) {}
+    ComputePipeline(const Device &device, VkPipelineCache cache = VK_NULL_HANDLE) : Pipeline(device, cache) {}
     ~ComputePipeline() override
     {
         vkDestroyPipeline(_device.device(), _pipeline, nullptr);
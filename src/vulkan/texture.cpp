@@ -1,49 +1,66 @@
 #include "texture.h"
 
+#include <cassert>
+#include <utility>
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb/stb_image.h"
 
 namespace VulkanImpl
 {
 
-    void Texture::load(VkCommandPool command_pool)
+    // static
+    TexturePixels Texture::decode(const std::string &file)
     {
         int texWidth, texHeight, texChannels;
-        stbi_uc *pixels = stbi_load(_file.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
-        VkDeviceSize imageSize = texWidth * texHeight * 4;
-
+        stbi_uc *pixels = stbi_load(file.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
         if (!pixels)
         {
-            throw std::runtime_error("failed to load texture image!");
+            throw std::runtime_error("failed to load texture image " + file + "!");
         }
 
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-
-        void *data;
-        vkMapMemory(_device.device(), stagingBufferMemory, 0, imageSize, 0, &data);
-        memcpy(data, pixels, static_cast<size_t>(imageSize));
-        vkUnmapMemory(_device.device(), stagingBufferMemory);
-
+        TexturePixels result;
+        result.width = static_cast<uint32_t>(texWidth);
+        result.height = static_cast<uint32_t>(texHeight);
+        result.pixels.assign(pixels, pixels + size_t(texWidth) * texHeight * 4);
         stbi_image_free(pixels);
+        return result;
+    }
 
-        createImage(texWidth, texHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+    void Texture::init_placeholder(UploadBatch &uploads)
+    {
+        const uint8_t white[4] = {255, 255, 255, 255};
+        createImage(1, 1, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, _texture_image, _texture_image_memory);
 
-        transitionImageLayout(_texture_image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, command_pool);
-        copyBufferToImage(stagingBuffer, _texture_image, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight), command_pool);
-        transitionImageLayout(_texture_image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, command_pool);
+        uploads.copy_to_image(white, sizeof(white), _texture_image, 1, 1,
+                              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
 
-        vkDestroyBuffer(_device.device(), stagingBuffer, nullptr);
-        vkFreeMemory(_device.device(), stagingBufferMemory, nullptr);
-
-        init_image_view();
+        _texture_image_view = _device.createImageView(_texture_image, VK_FORMAT_R8G8B8A8_SRGB);
         init_image_sampler();
     }
 
-    void Texture::init_image_view() {
-        _texture_image_view = _device.createImageView(_texture_image, VK_FORMAT_R8G8B8A8_SRGB);
+    VkImage Texture::stage_image(uint32_t width, uint32_t height)
+    {
+        destroy_image(_staged_image, _staged_image_memory, _staged_image_view);
+        createImage(width, height, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, _staged_image, _staged_image_memory);
+        _staged_image_view = _device.createImageView(_staged_image, VK_FORMAT_R8G8B8A8_SRGB);
+        return _staged_image;
+    }
+
+    void Texture::swap_staged_image()
+    {
+        assert(_staged_image != VK_NULL_HANDLE);
+        std::swap(_texture_image, _staged_image);
+        std::swap(_texture_image_memory, _staged_image_memory);
+        std::swap(_texture_image_view, _staged_image_view);
+        _streamed = true;
+    }
+
+    void Texture::release_replaced_image()
+    {
+        destroy_image(_staged_image, _staged_image_memory, _staged_image_view);
     }
 
     void Texture::init_image_sampler() {
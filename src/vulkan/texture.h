@@ -2,25 +2,45 @@
 
 #include <vulkan/vulkan.h>
 
+#include <cstdint>
+#include <string>
+#include <vector>
+
 #include "vulkan_common_objects.h"
 #include "buffer_base.h"
+#include "upload_batch.h"
 
 namespace VulkanImpl
 {
 
+// Decoded RGBA8 texels of an image file.
+struct TexturePixels {
+    std::vector<uint8_t> pixels;
+    uint32_t width = 0;
+    uint32_t height = 0;
+};
+
+// Sampled texture of an image file. It starts out as a 1x1 white placeholder, so descriptors can
+// point at it before the file is decoded; the streamed image replaces it once uploaded.
 class Texture : public BufferBase {
 public:
     Texture(Device &device, const std::string &file, BindingKey key) : BufferBase(device), _file(file), _key(key) {}
 
     ~Texture() {
-        if (_texture_image) {
-            vkDestroyImage(_device.device(), _texture_image, nullptr);
-            vkFreeMemory(_device.device(), _texture_image_memory, nullptr);
+        destroy_image(_texture_image, _texture_image_memory, _texture_image_view);
+        destroy_image(_staged_image, _staged_image_memory, _staged_image_view);
+        if (_texture_sampler != VK_NULL_HANDLE) {
             vkDestroySampler(_device.device(), _texture_sampler, nullptr);
-            vkDestroyImageView(_device.device(), _texture_image_view, nullptr);
         }
     }
 
+    // Reads and decodes the file, on any thread.
+    static TexturePixels decode(const std::string &file);
+
+    const std::string &file() const {
+        return _file;
+    }
+
     VkImageView texture_image_view() const {
         return _texture_image_view;
     }
@@ -29,13 +49,31 @@ public:
         return _texture_sampler;
     }
 
-    void load(VkCommandPool command_pool);
+    // Records the upload of the placeholder; the texture is usable once the batch is submitted.
+    void init_placeholder(UploadBatch &uploads);
+
+    // Creates the image the decoded file is uploaded to, in the undefined layout. The image a
+    // previous swap replaced must have been released.
+    VkImage stage_image(uint32_t width, uint32_t height);
+
+    // The staged image, uploaded and in the shader read layout, replaces the shown one. The old
+    // image moves to the staged slot, since frames in flight may still read it; it stays there
+    // until release_replaced_image().
+    void swap_staged_image();
+
+    // Frees the image the last swap replaced. No descriptor set the GPU may still use can point
+    // at it any more.
+    void release_replaced_image();
+
+    bool streamed() const {
+        return _streamed;
+    }
 
 private:
     Texture(const Texture &) = delete;
     Texture &operator=(const Texture &) = delete;
 
-    void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage &image, VkDeviceMemory &imageMemory)
+    void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage &image, Allocation &imageMemory)
     {
         VkImageCreateInfo imageInfo{};
         imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -57,107 +95,32 @@ private:
             throw std::runtime_error("failed to create image!");
         }
 
-        VkMemoryRequirements memRequirements;
-        vkGetImageMemoryRequirements(_device.device(), image, &memRequirements);
-
-        VkMemoryAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = memRequirements.size;
-        allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-        if (vkAllocateMemory(_device.device(), &allocInfo, nullptr, &imageMemory) != VK_SUCCESS)
-        {
-            throw std::runtime_error("failed to allocate image memory!");
-        }
-
-        vkBindImageMemory(_device.device(), image, imageMemory, 0);
+        imageMemory = _device.allocator().allocate_image_memory(image, tiling, properties);
     }
 
-    void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, VkCommandPool command_pool)
-    {
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands(command_pool);
-
-        VkImageMemoryBarrier barrier{};
-        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        barrier.oldLayout = oldLayout;
-        barrier.newLayout = newLayout;
-        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.image = image;
-        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        barrier.subresourceRange.baseMipLevel = 0;
-        barrier.subresourceRange.levelCount = 1;
-        barrier.subresourceRange.baseArrayLayer = 0;
-        barrier.subresourceRange.layerCount = 1;
-
-        VkPipelineStageFlags sourceStage;
-        VkPipelineStageFlags destinationStage;
-
-        if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL)
-        {
-            barrier.srcAccessMask = 0;
-            barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-            sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-            destinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-        }
-        else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)
-        {
-            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-            sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-            destinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    void destroy_image(VkImage &image, Allocation &memory, VkImageView &view) {
+        if (view != VK_NULL_HANDLE) {
+            vkDestroyImageView(_device.device(), view, nullptr);
+            view = VK_NULL_HANDLE;
         }
-        else
-        {
-            throw std::invalid_argument("unsupported layout transition!");
+        if (image != VK_NULL_HANDLE) {
+            vkDestroyImage(_device.device(), image, nullptr);
+            image = VK_NULL_HANDLE;
         }
-
-        vkCmdPipelineBarrier(
-            commandBuffer,
-            sourceStage, destinationStage,
-            0,
-            0, nullptr,
-            0, nullptr,
-            1, &barrier);
-
-        endSingleTimeCommands(commandBuffer, command_pool, _device.graphics_queue());
-    }
-
-    void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, VkCommandPool command_pool)
-    {
-        assert(width > 10);
-        assert(height > 10);
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands(command_pool);
-
-        VkBufferImageCopy region{};
-        region.bufferOffset = 0;
-        region.bufferRowLength = 0;
-        region.bufferImageHeight = 0;
-        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        region.imageSubresource.mipLevel = 0;
-        region.imageSubresource.baseArrayLayer = 0;
-        region.imageSubresource.layerCount = 1;
-        region.imageOffset = {0, 0, 0};
-        region.imageExtent = {
-            width,
-            height,
-            1};
-
-        vkCmdCopyBufferToImage(commandBuffer, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-
-        endSingleTimeCommands(commandBuffer, command_pool, _device.graphics_queue());
+        _device.allocator().free(memory);
     }
 
-    void init_image_view();
     void init_image_sampler();
 
     const std::string _file;
     const BindingKey _key;
-    VkImage _texture_image;
-    VkDeviceMemory _texture_image_memory;
-    VkImageView _texture_image_view;
-    VkSampler _texture_sampler;
+    VkImage _texture_image = VK_NULL_HANDLE;
+    Allocation _texture_image_memory;
+    VkImageView _texture_image_view = VK_NULL_HANDLE;
+    VkSampler _texture_sampler = VK_NULL_HANDLE;
+    VkImage _staged_image = VK_NULL_HANDLE;
+    Allocation _staged_image_memory;
+    VkImageView _staged_image_view = VK_NULL_HANDLE;
+    bool _streamed = false;
 };
 }
@@ -1,7 +1,8 @@
 #pragma once
 
 #include <vulkan/vulkan.h>
-#include <map>
+#include <algorithm>
+#include <cstring>
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
@@ -16,78 +17,72 @@ struct UniformBufferObject
     alignas(16) glm::mat4 model;
     alignas(16) glm::mat4 view;
     alignas(16) glm::mat4 proj;
+
+    // Path tracer view, set up like camera::initialize() on the CPU side.
+    alignas(16) glm::vec4 camera_center;
+    alignas(16) glm::vec4 pixel00;
+    alignas(16) glm::vec4 pixel_delta_u;
+    alignas(16) glm::vec4 pixel_delta_v;
+    alignas(16) glm::vec4 defocus_disk_u;  // w is 1 when depth of field is on
+    alignas(16) glm::vec4 defocus_disk_v;
+    alignas(4) uint32_t frame_index;  // Seeds the random numbers of a frame
+    alignas(4) uint32_t samples_per_pixel;
+    alignas(4) uint32_t max_depth;
+    alignas(4) uint32_t use_bvh;  // 0 tests every sphere, the brute force reference
+    alignas(4) uint32_t accumulated_frames;  // Frames already in the accumulation image, 0 restarts it
 };
 
+// Per-frame uniforms in one persistently mapped buffer, one slot per swapchain image. Command
+// buffers are recorded once per image and bind the common set with the dynamic offset of their
+// slot, so a frame only copies its data into the slot; the previous use of the image must be
+// complete.
 class UniformBuffers : public BufferBase {
 public:
-    UniformBuffers(Device &device, int size) : BufferBase(device), _size(size) {}
-
-    ~UniformBuffers() {
-        for (const auto& key_val : _uniform_buffers) {
-            BindingKey key = key_val.first;
-            for (size_t i = 0; i < _size; i++)
-            {
-                vkDestroyBuffer(_device.device(), _uniform_buffers[key][i], nullptr);
-                vkFreeMemory(_device.device(), _uniform_buffers_memory[key][i], nullptr);
-            }
+    UniformBuffers(Device &device, ImagesCount slots, VkDeviceSize element_size)
+        : BufferBase(device), _slots(static_cast<uint32_t>(slots)), _element_size(element_size) {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(_device.physical_device(), &properties);
+        auto alignment = std::max<VkDeviceSize>(properties.limits.minUniformBufferOffsetAlignment, 1);
+        _stride = (_element_size + alignment - 1) / alignment * alignment;
+
+        createBuffer(_stride * _slots, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, _buffer, _memory);
+        if (_memory.mapped == nullptr)
+        {
+            LOG_AND_THROW(std::runtime_error("failed to map memory"));
         }
     }
 
-    VkBuffer uniform_buffer(FrameIndex frame_index, BindingKey key) const
-    {
-        auto it = _uniform_buffers.find(key);
-        assert(it != _uniform_buffers.end());
-        assert(static_cast<size_t>(frame_index) < (*it).second.size());
-        return (*it).second[static_cast<size_t>(frame_index)];
+    ~UniformBuffers() {
+        destroyBuffer(_buffer, _memory);
     }
 
-    size_t uniform_buffer_size(FrameIndex frame_index, BindingKey key) const
-    {
-        auto it = _uniform_buffer_sizes.find(key);
-        assert(it != _uniform_buffer_sizes.end());
-        assert(static_cast<size_t>(frame_index) < (*it).second.size());
-        return (*it).second[static_cast<size_t>(frame_index)];
+    // The range of one slot, for a VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC binding.
+    VkDescriptorBufferInfo descriptor_info() const {
+        return {_buffer, 0, _element_size};
     }
 
-    template<typename T>
-    void add(BindingKey key) {
-        VkDeviceSize bufferSize = sizeof(T);
-
-        _uniform_buffers[key].resize(_size);
-        _uniform_buffers_memory[key].resize(_size);
-        _uniform_buffers_mapped[key].resize(_size);
-        _uniform_buffer_sizes[key].resize(_size);
-
-        for (size_t i = 0; i < _size; i++)
-        {
-            createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                         _uniform_buffers[key][i], _uniform_buffers_memory[key][i]);
-
-            if (vkMapMemory(_device.device(), _uniform_buffers_memory[key][i], 0, bufferSize, 0, &_uniform_buffers_mapped[key][i]) != VK_SUCCESS)
-            {
-                LOG_AND_THROW(std::runtime_error("failed to map memory"));
-            }
-            _uniform_buffer_sizes[key][i] = bufferSize;
-        }
+    uint32_t dynamic_offset(ImageIndex image_index) const {
+        assert(static_cast<uint32_t>(image_index) < _slots);
+        return static_cast<uint32_t>(_stride * static_cast<uint32_t>(image_index));
     }
 
     template <typename T>
-    void copy_to_uniform_buffers_for_frame(FrameIndex currentFrame, BindingKey key, const T &ubo)
+    void write(ImageIndex image_index, const T &data)
     {
-        assert(static_cast<size_t>(currentFrame) < _size);
-        memcpy(_uniform_buffers_mapped[key][static_cast<size_t>(currentFrame)], &ubo, sizeof(ubo));
+        assert(sizeof(T) <= _element_size);
+        memcpy(static_cast<char *>(_memory.mapped) + dynamic_offset(image_index), &data, sizeof(T));
     }
 
 private:
     UniformBuffers(const UniformBuffers &) = delete;
     UniformBuffers &operator=(const UniformBuffers &) = delete;
 
-    const int _size;
-
-    std::map<BindingKey, std::vector<VkBuffer>> _uniform_buffers;
-    std::map<BindingKey, std::vector<VkDeviceMemory>> _uniform_buffers_memory;
-    std::map<BindingKey, std::vector<void *>> _uniform_buffers_mapped;
-    std::map<BindingKey, std::vector<size_t>> _uniform_buffer_sizes;
+    const uint32_t _slots;
+    const VkDeviceSize _element_size;
+    VkDeviceSize _stride = 0;
+    VkBuffer _buffer = VK_NULL_HANDLE;
+    Allocation _memory;
 };
 
 } // namespace
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "buffer_base.h"
+
+namespace VulkanImpl
+{
+
+// Records uploads of buffers and images into one command buffer and submits them together with
+// a single fence, instead of a submit and a queue wait per copy. The data is staged in a host
+// visible ring, created with the first data staged; when the ring is full the batch is submitted
+// and the ring starts over, and data larger than the whole ring gets a staging buffer of its own
+// until the submit. A batch that only records layout transitions allocates no staging memory.
+class UploadBatch : public BufferBase {
+public:
+    static constexpr VkDeviceSize s_default_staging_size = VkDeviceSize(32) << 20;
+
+    UploadBatch(Device &device, VkCommandPool command_pool, VkQueue queue, VkDeviceSize staging_size = s_default_staging_size)
+        : BufferBase(device), _command_pool(command_pool), _queue(queue), _staging_size(staging_size) {
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandPool = _command_pool;
+        allocInfo.commandBufferCount = 1;
+        if (vkAllocateCommandBuffers(_device.device(), &allocInfo, &_command_buffer) != VK_SUCCESS)
+        {
+            LOG_AND_THROW(std::runtime_error("failed to allocate upload command buffer!"));
+        }
+
+        VkFenceCreateInfo fenceInfo{};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        if (vkCreateFence(_device.device(), &fenceInfo, nullptr, &_fence) != VK_SUCCESS)
+        {
+            LOG_AND_THROW(std::runtime_error("failed to create upload fence!"));
+        }
+    }
+
+    // Uploads still recorded are submitted, a batch is never dropped. A failed submit was logged
+    // by LOG_AND_THROW already and can't propagate from here; the queue is drained so nothing
+    // freed below is still in use.
+    ~UploadBatch() {
+        if (_recording) {
+            std::cerr << "Upload batch destroyed before submit" << std::endl;
+            try {
+                submit();
+            } catch (const std::exception &) {
+                vkQueueWaitIdle(_queue);
+            }
+        }
+        vkDestroyFence(_device.device(), _fence, nullptr);
+        vkFreeCommandBuffers(_device.device(), _command_pool, 1, &_command_buffer);
+        if (_staging_buffer != VK_NULL_HANDLE) {
+            destroyBuffer(_staging_buffer, _staging_memory);
+        }
+    }
+
+    // Copies `size` bytes to `dst` at `dst_offset`. The data is staged right away.
+    void copy_to_buffer(const void *data, VkDeviceSize size, VkBuffer dst, VkDeviceSize dst_offset = 0) {
+        if (size == 0) {
+            return;
+        }
+        auto [src, src_offset] = stage(data, size);
+
+        VkBufferCopy region{};
+        region.srcOffset = src_offset;
+        region.dstOffset = dst_offset;
+        region.size = size;
+        vkCmdCopyBuffer(_command_buffer, src, dst, 1, &region);
+    }
+
+    // Fills a whole image with tightly packed texels, from the undefined layout to `final_layout`,
+    // made visible to `dst_access` at `dst_stage`.
+    void copy_to_image(const void *data, VkDeviceSize size, VkImage image, uint32_t width, uint32_t height,
+                       VkImageLayout final_layout, VkPipelineStageFlags dst_stage, VkAccessFlags dst_access) {
+        auto [src, src_offset] = stage(data, size);
+
+        transition_image(image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+
+        VkBufferImageCopy region{};
+        region.bufferOffset = src_offset;
+        region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+        region.imageOffset = {0, 0, 0};
+        region.imageExtent = {width, height, 1};
+        vkCmdCopyBufferToImage(_command_buffer, src, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+        transition_image(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, final_layout,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, dst_stage, dst_access);
+    }
+
+    void transition_image(VkImage image, VkImageLayout old_layout, VkImageLayout new_layout,
+                          VkPipelineStageFlags src_stage, VkAccessFlags src_access,
+                          VkPipelineStageFlags dst_stage, VkAccessFlags dst_access) {
+        begin();
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.oldLayout = old_layout;
+        barrier.newLayout = new_layout;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = image;
+        barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+        barrier.srcAccessMask = src_access;
+        barrier.dstAccessMask = dst_access;
+        vkCmdPipelineBarrier(_command_buffer, src_stage, dst_stage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+    }
+
+    // Submits everything recorded since the last submit and waits for it. Does nothing when
+    // nothing was recorded.
+    void submit() {
+        if (!_recording) {
+            return;
+        }
+        // Buffer copies are made visible to every later reader; images got their own barriers.
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+        vkCmdPipelineBarrier(_command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+                             1, &barrier, 0, nullptr, 0, nullptr);
+
+        if (vkEndCommandBuffer(_command_buffer) != VK_SUCCESS)
+        {
+            LOG_AND_THROW(std::runtime_error("vkEndCommandBuffer failed"));
+        }
+        _recording = false;
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &_command_buffer;
+        if (vkQueueSubmit(_queue, 1, &submitInfo, _fence) != VK_SUCCESS)
+        {
+            LOG_AND_THROW(std::runtime_error("vkQueueSubmit failed"));
+        }
+        if (vkWaitForFences(_device.device(), 1, &_fence, VK_TRUE, UINT64_MAX) != VK_SUCCESS)
+        {
+            LOG_AND_THROW(std::runtime_error("upload fence wait failed"));
+        }
+        vkResetFences(_device.device(), 1, &_fence);
+        vkResetCommandBuffer(_command_buffer, 0);
+
+        for (auto &[buffer, memory] : _oversized) {
+            destroyBuffer(buffer, memory);
+        }
+        _oversized.clear();
+        _head = 0;
+        ++_submits;
+    }
+
+    uint32_t submit_count() const {
+        return _submits;
+    }
+
+    VkDeviceSize staged_bytes() const {
+        return _staged_bytes;
+    }
+
+private:
+    // Offsets in the ring keep the alignment buffer to image copies need for any texel size.
+    static constexpr VkDeviceSize s_alignment = 16;
+
+    void begin() {
+        if (_recording) {
+            return;
+        }
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (vkBeginCommandBuffer(_command_buffer, &beginInfo) != VK_SUCCESS)
+        {
+            LOG_AND_THROW(std::runtime_error("vkBeginCommandBuffer failed"));
+        }
+        _recording = true;
+    }
+
+    // Copies the data to staging memory; returns the buffer and offset to copy from.
+    std::pair<VkBuffer, VkDeviceSize> stage(const void *data, VkDeviceSize size) {
+        _staged_bytes += size;
+        if (size > _staging_size) {
+            begin();
+            _oversized.emplace_back();
+            auto &[buffer, memory] = _oversized.back();
+            createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                         buffer, memory);
+            memcpy(memory.mapped, data, size);
+            return {buffer, 0};
+        }
+
+        if (_staging_buffer == VK_NULL_HANDLE) {
+            createBuffer(_staging_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                         _staging_buffer, _staging_memory);
+        }
+        auto offset = (_head + s_alignment - 1) / s_alignment * s_alignment;
+        if (offset + size > _staging_size) {
+            // The ring is full: what is in flight has to land before its space is reused.
+            submit();
+            offset = 0;
+        }
+        begin();
+        memcpy(static_cast<char *>(_staging_memory.mapped) + offset, data, size);
+        _head = offset + size;
+        return {_staging_buffer, offset};
+    }
+
+    const VkCommandPool _command_pool;
+    const VkQueue _queue;
+    const VkDeviceSize _staging_size;
+    VkBuffer _staging_buffer = VK_NULL_HANDLE;
+    Allocation _staging_memory;
+    VkDeviceSize _head = 0;
+    std::vector<std::pair<VkBuffer, Allocation>> _oversized;
+
+    VkCommandBuffer _command_buffer = VK_NULL_HANDLE;
+    VkFence _fence = VK_NULL_HANDLE;
+    bool _recording = false;
+    uint32_t _submits = 0;
+    VkDeviceSize _staged_bytes = 0;
+};
+
+}  // namespace
@@ -5,6 +5,7 @@
 #include <vector>
 
 #include "buffer_base.h"
+#include "upload_batch.h"
 #include "vertex.h"
 
 namespace VulkanImpl
@@ -15,11 +16,8 @@ public:
     VertexBuffer(Device &device) : BufferBase(device) {}
 
     ~VertexBuffer() {
-        vkDestroyBuffer(_device.device(), _index_buffer, nullptr);
-        vkFreeMemory(_device.device(), _index_buffer_memory, nullptr);
-
-        vkDestroyBuffer(_device.device(), _vertex_buffer, nullptr);
-        vkFreeMemory(_device.device(), _vertex_buffer_memory, nullptr);
+        destroyBuffer(_index_buffer, _index_buffer_memory);
+        destroyBuffer(_vertex_buffer, _vertex_buffer_memory);
     }
 
     VkBuffer vertex_buffer() const {
@@ -30,10 +28,10 @@ public:
         return _index_buffer;
     }
 
-    void init(VkCommandPool command_pool)
+    void init(UploadBatch &uploads)
     {
-        create_vertex_buffer(command_pool);
-        create_index_buffer(command_pool);
+        create_vertex_buffer(uploads);
+        create_index_buffer(uploads);
     }
 
     int indices_size() const {
@@ -44,56 +42,32 @@ private:
     VertexBuffer(const VertexBuffer &) = delete;
     VertexBuffer &operator=(const VertexBuffer &) = delete;
 
-    void create_vertex_buffer(VkCommandPool command_pool)
+    void create_vertex_buffer(UploadBatch &uploads)
     {
         VkDeviceSize bufferSize = sizeof(_vertices[0]) * _vertices.size();
 
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-
-        void *data;
-        vkMapMemory(_device.device(), stagingBufferMemory, 0, bufferSize, 0, &data);
-        memcpy(data, _vertices.data(), (size_t)bufferSize);
-        vkUnmapMemory(_device.device(), stagingBufferMemory);
-
         createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, _vertex_buffer, _vertex_buffer_memory);
 
-        copyBuffer(stagingBuffer, _vertex_buffer, bufferSize, command_pool);
-
-        vkDestroyBuffer(_device.device(), stagingBuffer, nullptr);
-        vkFreeMemory(_device.device(), stagingBufferMemory, nullptr);
+        uploads.copy_to_buffer(_vertices.data(), bufferSize, _vertex_buffer);
     }
 
-    void create_index_buffer(VkCommandPool command_pool)
+    void create_index_buffer(UploadBatch &uploads)
     {
         VkDeviceSize bufferSize = sizeof(_indices[0]) * _indices.size();
 
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-
-        void *data;
-        vkMapMemory(_device.device(), stagingBufferMemory, 0, bufferSize, 0, &data);
-        memcpy(data, _indices.data(), (size_t)bufferSize);
-        vkUnmapMemory(_device.device(), stagingBufferMemory);
-
         createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
             _index_buffer, _index_buffer_memory);
 
-        copyBuffer(stagingBuffer, _index_buffer, bufferSize, command_pool);
-
-        vkDestroyBuffer(_device.device(), stagingBuffer, nullptr);
-        vkFreeMemory(_device.device(), stagingBufferMemory, nullptr);
+        uploads.copy_to_buffer(_indices.data(), bufferSize, _index_buffer);
     }
 
     static const std::vector<Vertex> _vertices;
     static const std::vector<uint16_t> _indices;
 
-    VkBuffer _vertex_buffer;
-    VkDeviceMemory _vertex_buffer_memory;
-    VkBuffer _index_buffer;
-    VkDeviceMemory _index_buffer_memory;
+    VkBuffer _vertex_buffer = VK_NULL_HANDLE;
+    Allocation _vertex_buffer_memory;
+    VkBuffer _index_buffer = VK_NULL_HANDLE;
+    Allocation _index_buffer_memory;
 };
 
 } // namespace
@@ -13,19 +13,27 @@ enum class BindingSequence : uint32_t
     COMMON_UBO = 0,
     TEXTURE_IMAGE_SAMPLER,
     FRAME_IMAGE,
+    SPHERES,
+    BVH_NODES,
+    ACCUMULATION_IMAGE,
 };
 
 enum class BindingType {
     Buffer,
     Image,
     SwapChainImage,
+    AccumulationImage,
+    StorageBuffer,
     Acceleration
 };
 
 enum class BindingKey {
     PrimaryTexture,
     CommonUBO,
-    FrameImage
+    FrameImage,
+    Spheres,
+    BvhNodes,
+    AccumulationImage
 };
 
 enum class BindingsMaxCount : uint32_t {};
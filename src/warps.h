@@ -0,0 +1,151 @@
+#pragma once
+#include "rtweekend.h"
+
+#include <cstddef>
+
+// Closed-form maps from uniform values in [0,1) to the distributions the renderer samples.
+// Every warp consumes a fixed number of values and has no data dependent loops, so it composes
+// with stratified and low-discrepancy samplers. The batch versions take and return
+// structure-of-arrays data and are written as plain branch-free loops the compiler can
+// vectorize.
+
+struct sample_2d {
+    double x, y;
+};
+
+// Shirley & Chiu concentric mapping of the square to the unit disk (z = 0). Keeps strata
+// compact, unlike the polar mapping.
+inline vec3 warp_concentric_disk(sample_2d u) {
+    auto a = 2 * u.x - 1;
+    auto b = 2 * u.y - 1;
+    bool use_a = fabs(a) > fabs(b);
+    auto r = use_a ? a : b;
+    auto numerator = use_a ? b : a;
+    auto denominator = use_a ? a : b;
+    auto ratio = denominator != 0 ? numerator / denominator : 0.0;
+    auto phi = use_a ? (pi / 4) * ratio : (pi / 2) - (pi / 4) * ratio;
+    return vec3(r * std::cos(phi), r * std::sin(phi), 0);
+}
+
+inline vec3 warp_uniform_sphere(sample_2d u) {
+    auto z = 1 - 2 * u.x;
+    auto r = std::sqrt(fmax(0.0, 1 - z * z));
+    auto phi = 2 * pi * u.y;
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+inline double uniform_sphere_pdf() {
+    return 1 / (4 * pi);
+}
+
+// Uniform point in the unit ball: a sphere direction scaled by the cube root of a third value.
+inline vec3 warp_uniform_ball(sample_2d u, double radius_u) {
+    return std::cbrt(radius_u) * warp_uniform_sphere(u);
+}
+
+// Cosine-weighted direction on the hemisphere around +z (Malley's method).
+inline vec3 warp_cosine_hemisphere(sample_2d u) {
+    auto d = warp_concentric_disk(u);
+    auto z = std::sqrt(fmax(0.0, 1 - d.x() * d.x() - d.y() * d.y()));
+    return vec3(d.x(), d.y(), z);
+}
+
+inline double cosine_hemisphere_pdf(double cos_theta) {
+    return fmax(0.0, cos_theta) / pi;
+}
+
+// GGX (Trowbridge-Reitz) microfacet normal around +z for roughness alpha, distributed with
+// pdf D(h) cos(theta_h).
+inline vec3 warp_ggx(sample_2d u, double alpha) {
+    auto tan2_theta = alpha * alpha * u.x / fmax(1 - u.x, 1e-12);
+    auto cos_theta = 1 / std::sqrt(1 + tan2_theta);
+    auto sin_theta = std::sqrt(fmax(0.0, 1 - cos_theta * cos_theta));
+    auto phi = 2 * pi * u.y;
+    return vec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+}
+
+inline double ggx_pdf(const vec3& h, double alpha) {
+    auto cos_theta = h.z();
+    if (cos_theta <= 0)
+        return 0;
+    auto a2 = alpha * alpha;
+    auto d = cos_theta * cos_theta * (a2 - 1) + 1;
+    return a2 / (pi * d * d) * cos_theta;
+}
+
+// Orthonormal basis around a unit vector, without branches on the vector's direction
+// (Duff et al., "Building an Orthonormal Basis, Revisited", 2017).
+class onb {
+  public:
+    explicit onb(const vec3& n) : w(n) {
+        auto sign = std::copysign(1.0, n.z());
+        auto a = -1 / (sign + n.z());
+        auto b = n.x() * n.y() * a;
+        u = vec3(1 + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+        v = vec3(b, sign + n.y() * n.y() * a, -n.y());
+    }
+
+    vec3 local(const vec3& a) const {
+        return a.x() * u + a.y() * v + a.z() * w;
+    }
+
+    vec3 u, v, w;
+};
+
+// Batch versions over n samples.
+
+inline void warp_concentric_disk(size_t n, const double* ux, const double* uy, double* x, double* y) {
+    for (size_t i = 0; i < n; ++i) {
+        auto a = 2 * ux[i] - 1;
+        auto b = 2 * uy[i] - 1;
+        bool use_a = fabs(a) > fabs(b);
+        auto r = use_a ? a : b;
+        auto numerator = use_a ? b : a;
+        auto denominator = use_a ? a : b;
+        auto ratio = denominator != 0 ? numerator / denominator : 0.0;
+        auto phi = use_a ? (pi / 4) * ratio : (pi / 2) - (pi / 4) * ratio;
+        x[i] = r * std::cos(phi);
+        y[i] = r * std::sin(phi);
+    }
+}
+
+inline void warp_uniform_sphere(size_t n, const double* ux, const double* uy, double* x, double* y, double* z) {
+    for (size_t i = 0; i < n; ++i) {
+        auto zi = 1 - 2 * ux[i];
+        auto r = std::sqrt(fmax(0.0, 1 - zi * zi));
+        auto phi = 2 * pi * uy[i];
+        x[i] = r * std::cos(phi);
+        y[i] = r * std::sin(phi);
+        z[i] = zi;
+    }
+}
+
+inline void warp_cosine_hemisphere(size_t n, const double* ux, const double* uy, double* x, double* y, double* z) {
+    warp_concentric_disk(n, ux, uy, x, y);
+    for (size_t i = 0; i < n; ++i)
+        z[i] = std::sqrt(fmax(0.0, 1 - x[i] * x[i] - y[i] * y[i]));
+}
+
+// Replacements for the old rejection sampling helpers, drawing a fixed count of random_double()
+// values.
+
+inline vec3 random_in_unit_disk() {
+    return warp_concentric_disk({random_double(), random_double()});
+}
+
+inline vec3 random_in_unit_sphere() {
+    sample_2d u = {random_double(), random_double()};
+    return warp_uniform_ball(u, random_double());
+}
+
+inline vec3 random_unit_vector() {
+    return warp_uniform_sphere({random_double(), random_double()});
+}
+
+inline vec3 random_on_hemisphere(const vec3& normal) {
+    vec3 on_unit_sphere = random_unit_vector();
+    if (dot(on_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
+        return on_unit_sphere;
+    else
+        return -on_unit_sphere;
+}
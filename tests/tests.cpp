@@ -1,11 +1,37 @@
+#include "accelerator.h"
+#include "aov.h"
+#include "arena.h"
+#include "buddy_allocator.h"
+#include "bvh.h"
+#include "bvh_cache.h"
+#include "bvh_gpu.h"
 #include "camera.h"
 #include "camera_cpu.h"
+#include "checkpoint.h"
+#include "denoise.h"
+#include "distributed.h"
+#include "framebuffer.h"
+#include "heatmap.h"
+#include "image_io.h"
 #include "hittable_list.h"
 #include "material.h"
+#include "sampler.h"
+#include "scene_file.h"
 #include "sphere.h"
+#include "stats.h"
+#include "trace.h"
+#include "warps.h"
 
 #include <gtest/gtest.h>
 
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <numeric>
+#include <sstream>
+#include <thread>
+
 class RayTracingFixture : public ::testing::Test {
 protected:
     void SetUp() override {
@@ -28,8 +54,60 @@ protected:
         world.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground_material));
     }
 
+    void add_random_spheres() {
+        for (int a = -11; a < 11; a++) {
+            for (int b = -11; b < 11; b++) {
+                point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+                auto sphere_material = make_shared<lambertian>(color::random() * color::random());
+                if (random_double() < 0.5) {
+                    auto center2 = center + vec3(0, random_double(0,.5), 0);
+                    world.add(make_shared<sphere>(center, center2, 0.2, sphere_material));
+                } else {
+                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    // Camera rays through every `stride`-th pixel, with the closest hits found by a linear scan.
+    void trace_reference(int stride) {
+        cam.initialize();
+        auto image_size = cam.image_size();
+        for (int j = 0; j < image_size.second; j += stride) {
+            for (int i = 0; i < image_size.first; i += stride) {
+                rays.push_back(cam.get_ray(i, j));
+            }
+        }
+        for (size_t k = 0; k < rays.size(); ++k) {
+            hit_record rec;
+            expected_hit.push_back(world.hit(rays[k], interval(0.001, infinity), rec));
+            expected.push_back(rec);
+        }
+    }
+
+    // Returns the milliseconds spent tracing the reference rays through `accelerator`.
+    double expect_reference_hits(const hittable& accelerator) {
+        std::vector<hit_record> actual(rays.size());
+        std::vector<bool> actual_hit(rays.size());
+        auto trace_start = std::chrono::steady_clock::now();
+        for (size_t k = 0; k < rays.size(); ++k)
+            actual_hit[k] = accelerator.hit(rays[k], interval(0.001, infinity), actual[k]);
+        auto trace_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - trace_start).count();
+
+        for (size_t k = 0; k < rays.size(); ++k) {
+            EXPECT_EQ(expected_hit[k], actual_hit[k]);
+            if (expected_hit[k] && actual_hit[k]) {
+                EXPECT_DOUBLE_EQ(expected[k].t, actual[k].t);
+            }
+        }
+        return trace_ms;
+    }
+
     hittable_list world;
     CPUImpl::Camera cam;
+    std::vector<ray> rays;
+    std::vector<hit_record> expected;
+    std::vector<bool> expected_hit;
 };
 
 TEST_F(RayTracingFixture, PixelMatch) {
@@ -41,7 +119,996 @@ TEST_F(RayTracingFixture, PixelMatch) {
     ray r = cam.get_ray(center.first, center.second);
     color ray_color = cam.ray_color(r, cam.max_depth, world);
 
-    EXPECT_TRUE(ray_color.similar_to(color(0.253, 0.3518, 0.5))) << ray_color;
+    EXPECT_TRUE(ray_color.similar_to(color(0.2772, 0.3663, 0.5))) << ray_color;
+}
+
+TEST_F(RayTracingFixture, BvhBuildersMatchLinearScan) {
+    add_sphere();
+    add_random_spheres();
+    trace_reference(4);
+
+    bvh_options sah;
+    bvh_options lbvh;
+    lbvh.builder = bvh_builder::lbvh;
+    bvh_options lbvh_treelets = lbvh;
+    lbvh_treelets.morton_bits = 63;
+    lbvh_treelets.treelet_restructure = true;
+
+    for (const auto& options : {sah, lbvh, lbvh_treelets}) {
+        bvh_node bvh(world, options);
+        EXPECT_EQ(bvh.primitive_order().size(), world.objects.size());
+
+        auto trace_ms = expect_reference_hits(bvh);
+        std::clog << "BVH builder " << static_cast<int>(options.builder)
+                  << (options.treelet_restructure ? " +treelets" : "")
+                  << ": " << bvh.nodes().size() << " nodes, build " << bvh.build_milliseconds()
+                  << " ms, trace " << trace_ms << " ms for " << rays.size() << " rays" << std::endl;
+    }
+}
+
+// The stackless traversal of ray_tracing.comp over the GPU node layout.
+class gpu_bvh_traversal : public hittable {
+  public:
+    gpu_bvh_traversal(const bvh_node& bvh, const hittable_list& list)
+      : nodes(flatten_bvh_for_gpu(bvh)) {
+        for (auto index : bvh.primitive_order())
+            objects.push_back(list.objects[index]);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        bool hit_anything = false;
+        uint32_t current = 0;
+        while (current < nodes.size()) {
+            const auto& node = nodes[current];
+            if (!box_hit(node, r, ray_t)) {
+                current = node.skip;
+                continue;
+            }
+            auto count = node.primitives & 0xff;
+            if (count == 0) {
+                current++;
+                continue;
+            }
+            for (uint32_t i = node.primitives >> 8; i < (node.primitives >> 8) + count; ++i) {
+                if (objects[i]->hit(r, ray_t, rec)) {
+                    hit_anything = true;
+                    ray_t.max = rec.t;
+                }
+            }
+            current = node.skip;
+        }
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return aabb(); }
+
+    std::vector<bvh_gpu_node> nodes;
+
+  private:
+    static bool box_hit(const bvh_gpu_node& node, const ray& r, interval ray_t) {
+        for (int a = 0; a < 3; a++) {
+            auto inv_d = 1 / r.direction()[a];
+            auto t0 = (node.bounds_min[a] - r.origin()[a]) * inv_d;
+            auto t1 = (node.bounds_max[a] - r.origin()[a]) * inv_d;
+            if (inv_d < 0)
+                std::swap(t0, t1);
+            ray_t.min = std::max(ray_t.min, t0);
+            ray_t.max = std::min(ray_t.max, t1);
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+    std::vector<shared_ptr<hittable>> objects;
+};
+
+TEST_F(RayTracingFixture, GpuBvhLayoutMatchesLinearScan) {
+    add_sphere();
+    add_random_spheres();
+    trace_reference(4);
+
+    bvh_options lbvh;
+    lbvh.builder = bvh_builder::lbvh;
+    for (const auto& options : {bvh_options{}, lbvh}) {
+        bvh_node bvh(world, options);
+        gpu_bvh_traversal gpu(bvh, world);
+        ASSERT_EQ(gpu.nodes.size(), bvh.nodes().size());
+        EXPECT_EQ(gpu.nodes[0].skip, gpu.nodes.size());
+
+        // Every primitive slot is in exactly one leaf.
+        size_t primitives = 0;
+        for (const auto& node : gpu.nodes)
+            primitives += node.primitives & 0xff;
+        EXPECT_EQ(primitives, world.objects.size());
+
+        expect_reference_hits(gpu);
+    }
+
+    // A leaf over more primitives than the 8 bit count holds is split into a run of leaves.
+    auto box = world.bounding_box();
+    bvh_linear_node leaf{};
+    for (int a = 0; a < 3; a++) {
+        leaf.bounds_min[a] = box.axis(a).min;
+        leaf.bounds_max[a] = box.axis(a).max;
+    }
+    leaf.count = static_cast<uint32_t>(world.objects.size());
+    std::vector<uint32_t> order(world.objects.size());
+    std::iota(order.begin(), order.end(), 0);
+    bvh_node big_leaf(world, bvh_prebuilt{{&leaf, 1}, {order.data(), order.size()}, nullptr});
+    gpu_bvh_traversal gpu(big_leaf, world);
+    ASSERT_GT(world.objects.size(), bvh_gpu_max_leaf_size);
+    ASSERT_EQ(gpu.nodes.size(), (world.objects.size() + bvh_gpu_max_leaf_size - 1) / bvh_gpu_max_leaf_size);
+    EXPECT_EQ(gpu.nodes.back().skip, gpu.nodes.size());
+    expect_reference_hits(gpu);
+}
+
+TEST_F(RayTracingFixture, BvhCacheRoundTrip) {
+    add_sphere();
+    add_random_spheres();
+    trace_reference(4);
+
+    auto cache_dir = (std::filesystem::temp_directory_path() / "rt_bvh_cache_test").string();
+    std::filesystem::remove_all(cache_dir);
+
+    bvh_options options;
+    auto content_hash = bvh_content_hash(world, options);
+    auto path = bvh_cache_path(cache_dir, content_hash);
+    EXPECT_FALSE(load_bvh_cache(path, content_hash, world.objects.size()));
+
+    auto built = make_cached_bvh(world, cache_dir, options);
+    ASSERT_TRUE(std::filesystem::exists(path));
+
+    auto load_start = std::chrono::steady_clock::now();
+    auto loaded = make_cached_bvh(world, cache_dir, options);
+    auto load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - load_start).count();
+
+    ASSERT_EQ(built->nodes().size(), loaded->nodes().size());
+    EXPECT_EQ(0, std::memcmp(built->nodes().data, loaded->nodes().data,
+                             built->nodes().size() * sizeof(bvh_linear_node)));
+    EXPECT_NE(built->nodes().data, loaded->nodes().data);
+    expect_reference_hits(*loaded);
+
+    // Files for other content or other primitive counts are rejected.
+    EXPECT_FALSE(load_bvh_cache(path, content_hash + 1, world.objects.size()));
+    EXPECT_FALSE(load_bvh_cache(path, content_hash, world.objects.size() + 1));
+
+    // A cache whose child index points past the node array is rebuilt instead of traversed.
+    {
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+        bvh_cache_header header;
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        bvh_linear_node root;
+        file.seekg(header.nodes_offset);
+        file.read(reinterpret_cast<char*>(&root), sizeof(root));
+        ASSERT_EQ(0, root.count);
+        root.offset = static_cast<uint32_t>(header.node_count);
+        file.seekp(header.nodes_offset);
+        file.write(reinterpret_cast<const char*>(&root), sizeof(root));
+    }
+    EXPECT_FALSE(load_bvh_cache(path, content_hash, world.objects.size()));
+    expect_reference_hits(*make_cached_bvh(world, cache_dir, options));
+    EXPECT_TRUE(load_bvh_cache(path, content_hash, world.objects.size()));
+
+    options.max_leaf_size = 2;
+    EXPECT_NE(content_hash, bvh_content_hash(world, options));
+
+    std::clog << "BVH cache: build " << built->build_milliseconds() << " ms, load " << load_ms << " ms" << std::endl;
+    std::filesystem::remove_all(cache_dir);
+}
+
+TEST_F(RayTracingFixture, GridMatchesLinearScan) {
+    add_sphere();
+    add_random_spheres();
+    trace_reference(4);
+
+    auto build_start = std::chrono::steady_clock::now();
+    uniform_grid grid(world);
+    auto build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - build_start).count();
+    EXPECT_EQ(grid.outlier_count(), 1u);
+
+    auto grid_ms = expect_reference_hits(grid);
+    auto bvh_ms = expect_reference_hits(bvh_node(world));
+
+    auto resolution = grid.grid_resolution();
+    std::clog << "Grid " << resolution[0] << "x" << resolution[1] << "x" << resolution[2]
+              << ": build " << build_ms << " ms, trace " << grid_ms << " ms (BVH " << bvh_ms << " ms) for "
+              << rays.size() << " rays" << std::endl;
+}
+
+TEST_F(RayTracingFixture, AcceleratorPolicy) {
+    add_sphere();
+    EXPECT_EQ(choose_accelerator(world.objects), accelerator_type::bvh);
+
+    add_random_spheres();
+    EXPECT_EQ(choose_accelerator(world.objects), accelerator_type::grid);
+
+    // A dense cluster far from the rest leaves most of the grid empty.
+    for (int i = 0; i < 400; i++) {
+        auto center = point3(100, 0, 100) + 0.5 * vec3::random();
+        world.add(make_shared<sphere>(center, 0.2, make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+    }
+    EXPECT_EQ(choose_accelerator(world.objects), accelerator_type::bvh);
+
+    accelerator_policy forced;
+    forced.type = accelerator_type::grid;
+    EXPECT_EQ(choose_accelerator(world.objects, forced), accelerator_type::grid);
+}
+
+TEST_F(RayTracingFixture, SceneFileRoundTrip) {
+    std::istringstream text(R"(
+        # Two materials, a sphere on the ground and two instances of a pyramid.
+        material ground lambertian 0.5 0.5 0.5
+        material shiny metal 0.7 0.6 0.5 0.1
+        sphere ground 0 -1000 0 1000
+        moving_sphere shiny -2 1 0 -2 1.5 0 1
+        mesh pyramid shiny
+        v -1 0 -1
+        v 1 0 -1
+        v 1 0 1
+        v -1 0 1
+        v 0 2 0
+        f 0 1 4
+        f 1 2 4
+        f 2 3 4
+        f 3 0 4
+        instance pyramid 0 0 0
+        instance pyramid 3 0 -1
+        camera aspect_ratio 1.7777777777777777
+        camera image_width 400
+        camera vfov 20
+        camera lookfrom 13 2 3
+        camera lookat 0 0 0
+        camera focus_dist 10
+    )");
+    auto description = parse_scene_text(text);
+    ASSERT_EQ(description.meshes.size(), 1u);
+    EXPECT_EQ(description.meshes[0].indices.size(), 12u);
+    EXPECT_EQ(description.instances.size(), 2u);
+
+    auto path = (std::filesystem::temp_directory_path() / "rt_scene_test.rtscene").string();
+    write_scene_binary(path, description);
+    ASSERT_TRUE(is_binary_scene_file(path));
+
+    auto from_text = build_scene(description);
+    auto from_binary = load_scene(path);
+
+    // A file cut inside a section or its header is rejected; one cut between sections is a
+    // scene without the sections that follow.
+    auto truncated_path = path + ".truncated";
+    auto size = std::filesystem::file_size(path);
+    auto camera_section = size - sizeof(scene_camera_record) - sizeof(scene_section_header);
+    for (auto cut : {size - 1, camera_section + 1, camera_section, uint64_t(sizeof(scene_file_header)) - 1}) {
+        std::filesystem::copy_file(path, truncated_path, std::filesystem::copy_options::overwrite_existing);
+        std::filesystem::resize_file(truncated_path, cut);
+        if (cut == camera_section)
+            EXPECT_EQ(load_scene(truncated_path).camera.image_width, scene_camera().image_width);
+        else
+            EXPECT_THROW(load_scene(truncated_path), std::runtime_error) << cut;
+    }
+    std::filesystem::remove(truncated_path);
+    std::filesystem::remove(path);
+
+    EXPECT_EQ(from_binary.camera.image_width, 400);
+    EXPECT_DOUBLE_EQ(from_binary.camera.vfov, 20);
+    EXPECT_DOUBLE_EQ(from_binary.camera.lookfrom.x(), 13);
+
+    from_binary.camera.apply(cam);
+    cam.defocus_angle = 0;
+    cam.initialize();
+    auto image_size = cam.image_size();
+    int hits = 0;
+    for (int j = 0; j < image_size.second; j += 8) {
+        for (int i = 0; i < image_size.first; i += 8) {
+            ray r = cam.get_ray(i, j);
+            hit_record expected_rec, actual_rec;
+            bool expected_hit = from_text.world.hit(r, interval(0.001, infinity), expected_rec);
+            ASSERT_EQ(expected_hit, from_binary.world.hit(r, interval(0.001, infinity), actual_rec));
+            if (expected_hit) {
+                EXPECT_DOUBLE_EQ(expected_rec.t, actual_rec.t);
+                ++hits;
+            }
+        }
+    }
+    EXPECT_GT(hits, 0);
+
+    std::istringstream bad("sphere missing 0 0 0 1\n");
+    EXPECT_THROW(parse_scene_text(bad), std::runtime_error);
+}
+
+TEST(SceneArena, PacksObjectsAndReleasesThemTogether) {
+    static int destroyed = 0;
+    struct tracked {
+        int value;
+        explicit tracked(int v) : value(v) {}
+        ~tracked() { destroyed++; }
+    };
+
+    shared_ptr<tracked> survivor;
+    {
+        scene_arena arena(16 * 1024);
+        auto mat = arena.make<lambertian>(color(0.5, 0.5, 0.5));
+        std::vector<shared_ptr<sphere>> spheres;
+        for (int i = 0; i < 1000; i++)
+            spheres.push_back(arena.make<sphere>(point3(i, 0, 0), 0.5, mat));
+        shared_ptr<tracked> last;
+        for (int i = 0; i < 10; i++)
+            last = arena.make<tracked>(i);
+
+        // Spheres of one block are adjacent in memory and all objects share one control block.
+        auto* first = reinterpret_cast<const char*>(spheres[0].get());
+        EXPECT_EQ(reinterpret_cast<const char*>(spheres[1].get()) - first, static_cast<ptrdiff_t>(sizeof(sphere)));
+        EXPECT_FALSE(spheres[0].owner_before(last) || last.owner_before(spheres[0]));
+
+        auto stats = arena.stats();
+        EXPECT_EQ(stats.objects, 1011u);
+        EXPECT_EQ(stats.bytes_used, sizeof(lambertian) + 1000 * sizeof(sphere) + 10 * sizeof(tracked));
+        EXPECT_LT(stats.blocks, 1000u / (16 * 1024 / sizeof(sphere)) + 4);
+
+        hit_record rec;
+        EXPECT_TRUE(spheres[5]->hit(ray(point3(5, 0, -5), vec3(0, 0, 1), 0.0), interval(0.001, infinity), rec));
+        EXPECT_EQ(rec.mat, mat);
+        EXPECT_EQ(last->value, 9);
+        EXPECT_EQ(destroyed, 0);
+        survivor = last;
+    }
+    // An object that outlives the arena keeps it alive, and the arena's objects go together.
+    EXPECT_EQ(destroyed, 0);
+    EXPECT_EQ(survivor->value, 9);
+    survivor.reset();
+    EXPECT_EQ(destroyed, 10);
+
+    auto build = [](auto make) {
+        std::vector<shared_ptr<hittable>> objects;
+        objects.reserve(100000);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < 100000; i++)
+            objects.push_back(make(point3(i, 0, 0)));
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    auto heap_ms = build([&](point3 p) { return make_shared<sphere>(p, 0.5, mat); });
+    scene_arena arena;
+    auto arena_ms = build([&](point3 p) { return arena.make<sphere>(p, 0.5, mat); });
+    std::clog << "100000 spheres: make_shared " << heap_ms << " ms, arena " << arena_ms << " ms, "
+              << arena.stats().blocks << " arena blocks" << std::endl;
+}
+
+TEST(Samplers, DeterministicAndInUnitInterval) {
+    for (auto type : {sampler_type::independent, sampler_type::stratified, sampler_type::sobol}) {
+        auto a = make_sampler(type, 16, 7);
+        auto b = make_sampler(type, 16, 7);
+        for (int sample = 0; sample < 16; sample++) {
+            a->start_pixel_sample(3, 5, sample);
+            b->start_pixel_sample(3, 5, sample);
+            for (int d = 0; d < 12; d++) {
+                auto u = a->get_1d();
+                EXPECT_EQ(u, b->get_1d());
+                EXPECT_GE(u, 0.0);
+                EXPECT_LT(u, 1.0);
+            }
+        }
+    }
+
+    // Every 1D stratum of a 16-sample pixel receives exactly one Sobol sample.
+    sobol_sampler sobol;
+    std::vector<int> strata(16, 0);
+    for (int sample = 0; sample < 16; sample++) {
+        sobol.start_pixel_sample(1, 2, sample);
+        sobol.set_dimension(sampler_vertex_dimension(3));
+        strata[static_cast<int>(sobol.get_1d() * 16)]++;
+    }
+    for (auto count : strata)
+        EXPECT_EQ(count, 1);
+}
+
+TEST_F(RayTracingFixture, SamplerRmseVsSpp) {
+    add_sphere();
+    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, make_shared<lambertian>(color(0.4, 0.2, 0.1))));
+    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, make_shared<metal>(color(0.7, 0.6, 0.5), 0.2)));
+    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, make_shared<lambertian>(color(0.2, 0.5, 0.3))));
+
+    cam.image_width = 48;
+    cam.max_depth = 6;
+    cam.initialize();
+    auto image_size = cam.image_size();
+
+    auto render = [&](sampler_type type, int spp, uint32_t seed) {
+        auto s = make_sampler(type, spp, seed);
+        std::vector<color> image;
+        for (int j = 0; j < image_size.second; ++j) {
+            for (int i = 0; i < image_size.first; ++i) {
+                color sum(0, 0, 0);
+                for (int sample = 0; sample < spp; ++sample) {
+                    s->start_pixel_sample(i, j, sample);
+                    sum += cam.ray_color(cam.get_ray(i, j, *s), cam.max_depth, world, *s);
+                }
+                image.push_back(sum / spp);
+            }
+        }
+        return image;
+    };
+
+    auto reference = render(sampler_type::sobol, 1024, 12345);
+    auto rmse = [&](const std::vector<color>& image) {
+        double sum = 0;
+        for (size_t k = 0; k < image.size(); ++k)
+            sum += (image[k] - reference[k]).length_squared() / 3;
+        return std::sqrt(sum / image.size());
+    };
+
+    std::map<std::pair<sampler_type, int>, double> error;
+    for (auto type : {sampler_type::independent, sampler_type::stratified, sampler_type::sobol}) {
+        for (int spp : {4, 16, 64}) {
+            error[{type, spp}] = rmse(render(type, spp, 1));
+            std::clog << "Sampler " << static_cast<int>(type) << " at " << spp << " spp: RMSE "
+                      << error[{type, spp}] << std::endl;
+        }
+    }
+
+    for (int spp : {16, 64}) {
+        auto independent = error[{sampler_type::independent, spp}];
+        EXPECT_LT((error[{sampler_type::sobol, spp}]), independent);
+        EXPECT_LT((error[{sampler_type::stratified, spp}]), independent);
+    }
+}
+
+TEST(Warps, ClosedFormMappings) {
+    const int n = 4096;
+    std::vector<double> ux(n), uy(n), x(n), y(n), z(n);
+    sobol_sampler s;
+    for (int i = 0; i < n; i++) {
+        s.start_pixel_sample(0, 0, i);
+        auto u = s.get_2d();
+        ux[i] = u.x;
+        uy[i] = u.y;
+    }
+
+    double mean_cos = 0, ggx_integral = 0;
+    warp_cosine_hemisphere(n, ux.data(), uy.data(), x.data(), y.data(), z.data());
+    for (int i = 0; i < n; i++) {
+        auto disk = warp_concentric_disk({ux[i], uy[i]});
+        EXPECT_LE(disk.length_squared(), 1.0 + 1e-12);
+
+        auto sphere_dir = warp_uniform_sphere({ux[i], uy[i]});
+        EXPECT_NEAR(sphere_dir.length(), 1.0, 1e-12);
+
+        auto h = warp_cosine_hemisphere({ux[i], uy[i]});
+        EXPECT_NEAR(h.length(), 1.0, 1e-9);
+        EXPECT_GE(h.z(), 0.0);
+        EXPECT_DOUBLE_EQ(h.x(), x[i]);
+        EXPECT_DOUBLE_EQ(h.z(), z[i]);
+        mean_cos += h.z() / n;
+
+        // Integrate the GGX pdf over the sphere with uniform directions.
+        ggx_integral += ggx_pdf(sphere_dir, 0.3) / uniform_sphere_pdf() / n;
+    }
+    EXPECT_NEAR(mean_cos, 2.0 / 3.0, 1e-3);  // E[cos] under cos/pi
+    EXPECT_NEAR(ggx_integral, 1.0, 0.05);
+
+    auto normal = unit_vector(vec3(0.3, -0.9, 0.2));
+    onb basis(normal);
+    EXPECT_NEAR(dot(basis.u, basis.v), 0.0, 1e-12);
+    EXPECT_NEAR(dot(basis.u, normal), 0.0, 1e-12);
+    EXPECT_NEAR(basis.u.length(), 1.0, 1e-12);
+    EXPECT_NEAR(dot(basis.local(vec3(0, 0, 1)), normal), 1.0, 1e-12);
+
+    auto m = warp_ggx({0.5, 0.25}, 0.3);
+    EXPECT_NEAR(m.length(), 1.0, 1e-12);
+    EXPECT_GT(m.z(), 0.0);
+}
+
+TEST_F(RayTracingFixture, ProgressiveRenderStopsAndAccumulates) {
+    add_sphere();
+    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, make_shared<lambertian>(color(0.4, 0.2, 0.1))));
+    cam.image_width = 32;
+    cam.max_depth = 6;
+
+    // Passes of different sizes add up to the same image.
+    progressive_settings settings;
+    settings.target_samples = 8;
+    settings.pass_samples = 8;
+    framebuffer single;
+    auto result = cam.render_progressive(world, single, settings);
+    EXPECT_EQ(result.reason, progressive_stop::target_samples);
+    EXPECT_EQ(result.passes, 1);
+
+    int flushed = 0;
+    settings.pass_samples = 3;
+    settings.on_pass = [&flushed](const framebuffer&, int) { flushed++; };
+    framebuffer passes;
+    result = cam.render_progressive(world, passes, settings);
+    EXPECT_EQ(result.samples_per_pixel, 8);
+    EXPECT_EQ(result.passes, 3);
+    EXPECT_EQ(flushed, 3);
+    for (int j = 0; j < passes.image_height(); ++j) {
+        for (int i = 0; i < passes.image_width(); ++i) {
+            EXPECT_EQ(passes.samples(i, j), 8u);
+            EXPECT_TRUE(passes.average(i, j).similar_to(single.average(i, j)));
+        }
+    }
+
+    // A budget far below the time the target needs stops the render early.
+    settings.on_pass = nullptr;
+    settings.target_samples = 1 << 20;
+    settings.pass_samples = 1;
+    settings.time_budget = 0.05;
+    framebuffer budgeted;
+    result = cam.render_progressive(world, budgeted, settings);
+    EXPECT_EQ(result.reason, progressive_stop::time_budget);
+    EXPECT_LT(result.samples_per_pixel, settings.target_samples);
+    EXPECT_LT(result.seconds, 1.0);
+
+    settings.time_budget = 0;
+    settings.pass_samples = 16;
+    settings.noise_threshold = 0.5;
+    framebuffer converged;
+    result = cam.render_progressive(world, converged, settings);
+    EXPECT_EQ(result.reason, progressive_stop::noise_threshold);
+    EXPECT_LT(converged.max_relative_error(), 0.5);
+}
+
+TEST_F(RayTracingFixture, CheckpointResumeIsBitIdentical) {
+    add_sphere();
+    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, make_shared<dielectric>(1.5)));
+    cam.image_width = 24;
+    cam.max_depth = 6;
+    auto path = (std::filesystem::temp_directory_path() / "rt_checkpoint_test.ckpt").string();
+
+    for (auto type : {sampler_type::sobol, sampler_type::random}) {
+        cam.sampling = type;
+        progressive_settings settings;
+        settings.target_samples = 9;
+        settings.pass_samples = 2;
+
+        random_generator().seed(7);
+        framebuffer uninterrupted;
+        cam.render_progressive(world, uninterrupted, settings);
+
+        // Stop after the second pass, checkpointing the way a preempted render would.
+        random_generator().seed(7);
+        {
+            checkpoint_writer writer(path);
+            auto partial = settings;
+            partial.target_samples = 4;
+            partial.on_pass = [&](const framebuffer& image, int) {
+                writer.write(image, {cam.sampling, settings.target_samples, save_random_state()});
+                writer.wait();
+            };
+            framebuffer interrupted;
+            cam.render_progressive(world, interrupted, partial);
+        }
+        random_double();  // Whatever happens after the checkpoint must not matter
+
+        framebuffer resumed;
+        auto state = load_checkpoint(path, resumed, cam.image_size().first, cam.image_size().second);
+        ASSERT_TRUE(state.has_value());
+        EXPECT_EQ(state->sampling, type);
+        EXPECT_EQ(resumed.samples(0, 0), 4u);
+        restore_random_state(state->random_state);
+        settings.target_samples = state->target_samples;
+        auto result = cam.render_progressive(world, resumed, settings);
+        EXPECT_EQ(result.samples_per_pixel, 9);
+
+        EXPECT_EQ(resumed.sample_counts(), uninterrupted.sample_counts());
+        EXPECT_EQ(resumed.luminance_squares(), uninterrupted.luminance_squares());
+        for (size_t k = 0; k < resumed.sums().size(); ++k) {
+            for (int a = 0; a < 3; a++)
+                EXPECT_EQ(resumed.sums()[k][a], uninterrupted.sums()[k][a]);
+        }
+    }
+
+    // A checkpoint of another image size, with sample counts other than its header's, or one cut
+    // short, is not resumed.
+    auto [width, height] = cam.image_size();
+    framebuffer other;
+    EXPECT_TRUE(load_checkpoint(path, other, width, height));
+    EXPECT_FALSE(load_checkpoint(path, other, width + 1, height));
+    {
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+        uint32_t samples_per_pixel = 5;
+        file.seekp(offsetof(checkpoint_header, samples_per_pixel));
+        file.write(reinterpret_cast<const char*>(&samples_per_pixel), sizeof(samples_per_pixel));
+    }
+    EXPECT_FALSE(load_checkpoint(path, other, width, height));
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+    EXPECT_FALSE(load_checkpoint(path, other, width, height));
+    std::filesystem::remove(path);
+}
+
+TEST_F(RayTracingFixture, DistributedTilesMatchLocalRender) {
+    add_sphere();
+    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, make_shared<metal>(color(0.7, 0.6, 0.5), 0.2)));
+    cam.image_width = 40;
+    cam.samples_per_pixel = 4;
+    cam.max_depth = 6;
+
+    progressive_settings settings;
+    settings.pass_samples = cam.samples_per_pixel;
+    framebuffer reference;
+    cam.render_progressive(world, reference, settings);
+
+    auto expect_reference = [&](const framebuffer& image) {
+        EXPECT_EQ(image.sample_counts(), reference.sample_counts());
+        for (size_t k = 0; k < image.sums().size(); ++k) {
+            for (int a = 0; a < 3; a++)
+                EXPECT_EQ(image.sums()[k][a], reference.sums()[k][a]);
+        }
+    };
+
+    // A worker that takes one tile and disconnects without answering.
+    auto failing_worker = [](int fd) {
+        tile_message type;
+        std::vector<char> payload;
+        receive_tile_message(fd, type, payload, sizeof(tile_request));
+        ::close(fd);
+    };
+
+    // A worker that answers its first tile with a rectangle outside of the image.
+    auto lying_worker = [](int fd) {
+        tile_message type;
+        std::vector<char> payload;
+        if (receive_tile_message(fd, type, payload, sizeof(tile_request))) {
+            tile_request request;
+            std::memcpy(&request, payload.data(), sizeof(request));
+            framebuffer tile(request.x1 - request.x0, request.y1 - request.y0, request.x0 + 1000, request.y0);
+            auto result = pack_tile_result(request.tile, tile);
+            send_tile_message(fd, tile_message::result, result.data(), result.size());
+        }
+        while (receive_tile_message(fd, type, payload, sizeof(tile_request))) {
+        }
+        ::close(fd);
+    };
+
+    // A worker that takes one tile and never answers, until the coordinator hangs up.
+    auto stalled_worker = [](int fd) {
+        tile_message type;
+        std::vector<char> payload;
+        while (receive_tile_message(fd, type, payload, sizeof(tile_request))) {
+        }
+        ::close(fd);
+    };
+
+    distributed_settings tiles;
+    tiles.tile_size = 8;
+    {
+        local_worker_pool pool(3, cam, world);
+        ASSERT_EQ(pool.processes().size(), 3u);
+        auto workers = pool.take_sockets();
+        int fds[2];
+        ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        std::thread failing(failing_worker, fds[1]);
+        workers.insert(workers.begin(), fds[0]);
+
+        framebuffer image;
+        auto result = render_distributed(cam, world, image, workers, tiles);
+        failing.join();
+        EXPECT_EQ(result.tiles, 15u);
+        EXPECT_EQ(result.workers_lost, 1u);
+        EXPECT_EQ(result.redispatched, 1u);
+        EXPECT_EQ(result.rendered_locally, 0u);
+        expect_reference(image);
+    }
+
+    // Results for another rectangle and stalled tiles are redispatched to the healthy worker.
+    {
+        local_worker_pool pool(1, cam, world);
+        auto workers = pool.take_sockets();
+        std::vector<std::thread> threads;
+        for (auto worker : {+lying_worker, +stalled_worker}) {
+            int fds[2];
+            ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+            threads.emplace_back(worker, fds[1]);
+            workers.insert(workers.begin(), fds[0]);
+        }
+
+        distributed_settings short_timeout = tiles;
+        short_timeout.tile_timeout_ms = 200;
+        framebuffer image;
+        auto result = render_distributed(cam, world, image, workers, short_timeout);
+        for (auto& thread : threads)
+            thread.join();
+        EXPECT_EQ(result.workers_lost, 2u);
+        EXPECT_EQ(result.redispatched, 2u);
+        expect_reference(image);
+    }
+
+    // With every worker gone the coordinator finishes the frame itself.
+    int fds[2];
+    ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    std::thread failing(failing_worker, fds[1]);
+    framebuffer image;
+    auto result = render_distributed(cam, world, image, {fds[0]}, tiles);
+    failing.join();
+    EXPECT_EQ(result.rendered_locally, result.tiles);
+    expect_reference(image);
+}
+
+TEST_F(RayTracingFixture, RenderStats) {
+    add_sphere();
+    add_random_spheres();
+    world = hittable_list(make_shared<bvh_node>(world));
+    cam.image_width = 32;
+    cam.max_depth = 8;
+
+    reset_render_stats();
+    progressive_settings settings;
+    settings.target_samples = 2;
+    framebuffer image;
+    cam.render_progressive(world, image, settings);
+    auto stats = collect_render_stats();
+
+    std::ostringstream json;
+    write_render_stats_json(json, stats);
+    EXPECT_NE(json.str().find("\"primary_rays\": "), std::string::npos);
+
+#ifdef RT_ENABLE_STATS
+    uint64_t primary = image.sums().size() * 2;
+    EXPECT_EQ(stats[stat_counter::primary_rays], primary);
+    uint64_t paths = 0, bounces = 0;
+    for (size_t n = 0; n < stats.path_lengths.size(); ++n) {
+        paths += stats.path_lengths[n];
+        bounces += n * stats.path_lengths[n];
+    }
+    EXPECT_EQ(paths, primary);
+    // The ray scattered at the depth limit isn't traced.
+    EXPECT_EQ(stats[stat_counter::secondary_rays], bounces - stats.path_lengths[cam.max_depth]);
+    EXPECT_EQ(stats[stat_counter::lambertian_hits], bounces);
+    EXPECT_GT(stats[stat_counter::bvh_node_visits], primary);
+    EXPECT_GT(stats[stat_counter::primitive_tests], primary);
+    EXPECT_GT(stats.stage_nanoseconds[static_cast<size_t>(stat_stage::traversal)], 0u);
+#else
+    EXPECT_EQ(stats[stat_counter::primary_rays], 0u);
+#endif
+
+    // Every render counts from zero, so a second one reports the same rays, not twice as many.
+    framebuffer again;
+    cam.render_progressive(world, again, settings);
+    EXPECT_EQ(collect_render_stats()[stat_counter::primary_rays], stats[stat_counter::primary_rays]);
+}
+
+TEST_F(RayTracingFixture, TraceRecordsScopesPerThread) {
+    add_sphere();
+    add_random_spheres();
+    cam.image_width = 64;
+    cam.max_depth = 4;
+
+    trace_start();
+    world = hittable_list(make_shared<bvh_node>(world));
+    progressive_settings settings;
+    settings.target_samples = 2;
+    settings.pass_samples = 1;
+    settings.tile_size = 16;
+    framebuffer image;
+    cam.render_progressive(world, image, settings);
+    std::ostringstream ppm;
+    image.write_ppm(ppm);
+    auto& recorder = trace_recorder::instance();
+    recorder.record_gpu({"gpu_ray_trace", "gpu", recorder.now_ns() - 1000, recorder.now_ns(), 0});
+    trace_stop();
+
+    {
+        trace_scope ignored("after_stop");
+    }
+
+    // One bvh_build, one progressive_render, two passes, 4 x 3 tiles per pass, one write_image,
+    // one GPU pass.
+    EXPECT_EQ(trace_recorder::instance().event_count(), 1u + 1 + 2 + 2 * 12 + 1 + 1);
+
+    std::ostringstream json;
+    trace_recorder::instance().write_json(json);
+    auto text = json.str();
+    EXPECT_EQ(text.rfind("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", 0), 0u);
+    EXPECT_NE(text.find("\"name\": \"bvh_build\", \"cat\": \"bvh\", \"ph\": \"X\""), std::string::npos);
+    EXPECT_NE(text.find("\"name\": \"tile\""), std::string::npos);
+    EXPECT_NE(text.find("\"args\": {\"id\": 11}"), std::string::npos);
+    EXPECT_EQ(text.find("after_stop"), std::string::npos);
+    EXPECT_NE(text.find("\"tid\": 65536, \"args\": {\"name\": \"GPU\"}"), std::string::npos);
+    EXPECT_NE(text.find("\"name\": \"gpu_ray_trace\", \"cat\": \"gpu\", \"ph\": \"X\", \"pid\": 1, \"tid\": 65536"), std::string::npos);
+}
+
+TEST_F(RayTracingFixture, CostHeatmaps) {
+    add_sphere();
+    add_random_spheres();
+    world = hittable_list(make_shared<bvh_node>(world));
+    cam.image_width = 32;
+    cam.max_depth = 8;
+
+    cost_heatmaps heatmaps;
+    progressive_settings settings;
+    settings.target_samples = 4;
+    settings.pass_samples = 2;
+    settings.heatmaps = &heatmaps;
+    framebuffer image;
+    cam.render_progressive(world, image, settings);
+    ASSERT_EQ(heatmaps.image_width(), image.image_width());
+    ASSERT_EQ(heatmaps.image_height(), image.image_height());
+
+    auto bottom = image.image_height() - 1;
+    for (int x = 0; x < image.image_width(); ++x) {
+        EXPECT_GT(heatmaps.value(heatmap_channel::nanoseconds, x, 0), 0.0f);
+#ifdef RT_ENABLE_STATS
+        // The top row sees the sky, the bottom row the ground and the spheres on it.
+        EXPECT_FLOAT_EQ(heatmaps.value(heatmap_channel::path_length, x, 0), 1.0f);
+        EXPECT_GT(heatmaps.value(heatmap_channel::path_length, x, bottom), 1.0f);
+        EXPECT_GT(heatmaps.value(heatmap_channel::traversal_steps, x, 0), 0.0f);
+        EXPECT_GT(heatmaps.value(heatmap_channel::primitive_tests, x, bottom),
+                  heatmaps.value(heatmap_channel::primitive_tests, x, 0));
+#else
+        EXPECT_EQ(heatmaps.value(heatmap_channel::traversal_steps, x, bottom), 0.0f);
+#endif
+    }
+
+    auto prefix = (std::filesystem::temp_directory_path() / "rt_heatmap_test").string();
+    ASSERT_TRUE(heatmaps.write(prefix));
+    auto path = prefix + "_nanoseconds.pfm";
+    std::ifstream file(path, std::ios::binary);
+    std::string magic, scale;
+    int width = 0, height = 0;
+    file >> magic >> width >> height >> scale;
+    file.get();
+    EXPECT_EQ(magic, "Pf");
+    EXPECT_EQ(width, image.image_width());
+    EXPECT_EQ(height, image.image_height());
+    std::vector<float> pixels(size_t(width) * height);
+    file.read(reinterpret_cast<char*>(pixels.data()), pixels.size() * sizeof(float));
+    ASSERT_TRUE(file);
+    // Rows are stored bottom to top.
+    EXPECT_EQ(pixels[size_t(height - 1) * width], heatmaps.value(heatmap_channel::nanoseconds, 0, 0));
+    for (int c = 0; c < static_cast<int>(heatmap_channel::count); ++c)
+        std::filesystem::remove(prefix + "_" + heatmap_channel_name(static_cast<heatmap_channel>(c)) + ".pfm");
+}
+
+TEST_F(RayTracingFixture, AovBuffersFromPrimaryHits) {
+    add_sphere();
+    add_random_spheres();
+    world.assign_object_ids();
+    world = hittable_list(make_shared<bvh_node>(world));
+    cam.image_width = 32;
+    cam.max_depth = 8;
+
+    progressive_settings settings;
+    settings.target_samples = 4;
+    framebuffer plain;
+    cam.render_progressive(world, plain, settings);
+
+    aov_buffers aovs(0, 0, aov_albedo | aov_normal | aov_depth | aov_object_id);
+    settings.aovs = &aovs;
+    framebuffer image;
+    cam.render_progressive(world, image, settings);
+    ASSERT_EQ(aovs.image_width(), image.image_width());
+    ASSERT_EQ(aovs.image_height(), image.image_height());
+    // The features come from the same paths, the colors don't change.
+    for (size_t k = 0; k < image.sums().size(); ++k) {
+        for (int a = 0; a < 3; ++a)
+            EXPECT_EQ(image.sums()[k][a], plain.sums()[k][a]);
+    }
+
+    auto bottom = image.image_height() - 1;
+    bool ground_seen = false, sphere_seen = false;
+    for (int x = 0; x < image.image_width(); ++x) {
+        // The top row sees the sky, the bottom row the ground and the spheres on it.
+        EXPECT_EQ(aovs.depth_at(x, 0), 0.0f);
+        EXPECT_EQ(aovs.object_id_at(x, 0), 0u);
+        EXPECT_EQ(aovs.normal_at(x, 0).length(), 0.0);
+        EXPECT_GT(aovs.depth_at(x, bottom), 0.0f);
+        EXPECT_GT(aovs.object_id_at(x, bottom), 0u);
+        EXPECT_GT(aovs.albedo_at(x, bottom).length(), 0.0);
+        EXPECT_LE(aovs.normal_at(x, bottom).length(), 1.0 + 1e-6);
+        // Id 1 is the ground, which faces straight up.
+        if (aovs.object_id_at(x, bottom) != 1u)
+            sphere_seen = true;
+        else if (aovs.normal_at(x, bottom).y() > 0.999)
+            ground_seen = true;
+    }
+    EXPECT_TRUE(ground_seen);
+    EXPECT_TRUE(sphere_seen);
+
+    aov_buffers depth_only(0, 0, parse_aov_channels("depth"));
+    settings.aovs = &depth_only;
+    framebuffer depth_image;
+    cam.render_progressive(world, depth_image, settings);
+    EXPECT_TRUE(depth_only.albedo_channel().empty());
+    EXPECT_TRUE(depth_only.normal_channel().empty());
+    EXPECT_TRUE(depth_only.object_id_channel().empty());
+    EXPECT_EQ(depth_only.depth_channel(), aovs.depth_channel());
+    EXPECT_THROW(parse_aov_channels("albedo,bogus"), std::invalid_argument);
+
+    auto prefix = (std::filesystem::temp_directory_path() / "rt_aov_test").string();
+    ASSERT_TRUE(aovs.write(prefix));
+    for (auto name : {"albedo", "normal", "depth", "object_id"}) {
+        auto path = prefix + "_" + name + ".pfm";
+        EXPECT_TRUE(std::filesystem::exists(path)) << path;
+        std::filesystem::remove(path);
+    }
+}
+
+TEST_F(RayTracingFixture, DenoiserReducesError) {
+    add_sphere();
+    add_random_spheres();
+    world.assign_object_ids();
+    world = hittable_list(make_shared<bvh_node>(world));
+    cam.image_width = 64;
+    cam.max_depth = 8;
+
+    progressive_settings settings;
+    settings.target_samples = 256;
+    framebuffer reference;
+    cam.render_progressive(world, reference, settings);
+
+    aov_buffers aovs(0, 0, aov_albedo | aov_normal);
+    settings.target_samples = 4;
+    settings.aovs = &aovs;
+    framebuffer noisy;
+    cam.render_progressive(world, noisy, settings);
+    auto denoised = denoise(noisy, aovs);
+    ASSERT_EQ(denoised.image_width(), noisy.image_width());
+    ASSERT_EQ(denoised.image_height(), noisy.image_height());
+
+    auto rmse = [&reference](const framebuffer& image) {
+        double sum = 0;
+        for (int y = 0; y < image.image_height(); ++y) {
+            for (int x = 0; x < image.image_width(); ++x) {
+                auto d = image.average(x, y) - reference.average(x, y);
+                sum += dot(d, d);
+            }
+        }
+        return std::sqrt(sum / (image.image_width() * image.image_height()));
+    };
+    auto noisy_error = rmse(noisy);
+    auto denoised_error = rmse(denoised);
+    std::cout << "RMSE at 4 spp: " << noisy_error << " noisy, " << denoised_error << " denoised\n";
+    EXPECT_LT(denoised_error, noisy_error * 0.8);
+
+    // A flat image stays flat.
+    framebuffer flat(8, 8);
+    for (int y = 0; y < 8; ++y)
+        for (int x = 0; x < 8; ++x)
+            flat.add_sample(x, y, color(0.25, 0.5, 0.75));
+    auto filtered = denoise(flat, aov_buffers());
+    EXPECT_TRUE(filtered.average(3, 5).similar_to(color(0.25, 0.5, 0.75)));
+}
+
+TEST(BuddyAllocator, AlignsSplitsAndMerges) {
+    VulkanImpl::BuddyAllocator buddy(1 << 20, 256);
+    EXPECT_TRUE(buddy.empty());
+    EXPECT_EQ(buddy.largest_free_block(), 1u << 20);
+
+    // Allocations are aligned and never overlap.
+    std::map<uint64_t, uint64_t> ranges;
+    std::vector<std::pair<uint64_t, uint64_t>> requests = {{100, 4}, {4096, 4096}, {300, 256}, {70000, 64}, {256, 65536}, {1, 1}};
+    for (auto [size, alignment] : requests) {
+        auto offset = buddy.allocate(size, alignment);
+        ASSERT_NE(offset, VulkanImpl::BuddyAllocator::npos);
+        EXPECT_EQ(offset % alignment, 0u);
+        EXPECT_LE(offset + size, buddy.size());
+        ranges[offset] = size;
+    }
+    uint64_t end = 0;
+    for (auto [offset, size] : ranges) {
+        EXPECT_GE(offset, end);
+        end = offset + size;
+    }
+    EXPECT_EQ(buddy.allocation_count(), requests.size());
+    EXPECT_GE(buddy.used_bytes(), buddy.requested_bytes());
+    EXPECT_LT(buddy.largest_free_block(), buddy.size());
+
+    // Freeing everything merges the buddies back into one block.
+    for (auto [offset, size] : ranges)
+        buddy.free(offset);
+    EXPECT_TRUE(buddy.empty());
+    EXPECT_EQ(buddy.used_bytes(), 0u);
+    EXPECT_EQ(buddy.requested_bytes(), 0u);
+    EXPECT_EQ(buddy.largest_free_block(), buddy.size());
+
+    // A full block refuses more, and takes it again after a free.
+    std::vector<uint64_t> quarters;
+    for (int i = 0; i < 4; ++i)
+        quarters.push_back(buddy.allocate(buddy.size() / 4));
+    EXPECT_EQ(buddy.allocate(1), VulkanImpl::BuddyAllocator::npos);
+    EXPECT_EQ(buddy.allocate(buddy.size() * 2), VulkanImpl::BuddyAllocator::npos);
+    buddy.free(quarters[2]);
+    EXPECT_EQ(buddy.allocate(1000), quarters[2]);
 }
 
 TEST_F(RayTracingFixture, Tmp) {
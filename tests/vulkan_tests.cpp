@@ -1,6 +1,17 @@
 #include "vulkan/graphical_environment_vulkan.h"
 
+#include "camera_cpu.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <gtest/gtest.h>
 
 using namespace RayTracingProject;
@@ -30,3 +41,321 @@ protected:
 TEST_F(RayTracingFixture, BasicVulkan) {
     _scene.start_interactive_loop(std::chrono::milliseconds(3000));
 }
+
+// Headless environments of a small image, set up like the application: the preconfigured
+// shapes, the statue texture, and the spheres and camera of the test.
+class HeadlessVulkanFixture : public ::testing::Test {
+protected:
+    static constexpr int width = 64;
+    static constexpr int height = 32;
+
+    static GraphicalEnvironmentSettings headless_settings() {
+        GraphicalEnvironmentSettings settings;
+        settings.headless = true;
+        settings.width = width;
+        settings.height = height;
+        return settings;
+    }
+
+    // The environment is returned before init(), so tests can add to it or time init().
+    static std::unique_ptr<VulkanImpl::GraphicalEnvironment> make_environment(
+        const GraphicalEnvironmentSettings &settings, const std::vector<Sphere> &spheres = {},
+        const CameraSettings &camera = {}, int textures = 1) {
+        auto gpu = std::make_unique<VulkanImpl::GraphicalEnvironment>(settings);
+        gpu->load_preconfigured_shapes();
+        for (int i = 0; i < textures; ++i) {
+            gpu->add_texture("../../build/assets/textures/statue.jpg");
+        }
+        gpu->add_spheres(spheres);
+        gpu->set_camera(camera);
+        return gpu;
+    }
+
+    GraphicalEnvironmentSettings settings = headless_settings();
+
+    // A sphere on the ground, enough to tell frames apart.
+    std::vector<Sphere> two_spheres = {
+        {{0.0f, -1000.0f, 0.0f}, 1000.0f, {0.5f, 0.5f, 0.5f, 1.0f}},
+        {{0.0f, 1.0f, 0.0f}, 1.0f, {0.4f, 0.2f, 0.1f, 1.0f}}
+    };
+};
+
+// The headless GPU path tracer converges to the CPU render of the same scene and camera.
+TEST_F(HeadlessVulkanFixture, MatchesCpuRender) {
+    constexpr int samples = 256;
+    constexpr int depth = 8;
+
+    std::vector<Sphere> spheres(4);
+    spheres[0] = {{0.0f, -1000.0f, 0.0f}, 1000.0f, {0.5f, 0.5f, 0.5f, 1.0f}};
+    spheres[1] = {{0.0f, 1.0f, 0.0f}, 1.0f, {1.0f, 1.0f, 1.0f, 1.0f}, SphereMaterial::Dielectric, 1.5f};
+    spheres[2] = {{-4.0f, 1.0f, 0.0f}, 1.0f, {0.4f, 0.2f, 0.1f, 1.0f}};
+    spheres[3] = {{4.0f, 1.0f, 0.0f}, 1.0f, {0.7f, 0.6f, 0.5f, 1.0f}, SphereMaterial::Metal, 0.0f};
+
+    CameraSettings camera;
+    camera.samples_per_pixel = samples;
+    camera.max_depth = depth;
+
+    auto gpu = make_environment(settings, spheres, camera);
+    gpu->enable_validation();
+    gpu->init();
+    auto pixels = gpu->render_offscreen();
+    ASSERT_EQ(pixels.size(), size_t(width) * height * 4);
+
+    hittable_list world;
+    for (const auto& s : spheres) {
+        auto albedo = color(s.color.r, s.color.g, s.color.b);
+        shared_ptr<material> mat;
+        switch (s.material) {
+            case SphereMaterial::Lambertian: mat = make_shared<lambertian>(albedo); break;
+            case SphereMaterial::Metal: mat = make_shared<metal>(albedo, s.parameter); break;
+            case SphereMaterial::Dielectric: mat = make_shared<dielectric>(s.parameter); break;
+        }
+        world.add(make_shared<sphere>(point3(s.center.x, s.center.y, s.center.z), s.radius, mat));
+    }
+    CPUImpl::Camera cpu;
+    cpu.aspect_ratio = double(width) / height;
+    cpu.image_width = width;
+    cpu.samples_per_pixel = samples;
+    cpu.max_depth = depth;
+    cpu.vfov = camera.vfov;
+    cpu.lookfrom = point3(camera.lookfrom.x, camera.lookfrom.y, camera.lookfrom.z);
+    cpu.lookat = point3(camera.lookat.x, camera.lookat.y, camera.lookat.z);
+    cpu.vup = vec3(camera.vup.x, camera.vup.y, camera.vup.z);
+    cpu.defocus_angle = camera.defocus_angle;
+    cpu.focus_dist = camera.focus_dist;
+    framebuffer reference;
+    cpu.render_progressive(world, reference, {});
+
+    // Both are compared gamma corrected, like the GPU stores them.
+    double sum = 0;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            auto expected = reference.average(x, y);
+            for (int c = 0; c < 3; ++c) {
+                auto gpu_value = pixels[(size_t(y) * width + x) * 4 + c] / 255.0;
+                auto d = gpu_value - std::sqrt(std::clamp(expected[c], 0.0, 1.0));
+                sum += d * d;
+            }
+        }
+    }
+    auto rmse = std::sqrt(sum / (width * height * 3));
+    std::cout << "GPU vs CPU RMSE: " << rmse << std::endl;
+    EXPECT_LT(rmse, 0.05);
+}
+
+// A ground sphere and a square of small spheres with about the same density at every count.
+static std::vector<Sphere> random_spheres(int count) {
+    std::vector<Sphere> spheres;
+    spheres.push_back({{0.0f, -1000.0f, 0.0f}, 1000.0f, {0.5f, 0.5f, 0.5f, 1.0f}});
+    auto side = static_cast<float>(std::sqrt(count)) * 0.5f;
+    for (int i = 1; i < count; ++i) {
+        glm::vec3 center(side * (2 * random_double() - 1), 0.2f, side * (2 * random_double() - 1));
+        glm::vec4 albedo(random_double(), random_double(), random_double(), 1.0f);
+        spheres.push_back({center, 0.2f, albedo});
+    }
+    return spheres;
+}
+
+// Pixels of two RGBA images that differ in any channel.
+static size_t mismatched_pixels(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) {
+    size_t mismatched = 0;
+    for (size_t i = 0; i + 3 < std::min(a.size(), b.size()); i += 4) {
+        mismatched += !std::equal(a.begin() + i, a.begin() + i + 4, b.begin() + i);
+    }
+    return mismatched;
+}
+
+// The BVH traversal finds the hits of the brute force loop over all spheres. Rays grazing a
+// node's box may round differently, so a few pixels are allowed to differ.
+TEST_F(HeadlessVulkanFixture, BvhMatchesBruteForce) {
+    auto spheres = random_spheres(1000);
+    settings.sphere_count = static_cast<int>(spheres.size());
+
+    std::vector<uint8_t> images[2];
+    for (bool use_bvh : {false, true}) {
+        settings.gpu_bvh = use_bvh;
+        auto gpu = make_environment(settings, spheres);
+        gpu->init();
+        images[use_bvh] = gpu->render_offscreen();
+    }
+    ASSERT_EQ(images[0].size(), size_t(width) * height * 4);
+    EXPECT_EQ(images[0].size(), images[1].size());
+    EXPECT_LE(mismatched_pixels(images[0], images[1]), size_t(width) * height / 1000);
+}
+
+// Camera rays per second of the BVH traversal and of the brute force loop over all spheres, as
+// the scene grows. Brute force is left out where it would take minutes. Disabled by default;
+// run with --gtest_also_run_disabled_tests.
+TEST_F(HeadlessVulkanFixture, DISABLED_BvhVsBruteForceBenchmark) {
+    constexpr int frames = 4;
+    settings.width = 256;
+    settings.height = 128;
+
+    CameraSettings camera;
+    camera.samples_per_pixel = 4;
+    camera.max_depth = 4;
+
+    for (int count : {100, 1000, 10000, 100000}) {
+        auto spheres = random_spheres(count);
+        settings.sphere_count = count;
+
+        std::vector<uint8_t> brute_force_image;
+        for (bool use_bvh : {false, true}) {
+            if (!use_bvh && count > 10000) {
+                continue;
+            }
+            settings.gpu_bvh = use_bvh;
+            auto gpu = make_environment(settings, spheres, camera);
+            gpu->init();
+            // The first frame warms up; both traversals render it with the same frame index.
+            auto image = gpu->render_offscreen();
+            if (!use_bvh) {
+                brute_force_image = std::move(image);
+            } else if (!brute_force_image.empty()) {
+                EXPECT_LE(mismatched_pixels(brute_force_image, image), size_t(settings.width) * settings.height / 1000)
+                    << count << " spheres";
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            for (int f = 0; f < frames; ++f) {
+                gpu->render_offscreen();
+            }
+            auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            auto rays = double(settings.width) * settings.height * camera.samples_per_pixel * frames;
+            std::cout << count << " spheres, " << (use_bvh ? "BVH" : "brute force") << ": "
+                      << rays / seconds / 1e6 << " M camera rays/s" << std::endl;
+        }
+    }
+}
+
+// The second run finds the pipelines of the first one in the cache file.
+TEST_F(HeadlessVulkanFixture, PipelineCacheColdVsWarm) {
+    settings.pipeline_cache_path = (std::filesystem::temp_directory_path() / "rt_pipeline_cache_test.bin").string();
+    std::filesystem::remove(settings.pipeline_cache_path);
+
+    double milliseconds[2];
+    for (int run = 0; run < 2; ++run) {
+        auto gpu = make_environment(settings);
+        gpu->init();
+        EXPECT_EQ(gpu->pipeline_cache_loaded(), run == 1);
+        milliseconds[run] = gpu->pipeline_creation_milliseconds();
+    }
+    EXPECT_TRUE(std::filesystem::exists(settings.pipeline_cache_path));
+    std::cout << "Pipeline creation: " << milliseconds[0] << " ms cold, " << milliseconds[1] << " ms warm" << std::endl;
+    std::filesystem::remove(settings.pipeline_cache_path);
+}
+
+// Startup uploads of all textures and buffers share one submit.
+TEST_F(HeadlessVulkanFixture, BatchedStartupUploads) {
+    auto gpu = make_environment(settings, {}, {}, 8);
+    auto start = std::chrono::steady_clock::now();
+    gpu->init();
+    auto milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    EXPECT_EQ(gpu->startup_upload_submits(), 1u);
+    std::cout << "Init with 8 textures: " << milliseconds << " ms" << std::endl;
+}
+
+// Textures are decoded and uploaded after init, while frames keep rendering.
+TEST_F(HeadlessVulkanFixture, StreamedTextures) {
+    auto gpu = make_environment(settings, {}, {}, 8);
+    gpu->add_texture("missing_texture.jpg");
+    gpu->init();
+
+    auto start = std::chrono::steady_clock::now();
+    int frames = 0;
+    while (gpu->streamed_textures() < 8 && std::chrono::steady_clock::now() - start < std::chrono::seconds(10)) {
+        gpu->render_offscreen();
+        ++frames;
+    }
+    EXPECT_TRUE(gpu->wait_for_textures(std::chrono::seconds(10)));
+    EXPECT_EQ(gpu->streamed_textures(), 8u);
+    auto milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "8 textures streamed in " << milliseconds << " ms, " << frames << " frames rendered meanwhile" << std::endl;
+}
+
+// Timestamp queries time the ray tracing pass without stalling and land on the GPU trace track.
+TEST_F(HeadlessVulkanFixture, GpuPassTimestamps) {
+    auto gpu = make_environment(settings);
+    gpu->init();
+
+    trace_start();
+    for (int frame = 0; frame < 16; ++frame) {
+        gpu->render_offscreen();
+    }
+    trace_stop();
+
+    EXPECT_GT(gpu->gpu_milliseconds(VulkanImpl::GpuPass::RayTrace), 0.0);
+    std::ostringstream json;
+    trace_recorder::instance().write_json(json);
+    EXPECT_NE(json.str().find("\"name\": \"gpu_ray_trace\""), std::string::npos);
+    std::cout << "Ray trace pass: " << gpu->gpu_milliseconds(VulkanImpl::GpuPass::RayTrace) << " ms on the GPU" << std::endl;
+}
+
+// Command buffers are recorded at init and when the descriptors change, not per frame; the frame
+// index and the camera still change every frame through the uniforms ring.
+TEST_F(HeadlessVulkanFixture, PrerecordedCommandBuffers) {
+    CameraSettings camera;
+    camera.samples_per_pixel = 1;
+
+    auto gpu = make_environment(settings, two_spheres, camera);
+    gpu->init();
+    EXPECT_EQ(gpu->command_buffer_recordings(), 1u);
+
+    // The streamed texture rewrites the descriptor sets once, which records the buffers again.
+    ASSERT_TRUE(gpu->wait_for_textures(std::chrono::seconds(10)));
+    auto recordings = gpu->command_buffer_recordings();
+    EXPECT_LE(recordings, 2u);
+
+    auto first = gpu->render_offscreen();
+    auto second = gpu->render_offscreen();
+    EXPECT_NE(first, second);  // Seeded by the frame index
+
+    auto start = std::chrono::steady_clock::now();
+    constexpr int frames = 64;
+    for (int frame = 0; frame < frames; ++frame) {
+        gpu->render_offscreen();
+    }
+    auto milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    camera.lookfrom = {-13.0f, 2.0f, 3.0f};
+    gpu->set_camera(camera);
+    EXPECT_NE(gpu->render_offscreen(), second);
+    EXPECT_EQ(gpu->command_buffer_recordings(), recordings);
+    std::cout << frames << " frames in " << milliseconds << " ms with prerecorded command buffers" << std::endl;
+}
+
+// Frames accumulate into the float image: the resolved image changes less and less while the
+// view is still, and restarts when the camera moves.
+TEST_F(HeadlessVulkanFixture, ProgressiveAccumulation) {
+    CameraSettings camera;
+    camera.samples_per_pixel = 1;
+
+    auto gpu = make_environment(settings, two_spheres, camera);
+    gpu->init();
+
+    auto difference = [](const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) {
+        double sum = 0;
+        for (size_t i = 0; i < a.size(); ++i) {
+            sum += std::abs(int(a[i]) - int(b[i]));
+        }
+        return sum / a.size();
+    };
+
+    auto previous = gpu->render_offscreen();
+    auto current = gpu->render_offscreen();
+    auto early = difference(previous, current);
+    for (int frame = 2; frame < 128; ++frame) {
+        previous = std::move(current);
+        current = gpu->render_offscreen();
+    }
+    auto late = difference(previous, current);
+    EXPECT_EQ(gpu->accumulated_samples(), 128u);
+    EXPECT_LT(late, early / 8);
+
+    camera.lookfrom = {-13.0f, 2.0f, 3.0f};
+    gpu->set_camera(camera);
+    EXPECT_EQ(gpu->accumulated_samples(), 0u);
+    gpu->render_offscreen();
+    EXPECT_EQ(gpu->accumulated_samples(), 1u);
+    std::cout << "Mean change per frame: " << early << " after 2 frames, " << late << " after 128" << std::endl;
+}